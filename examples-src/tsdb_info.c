@@ -44,6 +44,9 @@ static void print_db_info(char *file) {
     u_int16_t unused16 = 0;
     u_int32_t unused32 = 0;
     struct stat info;
+    tsdb_codec_stats stats;
+    u_int64_t stored;
+    u_int8_t codec;
 
     rc = tsdb_open(file, &db, &unused16, unused32, 1);
     if (rc) {
@@ -61,6 +64,26 @@ static void print_db_info(char *file) {
     printf("          Size: %zd\n", info.st_size);
     printf("Vals Per Entry: %u\n", db.values_per_entry);
     printf("  Slot Seconds: %u\n", db.slot_duration);;
+    printf("        Format: %u\n", db.format_version);
+    printf(" Frag. Indexes: %u\n", db.fragment_len);
+    printf("        Epochs: %u\n", db.number_of_epochs);
+    if (tsdb_get_codec_stats(&db, &stats) == 0) {
+        for (codec = 0; codec < TSDB_NUM_FRAGMENT_CODECS; codec++) {
+            printf("%14s: %llu fragments, %llu bytes\n", tsdb_fragment_codec_name(codec),
+                   (unsigned long long)stats.fragments[codec], (unsigned long long)stats.bytes[codec]);
+        }
+        printf("  Delta Frames: %llu\n", (unsigned long long)stats.delta_frames);
+        if (stats.payloads) {
+            for (codec = 0, stored = stats.payload_bytes; codec < TSDB_NUM_FRAGMENT_CODECS; codec++) {
+                stored += stats.bytes[codec];
+            }
+            printf("Shared Payload: %llu, %llu bytes, referred to by %llu fragments\n",
+                   (unsigned long long)stats.payloads, (unsigned long long)stats.payload_bytes,
+                   (unsigned long long)stats.shared);
+            printf("   Dedup Ratio: %.2f\n",
+                   (double)(stored + stats.deduplicated_bytes - stats.shared * SHARED_REF_LEN) / stored);
+        }
+    }
     tsdb_close(&db);
 }
 
@@ -0,0 +1,31 @@
+/*
+ * quicklz3.c
+ *
+ * QuickLZ built at compression level 3, see quicklz3.h
+ */
+
+#define QLZ_COMPRESSION_LEVEL 3
+#define QLZ_STREAMING_BUFFER 0
+
+#define qlz_get_setting qlz3_level_get_setting
+#define qlz_size_decompressed qlz3_level_size_decompressed
+#define qlz_size_compressed qlz3_level_size_compressed
+#define qlz_compress qlz3_level_compress
+#define qlz_decompress qlz3_level_decompress
+
+#include "quicklz.c"
+#include "quicklz3.h"
+
+size_t qlz3_state_size(void) {
+    return sizeof(qlz_state_compress);
+}
+
+size_t qlz3_compress(const void *source, char *destination, size_t size, void *state) {
+    return qlz3_level_compress(source, destination, size, (qlz_state_compress *)state);
+}
+
+size_t qlz3_decompress(const char *source, void *destination) {
+    qlz_state_decompress state; //a few bytes only at level 3 without streaming
+
+    return qlz3_level_decompress(source, destination, &state);
+}
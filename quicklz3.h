@@ -0,0 +1,23 @@
+/*
+ * quicklz3.h
+ *
+ * QuickLZ at compression level 3: slower compression than the level 1 of
+ * quicklz.h, but better ratios and faster decompression. quicklz3.c builds
+ * quicklz.c a second time with the level set and its functions renamed,
+ * so that both levels live in the same program. Records of both levels
+ * share the header read by qlz_size_decompressed() and qlz_size_compressed().
+ */
+
+#ifndef QUICKLZ3_H_
+#define QUICKLZ3_H_
+
+#include <stddef.h>
+
+/* Size of the state qlz3_compress() needs, which must not be shared by threads */
+size_t qlz3_state_size(void);
+
+size_t qlz3_compress(const void *source, char *destination, size_t size, void *state);
+
+size_t qlz3_decompress(const char *source, void *destination);
+
+#endif /* QUICKLZ3_H_ */
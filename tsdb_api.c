@@ -43,9 +43,28 @@ static void db_put(tsdb_handler *handler,
     data.data = value;
     data.size = value_len;
 
+    pthread_mutex_lock(&handler->flusher.db_lock);
     if (handler->db->put(handler->db, NULL, &key_data, &data, 0) != 0) {
         trace_error("Error while map_set(%s, %d)", (char*)key, *((tsdb_value*)value));
     }
+    pthread_mutex_unlock(&handler->flusher.db_lock);
+}
+
+static void db_del(tsdb_handler *handler, void *key, u_int32_t key_len) {
+    DBT key_data;
+
+    if (handler->read_only) {
+        trace_warning("Unable to delete value (read-only mode)");
+        return;
+    }
+
+    memset(&key_data, 0, sizeof(key_data));
+    key_data.data = key;
+    key_data.size = key_len;
+
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    handler->db->del(handler->db, NULL, &key_data, 0);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
 }
 
 static int db_get(tsdb_handler *handler,
@@ -67,14 +86,46 @@ static int db_get(tsdb_handler *handler,
    * therefore it is important. */
 
     DBT key_data, data;
+    int rv;
+
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+
+    key_data.data = key;
+    key_data.size = key_len;
+
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    rv = handler->db->get(handler->db, NULL, &key_data, &data, 0);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
+
+    if (rv == 0) {
+        *value = data.data, *value_len = data.size;
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+static int db_get_copy(tsdb_handler *handler,
+                       void *key, u_int32_t key_len,
+                       void **value, u_int32_t *value_len) {
+  /* Same as db_get(), but the value is returned in a private
+   * buffer which survives subsequent gets and must be freed */
+    DBT key_data, data;
+    int rv;
 
     memset(&key_data, 0, sizeof(key_data));
     memset(&data, 0, sizeof(data));
 
     key_data.data = key;
     key_data.size = key_len;
+    data.flags = DB_DBT_MALLOC;
+
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    rv = handler->db->get(handler->db, NULL, &key_data, &data, 0);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
 
-    if (handler->db->get(handler->db, NULL, &key_data, &data, 0) == 0) {
+    if (rv == 0) {
         *value = data.data, *value_len = data.size;
         return 0;
     } else {
@@ -91,7 +142,9 @@ static int db_key_exists (tsdb_handler *handler, void *key, u_int32_t key_len) {
   key_data.data = key;
   key_data.size = key_len;
 
+  pthread_mutex_lock(&handler->flusher.db_lock);
   rv = handler->db->exists(handler->db,NULL,&key_data,0);
+  pthread_mutex_unlock(&handler->flusher.db_lock);
 
   if (rv ==  DB_NOTFOUND) {
       return 0;
@@ -101,6 +154,287 @@ static int db_key_exists (tsdb_handler *handler, void *key, u_int32_t key_len) {
   }
 }
 
+/* Epoch index: the sorted epochs of the DB are stored in pages of
+ * EPOCH_PAGE_LEN epochs under "epochs-<page>". Only the last page is
+ * rewritten when an epoch is added, pages are read on first access. */
+
+static int epoch_index_reserve(tsdb_handler *handler, u_int32_t page) {
+  /* Makes room for page in handler->epoch_index.pages */
+    tsdb_epoch_index *index = &handler->epoch_index;
+    u_int32_t num_pages;
+    u_int32_t **pages;
+
+    if (page < index->num_pages) {
+        return 0;
+    }
+
+    num_pages = (index->num_pages ? index->num_pages : 16);
+    while (num_pages <= page) {
+        num_pages *= 2;
+    }
+    pages = (u_int32_t**) realloc(index->pages, num_pages * sizeof(u_int32_t*));
+    if (pages == NULL) {
+        trace_error("Not enough memory (%u bytes)", num_pages * sizeof(u_int32_t*));
+        return -2;
+    }
+    memset(&pages[index->num_pages], 0, (num_pages - index->num_pages) * sizeof(u_int32_t*));
+    index->pages = pages;
+    index->num_pages = num_pages;
+
+    return 0;
+}
+
+static u_int32_t *epoch_index_page(tsdb_handler *handler, u_int32_t page) {
+  /* Returns the page, reading it from the DB unless it was done before */
+    char str[32];
+    void *value;
+    u_int32_t value_len;
+
+    if (epoch_index_reserve(handler, page)) {
+        return NULL;
+    }
+    if (handler->epoch_index.pages[page]) {
+        return handler->epoch_index.pages[page];
+    }
+
+    snprintf(str, sizeof(str), "epochs-%u", page);
+    if (db_get(handler, str, strlen(str), &value, &value_len) == -1 ||
+        value_len > EPOCH_PAGE_LEN * sizeof(u_int32_t)) {
+        trace_error("Page %u of the epoch index is missing or corrupted", page);
+        return NULL;
+    }
+
+    handler->epoch_index.pages[page] = (u_int32_t*) malloc(EPOCH_PAGE_LEN * sizeof(u_int32_t));
+    if (handler->epoch_index.pages[page] == NULL) {
+        trace_error("Not enough memory (%u bytes)", EPOCH_PAGE_LEN * sizeof(u_int32_t));
+        return NULL;
+    }
+    memcpy(handler->epoch_index.pages[page], value, value_len);
+
+    return handler->epoch_index.pages[page];
+}
+
+static int epoch_index_add(tsdb_handler *handler, u_int32_t epoch) {
+  /* Appends the epoch, which must be the most recent one, and writes
+   * the last page. The counter of epochs is increased as well */
+    char str[32];
+    u_int32_t *page_data;
+    u_int32_t page = handler->number_of_epochs / EPOCH_PAGE_LEN;
+    u_int32_t slot = handler->number_of_epochs % EPOCH_PAGE_LEN;
+
+    if (slot == 0) {
+        // a fresh page
+        if (epoch_index_reserve(handler, page)) {
+            return -1;
+        }
+        if (!handler->epoch_index.pages[page]) {
+            handler->epoch_index.pages[page] = (u_int32_t*) malloc(EPOCH_PAGE_LEN * sizeof(u_int32_t));
+        }
+        page_data = handler->epoch_index.pages[page];
+    } else {
+        page_data = epoch_index_page(handler, page);
+    }
+    if (page_data == NULL) {
+        return -1;
+    }
+
+    page_data[slot] = epoch;
+    handler->number_of_epochs++;
+
+    snprintf(str, sizeof(str), "epochs-%u", page);
+    db_put(handler, str, strlen(str), page_data, (slot + 1) * sizeof(u_int32_t));
+
+    return 0;
+}
+
+static int epoch_index_insert(tsdb_handler *handler, u_int32_t epoch, u_int32_t position) {
+  /* Inserts the epoch at position, moving the later ones one position
+   * ahead, and writes the pages changed. All of them are read beforehand,
+   * so that the index is left as it was on errors */
+    char str[32];
+    u_int32_t *page_data, carry = epoch, out;
+    u_int32_t page, slot, page_len, first_page = position / EPOCH_PAGE_LEN;
+    u_int32_t last_page = (handler->number_of_epochs - 1) / EPOCH_PAGE_LEN;
+
+    if (position >= handler->number_of_epochs) {
+        return epoch_index_add(handler, epoch);
+    }
+
+    for (page = first_page; page <= last_page; page++) {
+        if (epoch_index_page(handler, page) == NULL) {
+            return -1;
+        }
+    }
+    // all pages are full, the last epoch moves to a fresh one
+    if (handler->number_of_epochs % EPOCH_PAGE_LEN == 0) {
+        if (epoch_index_reserve(handler, last_page + 1)) {
+            return -1;
+        }
+        if (!handler->epoch_index.pages[last_page + 1] &&
+            !(handler->epoch_index.pages[last_page + 1] = (u_int32_t*) malloc(EPOCH_PAGE_LEN * sizeof(u_int32_t)))) {
+            trace_error("Not enough memory (%u bytes)", EPOCH_PAGE_LEN * sizeof(u_int32_t));
+            return -1;
+        }
+    }
+
+    for (page = first_page, slot = position % EPOCH_PAGE_LEN; page <= last_page; page++, slot = 0) {
+        page_data = handler->epoch_index.pages[page];
+        page_len = handler->number_of_epochs - page * EPOCH_PAGE_LEN;
+        snprintf(str, sizeof(str), "epochs-%u", page);
+
+        if (page_len < EPOCH_PAGE_LEN) {
+            memmove(&page_data[slot + 1], &page_data[slot], (page_len - slot) * sizeof(u_int32_t));
+            page_data[slot] = carry;
+            handler->number_of_epochs++;
+            db_put(handler, str, strlen(str), page_data, (page_len + 1) * sizeof(u_int32_t));
+            return 0;
+        }
+
+        out = page_data[EPOCH_PAGE_LEN - 1];
+        memmove(&page_data[slot + 1], &page_data[slot], (EPOCH_PAGE_LEN - 1 - slot) * sizeof(u_int32_t));
+        page_data[slot] = carry;
+        carry = out;
+        db_put(handler, str, strlen(str), page_data, EPOCH_PAGE_LEN * sizeof(u_int32_t));
+    }
+
+    return epoch_index_add(handler, carry);
+}
+
+static void epoch_index_destroy(tsdb_handler *handler) {
+    u_int32_t i;
+
+    for (i = 0; i < handler->epoch_index.num_pages; i++) {
+        free(handler->epoch_index.pages[i]);
+    }
+    free(handler->epoch_index.pages);
+    memset(&handler->epoch_index, 0, sizeof(handler->epoch_index));
+}
+
+static int convert_epoch_list(tsdb_handler *handler) {
+  /* DBs written before the epoch index keep all epochs in a single
+   * "epoch_list" record. It is split into pages, which are written
+   * and replace the record unless the DB is read-only */
+    char str[32];
+    void *value;
+    u_int32_t value_len, page, num_pages, page_len;
+    u_int32_t *epochs;
+
+    if (db_get_copy(handler, "epoch_list", strlen("epoch_list"), &value, &value_len) == -1) {
+        return 0;
+    }
+
+    epochs = (u_int32_t*) value;
+    handler->number_of_epochs = value_len / sizeof(u_int32_t);
+    num_pages = (handler->number_of_epochs + EPOCH_PAGE_LEN - 1) / EPOCH_PAGE_LEN;
+
+    for (page = 0; page < num_pages; page++) {
+        page_len = handler->number_of_epochs - page * EPOCH_PAGE_LEN;
+        if (page_len > EPOCH_PAGE_LEN) {
+            page_len = EPOCH_PAGE_LEN;
+        }
+        if (epoch_index_reserve(handler, page) ||
+            !(handler->epoch_index.pages[page] = (u_int32_t*) malloc(EPOCH_PAGE_LEN * sizeof(u_int32_t)))) {
+            free(value);
+            return -1;
+        }
+        memcpy(handler->epoch_index.pages[page], &epochs[page * EPOCH_PAGE_LEN], page_len * sizeof(u_int32_t));
+
+        if (!handler->read_only) {
+            snprintf(str, sizeof(str), "epochs-%u", page);
+            db_put(handler, str, strlen(str), handler->epoch_index.pages[page], page_len * sizeof(u_int32_t));
+        }
+    }
+    free(value);
+
+    if (!handler->read_only) {
+        db_put(handler, "num_epochs", strlen("num_epochs"),
+               &handler->number_of_epochs, sizeof(handler->number_of_epochs));
+        db_del(handler, "epoch_list", strlen("epoch_list"));
+        trace_info("Converted the list of %u epochs into the epoch index", handler->number_of_epochs);
+    }
+
+    return 0;
+}
+
+int tsdb_epoch_at(tsdb_handler *handler, u_int32_t position, u_int32_t *epoch) {
+    u_int32_t *page_data;
+
+    if (position >= handler->number_of_epochs) {
+        return -1;
+    }
+
+    page_data = epoch_index_page(handler, position / EPOCH_PAGE_LEN);
+    if (page_data == NULL) {
+        return -2;
+    }
+    *epoch = page_data[position % EPOCH_PAGE_LEN];
+
+    return 0;
+}
+
+int tsdb_epoch_search(tsdb_handler *handler, u_int32_t epoch, u_int32_t *position) {
+    u_int32_t low = 0, high = handler->number_of_epochs, middle, value;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (tsdb_epoch_at(handler, middle, &value)) {
+            return -2;
+        }
+        if (value < epoch) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *position = low;
+
+    if (low < handler->number_of_epochs) {
+        if (tsdb_epoch_at(handler, low, &value)) {
+            return -2;
+        }
+        return value == epoch;
+    }
+
+    return 0;
+}
+
+static void load_keymap(tsdb_handler *handler) {
+  /* Fills handler->keymap with all "key-" records in a single cursor pass,
+   * the B-tree keeps them next to each other */
+    DBC *cursor;
+    DBT key_data, data;
+    char key[32];
+    int rv;
+
+    if (handler->db->cursor(handler->db, NULL, &cursor, 0) != 0) {
+        trace_warning("Unable to scan the keys, they will be looked up one by one");
+        return;
+    }
+
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+    key_data.data = "key-";
+    key_data.size = strlen("key-");
+
+    rv = cursor->get(cursor, &key_data, &data, DB_SET_RANGE);
+    while (rv == 0 && key_data.size >= strlen("key-") &&
+           memcmp(key_data.data, "key-", strlen("key-")) == 0) {
+        if (key_data.size < sizeof(key) && data.size == sizeof(u_int32_t)) {
+            memcpy(key, key_data.data, key_data.size);
+            key[key_data.size] = '\0';
+            if (tsdb_keymap_put(&handler->keymap, &key[strlen("key-")], *(u_int32_t*)data.data)) {
+                trace_warning("Not enough memory to keep all keys, the rest will be looked up one by one");
+                break;
+            }
+        }
+        rv = cursor->get(cursor, &key_data, &data, DB_NEXT);
+    }
+
+    cursor->close(cursor);
+
+    trace_info("Loaded %u keys", handler->keymap.num_entries);
+}
+
 int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
 	      u_int16_t *values_per_entry,
 	      u_int32_t slot_duration,
@@ -111,6 +445,13 @@ int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
 
     memset(handler, 0, sizeof(tsdb_handler));
 
+    pthread_mutex_init(&handler->flusher.lock, NULL);
+    pthread_cond_init(&handler->flusher.cond, NULL);
+    pthread_mutex_init(&handler->flusher.db_lock, NULL);
+    pthread_mutex_init(&handler->compactor.lock, NULL);
+    pthread_cond_init(&handler->compactor.cond, NULL);
+    pthread_mutex_init(&handler->shared.lock, NULL);
+
     handler->read_only = read_only;
     mode = (read_only ? 00444 : 00664 );
 
@@ -134,6 +475,28 @@ int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
     }
 
 
+    if (db_get(handler, "format_version",
+               strlen("format_version"),
+               &value, &value_len) == 0) {
+        handler->format_version = *((u_int32_t*)value);
+        if (handler->format_version > TSDB_FORMAT_VERSION) {
+            trace_error("DB %s has format %u, newer than the supported %u",
+                        tsdb_path, handler->format_version, TSDB_FORMAT_VERSION);
+            handler->db->close(handler->db, 0);
+            return -1;
+        }
+    } else if (!read_only && !db_key_exists(handler, "lowest_free_index", strlen("lowest_free_index"))) {
+        // a new DB
+        handler->format_version = TSDB_FORMAT_VERSION;
+        db_put(handler, "format_version",
+               strlen("format_version"),
+               &handler->format_version,
+               sizeof(handler->format_version));
+    } else {
+        // written before formats were versioned
+        handler->format_version = 1;
+    }
+
     if (db_get(handler, "lowest_free_index",
                strlen("lowest_free_index"),
                &value, &value_len) == 0) {
@@ -148,17 +511,6 @@ int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
         }
     }
 
-    if (db_get(handler, "epoch_list",
-               strlen("epoch_list"),
-               &value, &value_len) == 0) {
-        handler->epoch_list = (u_int32_t*) malloc(value_len);
-        memcpy(handler->epoch_list, value , value_len);
-    } else {
-        if (!handler->read_only) {
-            handler->epoch_list = NULL;
-        }
-    }
-
     if (db_get(handler, "slot_duration",
                strlen("slot_duration"),
                &value, &value_len) == 0) {
@@ -173,6 +525,22 @@ int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
         }
     }
 
+    if (db_get(handler, "fragment_len",
+               strlen("fragment_len"),
+               &value, &value_len) == 0) {
+        handler->fragment_len = *((u_int32_t*)value);
+        if (handler->fragment_len == 0 || handler->fragment_len > MAX_FRAGMENT_LEN ||
+            handler->fragment_len % SEGMENT_SERIES) {
+            trace_error("DB %s has %u indexes per fragment, which is not supported",
+                        tsdb_path, handler->fragment_len);
+            handler->db->close(handler->db, 0);
+            return -1;
+        }
+    } else {
+        // set by tsdb_set_fragment_len() only, CHUNK_GROWTH once values_len is known
+        handler->fragment_len = 0;
+    }
+
     if (db_get(handler, "values_per_entry",
                strlen("values_per_entry"),
                &value, &value_len) == 0) {
@@ -216,7 +584,31 @@ int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
             }
         }
 
+    if (db_get(handler, "cold_segments",
+               strlen("cold_segments"),
+               &value, &value_len) == 0) {
+        handler->compactor.cold_segments = handler->compactor.next_segment = *((u_int32_t*)value);
+    }
+
     handler->values_len = handler->values_per_entry * sizeof(tsdb_value);
+    handler->segment_codec = TSDB_CODEC_SERIES;
+
+    if (handler->fragment_len == 0) {
+        // wide entries get shorter fragments by default
+        handler->fragment_len = CHUNK_GROWTH;
+        if ((u_int64_t)handler->fragment_len * handler->values_len > MAX_FRAGMENT_BYTES) {
+            handler->fragment_len = MAX_FRAGMENT_BYTES / handler->values_len / SEGMENT_SERIES * SEGMENT_SERIES;
+        }
+    } else if ((u_int64_t)handler->fragment_len * handler->values_len > MAX_FRAGMENT_BYTES) {
+        trace_error("DB %s has fragments of %llu bytes, which is not supported", tsdb_path,
+                    (unsigned long long)handler->fragment_len * handler->values_len);
+        handler->db->close(handler->db, 0);
+        return -1;
+    }
+
+    if (convert_epoch_list(handler)) {
+        return -1;
+    }
 
     trace_info("lowest_free_index: %u", handler->lowest_free_index);
     trace_info("slot_duration: %u", handler->slot_duration);
@@ -225,620 +617,4060 @@ int tsdb_open(const char *tsdb_path, tsdb_handler *handler,
     memset(&handler->state_compress, 0, sizeof(handler->state_compress));
     memset(&handler->state_decompress, 0, sizeof(handler->state_decompress));
 
+    load_keymap(handler);
+
+    ret = sysconf(_SC_NPROCESSORS_ONLN);
+    handler->num_workers = (ret < 1 ? 1 : (ret > MAX_NUM_WORKERS ? MAX_NUM_WORKERS : ret));
+    handler->codec_budget = CODEC_BUDGET;
+
     handler->alive = 1;
 
     return 0;
 }
 
+static int chunk_reserve(tsdb_chunk *chunk, u_int32_t num_fragments) {
+  /* Grows the fragment_changed and fragment_loaded bitsets of a chunk to
+   * hold num_fragments fragments, the bits added are clear.
+   * Returns 0 on success, -2 if there is not enough memory */
+    u_int32_t *changed, *loaded;
+    u_int32_t old_words = (chunk->num_fragments + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    u_int32_t num_words = (num_fragments + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    if (num_fragments <= chunk->num_fragments) {
+        return 0;
+    }
+    if (num_words > old_words) {
+        changed = (u_int32_t*) realloc(chunk->fragment_changed, num_words * sizeof(u_int32_t));
+        if (changed) {
+            chunk->fragment_changed = changed;
+        }
+        loaded = (u_int32_t*) realloc(chunk->fragment_loaded, num_words * sizeof(u_int32_t));
+        if (loaded) {
+            chunk->fragment_loaded = loaded;
+        }
+        if (changed == NULL || loaded == NULL) {
+            trace_error("Not enough memory (%u bytes)", 2 * num_words * sizeof(u_int32_t));
+            return -2;
+        }
+        memset(&changed[old_words], 0, (num_words - old_words) * sizeof(u_int32_t));
+        memset(&loaded[old_words], 0, (num_words - old_words) * sizeof(u_int32_t));
+    }
+    chunk->num_fragments = num_fragments;
+
+    return 0;
+}
+
+static void chunk_free(tsdb_chunk *chunk) {
+    free(chunk->data);
+    free(chunk->valid);
+    free(chunk->base);
+    free(chunk->fragment_changed);
+    free(chunk->fragment_loaded);
+}
+
 void purge_chunk_with_fire(tsdb_handler *db_handler) {
-  if (db_handler->chunk.data != NULL) {
-      free(db_handler->chunk.data);
-  }
+  chunk_free(&db_handler->chunk);
   memset(&db_handler->chunk, 0, sizeof(db_handler->chunk));
   db_handler->chunk.epoch = 0;
   db_handler->chunk.data_len = 0;
   db_handler->chunk.new_epoch_flag = 0;
 }
 
-static int epoch_list_add(tsdb_handler *handler, u_int32_t epoch) {
-  // reallocate memory and add put the epoch at the end
-  // counter of epochs is increased as well
-  u_int32_t *new_arr_p;
-  new_arr_p = (u_int32_t *) realloc(handler->epoch_list, (handler->number_of_epochs + 1) * sizeof(u_int32_t));
-  if (new_arr_p == NULL) {
-      return -1;
-  }
-  handler->number_of_epochs++;
-  handler->epoch_list = new_arr_p;
-  handler->epoch_list[handler->number_of_epochs - 1] = epoch;
-
-  return 0;
-}
+/* Fragment records. In format 1 they are keyed by "<epoch>-<fragment>"
+ * strings, which a B-tree sorts lexicographically ("1000-10" < "1000-2").
+ * Format 2 keys are a zero byte followed by the big-endian epoch and
+ * fragment, so that fragment records sort chronologically, ahead of all
+ * other records, and a time range is a single cursor walk. */
 
-static void tsdb_flush_chunk(tsdb_handler *handler) {
-    char *compressed;
-    u_int compressed_len, new_len, num_fragments, i;
-    u_int fragment_size;
-    char str[32], rv=0;
+static u_int32_t fragment_key(tsdb_handler *handler, u_int32_t epoch,
+                              u_int32_t fragment, char *key) {
+  /* Writes the key of the fragment record into key (at least 32 bytes)
+   * and returns its length */
+    u_int8_t *ptr = (u_int8_t *)key;
 
-    if (!handler->chunk.data) {
-        purge_chunk_with_fire(handler);
-        return;
+    if (handler->format_version < 2) {
+        return snprintf(key, 32, "%u-%u", epoch, fragment);
     }
 
-    if (handler->chunk.new_epoch_flag) {
+    ptr[0] = 0;
+    ptr[1] = epoch >> 24, ptr[2] = epoch >> 16, ptr[3] = epoch >> 8, ptr[4] = epoch;
+    ptr[5] = fragment >> 24, ptr[6] = fragment >> 16, ptr[7] = fragment >> 8, ptr[8] = fragment;
 
-        if (handler->most_recent_epoch >= handler->chunk.epoch) {
-            trace_error("BUG: last epoch in DB %d >= current epoch %d being written \n", handler->most_recent_epoch, handler->chunk.epoch);
-        }
+    return FRAGMENT_KEY_LEN;
+}
 
-        /* The following assertion is fundamental for the logic.
-         * It assures that no epochs can be created in the past, and thus inserted
-         * into list of epochs in DB at the end. This will violate the assumption,
-         * that all epochs in the list are sorted in chronological order.
-         * In principle one can cancel this limitation by introducing sorting
-         * every time we flush a chunk for a new epoch into DB. However
-         * if we have about 1 million of epochs and have to sort them for
-         * every DB flush, it can prove being greedy for too much CPU resources */
-        if (handler->most_recent_epoch > handler->chunk.epoch) {
-        	trace_error("Fatal logic error: current epoch is older than the last one available in the TSDB");
-        	exit(1);
-        }
+static int parse_fragment_key(const DBT *key, u_int32_t *epoch, u_int32_t *fragment) {
+  /* Inverse of fragment_key() for format 2, returns -1 for other records */
+    const u_int8_t *ptr = (const u_int8_t *)key->data;
 
-        rv = epoch_list_add(handler, handler->chunk.epoch);
-        if (rv) {
-            trace_error("Epoch %lu will not be written, failed to allocate memory. Current chunk will be purged. We keep working.",handler->chunk.epoch );
-            purge_chunk_with_fire(handler);
-            return;
-        }
-        //handler->number_of_epochs ++; | It was incremented by epoch_list_add(), if reallocation succeeded
+    if (key->size != FRAGMENT_KEY_LEN || ptr[0] != 0) {
+        return -1;
+    }
 
-        db_put(handler, "epoch_list",
-            strlen("epoch_list"),
-            handler->epoch_list,
-            handler->number_of_epochs * sizeof(handler->chunk.epoch));
-        db_put(handler, "num_epochs",
-            strlen("num_epochs"),
-            &handler->number_of_epochs,
-            sizeof(handler->number_of_epochs));
+    *epoch = ((u_int32_t)ptr[1] << 24) | ((u_int32_t)ptr[2] << 16) | ((u_int32_t)ptr[3] << 8) | ptr[4];
+    *fragment = ((u_int32_t)ptr[5] << 24) | ((u_int32_t)ptr[6] << 16) | ((u_int32_t)ptr[7] << 8) | ptr[8];
 
-        if (handler->chunk.epoch > handler->most_recent_epoch) { //must always be true given the assertion above
-            handler->most_recent_epoch = handler->chunk.epoch;
-            db_put(handler, "recent_epoch", strlen("recent_epoch"),
-                   &handler->most_recent_epoch, sizeof(handler->most_recent_epoch));
-        }
+    return 0;
+}
+
+/* Fragment records of format 3 start with a tag. Its low nibble is the
+ * kind of frame: FRAGMENT_FULL (a keyframe) is followed by the encoded
+ * fragment, FRAGMENT_DELTA (a delta frame) by the epoch it is based on, the
+ * previous one, and the encoded fragment of the differences of every value
+ * with that of the base (wrapping around 64 bits). Its high nibble is the
+ * TSDB_FRAGMENT_ codec picked by compress_fragment(). Unless all indexes
+ * of the fragment were set, FRAGMENT_VALID is added to the kind and the
+ * header is followed by the length (2 bytes) of the validity bitmap of the
+ * fragment encoded with tsdb_bits_encode() and the bitmap; keyframes then
+ * hold the values of the set indexes only. From format 4 on, the kind
+ * FRAGMENT_SHARED stands for a keyframe stored as a shared payload, see
+ * tsdb_shared.h. Records of older formats are TSDB_FRAGMENT_QLZ keyframes
+ * without a tag. */
+
+#define FRAGMENT_FULL 0
+#define FRAGMENT_DELTA 1
+#define FRAGMENT_SHARED 2
+#define FRAGMENT_VALID 8
+#define FRAGMENT_TAG(kind, codec) ((kind) | ((codec) << 4))
+#define FRAGMENT_VALID_LEN(fragment_len) (2 + TSDB_BITS_BOUND(fragment_len)) //longest validity bitmap of a record
+#define FRAGMENT_SAMPLES 4 //samples of a fragment compressed to estimate QuickLZ level 3, 1/32 of it each
+#define FOR_BOUND(num_values) (4 + ((num_values) / TSDB_FOR_BLOCK + 1) * 9 + (num_values) * 8) //longest tsdb_for_encode() output
+#define FRAGMENT_SCRATCH_LEN(len, fragment_len) ((len) + (len) / (8 * FRAGMENT_SAMPLES) + 2 * CHUNK_LEN_PADDING + \
+                                                 FRAGMENT_HEADER_LEN + FRAGMENT_VALID_LEN(fragment_len))
+
+typedef struct {
+    u_int8_t kind; //FRAGMENT_FULL, FRAGMENT_DELTA or FRAGMENT_SHARED
+    u_int8_t codec; //TSDB_FRAGMENT_ codec of data
+    u_int32_t base_epoch; //delta frames only
+    u_int8_t *valid; //encoded validity bitmap within the record, NULL if all indexes are set
+    u_int32_t valid_len;
+    u_int16_t values_per_entry; //of the handler
+    u_int32_t fragment_len; //of the handler, indexes per fragment
+    tsdb_value fill; //unknown_value of the handler, that of missing indexes
+    char *data; //the encoded fragment within the record
+    u_int32_t len;
+} fragment_frame;
+
+static int fragment_payload(tsdb_handler *handler, void *record, u_int32_t record_len,
+                            fragment_frame *frame) {
+  /* Splits a fragment record into its tag, validity bitmap and encoded data.
+   * Returns 0 on success, -1 if it is malformed */
+    u_int8_t *ptr = (u_int8_t *)record;
+    u_int32_t header_len;
+
+    memset(frame, 0, sizeof(fragment_frame));
+    frame->values_per_entry = handler->values_per_entry;
+    frame->fragment_len = handler->fragment_len;
+    memset(&frame->fill, handler->unknown_value, sizeof(frame->fill));
+
+    if (handler->format_version < 3) {
+        frame->data = (char *)record;
+        frame->len = record_len;
+        return 0;
     }
 
-    fragment_size = handler->values_len * CHUNK_GROWTH;
-    new_len = handler->chunk.data_len + CHUNK_LEN_PADDING;
-    compressed = (char*)malloc(new_len);
-    if (!compressed) {
-        trace_error("Not enough memory (%u bytes)", new_len);
-        return;
+    if (record_len < 1) {
+        return -1;
+    }
+    frame->kind = ptr[0] & 0x0F & ~FRAGMENT_VALID;
+    frame->codec = ptr[0] >> 4;
+    if (frame->kind == FRAGMENT_SHARED && handler->format_version >= 4 &&
+        record_len == SHARED_REF_LEN && frame->codec < TSDB_NUM_FRAGMENT_CODECS) {
+        // the hash of the payload, see fragment_get()
+        frame->data = (char *)&ptr[1];
+        frame->len = record_len - 1;
+        return 0;
+    }
+    header_len = (frame->kind == FRAGMENT_DELTA ? FRAGMENT_HEADER_LEN : 1);
+    if (frame->kind > FRAGMENT_DELTA || frame->codec >= TSDB_NUM_FRAGMENT_CODECS ||
+        record_len < header_len) {
+        return -1;
     }
 
-    // Split chunks on the DB
-    num_fragments = 1 + (handler->chunk.data_len -1) / fragment_size; //to avoid use of ceil() function
+    if (frame->kind == FRAGMENT_DELTA) {
+        memcpy(&frame->base_epoch, &ptr[1], sizeof(u_int32_t));
+    }
+    if (ptr[0] & FRAGMENT_VALID) {
+        if (record_len < header_len + 2) {
+            return -1;
+        }
+        frame->valid_len = ptr[header_len] | ((u_int32_t)ptr[header_len + 1] << 8);
+        frame->valid = &ptr[header_len + 2];
+        header_len += 2 + frame->valid_len;
+        if (record_len < header_len) {
+            return -1;
+        }
+    }
+    frame->data = (char *)&ptr[header_len];
+    frame->len = record_len - header_len;
+
+    return 0;
+}
 
-    for (i=0; i < num_fragments; i++) {
-        u_int offset;
+static int frame_validity(const fragment_frame *frame, u_int32_t *valid) {
+  /* Decodes the validity bitmap of a frame into valid, FRAGMENT_VALID_WORDS()
+   * words. Returns 0 on success, -1 if it is malformed */
+    if (frame->valid == NULL) {
+        memset(valid, 0xFF, FRAGMENT_VALID_WORDS(frame->fragment_len) * sizeof(u_int32_t));
+        return 0;
+    }
 
-        if ((!handler->read_only) && handler->chunk.fragment_changed[i]) {
-            offset = i * fragment_size;
+    return tsdb_bits_decode(frame->valid, frame->valid_len, valid, frame->fragment_len);
+}
 
-            compressed_len = qlz_compress(&handler->chunk.data[offset], //src, dst, init_len
-                                          compressed, fragment_size,
-                                          &handler->state_compress);
+static u_int32_t compact_values(u_int8_t *dst, const u_int8_t *src, const u_int32_t *valid,
+                                u_int32_t fragment_len, u_int32_t entry_len) {
+  /* Copies the entries of the set indexes of a fragment one after the
+   * other into dst, which may be src. Returns the number of bytes */
+    u_int32_t i, run, len = 0;
 
-            trace_info("Compression %u -> %u [fragment %u] [%.1f %%]",
-                       fragment_size, compressed_len, i,
-                       ((float)(compressed_len*100))/((float)fragment_size));
+    for (i = 0; i < fragment_len; i += run) {
+        if (!get_bit((u_int32_t *)valid, i)) {
+            run = 1;
+            continue;
+        }
+        for (run = 1; i + run < fragment_len && get_bit((u_int32_t *)valid, i + run); run++);
+        memmove(&dst[len], &src[i * entry_len], run * entry_len);
+        len += run * entry_len;
+    }
 
-            snprintf(str, sizeof(str), "%u-%u", handler->chunk.epoch, i);
+    return len;
+}
 
-            db_put(handler, str, strlen(str), compressed, compressed_len);
+static void expand_values(u_int8_t *data, const u_int32_t *valid, u_int32_t fragment_len,
+                          u_int32_t num_set, u_int32_t entry_len, tsdb_value fill) {
+  /* Inverse of compact_values() in place: the num_set entries at the start
+   * of data are moved to their indexes, missing ones get fill */
+    u_int32_t i = fragment_len, j = num_set, v;
+
+    // once all indexes below i are set, the entries left are in place
+    while (i > j) {
+        i--;
+        if (get_bit((u_int32_t *)valid, i)) {
+            j--;
+            memcpy(&data[i * entry_len], &data[j * entry_len], entry_len);
         } else {
-            trace_info("Skipping fragment %u (unchanged)", i);
+            for (v = 0; v < entry_len / sizeof(tsdb_value); v++) {
+                memcpy(&data[i * entry_len + v * sizeof(tsdb_value)], &fill, sizeof(tsdb_value));
+            }
         }
     }
+}
 
-    free(compressed);
-    /* Invoke the callback (if any) to allow manipulation
-     * on the handler->chunk.data before emptying it  */
-    if (handler->reportChunkDataCB.cb != NULL && handler->reportChunkDataCB.external_data != NULL) {
-        if (handler->reportChunkDataCB.cb(handler, handler->reportChunkDataCB.external_data)) {
-            trace_warning("CallBack call failed, no or incorrect data will be written into consolidated TSDBs.");
+static int decode_values(const fragment_frame *frame, u_int8_t *dst, u_int32_t *len,
+                         qlz_state_decompress *state) {
+  /* Decodes the data of a frame into dst, at most *len bytes, and sets *len
+   * to the length decoded. Returns 0 on success, -1 if it is malformed */
+    u_int8_t *packed;
+    u_int32_t packed_len;
+    int num_values;
+
+    switch (frame->codec) {
+    case TSDB_FRAGMENT_QLZ:
+    case TSDB_FRAGMENT_QLZ3:
+        // QuickLZ headers are 3 or 9 bytes long, see qlz_compress()
+        if (frame->len < 3 || frame->len < ((frame->data[0] & 2) ? 9 : 3) ||
+            qlz_size_compressed(frame->data) > frame->len || qlz_size_decompressed(frame->data) > *len) {
+            return -1;
         }
-    }
-    /******/
-    free(handler->chunk.data);
-    memset(&handler->chunk, 0, sizeof(handler->chunk));
-    handler->chunk.data = NULL;
-    handler->chunk.epoch = 0;
-    handler->chunk.data_len = 0;
-    handler->chunk.new_epoch_flag = 0;
+        *len = (frame->codec == TSDB_FRAGMENT_QLZ ? qlz_decompress(frame->data, dst, state)
+                                                  : qlz3_decompress(frame->data, dst));
+        return 0;
+    case TSDB_FRAGMENT_RAW:
+        if (frame->len > *len) {
+            return -1;
+        }
+        memcpy(dst, frame->data, frame->len);
+        *len = frame->len;
+        return 0;
+    case TSDB_FRAGMENT_RLE:
+        num_values = tsdb_rle_decode((u_int8_t *)frame->data, frame->len, (u_int64_t *)dst,
+                                     *len / sizeof(tsdb_value));
+        break;
+    case TSDB_FRAGMENT_FOR:
+        num_values = tsdb_for_decode((u_int8_t *)frame->data, frame->len, (u_int64_t *)dst,
+                                     *len / sizeof(tsdb_value));
+        break;
+    case TSDB_FRAGMENT_FOR_QLZ:
+        if (frame->len < 3 || frame->len < ((frame->data[0] & 2) ? 9 : 3) ||
+            qlz_size_compressed(frame->data) > frame->len ||
+            qlz_size_decompressed(frame->data) > FOR_BOUND(*len / sizeof(tsdb_value)) ||
+            (packed = (u_int8_t*) malloc(qlz_size_decompressed(frame->data))) == NULL) {
+            return -1;
+        }
+        packed_len = qlz_decompress(frame->data, packed, state);
+        num_values = tsdb_for_decode(packed, packed_len, (u_int64_t *)dst, *len / sizeof(tsdb_value));
+        free(packed);
+        break;
+    default:
+        return -1;
+    }
+
+    if (num_values < 0) {
+        return -1;
+    }
+    *len = num_values * sizeof(tsdb_value);
+
+    return 0;
 }
 
-void tsdb_close(tsdb_handler *handler) {
+static int fragment_decode(const fragment_frame *frame, u_int8_t *dst, u_int32_t *len,
+                           qlz_state_decompress *state, u_int32_t *valid) {
+  /* Decodes the data of a frame into dst, at most *len bytes, and sets *len
+   * to the length decoded. Missing indexes dropped from keyframes get
+   * unknown values back. The validity bitmap of the frame is decoded into
+   * valid (FRAGMENT_VALID_WORDS() words) unless it is NULL.
+   * Returns 0 on success, -1 if it is malformed */
+    u_int32_t bits[FRAGMENT_VALID_WORDS(MAX_FRAGMENT_LEN)], num_set, max_len = *len;
+    u_int32_t entry_len = frame->values_per_entry * sizeof(tsdb_value);
+
+    if (frame->kind == FRAGMENT_SHARED || decode_values(frame, dst, len, state)) {
+        return -1;
+    }
 
-    if (!handler->alive) {
-        return;
+    if (frame->valid == NULL) {
+        if (valid) {
+            frame_validity(frame, valid);
+        }
+        return 0;
+    }
+
+    if (frame_validity(frame, bits)) {
+        return -1;
+    }
+    if (frame->kind == FRAGMENT_FULL) {
+        num_set = tsdb_bits_count(bits, frame->fragment_len);
+        if (*len != num_set * entry_len || frame->fragment_len * entry_len > max_len) {
+            return -1;
+        }
+        expand_values(dst, bits, frame->fragment_len, num_set, entry_len, frame->fill);
+        *len = frame->fragment_len * entry_len;
+    }
+    if (valid) {
+        memcpy(valid, bits, FRAGMENT_VALID_WORDS(frame->fragment_len) * sizeof(u_int32_t));
     }
 
-    tsdb_flush_chunk(handler);
+    return 0;
+}
 
-    if (!handler->read_only) {
-        trace_info("Flushing database changes...");
+static void delta_apply(u_int8_t *data, const u_int8_t *base, u_int32_t len, u_int8_t decode) {
+  /* Turns the values of a fragment into their differences with those of
+   * the base, or back if decode is set */
+    tsdb_value *values = (tsdb_value *)data;
+    const tsdb_value *base_values = (const tsdb_value *)base;
+    u_int32_t i;
+
+    if (decode) {
+        for (i = 0; i < len / sizeof(tsdb_value); i++) {
+            values[i] += base_values[i];
+        }
+    } else {
+        for (i = 0; i < len / sizeof(tsdb_value); i++) {
+            values[i] -= base_values[i];
+        }
     }
+}
 
-    handler->db->close(handler->db, 0);
-    if (handler->epoch_list) {
-    	free(handler->epoch_list);
-    	handler->epoch_list = NULL;
+/* Shared payloads, see tsdb_shared.h. From format 4 on, a keyframe record
+ * of at least SHARED_MIN_LEN bytes is stored in place the first time. Once
+ * the same record is stored again, it becomes a shared payload, and both
+ * fragment records, as well as all later ones with the same content, refer
+ * to it: a FRAGMENT_SHARED tag, holding the codec of the payload, followed
+ * by the hash. The SHARED_COUNT record keeps the number of references and
+ * the length of the payload, so that another reference costs no rewrite
+ * of it. A payload goes along with its last reference. Records whose hash
+ * is taken by another payload are stored in place. */
+
+static int shared_ref(tsdb_handler *handler, const void *record, u_int32_t record_len,
+                      u_int64_t *hash) {
+  /* Returns 1 if a fragment record refers to a shared payload, whose hash is set */
+    const u_int8_t *ptr = (const u_int8_t *)record;
+
+    if (handler->format_version < 4 || record_len != SHARED_REF_LEN ||
+        (ptr[0] & 0x0F) != FRAGMENT_SHARED) {
+        return 0;
     }
+    memcpy(hash, &ptr[1], sizeof(u_int64_t));
 
-    handler->alive = 0;
+    return 1;
 }
 
-void normalize_epoch(tsdb_handler *handler, u_int32_t *epoch) {
-    *epoch -= *epoch % handler->slot_duration;
-//    *epoch += timezone - daylight * 3600; <-- Legacy code, it used to recalculate local time into UTC (in a wrong way, btw)
+static int shared_acquire(tsdb_handler *handler, const u_int8_t *record,
+                          u_int32_t len, u_int64_t hash, u_int32_t refs) {
+  /* Adds refs references to the payload record, or stores it with refs
+   * references if it is new and refs > 1. Must be called with
+   * handler->shared.lock held. Returns 0 on success, 1 if it is new and
+   * refs == 1, -1 if its hash is taken by another payload */
+    char key[SHARED_KEY_LEN];
+    void *value;
+    u_int32_t value_len;
+    tsdb_shared_count count;
+    int rc = 0;
+
+    tsdb_shared_key(SHARED_COUNT, hash, key);
+    if (db_get_copy(handler, key, SHARED_KEY_LEN, &value, &value_len) == -1) {
+        if (refs == 1) {
+            return 1;
+        }
+        tsdb_shared_key(SHARED_PAYLOAD, hash, key);
+        db_put(handler, key, SHARED_KEY_LEN, (void *)record, len);
+        count.refs = refs;
+        count.len = len;
+        tsdb_shared_key(SHARED_COUNT, hash, key);
+        db_put(handler, key, SHARED_KEY_LEN, &count, sizeof(count));
+        return 0;
+    }
+
+    tsdb_shared_parse_count(value, value_len, &count);
+    free(value);
+
+    // the same hash is no proof of the same content
+    rc = -1;
+    tsdb_shared_key(SHARED_PAYLOAD, hash, key);
+    if (count.refs && count.len == len &&
+        db_get_copy(handler, key, SHARED_KEY_LEN, &value, &value_len) == 0) {
+        if (value_len == len && memcmp(value, record, len) == 0) {
+            rc = 0;
+        }
+        free(value);
+    }
+    if (rc == 0) {
+        count.refs += refs;
+        tsdb_shared_key(SHARED_COUNT, hash, key);
+        db_put(handler, key, SHARED_KEY_LEN, &count, sizeof(count));
+    }
+
+    return rc;
 }
 
-int tsdb_get_key_index(tsdb_handler *handler, char *key, u_int32_t *index) {
-/*get index by key*/
-    void *ptr;
-    u_int32_t len;
-    char str[32] = { 0 };
+static void shared_release(tsdb_handler *handler, u_int64_t hash) {
+  /* Drops a reference to a payload, which is deleted along with the last
+   * one. Must be called with handler->shared.lock held */
+    char key[SHARED_KEY_LEN];
+    void *value;
+    u_int32_t value_len;
+    tsdb_shared_count count;
 
-    snprintf(str, sizeof(str), "key-%s", key);
+    tsdb_shared_key(SHARED_COUNT, hash, key);
+    if (db_get_copy(handler, key, SHARED_KEY_LEN, &value, &value_len) == -1) {
+        return;
+    }
+    tsdb_shared_parse_count(value, value_len, &count);
+    free(value);
 
-    if (db_get(handler, str, strlen(str), &ptr, &len) == 0) {
-        *index = *(u_int32_t*)ptr;
-        return 0;
+    if (count.refs > 1) {
+        count.refs--;
+        db_put(handler, key, SHARED_KEY_LEN, &count, sizeof(count));
+    } else {
+        db_del(handler, key, SHARED_KEY_LEN);
+        tsdb_shared_key(SHARED_PAYLOAD, hash, key);
+        db_del(handler, key, SHARED_KEY_LEN);
     }
-    return -1;
 }
 
-static void set_key_index(tsdb_handler *handler, char *key, u_int32_t index) {
-    char str[32];
+static int fragment_ref(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment,
+                        u_int64_t *hash) {
+  /* Returns 1 if the record of a fragment refers to a shared payload, whose hash is set */
+    char key[32];
+    void *record;
+    u_int32_t key_len, record_len;
+    int rc;
 
-    snprintf(str, sizeof(str), "key-%s", key); // strlen(key) <= 31 - 4 = 27
+    if (handler->format_version < 4) {
+        return 0;
+    }
+    key_len = fragment_key(handler, epoch, fragment, key);
+    if (db_get_copy(handler, key, key_len, &record, &record_len) == -1) {
+        return 0;
+    }
+    rc = shared_ref(handler, record, record_len, hash);
+    free(record);
 
-    db_put(handler, str, strlen(str), &index, sizeof(index));
+    return rc;
+}
 
-    trace_info("[NEW_SET] Mapping %s -> %u", key, index);
+static int fragment_get(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment,
+                        void **record, u_int32_t *record_len) {
+  /* db_get_copy() of the record of a fragment, a reference is replaced by
+   * its shared payload. Returns -1 if there is none, -2 on errors */
+    char key[32];
+    u_int32_t key_len = fragment_key(handler, epoch, fragment, key);
+    u_int64_t hash, current;
+
+    if (db_get_copy(handler, key, key_len, record, record_len) == -1) {
+        return -1;
+    }
+    if (shared_ref(handler, *record, *record_len, &hash)) {
+        free(*record);
+        tsdb_shared_key(SHARED_PAYLOAD, hash, key);
+        if (db_get_copy(handler, key, SHARED_KEY_LEN, record, record_len) == 0) {
+            return 0;
+        }
+        // gone along with the fragment if it was deleted or rewritten meanwhile
+        if (fragment_ref(handler, epoch, fragment, &current) == 0 || current != hash) {
+            return -1;
+        }
+        trace_error("Shared payload of fragment %u of epoch %u is missing", fragment, epoch);
+        return -2;
+    }
+
+    return 0;
 }
 
-int tsdb_goto_epoch(tsdb_handler *handler,
-                    u_int32_t epoch,
-                    u_int8_t fail_if_missing,
-                    u_int8_t growable) {
-  //if epoch exists, it loads it with all fragments
-  //otherwise, if permitted, a new empty epoch is created
-    int rc;
+static int fragment_share(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment,
+                          const u_int8_t *record, u_int32_t len, u_int64_t hash) {
+  /* Makes the record of a fragment a reference to its shared payload if the
+   * same one is already shared or was the last one of the fragment stored
+   * in place, which then refers to the payload as well. Must be called with
+   * handler->shared.lock held. Returns 0 if it is shared, -1 if not */
+    tsdb_shared_candidate *last = NULL;
+    char key[32];
+    u_int8_t ref[SHARED_REF_LEN];
     void *value;
-    u_int32_t value_len, fragment = 0;
-    char str[32];
+    u_int32_t key_len, value_len;
+    int rc;
 
-    if (handler == NULL) {
-        trace_error("DB handler is NULL pointer");
+    if ((rc = shared_acquire(handler, record, len, hash, 1)) == 1 &&
+        fragment < handler->shared.num_fragments) {
+        last = &handler->shared.candidates[fragment];
+        key_len = fragment_key(handler, last->epoch, fragment, key);
+        if (last->len == len && last->hash == hash && last->epoch != epoch &&
+            db_get_copy(handler, key, key_len, &value, &value_len) == 0) {
+            if (value_len == len && memcmp(value, record, len) == 0) {
+                rc = shared_acquire(handler, record, len, hash, 2);
+            }
+            free(value);
+        }
+    }
+    if (rc) {
         return -1;
     }
 
-    normalize_epoch(handler, &epoch);
-    if (handler->chunk.epoch == epoch) {
-        //by returning we effectively prevent extra disk writes (code
-        //does not reach the tsdb_flush_chunk() line)
-        return 0;
+    ref[0] = FRAGMENT_TAG(FRAGMENT_SHARED, record[0] >> 4);
+    memcpy(&ref[1], &hash, sizeof(hash));
+    if (last) {
+        key_len = fragment_key(handler, last->epoch, fragment, key);
+        db_put(handler, key, key_len, ref, SHARED_REF_LEN);
+        last->len = 0;
     }
+    key_len = fragment_key(handler, epoch, fragment, key);
+    db_put(handler, key, key_len, ref, SHARED_REF_LEN);
 
-    tsdb_flush_chunk(handler);
+    return 0;
+}
 
-    //normalize_epoch(handler, &epoch);
-    snprintf(str, sizeof(str), "%u-%u", epoch, fragment);
+static u_int32_t fragment_put(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment,
+                              const u_int8_t *record, u_int32_t len, u_int8_t replace) {
+  /* Stores the record of a fragment, see fragment_share(). If replace is
+   * set, the reference of the record it replaces is dropped afterwards, as
+   * it may be to the same payload. Returns the length of the record stored */
+    char key[32];
+    u_int32_t key_len, stored = len;
+    u_int64_t hash = 0, old_hash;
+    u_int8_t eligible, old;
+
+    eligible = (handler->format_version >= 4 && len >= SHARED_MIN_LEN &&
+                (record[0] & 0x0F & ~FRAGMENT_VALID) == FRAGMENT_FULL);
+    if (eligible) {
+        hash = tsdb_shared_hash(record, len);
+    }
 
-    rc = db_get(handler, str, strlen(str), &value, &value_len);
+    pthread_mutex_lock(&handler->shared.lock);
+    old = (replace && fragment_ref(handler, epoch, fragment, &old_hash));
+    if (eligible && fragment_share(handler, epoch, fragment, record, len, hash) == 0) {
+        stored = SHARED_REF_LEN;
+    } else {
+        key_len = fragment_key(handler, epoch, fragment, key);
+        db_put(handler, key, key_len, (void *)record, len);
+        if (eligible && tsdb_shared_remember(&handler->shared, epoch, fragment, hash, len)) {
+            trace_warning("Not enough memory, fragment %u of epoch %u will not be shared", fragment, epoch);
+        }
+    }
+    if (old) {
+        shared_release(handler, old_hash);
+    }
+    pthread_mutex_unlock(&handler->shared.lock);
 
-    if (rc == -1 && fail_if_missing) {
+    return stored;
+}
+
+static void fragment_del(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment) {
+  /* Deletes the record of a fragment and its reference to a shared payload */
+    char key[32];
+    u_int32_t key_len = fragment_key(handler, epoch, fragment, key);
+    u_int64_t hash;
+    int shared;
+
+    pthread_mutex_lock(&handler->shared.lock);
+    shared = fragment_ref(handler, epoch, fragment, &hash);
+    db_del(handler, key, key_len);
+    if (shared) {
+        shared_release(handler, hash);
+    }
+    pthread_mutex_unlock(&handler->shared.lock);
+}
+
+#define FRAGMENT_VALID_BYTES(handler) (FRAGMENT_VALID_WORDS((handler)->fragment_len) * sizeof(u_int32_t))
+
+static u_int8_t *cache_peek(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment) {
+  /* Cached fragments are followed by their validity bitmap, see
+   * cache_put_fragment(). Returns the cached fragment or NULL */
+    u_int32_t cached_len;
+    u_int8_t *cached = tsdb_cache_get(&handler->cache, epoch, fragment, &cached_len);
+
+    if (cached == NULL || cached_len != handler->values_len * handler->fragment_len + FRAGMENT_VALID_BYTES(handler)) {
+        return NULL;
+    }
+
+    return cached;
+}
+
+static int cache_get_fragment(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment,
+                              u_int8_t *dst, u_int32_t *valid) {
+  /* Copies a cached fragment into dst and its validity bitmap into valid
+   * unless it is NULL. Returns 0 on success, -1 if it is not cached */
+    u_int32_t fragment_size = handler->values_len * handler->fragment_len;
+    u_int8_t *cached = cache_peek(handler, epoch, fragment);
+
+    if (cached == NULL) {
         return -1;
     }
+    memcpy(dst, cached, fragment_size);
+    if (valid) {
+        memcpy(valid, &cached[fragment_size], FRAGMENT_VALID_BYTES(handler));
+    }
 
-    if (rc == -1 ) {
-        if (handler->most_recent_epoch > epoch) {
-            // intended epoch recored is in the past and does not exist
-            trace_warning("Attempt to access a non-existing epoch in the past. In the current implementation this is PROHIBITED, as it breaks program logic");
-            return -1;
+    return 0;
+}
+
+static void cache_put_fragment(tsdb_handler *handler, u_int32_t epoch, u_int32_t fragment,
+                               const u_int8_t *data, const u_int32_t *valid) {
+    tsdb_cache_put_parts(&handler->cache, epoch, fragment, data, handler->values_len * handler->fragment_len,
+                         (const u_int8_t *)valid, FRAGMENT_VALID_BYTES(handler));
+}
+
+static int fetch_fragment(tsdb_handler *handler, u_int32_t epoch,
+                          u_int32_t fragment, u_int8_t *dst, u_int32_t *valid) {
+  /* Decodes a fragment of an epoch into dst, and its validity bitmap into
+   * valid unless it is NULL, from the cache or its record, which is cached
+   * then. Delta frames are followed back to the closest keyframe or cached
+   * base, which are then decoded forward. Called by the thread owning the
+   * handler.
+   * Returns -1 if the epoch has no record of the fragment, -2 on errors */
+    void *records[SEGMENT_EPOCHS], *value;
+    fragment_frame frames[SEGMENT_EPOCHS], frame;
+    u_int8_t *buffer = NULL;
+    u_int32_t bits[FRAGMENT_VALID_WORDS(MAX_FRAGMENT_LEN)];
+    u_int32_t requested = epoch, num_deltas = 0, value_len, len;
+    u_int32_t fragment_size = handler->values_len * handler->fragment_len;
+    int rc = 0;
+
+    while (1) {
+        // the validity is that of the requested epoch, not of its bases
+        if (cache_get_fragment(handler, epoch, fragment, dst, num_deltas ? NULL : bits) == 0) {
+            if (num_deltas == 0) {
+                if (valid) {
+                    memcpy(valid, bits, FRAGMENT_VALID_BYTES(handler));
+                }
+                return 0;
+            }
+            break;
         }
-        // Having implemented the above condition, we make sure an every non-existent epoch we are about to write (thus creating it) is the most recent one and we don't change "the past"
-        handler->chunk.new_epoch_flag = 1;
+
+        if ((rc = fragment_get(handler, epoch, fragment, &value, &value_len)) == -2) {
+            goto cleanup;
+        }
+        if (rc == -1) {
+            if (num_deltas == 0) {
+                return -1;
+            }
+            // the base was never written
+            memset(dst, handler->unknown_value, fragment_size);
+            rc = 0;
+            break;
+        }
+
+        len = fragment_size;
+        if (fragment_payload(handler, value, value_len, &frame) ||
+            (num_deltas == 0 && frame_validity(&frame, bits)) ||
+            (frame.kind == FRAGMENT_FULL &&
+             (fragment_decode(&frame, dst, &len, &handler->state_decompress, NULL) || len != fragment_size))) {
+            trace_error("Fragment %u of epoch %u is malformed", fragment, epoch);
+            free(value);
+            rc = -2;
+            goto cleanup;
+        }
+        if (frame.kind == FRAGMENT_FULL) {
+            free(value);
+            break;
+        }
+
+        if (num_deltas == SEGMENT_EPOCHS) {
+            trace_error("Fragment %u has no keyframe within %u epochs before epoch %u",
+                        fragment, SEGMENT_EPOCHS, epoch);
+            free(value);
+            rc = -2;
+            goto cleanup;
+        }
+        records[num_deltas] = value;
+        frames[num_deltas++] = frame;
+        epoch = frame.base_epoch;
     }
 
-    handler->chunk.epoch = epoch;
-    handler->chunk.growable = growable;
-    //handler->chunk.data = NULL is set after flushing
+    if (num_deltas) {
+        buffer = (u_int8_t*) malloc(fragment_size);
+        if (buffer == NULL) {
+            trace_error("Not enough memory (%u bytes)", fragment_size);
+            rc = -2;
+            goto cleanup;
+        }
+    }
+    while (num_deltas) {
+        len = fragment_size;
+        if (fragment_decode(&frames[num_deltas - 1], buffer, &len, &handler->state_decompress, NULL) ||
+            len != fragment_size) {
+            trace_error("Delta frame of fragment %u before epoch %u is malformed", fragment, requested);
+            rc = -2;
+            goto cleanup;
+        }
+        delta_apply(dst, buffer, fragment_size, 1);
+        free(records[--num_deltas]);
+    }
+    cache_put_fragment(handler, requested, fragment, dst, bits);
+    if (valid) {
+        memcpy(valid, bits, FRAGMENT_VALID_BYTES(handler));
+    }
 
-    if (rc == 0) {
-        //ATTENTION! All fragments must exist consecutively, i.e., we cant have only fragments 3, 7 and 90
-        //Fragments existing in the DB for every epoch must be [0,1,...,k], where k <= MAX_NUM_FRAGMENTS
-        //Otherwise we cannot guarantee that if k+1 th fragment does not exists - there are no more fragments for
-        //this epoch. This leads to a constraint on the way we write and save data in the DB - even if we have previously written
-        //only indices, e.g., 7000 and 45000, which corresponds to fragments 0 and 4, eventually the fragments 0,1,2,3,4 must be written
-        //for that epoch, even though the fragments 1,2,3 will be empty (have only zeros)
+cleanup:
+    while (num_deltas) {
+        free(records[--num_deltas]);
+    }
+    free(buffer);
 
-        u_int32_t new_decompr_chunk_len, offset = 0;
-        u_int8_t *cur_data = NULL, *new_data = NULL;
+    return rc;
+}
 
-        trace_info("Loading epoch %u", epoch);
+/* Per-epoch manifest, stored under "manifest-<epoch>" by tsdb_flush_chunk():
+ * the number of fragments followed by the compressed and the decompressed
+ * size of each of them. A compressed size of 0 stands for a fragment which
+ * has no record, i.e. none of its indexes is set: it was never written, or
+ * all its indexes were unset again. Thus epochs may be sparse,
+ * writing a high index stores its fragment only. Epochs written before
+ * manifests existed have none, their fragments are contiguous and probed
+ * one by one. */
+
+typedef struct {
+    u_int32_t num_fragments;
+    u_int32_t *compressed_len;
+    u_int32_t *decompressed_len;
+    u_int32_t *raw; //the record as stored in the DB
+} tsdb_manifest;
+
+static int manifest_get(tsdb_handler *handler, u_int32_t epoch, tsdb_manifest *manifest) {
+    char str[32];
+    void *value;
+    u_int32_t value_len, num_fragments;
 
-        while (1) {
-            cur_data = new_data;
-            new_decompr_chunk_len = qlz_size_decompressed(value);
-            new_data = (u_int8_t*) realloc(cur_data, handler->chunk.data_len + new_decompr_chunk_len);
-            if (new_data == NULL) {
-                trace_error("Not enough memory (%u bytes)",
-                              handler->chunk.data_len+new_decompr_chunk_len);
-                free(value);
-                free(cur_data);
-                return -2;
+    memset(manifest, 0, sizeof(tsdb_manifest));
+
+    snprintf(str, sizeof(str), "manifest-%u", epoch);
+    if (db_get_copy(handler, str, strlen(str), &value, &value_len) == -1) {
+        return -1;
+    }
+
+    num_fragments = value_len >= sizeof(u_int32_t) ? *(u_int32_t *)value : 0;
+    if (num_fragments == 0 || num_fragments > value_len / (2 * sizeof(u_int32_t)) ||
+        value_len != (1 + 2 * num_fragments) * sizeof(u_int32_t)) {
+        trace_warning("Ignoring malformed manifest of epoch %u", epoch);
+        free(value);
+        return -1;
+    }
+
+    manifest->raw = (u_int32_t *)value;
+    manifest->num_fragments = num_fragments;
+    manifest->compressed_len = &manifest->raw[1];
+    manifest->decompressed_len = &manifest->raw[1 + num_fragments];
+
+    return 0;
+}
+
+static void manifest_free(tsdb_manifest *manifest) {
+    free(manifest->raw);
+    memset(manifest, 0, sizeof(tsdb_manifest));
+}
+
+/* Cold segments, see tsdb_segment.h. Once the SEGMENT_EPOCHS epochs at
+ * positions [s * SEGMENT_EPOCHS, (s + 1) * SEGMENT_EPOCHS) of the epoch
+ * index are all old enough, the compactor thread transposes every fragment
+ * of them into its slices. Segments are compacted in order, "cold_segments"
+ * counts those whose epochs have no fragment records anymore. */
+
+static u_int32_t cold_epochs(tsdb_handler *handler) {
+  /* Number of the oldest epochs kept in cold segments only, must be called
+   * with compactor.lock held. Read-only handlers look it up in the DB, the
+   * writing process may have compacted more since */
+    void *value;
+    u_int32_t value_len;
+
+    if (handler->read_only &&
+        db_get(handler, "cold_segments", strlen("cold_segments"), &value, &value_len) == 0) {
+        handler->compactor.cold_segments = *((u_int32_t*)value);
+    }
+
+    return handler->compactor.cold_segments * SEGMENT_EPOCHS;
+}
+
+static int epoch_compacted(tsdb_handler *handler, u_int32_t position) {
+  /* Returns 1 if the epoch at position is compacted or queued for it, so
+   * that no epoch may be inserted before it without moving it to another
+   * segment, else 0 */
+    int rc;
+
+    pthread_mutex_lock(&handler->compactor.lock);
+    rc = ((u_int64_t)position < (u_int64_t)handler->compactor.next_segment * SEGMENT_EPOCHS);
+    pthread_mutex_unlock(&handler->compactor.lock);
+
+    return rc;
+}
+
+static int load_cold_fragment(tsdb_handler *handler, u_int32_t epoch,
+                              u_int32_t fragment, u_int8_t *dst, u_int32_t *valid) {
+  /* Gathers a fragment of a compacted epoch from the slices of its segment,
+   * and its validity bitmap into valid (FRAGMENT_VALID_WORDS() words).
+   * Returns -1 if the epoch is not compacted, -2 on errors */
+    char key[32];
+    void *value;
+    u_int8_t *buffer;
+    u_int32_t position, num_cold, slice, i, offset, index, key_len, value_len;
+    u_int32_t slice_valid[TSDB_SLICE_WORDS];
+    u_int32_t slice_len = SEGMENT_SERIES * SEGMENT_EPOCHS * handler->values_len;
+    int rc = 0;
+
+    if (handler->format_version < 2 || tsdb_epoch_search(handler, epoch, &position) != 1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&handler->compactor.lock);
+    num_cold = cold_epochs(handler);
+    pthread_mutex_unlock(&handler->compactor.lock);
+    if (position >= num_cold) {
+        return -1;
+    }
+
+    buffer = (u_int8_t*) malloc(slice_len);
+    if (buffer == NULL) {
+        trace_error("Not enough memory (%u bytes)", slice_len);
+        return -2;
+    }
+
+    memset(valid, 0, FRAGMENT_VALID_BYTES(handler));
+    offset = position % SEGMENT_EPOCHS;
+    for (slice = 0; slice < handler->fragment_len / SEGMENT_SERIES; slice++) {
+        key_len = tsdb_segment_key(fragment, slice, position / SEGMENT_EPOCHS, key);
+        if (db_get_copy(handler, key, key_len, &value, &value_len) == -1) {
+            memset(&dst[slice * SEGMENT_SERIES * handler->values_len], handler->unknown_value,
+                   SEGMENT_SERIES * handler->values_len);
+            continue;
+        }
+        if (tsdb_slice_open(handler->values_per_entry, value, value_len, buffer, slice_valid,
+                            &handler->state_decompress)) {
+            rc = -2;
+        }
+        for (i = 0; i < SEGMENT_SERIES && rc == 0; i++) {
+            index = slice * SEGMENT_SERIES + i;
+            if (!get_bit(slice_valid, i * SEGMENT_EPOCHS + offset)) {
+                memset(&dst[index * handler->values_len], handler->unknown_value, handler->values_len);
+                continue;
             }
-            new_decompr_chunk_len = qlz_decompress(value, &new_data[offset], &handler->state_decompress);
-            handler->chunk.data_len += new_decompr_chunk_len;
-            fragment++;
-            offset = handler->chunk.data_len;
+            set_bit(valid, index);
+            rc = tsdb_slice_copy(handler->values_per_entry, value, value_len, buffer, i, offset, 1,
+                                 &dst[index * handler->values_len], 0);
+        }
+        free(value);
+        if (rc) {
+            trace_error("Failed to read slice %u of fragment %u in cold segment %u",
+                        slice, fragment, position / SEGMENT_EPOCHS);
+            break;
+        }
+    }
+    free(buffer);
+    if (rc) {
+        return rc;
+    }
 
-            snprintf(str, sizeof(str), "%u-%u", epoch, fragment);
-            if (db_get(handler, str, strlen(str), &value, &value_len) == -1) {
-                break; // No more fragments
+    trace_info("Gathered fragment %u of epoch %u from cold segment %u",
+               fragment, epoch, position / SEGMENT_EPOCHS);
+
+    return 0;
+}
+
+static void compactor_schedule(tsdb_handler *handler) {
+  /* Queues the segments whose epochs are all old enough for the compactor
+   * thread, called by the thread owning the handler */
+    tsdb_compactor *compactor = &handler->compactor;
+    u_int32_t *queue, *epochs, last, i, queue_len;
+
+    if (!compactor->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&compactor->lock);
+    while ((u_int64_t)(compactor->next_segment + 1) * SEGMENT_EPOCHS <= handler->number_of_epochs) {
+        if (tsdb_epoch_at(handler, (compactor->next_segment + 1) * SEGMENT_EPOCHS - 1, &last) ||
+            (u_int64_t)last + compactor->age >= handler->most_recent_epoch) {
+            break;
+        }
+
+        if (compactor->num_queued == compactor->queue_len) {
+            queue_len = (compactor->queue_len ? 2 * compactor->queue_len : 4);
+            queue = (u_int32_t*) realloc(compactor->queue, queue_len * SEGMENT_EPOCHS * sizeof(u_int32_t));
+            if (queue == NULL) {
+                trace_error("Not enough memory (%u bytes)", queue_len * SEGMENT_EPOCHS * sizeof(u_int32_t));
+                break;
             }
+            compactor->queue = queue;
+            compactor->queue_len = queue_len;
         }
 
-        if (new_data == NULL) {
-            trace_error("Smth went wrong and epoch data was not read out into memory");
-            return -2;
+        epochs = &compactor->queue[compactor->num_queued * SEGMENT_EPOCHS];
+        for (i = 0; i < SEGMENT_EPOCHS; i++) {
+            if (tsdb_epoch_at(handler, compactor->next_segment * SEGMENT_EPOCHS + i, &epochs[i])) {
+                break;
+            }
+        }
+        if (i < SEGMENT_EPOCHS) {
+            break;
         }
 
+        compactor->num_queued++;
+        compactor->next_segment++;
+    }
+    pthread_cond_broadcast(&compactor->cond);
+    pthread_mutex_unlock(&compactor->lock);
+}
+
+static int ensure_workers(tsdb_handler *handler) {
+  /* Starts the worker pool of the handler on first use */
+    if (handler->pool.threads != NULL) {
+        return 0;
+    }
+
+    handler->worker_compress = (qlz_state_compress *)
+            calloc(handler->num_workers - 1, sizeof(qlz_state_compress));
+    handler->worker_decompress = (qlz_state_decompress *)
+            calloc(handler->num_workers - 1, sizeof(qlz_state_decompress));
+    if (handler->worker_compress == NULL || handler->worker_decompress == NULL) {
+        free(handler->worker_compress);
+        free(handler->worker_decompress);
+        handler->worker_compress = NULL;
+        handler->worker_decompress = NULL;
+        return -1;
+    }
+
+    if (tsdb_pool_init(&handler->pool, handler->num_workers)) {
+        trace_warning("Unable to start %u worker threads, working single-threaded",
+                      handler->num_workers);
+        free(handler->worker_compress);
+        free(handler->worker_decompress);
+        handler->worker_compress = NULL;
+        handler->worker_decompress = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void stop_workers(tsdb_handler *handler) {
+    tsdb_pool_destroy(&handler->pool);
+    free(handler->worker_compress);
+    free(handler->worker_decompress);
+    handler->worker_compress = NULL;
+    handler->worker_decompress = NULL;
+}
+
+static void run_jobs(tsdb_handler *handler, tsdb_job_func func,
+                     void *jobs, size_t job_size, u_int32_t num_jobs) {
+    u_int32_t i;
+
+    if (num_jobs > 1 && handler->num_workers > 1 && ensure_workers(handler) == 0) {
+        tsdb_pool_run(&handler->pool, func, jobs, job_size, num_jobs);
+        return;
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        func(&((u_int8_t *)jobs)[i * job_size], 0);
+    }
+}
+
+typedef struct {
+    tsdb_handler *handler;
+    u_int8_t *src; //fragment record, NULL if it is not to be decompressed
+    fragment_frame frame; //within src, delta frames are decoded against their base afterwards
+    u_int8_t *dst;
+    u_int32_t *valid; //validity bitmap of the fragment in the chunk
+    u_int32_t len; //expected decompressed length
+    int rc;
+} decompress_job;
+
+static void decompress_fragment(void *data, u_int32_t worker) {
+    decompress_job *job = (decompress_job *)data;
+    qlz_state_decompress *state = (worker ? &job->handler->worker_decompress[worker - 1]
+                                          : &job->handler->state_decompress);
+    u_int32_t len = job->len;
+
+    if (job->src == NULL) {
+        return;
+    }
+
+    job->rc = (fragment_decode(&job->frame, job->dst, &len, state, job->valid) == 0 && len == job->len ? 0 : -1);
+}
+
+typedef struct {
+    tsdb_handler *handler;
+    u_int32_t fragment;
+    u_int8_t *src;
+    u_int32_t len;
+    const u_int8_t *base; //the fragment of the previous epoch for delta frames, else NULL
+    u_int32_t base_epoch;
+    const u_int32_t *valid; //validity bitmap of the fragment, NULL if all its indexes are set
+    u_int32_t num_valid; //indexes set
+    u_int64_t deadline; //of the flush for picking the codec, 0 for TSDB_FRAGMENT_QLZ
+    char *dst; //at least FRAGMENT_SCRATCH_LEN(len, fragment_len) bytes
+    u_int32_t compressed_len;
+    u_int8_t codec;
+    u_int8_t unprobed; //set if the deadline had passed
+    char *packed; //TSDB_FRAGMENT_FOR_QLZ record tried by pick_codec()
+    u_int32_t packed_len;
+} compress_job;
+
+static u_int64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static u_int8_t pick_codec(compress_job *job, u_int32_t worker, u_int32_t qlz_len,
+                           qlz_state_compress *state, char *scratch) {
+  /* Picks the codec giving the shortest record given the length with
+   * TSDB_FRAGMENT_QLZ. Those without QuickLZ are exact and cheap to count.
+   * Within the budget of the flush, the bit-packed values are compressed
+   * into job->packed for TSDB_FRAGMENT_FOR_QLZ, and level 3 is tried if
+   * level 1 is still the shortest. The length of level 3 is extrapolated
+   * from that of both levels on samples of the fragment and has to be
+   * clearly shorter */
+    tsdb_handler *handler = job->handler;
+    const u_int64_t *values = (const u_int64_t *)job->src;
+    u_int64_t len[TSDB_NUM_FRAGMENT_CODECS], sampled = 0, sampled3 = 0;
+    u_int32_t i, offset, sample_len, num_values = job->len / sizeof(tsdb_value);
+    u_int8_t best = TSDB_FRAGMENT_QLZ;
+    void *state3;
+
+    if (now_usec() > job->deadline) {
+        job->unprobed = 1;
+        return TSDB_FRAGMENT_QLZ;
+    }
+
+    len[TSDB_FRAGMENT_QLZ] = qlz_len;
+    len[TSDB_FRAGMENT_RAW] = job->len;
+    len[TSDB_FRAGMENT_RLE] = tsdb_rle_size(values, num_values, job->len);
+    len[TSDB_FRAGMENT_FOR] = tsdb_for_size(values, num_values);
+    for (i = TSDB_FRAGMENT_RAW; i <= TSDB_FRAGMENT_FOR; i++) {
+        if (len[i] < len[best]) {
+            best = i;
+        }
+    }
+    if (now_usec() > job->deadline) {
+        return best;
+    }
+
+    // the packed values may still repeat, as for periodic series
+    if (len[TSDB_FRAGMENT_FOR] < job->len &&
+        (job->packed = (char*) malloc(2 * len[TSDB_FRAGMENT_FOR] + CHUNK_LEN_PADDING)) != NULL) {
+        tsdb_for_encode(values, num_values, (u_int8_t *)job->packed);
+        job->packed_len = qlz_compress(job->packed, &job->packed[len[TSDB_FRAGMENT_FOR]],
+                                       len[TSDB_FRAGMENT_FOR], state);
+        memmove(job->packed, &job->packed[len[TSDB_FRAGMENT_FOR]], job->packed_len);
+        if (job->packed_len < len[best]) {
+            best = TSDB_FRAGMENT_FOR_QLZ;
+        }
+    }
+    if (best != TSDB_FRAGMENT_QLZ || now_usec() > job->deadline) {
+        return best;
+    }
+
+    if (handler->worker_qlz3[worker] == NULL) {
+        handler->worker_qlz3[worker] = calloc(1, qlz3_state_size());
+    }
+    if ((state3 = handler->worker_qlz3[worker]) == NULL) {
+        return best;
+    }
+
+    // samples spread over the fragment, starting on values
+    sample_len = (job->len / (8 * FRAGMENT_SAMPLES)) & ~(sizeof(tsdb_value) - 1);
+    for (i = 0; i < FRAGMENT_SAMPLES && sample_len; i++) {
+        offset = (job->len / FRAGMENT_SAMPLES * i) & ~(sizeof(tsdb_value) - 1);
+        sampled += qlz_compress(&job->src[offset], scratch, sample_len, state);
+        sampled3 += qlz3_compress(&job->src[offset], scratch, sample_len, state3);
+    }
+    if (sampled && sampled3 * 10 < sampled * 9) {
+        best = TSDB_FRAGMENT_QLZ3;
+    }
+
+    return best;
+}
+
+static void compress_fragment(void *data, u_int32_t worker) {
+    compress_job *job = (compress_job *)data;
+    qlz_state_compress *state = (worker ? &job->handler->worker_compress[worker - 1]
+                                        : &job->handler->state_compress);
+    u_int32_t header_len = 0, len, num_values, src_len = job->len;
+    u_int8_t *src = job->src, *compacted = NULL;
+    char *dst, *scratch;
+
+    if (job->handler->format_version >= 3) {
+        header_len = 1;
+    }
+    if (job->base) {
+        // the differences are encoded in place, the values are restored afterwards
+        memcpy(&job->dst[1], &job->base_epoch, sizeof(u_int32_t));
+        header_len = FRAGMENT_HEADER_LEN;
+        delta_apply(job->src, job->base, job->len, 0);
+    } else if (job->valid) {
+        // keyframes hold the values of the set indexes only
+        compacted = (u_int8_t*) malloc((u_int64_t)job->num_valid * job->handler->values_len);
+        if (compacted == NULL) {
+            trace_warning("Not enough memory, missing indexes of fragment %u are written as set", job->fragment);
+            job->valid = NULL;
+        } else {
+            job->len = compact_values(compacted, job->src, job->valid, job->handler->fragment_len,
+                                      job->handler->values_len);
+            job->src = compacted;
+        }
+    }
+    if (job->valid) {
+        len = tsdb_bits_encode(job->valid, job->handler->fragment_len, (u_int8_t *)&job->dst[header_len + 2]);
+        job->dst[header_len] = len & 0xFF;
+        job->dst[header_len + 1] = len >> 8;
+        header_len += 2 + len;
+    }
+    dst = &job->dst[header_len];
+    num_values = job->len / sizeof(tsdb_value);
+
+    job->codec = TSDB_FRAGMENT_QLZ;
+    len = qlz_compress(job->src, dst, job->len, state);
+    if (job->deadline) {
+        // the samples are compressed past the record, which is shorter than job->len if they are
+        scratch = &dst[len];
+        job->codec = pick_codec(job, worker, len, state, scratch);
+    }
+
+    switch (job->codec) {
+    case TSDB_FRAGMENT_RAW:
+        memcpy(dst, job->src, job->len);
+        len = job->len;
+        break;
+    case TSDB_FRAGMENT_RLE:
+        len = tsdb_rle_encode((u_int64_t *)job->src, num_values, (u_int8_t *)dst);
+        break;
+    case TSDB_FRAGMENT_FOR:
+        len = tsdb_for_encode((u_int64_t *)job->src, num_values, (u_int8_t *)dst);
+        break;
+    case TSDB_FRAGMENT_QLZ3:
+        len = qlz3_compress(job->src, dst, job->len, job->handler->worker_qlz3[worker]);
+        break;
+    case TSDB_FRAGMENT_FOR_QLZ:
+        memcpy(dst, job->packed, job->packed_len);
+        len = job->packed_len;
+        break;
+    }
+    job->compressed_len = header_len + len;
+    free(job->packed);
+    job->packed = NULL;
+    job->src = src;
+    job->len = src_len;
+    free(compacted);
+
+    if (header_len) {
+        job->dst[0] = FRAGMENT_TAG((job->base ? FRAGMENT_DELTA : FRAGMENT_FULL) |
+                                   (job->valid ? FRAGMENT_VALID : 0), job->codec);
+    }
+    if (job->base) {
+        delta_apply(job->src, job->base, job->len, 1);
+    }
+}
+
+static int load_epoch(tsdb_handler *handler, u_int32_t epoch, tsdb_manifest *manifest) {
+  /* Loads all fragments of an epoch listed in the manifest into a single
+   * allocation. Fragments are fetched from the cache or the DB by the
+   * calling thread and decompressed in parallel by the worker pool, delta
+   * frames are decoded against their bases afterwards */
+    void *value;
+    u_int8_t *data, *base = NULL;
+    u_int32_t i, value_len, *valid;
+    u_int64_t data_len = 0, offset = 0;
+    decompress_job *jobs;
+    int rc = 0;
+
+    for (i = 0; i < manifest->num_fragments; i++) {
+        data_len += manifest->decompressed_len[i];
+    }
+
+    data = (u_int8_t *) malloc(data_len);
+    valid = (u_int32_t *) calloc(manifest->num_fragments, FRAGMENT_VALID_BYTES(handler));
+    jobs = (decompress_job *) calloc(manifest->num_fragments, sizeof(decompress_job));
+    if (data == NULL || valid == NULL || jobs == NULL) {
+        trace_error("Not enough memory (%llu bytes)", (unsigned long long)data_len);
+        free(data);
+        free(valid);
+        free(jobs);
+        return -2;
+    }
+
+    for (i = 0; i < manifest->num_fragments; i++) {
+        jobs[i].handler = handler;
+        jobs[i].dst = &data[offset];
+        jobs[i].valid = &valid[i * FRAGMENT_VALID_WORDS(handler->fragment_len)];
+        jobs[i].len = manifest->decompressed_len[i];
+        offset += manifest->decompressed_len[i];
+
+        if (jobs[i].len == handler->values_len * handler->fragment_len &&
+            cache_get_fragment(handler, epoch, i, jobs[i].dst, jobs[i].valid) == 0) {
+            continue;
+        }
+
+        if ((rc = fragment_get(handler, epoch, i, &value, &value_len)) == -2) {
+            break;
+        }
+        if (rc == -1) {
+            // moved into a cold segment or never written
+            if ((rc = load_cold_fragment(handler, epoch, i, jobs[i].dst, jobs[i].valid)) == -1) {
+                memset(jobs[i].dst, handler->unknown_value, jobs[i].len);
+                rc = 0;
+            }
+            if (rc) {
+                break;
+            }
+            continue;
+        }
+        if (fragment_payload(handler, value, value_len, &jobs[i].frame)) {
+            trace_error("Fragment %u of epoch %u is malformed", i, epoch);
+            free(value);
+            rc = -2;
+            break;
+        }
+        jobs[i].src = (u_int8_t *)value;
+    }
+
+    if (rc == 0) {
+        run_jobs(handler, decompress_fragment, jobs, sizeof(decompress_job), manifest->num_fragments);
+    }
+
+    for (i = 0; i < manifest->num_fragments; i++) {
+        if (jobs[i].src == NULL) {
+            continue;
+        }
+        if (jobs[i].rc) {
+            trace_error("Failed to decompress fragment %u of epoch %u", i, epoch);
+            rc = -2;
+        }
+        if (rc == 0 && jobs[i].frame.kind == FRAGMENT_DELTA) {
+            if (base == NULL && (base = (u_int8_t*) malloc(jobs[i].len)) == NULL) {
+                trace_error("Not enough memory (%u bytes)", jobs[i].len);
+                rc = -2;
+            } else if ((rc = fetch_fragment(handler, jobs[i].frame.base_epoch, i, base, NULL)) == -1) {
+                // the base was never written
+                memset(base, handler->unknown_value, jobs[i].len);
+                rc = 0;
+            }
+            if (rc == 0) {
+                delta_apply(jobs[i].dst, base, jobs[i].len, 1);
+            }
+        }
+        if (rc == 0 && jobs[i].len == handler->values_len * handler->fragment_len) {
+            cache_put_fragment(handler, epoch, i, jobs[i].dst, jobs[i].valid);
+        }
+        free(jobs[i].src);
+    }
+    free(jobs);
+    free(base);
+
+    if (rc == 0) {
+        rc = chunk_reserve(&handler->chunk, manifest->num_fragments);
+    }
+    if (rc) {
+        free(data);
+        free(valid);
+        return rc;
+    }
+
+    handler->chunk.data = data;
+    handler->chunk.valid = valid;
+    handler->chunk.data_len = data_len;
+
+    return 0;
+}
+
+static void point_drop(tsdb_handler *handler) {
+    free(handler->point.record);
+    handler->point.record = NULL;
+}
+
+static int load_fragment(tsdb_handler *handler, u_int32_t fragment) {
+  /* Decompresses a single fragment of the current lazily loaded epoch
+   * into its place in handler->chunk.data, unless it was done before */
+    u_int32_t fragment_size = handler->values_len * handler->fragment_len;
+    u_int32_t *valid = &handler->chunk.valid[(u_int64_t)fragment * FRAGMENT_VALID_WORDS(handler->fragment_len)];
+    u_int8_t *dst = &handler->chunk.data[(u_int64_t)fragment * fragment_size];
+    int rc;
+
+    if (!handler->chunk.lazy || get_bit(handler->chunk.fragment_loaded, fragment)) {
+        return 0;
+    }
+
+    rc = fetch_fragment(handler, handler->chunk.epoch, fragment, dst, valid);
+    if (rc == -1) {
+        rc = load_cold_fragment(handler, handler->chunk.epoch, fragment, dst, valid);
+        if (rc == -1) {
+            // listed in the manifest, but never written
+            memset(dst, handler->unknown_value, fragment_size);
+            memset(valid, 0, FRAGMENT_VALID_BYTES(handler));
+            rc = 0;
+        } else if (rc == 0) {
+            cache_put_fragment(handler, handler->chunk.epoch, fragment, dst, valid);
+        }
+    }
+    if (rc) {
+        return -1;
+    }
+    set_bit(handler->chunk.fragment_loaded, fragment);
+    if (handler->point.record && handler->point.fragment == fragment) {
+        point_drop(handler);
+    }
+
+    trace_info("Loaded fragment %u of epoch %u", fragment, handler->chunk.epoch);
+
+    return 0;
+}
+
+static int load_all_fragments(tsdb_handler *handler) {
+    u_int32_t i, num_fragments;
+
+    if (!handler->chunk.lazy) {
+        return 0;
+    }
+
+    num_fragments = handler->chunk.data_len / (handler->values_len * handler->fragment_len);
+    for (i = 0; i < num_fragments; i++) {
+        if (load_fragment(handler, i)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int record_new_epoch(tsdb_handler *handler) {
+  /* Adds the epoch of the current chunk to the index of epochs in the DB,
+   * at the end unless it is older than the most recent one */
+    u_int32_t position = handler->number_of_epochs;
+    int rc;
+
+    if (handler->number_of_epochs && handler->chunk.epoch <= handler->most_recent_epoch) {
+        rc = tsdb_epoch_search(handler, handler->chunk.epoch, &position);
+        if (rc == 1) {
+            return 0;
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        // positions of cold segments must not move
+        if (epoch_compacted(handler, position)) {
+            trace_error("Epoch %u is older than the compacted epochs, it will not be written", handler->chunk.epoch);
+            return -1;
+        }
+    }
+
+    if (epoch_index_insert(handler, handler->chunk.epoch, position)) {
+        trace_error("Epoch %lu will not be written, failed to allocate memory. Current chunk will be purged. We keep working.",handler->chunk.epoch );
+        return -1;
+    }
+    //handler->number_of_epochs ++; | It was incremented by epoch_index_insert(), if it succeeded
+
+    db_put(handler, "num_epochs",
+        strlen("num_epochs"),
+        &handler->number_of_epochs,
+        sizeof(handler->number_of_epochs));
+
+    if (handler->chunk.epoch > handler->most_recent_epoch) {
+        handler->most_recent_epoch = handler->chunk.epoch;
+        db_put(handler, "recent_epoch", strlen("recent_epoch"),
+               &handler->most_recent_epoch, sizeof(handler->most_recent_epoch));
+    } else {
+        trace_info("Epoch %u inserted at position %u", handler->chunk.epoch, position);
+    }
+
+    compactor_schedule(handler);
+
+    return 0;
+}
+
+static void write_chunk(tsdb_handler *handler, tsdb_chunk *chunk) {
+  /* Compresses the changed fragments of the chunk and writes them into
+   * the DB along with the manifest of the epoch. Called either by the
+   * thread owning the handler or by its flusher thread */
+    char *compressed;
+    u_int32_t *manifest;
+    tsdb_manifest old_manifest;
+    compress_job *jobs;
+    tsdb_codec_stats stats; //merged into those of the handler once written
+    u_int32_t num_fragments, i, num_jobs = 0, num_changed = 0, num_valid;
+    u_int32_t fragment_size, job_len;
+    u_int64_t deadline = 0;
+    u_int8_t sparse; //the fragments without a record are known
+    char str[32];
+
+    fragment_size = handler->values_len * handler->fragment_len;
+    job_len = FRAGMENT_SCRATCH_LEN(fragment_size, handler->fragment_len);
+
+    // Split chunks on the DB
+    num_fragments = 1 + (chunk->data_len -1) / fragment_size; //to avoid use of ceil() function
+
+    if (!handler->read_only) {
+        for (i = 0; i < num_fragments; i++) {
+            num_jobs += get_bit(chunk->fragment_changed, i);
+        }
+    }
+
+    // every changed fragment gets its own output buffer, so that all of them can be compressed at once
+    compressed = (char*)malloc((size_t)num_jobs * job_len + 1);
+    jobs = (compress_job*)calloc(num_jobs + 1, sizeof(compress_job));
+    manifest = (u_int32_t*)calloc(1 + 2 * num_fragments, sizeof(u_int32_t));
+    if (!compressed || !jobs || !manifest) {
+        trace_error("Not enough memory (%llu bytes)", (unsigned long long)num_jobs * job_len);
+        free(compressed);
+        free(jobs);
+        free(manifest);
+        return;
+    }
+    manifest[0] = num_fragments;
+    memset(&stats, 0, sizeof(stats));
+    sparse = chunk->new_epoch_flag;
+    if (!handler->read_only && !chunk->new_epoch_flag &&
+        manifest_get(handler, chunk->epoch, &old_manifest) == 0) {
+        // sizes of the fragments left untouched
+        for (i = 0; i < num_fragments && i < old_manifest.num_fragments; i++) {
+            manifest[1 + i] = old_manifest.compressed_len[i];
+        }
+        manifest_free(&old_manifest);
+        sparse = 1;
+    }
+
+    if (handler->format_version >= 3 && handler->codec_budget) {
+        deadline = now_usec() + handler->codec_budget;
+    }
+
+    for (i=0, num_jobs = 0; i < num_fragments; i++) {
+        manifest[1 + num_fragments + i] = fragment_size;
+
+        if ((!handler->read_only) && get_bit(chunk->fragment_changed, i)) {
+            num_changed++;
+            num_valid = tsdb_bits_count(&chunk->valid[(u_int64_t)i * FRAGMENT_VALID_WORDS(handler->fragment_len)],
+                                        handler->fragment_len);
+            // no index set, as if never written
+            if (num_valid == 0) {
+                if (!sparse || manifest[1 + i]) {
+                    fragment_del(handler, chunk->epoch, i);
+                    manifest[1 + i] = 0;
+                }
+                trace_info("Skipping fragment %u (no index set)", i);
+                stats.skipped++;
+                continue;
+            }
+            jobs[num_jobs].handler = handler;
+            jobs[num_jobs].fragment = i;
+            jobs[num_jobs].src = &chunk->data[(u_int64_t)i * fragment_size];
+            jobs[num_jobs].len = fragment_size;
+            // older formats have no tag to flag a validity bitmap with
+            if (num_valid < handler->fragment_len && handler->format_version >= 3) {
+                jobs[num_jobs].valid = &chunk->valid[(u_int64_t)i * FRAGMENT_VALID_WORDS(handler->fragment_len)];
+                jobs[num_jobs].num_valid = num_valid;
+            }
+            jobs[num_jobs].deadline = deadline;
+            if (chunk->base && (u_int64_t)(i + 1) * fragment_size <= chunk->base_len) {
+                jobs[num_jobs].base = &chunk->base[(u_int64_t)i * fragment_size];
+                jobs[num_jobs].base_epoch = chunk->base_epoch;
+            }
+            jobs[num_jobs].dst = &compressed[(size_t)num_jobs * job_len];
+            num_jobs++;
+        } else {
+            trace_info("Skipping fragment %u (unchanged)", i);
+        }
+    }
+
+    run_jobs(handler, compress_fragment, jobs, sizeof(compress_job), num_jobs);
+
+    // Berkeley DB gets the fragments in order, from the writing thread only
+    for (i = 0; i < num_jobs; i++) {
+        trace_info("Compression %u -> %u [fragment %u] [%s] [%.1f %%]",
+                   fragment_size, jobs[i].compressed_len, jobs[i].fragment,
+                   tsdb_fragment_codec_name(jobs[i].codec),
+                   ((float)(jobs[i].compressed_len*100))/((float)fragment_size));
+        stats.fragments[jobs[i].codec]++;
+        stats.bytes[jobs[i].codec] += jobs[i].compressed_len;
+        stats.delta_frames += (jobs[i].base != NULL);
+        stats.unprobed += jobs[i].unprobed;
+
+        manifest[1 + jobs[i].fragment] = fragment_put(handler, chunk->epoch, jobs[i].fragment,
+                                                      (u_int8_t *)jobs[i].dst, jobs[i].compressed_len,
+                                                      manifest[1 + jobs[i].fragment] != 0);
+    }
+
+    if (num_changed) {
+        snprintf(str, sizeof(str), "manifest-%u", chunk->epoch);
+        db_put(handler, str, strlen(str), manifest, (1 + 2 * num_fragments) * sizeof(u_int32_t));
+    }
+
+    // the flusher thread writes while the owning one may read them, see tsdb_get_codec_stats()
+    pthread_mutex_lock(&handler->flusher.lock);
+    for (i = 0; i < TSDB_NUM_FRAGMENT_CODECS; i++) {
+        handler->codec_stats.fragments[i] += stats.fragments[i];
+        handler->codec_stats.bytes[i] += stats.bytes[i];
+    }
+    handler->codec_stats.delta_frames += stats.delta_frames;
+    handler->codec_stats.unprobed += stats.unprobed;
+    handler->codec_stats.skipped += stats.skipped;
+    pthread_mutex_unlock(&handler->flusher.lock);
+
+    free(manifest);
+    free(jobs);
+    free(compressed);
+}
+
+static void *flusher_main(void *data) {
+    tsdb_handler *handler = (tsdb_handler *)data;
+    tsdb_flusher *flusher = &handler->flusher;
+    tsdb_chunk *chunk;
+
+    pthread_mutex_lock(&flusher->lock);
+    while (1) {
+        if (flusher->num_queued == 0) {
+            if (flusher->shutdown) {
+                break;
+            }
+            pthread_cond_wait(&flusher->cond, &flusher->lock);
+            continue;
+        }
+
+        // the chunk stays queued while being written, so that its epoch is known to be in flight
+        chunk = &flusher->queue[flusher->head];
+        pthread_mutex_unlock(&flusher->lock);
+
+        write_chunk(handler, chunk);
+        chunk_free(chunk);
+
+        pthread_mutex_lock(&flusher->lock);
+        flusher->head = (flusher->head + 1) % flusher->depth;
+        flusher->num_queued--;
+        pthread_cond_broadcast(&flusher->cond);
+    }
+    pthread_mutex_unlock(&flusher->lock);
+
+    return NULL;
+}
+
+static void flusher_push(tsdb_handler *handler) {
+  /* Hands the current chunk over to the flusher thread,
+   * waiting for a free slot if depth chunks are in flight */
+    tsdb_flusher *flusher = &handler->flusher;
+
+    pthread_mutex_lock(&flusher->lock);
+    while (flusher->num_queued == flusher->depth) {
+        pthread_cond_wait(&flusher->cond, &flusher->lock);
+    }
+    flusher->queue[(flusher->head + flusher->num_queued) % flusher->depth] = handler->chunk;
+    flusher->num_queued++;
+    pthread_cond_broadcast(&flusher->cond);
+    pthread_mutex_unlock(&flusher->lock);
+}
+
+static int flusher_has_epoch(tsdb_flusher *flusher, u_int32_t epoch) {
+  /* Must be called with flusher->lock held */
+    u_int8_t i;
+
+    for (i = 0; i < flusher->num_queued; i++) {
+        if (flusher->queue[(flusher->head + i) % flusher->depth].epoch == epoch) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void flusher_wait_epoch(tsdb_handler *handler, u_int32_t epoch) {
+    tsdb_flusher *flusher = &handler->flusher;
+
+    pthread_mutex_lock(&flusher->lock);
+    while (flusher_has_epoch(flusher, epoch)) {
+        pthread_cond_wait(&flusher->cond, &flusher->lock);
+    }
+    pthread_mutex_unlock(&flusher->lock);
+}
+
+static void delta_new_epoch(tsdb_handler *handler) {
+  /* Makes the chunk of a new epoch being flushed delta frames of the last
+   * one unless it is due for a keyframe, then keeps a copy of its data as
+   * the base of the next one */
+    tsdb_delta *delta = &handler->delta;
+    tsdb_chunk *chunk = &handler->chunk;
+    u_int32_t position = handler->number_of_epochs - 1, previous;
+
+    if (delta->keyframe_interval == 0) {
+        return;
+    }
+
+    // keyframes start cold segments too, so that compaction never needs an older base
+    if (delta->reference && position % delta->keyframe_interval && position % SEGMENT_EPOCHS &&
+        tsdb_epoch_at(handler, position - 1, &previous) == 0 && previous == delta->reference_epoch) {
+        chunk->base = delta->reference; //freed along with the chunk
+        chunk->base_len = delta->reference_len;
+        chunk->base_epoch = delta->reference_epoch;
+    } else {
+        free(delta->reference);
+    }
+
+    delta->reference = (u_int8_t*) malloc(chunk->data_len);
+    if (delta->reference == NULL) {
+        trace_warning("Not enough memory (%llu bytes), the next epoch is a keyframe",
+                      (unsigned long long)chunk->data_len);
+        return;
+    }
+    memcpy(delta->reference, chunk->data, chunk->data_len);
+    delta->reference_len = chunk->data_len;
+    delta->reference_epoch = chunk->epoch;
+}
+
+static void make_keyframe(tsdb_handler *handler, u_int32_t epoch,
+                          u_int32_t base_epoch, u_int32_t fragment) {
+  /* Rewrites the fragment of the epoch in full if it is a delta frame of base_epoch */
+    char key[32];
+    void *value;
+    u_int8_t *data = NULL, *record = NULL;
+    u_int32_t fragment_size = handler->values_len * handler->fragment_len;
+    u_int32_t key_len, value_len, record_len, len, valid[FRAGMENT_VALID_WORDS(MAX_FRAGMENT_LEN)];
+    qlz_state_compress *state = NULL;
+    tsdb_manifest manifest;
+    fragment_frame frame;
+    int rc;
+
+    key_len = fragment_key(handler, epoch, fragment, key);
+    if (db_get_copy(handler, key, key_len, &value, &value_len) == -1) {
+        return;
+    }
+    rc = fragment_payload(handler, value, value_len, &frame);
+    free(value);
+    if (rc || frame.kind != FRAGMENT_DELTA || frame.base_epoch != base_epoch) {
+        return;
+    }
+
+    // the flusher thread may be compressing with handler->state_compress
+    data = (u_int8_t*) malloc(fragment_size);
+    record = (u_int8_t*) malloc(1 + FRAGMENT_VALID_LEN(handler->fragment_len) + fragment_size + CHUNK_LEN_PADDING);
+    state = (qlz_state_compress*) calloc(1, sizeof(qlz_state_compress));
+    if (!data || !record || !state || fetch_fragment(handler, epoch, fragment, data, valid)) {
+        trace_error("Unable to write fragment %u of epoch %u as a keyframe, "
+                    "it is decoded against the new data of epoch %u", fragment, epoch, base_epoch);
+        goto cleanup;
+    }
+
+    record[0] = FRAGMENT_TAG(FRAGMENT_FULL, TSDB_FRAGMENT_QLZ);
+    record_len = 1;
+    len = fragment_size;
+    if (tsdb_bits_count(valid, handler->fragment_len) < handler->fragment_len) {
+        // the validity is kept, see compress_fragment()
+        record[0] |= FRAGMENT_VALID;
+        record_len = tsdb_bits_encode(valid, handler->fragment_len, &record[3]);
+        record[1] = record_len & 0xFF;
+        record[2] = record_len >> 8;
+        record_len += 3;
+        len = compact_values(data, data, valid, handler->fragment_len, handler->values_len);
+    }
+    if (len == 0) {
+        record[0] = (record[0] & 0x0F) | (TSDB_FRAGMENT_RAW << 4);
+    } else {
+        record_len += qlz_compress(data, (char *)&record[record_len], len, state);
+    }
+    record_len = fragment_put(handler, epoch, fragment, record, record_len, 0);
+
+    if (manifest_get(handler, epoch, &manifest) == 0) {
+        if (fragment < manifest.num_fragments) {
+            manifest.compressed_len[fragment] = record_len;
+            snprintf(key, sizeof(key), "manifest-%u", epoch);
+            db_put(handler, key, strlen(key), manifest.raw,
+                   (1 + 2 * manifest.num_fragments) * sizeof(u_int32_t));
+        }
+        manifest_free(&manifest);
+    }
+
+cleanup:
+    free(data);
+    free(record);
+    free(state);
+}
+
+static void delta_rewrite_epoch(tsdb_handler *handler) {
+  /* Before the changed fragments of an existing epoch are written, those
+   * of the next epoch which are delta frames of them become keyframes.
+   * The base of the next new epoch follows the changes */
+    tsdb_delta *delta = &handler->delta;
+    tsdb_chunk *chunk = &handler->chunk;
+    u_int32_t i, num_fragments, position, next, num_changed = 0;
+
+    num_fragments = chunk->data_len / (handler->values_len * handler->fragment_len);
+    for (i = 0; i < num_fragments; i++) {
+        num_changed += get_bit(chunk->fragment_changed, i);
+    }
+    if (num_changed == 0) {
+        return;
+    }
+
+    if (tsdb_epoch_search(handler, chunk->epoch, &position) == 1 &&
+        tsdb_epoch_at(handler, position + 1, &next) == 0) {
+        flusher_wait_epoch(handler, next);
+        for (i = 0; i < num_fragments; i++) {
+            if (get_bit(chunk->fragment_changed, i)) {
+                make_keyframe(handler, next, chunk->epoch, i);
+            }
+        }
+    }
+
+    if (delta->reference && delta->reference_epoch == chunk->epoch) {
+        // fragments of a lazily loaded chunk may be missing, the next epoch is a keyframe then
+        free(delta->reference);
+        delta->reference = (chunk->lazy ? NULL : (u_int8_t*) malloc(chunk->data_len));
+        if (delta->reference) {
+            memcpy(delta->reference, chunk->data, chunk->data_len);
+            delta->reference_len = chunk->data_len;
+        }
+    }
+}
+
+static u_int32_t epoch_fragments(tsdb_handler *handler, u_int32_t epoch) {
+  /* Number of fragments of a stored epoch, listed in its manifest or
+   * probed, they exist consecutively then (see tsdb_goto_epoch()) */
+    tsdb_manifest manifest;
+    u_int32_t fragment = 0, key_len;
+    char str[32];
+
+    if (manifest_get(handler, epoch, &manifest) == 0) {
+        fragment = manifest.num_fragments;
+        manifest_free(&manifest);
+        return fragment;
+    }
+
+    key_len = fragment_key(handler, epoch, fragment, str);
+    while (db_key_exists(handler, str, key_len)) {
+        fragment++;
+        key_len = fragment_key(handler, epoch, fragment, str);
+    }
+
+    return fragment;
+}
+
+static void delta_insert_epoch(tsdb_handler *handler) {
+  /* Compaction decodes a delta frame against the epoch before it in its
+   * segment. Once a past epoch is inserted, that is no longer the base of
+   * the epoch after it, and epochs moved to the start of a segment have
+   * none. Their delta frames become keyframes. The inserted epoch is a
+   * keyframe */
+    u_int32_t i, position, epoch, base, fragment, num_fragments;
+
+    if (tsdb_epoch_search(handler, handler->chunk.epoch, &position) != 1) {
+        return;
+    }
+
+    for (i = position + 1; i < handler->number_of_epochs; i = (i / SEGMENT_EPOCHS + 1) * SEGMENT_EPOCHS) {
+        if (i == position + 1 && position == 0) {
+            continue; //nothing before it to be a delta frame of
+        }
+        if (tsdb_epoch_at(handler, i, &epoch) ||
+            tsdb_epoch_at(handler, (i == position + 1 ? position - 1 : i - 1), &base)) {
+            break;
+        }
+        flusher_wait_epoch(handler, epoch);
+        num_fragments = epoch_fragments(handler, epoch);
+        for (fragment = 0; fragment < num_fragments; fragment++) {
+            make_keyframe(handler, epoch, base, fragment);
+        }
+    }
+}
+
+static void tsdb_flush_chunk(tsdb_handler *handler) {
+    u_int32_t i, num_fragments;
+
+    if (!handler->chunk.data) {
+        purge_chunk_with_fire(handler);
+        return;
+    }
+
+    if (handler->chunk.new_epoch_flag) {
+        if (record_new_epoch(handler)) {
+            purge_chunk_with_fire(handler);
+            return;
+        }
+    }
+
+    if (!handler->read_only && handler->format_version >= 3) {
+        if (handler->chunk.new_epoch_flag && handler->chunk.epoch == handler->most_recent_epoch) {
+            delta_new_epoch(handler);
+        } else if (handler->chunk.new_epoch_flag) {
+            delta_insert_epoch(handler);
+        } else {
+            delta_rewrite_epoch(handler);
+        }
+    }
+
+    if (!handler->read_only) {
+        num_fragments = handler->chunk.data_len / (handler->values_len * handler->fragment_len);
+        for (i = 0; i < num_fragments; i++) {
+            if (get_bit(handler->chunk.fragment_changed, i)) {
+                tsdb_cache_invalidate(&handler->cache, handler->chunk.epoch, i);
+            }
+        }
+    }
+
+    if (handler->flusher.depth == 0) {
+        write_chunk(handler, &handler->chunk);
+    }
+
+    /* Invoke the callback (if any) to allow manipulation
+     * on the handler->chunk.data before emptying it  */
+    if (handler->reportChunkDataCB.cb != NULL && handler->reportChunkDataCB.external_data != NULL) {
+        if (load_all_fragments(handler)) {
+            trace_warning("Failed to load the whole epoch %u for the callback", handler->chunk.epoch);
+        }
+        if (handler->reportChunkDataCB.cb(handler, handler->reportChunkDataCB.external_data)) {
+            trace_warning("CallBack call failed, no or incorrect data will be written into consolidated TSDBs.");
+        }
+    }
+    /******/
+    if (handler->flusher.depth) {
+        flusher_push(handler); //the flusher thread owns and frees the data from now on
+    } else {
+        chunk_free(&handler->chunk);
+    }
+    memset(&handler->chunk, 0, sizeof(handler->chunk));
+    handler->chunk.data = NULL;
+    handler->chunk.epoch = 0;
+    handler->chunk.data_len = 0;
+    handler->chunk.new_epoch_flag = 0;
+}
+
+/* Reorder window. Chunks of epochs with changes are parked in
+ * handler->window.chunks when tsdb_goto_epoch() leaves them, and swapped
+ * back into handler->chunk when it returns to them. Parked chunks are
+ * flushed through handler->chunk as well, oldest first, so that new epochs
+ * are still appended to the epoch index in order. */
+
+static int chunk_dirty(tsdb_chunk *chunk) {
+  /* Returns 1 if the chunk holds changes not written yet, else 0 */
+    if (chunk->data == NULL) {
+        return 0;
+    }
+    return chunk->new_epoch_flag || tsdb_bits_count(chunk->fragment_changed, chunk->num_fragments);
+}
+
+static void window_evict(tsdb_handler *handler, u_int8_t keep) {
+  /* Flushes the oldest open epochs until keep of them are left,
+   * there must be no current epoch */
+    tsdb_window *window = &handler->window;
+    u_int8_t i, oldest;
+
+    while (window->num_open > keep) {
+        for (i = 1, oldest = 0; i < window->num_open; i++) {
+            if (window->chunks[i].epoch < window->chunks[oldest].epoch) {
+                oldest = i;
+            }
+        }
+        handler->chunk = window->chunks[oldest];
+        window->chunks[oldest] = window->chunks[--window->num_open];
+        trace_info("Epoch %u leaves the reorder window", handler->chunk.epoch);
+        tsdb_flush_chunk(handler);
+    }
+}
+
+static void window_leave(tsdb_handler *handler) {
+  /* Leaves the current epoch, which is kept open if it has changes and
+   * the window is on, or else flushed */
+    tsdb_window *window = &handler->window;
+
+    if (window->size < 2 || !chunk_dirty(&handler->chunk)) {
+        tsdb_flush_chunk(handler);
+        return;
+    }
+
+    // there is room for it, the current epoch is counted as open
+    window->chunks[window->num_open++] = handler->chunk;
+    memset(&handler->chunk, 0, sizeof(handler->chunk));
+}
+
+static int window_enter(tsdb_handler *handler, u_int32_t epoch) {
+  /* Makes the open epoch current, there must be no current epoch.
+   * Returns 1 if it was open, else 0 and the oldest open epoch is flushed
+   * if the window is full */
+    tsdb_window *window = &handler->window;
+    u_int8_t i;
+
+    for (i = 0; i < window->num_open; i++) {
+        if (window->chunks[i].epoch == epoch) {
+            handler->chunk = window->chunks[i];
+            window->chunks[i] = window->chunks[--window->num_open];
+            return 1;
+        }
+    }
+
+    if (window->size > 1) {
+        window_evict(handler, window->size - 1);
+    }
+
+    return 0;
+}
+
+static void window_flush(tsdb_handler *handler) {
+  /* Flushes the current epoch and all open ones, oldest first */
+    window_leave(handler);
+    window_evict(handler, 0);
+}
+
+void tsdb_close(tsdb_handler *handler) {
+    u_int32_t i;
+
+    if (!handler->alive) {
+        return;
+    }
+
+    window_flush(handler);
+    free(handler->window.chunks);
+    handler->window.chunks = NULL;
+    tsdb_set_async_flush(handler, 0);
+    tsdb_set_compaction(handler, 0);
+
+    if (!handler->read_only) {
+        trace_info("Flushing database changes...");
+    }
+
+    handler->db->close(handler->db, 0);
+
+    if (handler->cache.budget) {
+        trace_info("Fragment cache: %llu hits, %llu misses, %llu evictions, %llu invalidations",
+                   (unsigned long long)handler->cache.hits,
+                   (unsigned long long)handler->cache.misses,
+                   (unsigned long long)handler->cache.evictions,
+                   (unsigned long long)handler->cache.invalidations);
+    }
+    tsdb_cache_destroy(&handler->cache);
+    tsdb_keymap_destroy(&handler->keymap);
+    stop_workers(handler);
+    pthread_mutex_destroy(&handler->flusher.lock);
+    pthread_cond_destroy(&handler->flusher.cond);
+    pthread_mutex_destroy(&handler->flusher.db_lock);
+    pthread_mutex_destroy(&handler->compactor.lock);
+    pthread_mutex_destroy(&handler->shared.lock);
+    tsdb_shared_destroy(&handler->shared);
+    pthread_cond_destroy(&handler->compactor.cond);
+    free(handler->compactor.queue);
+    free(handler->delta.reference);
+    for (i = 0; i < MAX_NUM_WORKERS; i++) {
+        free(handler->worker_qlz3[i]);
+    }
+    point_drop(handler);
+    free(handler->point.values);
+    free(handler->point.valid);
+
+    epoch_index_destroy(handler);
+
+    handler->alive = 0;
+}
+
+void normalize_epoch(tsdb_handler *handler, u_int32_t *epoch) {
+    *epoch -= *epoch % handler->slot_duration;
+//    *epoch += timezone - daylight * 3600; <-- Legacy code, it used to recalculate local time into UTC (in a wrong way, btw)
+}
+
+void tsdb_set_cache_budget(tsdb_handler *handler, u_int64_t budget) {
+    tsdb_cache_set_budget(&handler->cache, budget);
+}
+
+int tsdb_set_workers(tsdb_handler *handler, u_int16_t num_workers) {
+    if (num_workers < 1 || num_workers > MAX_NUM_WORKERS) {
+        trace_error("Number of workers must be within [1, %u]", MAX_NUM_WORKERS);
+        return -1;
+    }
+
+    tsdb_flush_wait(handler); //the flusher thread may be using the workers
+    stop_workers(handler); //restarted with the new size on demand
+    handler->num_workers = num_workers;
+
+    if (handler->flusher.running && handler->num_workers > 1 && ensure_workers(handler)) {
+        handler->num_workers = 1;
+    }
+
+    return 0;
+}
+
+int tsdb_set_async_flush(tsdb_handler *handler, u_int8_t depth) {
+    tsdb_flusher *flusher = &handler->flusher;
+
+    if (depth > MAX_FLUSH_DEPTH || (depth && handler->read_only)) {
+        trace_error("Flush depth must be within [0, %u] and 0 for read-only DBs", MAX_FLUSH_DEPTH);
+        return -1;
+    }
+
+    if (flusher->running) {
+        pthread_mutex_lock(&flusher->lock);
+        flusher->shutdown = 1;
+        pthread_cond_broadcast(&flusher->cond);
+        pthread_mutex_unlock(&flusher->lock);
+
+        pthread_join(flusher->thread, NULL); //pending chunks are written first
+        free(flusher->queue);
+        flusher->queue = NULL;
+        flusher->running = flusher->shutdown = 0;
+        flusher->depth = 0;
+    }
+
+    if (depth == 0) {
+        return 0;
+    }
+
+    flusher->queue = (tsdb_chunk *) calloc(depth, sizeof(tsdb_chunk));
+    if (flusher->queue == NULL) {
+        trace_error("Not enough memory (%u bytes)", depth * sizeof(tsdb_chunk));
+        return -1;
+    }
+
+    /* Workers are started before the flusher thread shares them with the calling one */
+    if (handler->num_workers > 1 && ensure_workers(handler)) {
+        handler->num_workers = 1;
+    }
+
+    flusher->head = flusher->num_queued = 0;
+    flusher->depth = depth;
+    if (pthread_create(&flusher->thread, NULL, flusher_main, handler)) {
+        trace_error("Unable to start the flusher thread, flushing synchronously");
+        free(flusher->queue);
+        flusher->queue = NULL;
+        flusher->depth = 0;
+        return -1;
+    }
+    flusher->running = 1;
+
+    return 0;
+}
+
+void tsdb_flush_wait(tsdb_handler *handler) {
+    tsdb_flusher *flusher = &handler->flusher;
+
+    pthread_mutex_lock(&flusher->lock);
+    while (flusher->num_queued) {
+        pthread_cond_wait(&flusher->cond, &flusher->lock);
+    }
+    pthread_mutex_unlock(&flusher->lock);
+}
+
+int tsdb_set_reorder_window(tsdb_handler *handler, u_int8_t num_epochs) {
+    tsdb_window *window = &handler->window;
+    tsdb_chunk current, *chunks;
+
+    if (!handler->alive || num_epochs > MAX_REORDER_EPOCHS || (num_epochs > 1 && handler->read_only)) {
+        trace_error("Reorder window must be within [0, %u] epochs and at most 1 for read-only DBs", MAX_REORDER_EPOCHS);
+        return -1;
+    }
+
+    // epochs open beyond the new window are flushed, the current one stays
+    current = handler->chunk;
+    memset(&handler->chunk, 0, sizeof(handler->chunk));
+    window_evict(handler, num_epochs > 1 ? num_epochs - 1 : 0);
+    handler->chunk = current;
+
+    if (num_epochs < 2) {
+        free(window->chunks);
+        window->chunks = NULL;
+        window->size = num_epochs;
+        return 0;
+    }
+
+    chunks = (tsdb_chunk *) realloc(window->chunks, num_epochs * sizeof(tsdb_chunk));
+    if (chunks == NULL) {
+        trace_error("Not enough memory (%u bytes)", num_epochs * sizeof(tsdb_chunk));
+        return -1;
+    }
+    window->chunks = chunks;
+    window->size = num_epochs;
+
+    return 0;
+}
+
+static int compact_segment(tsdb_handler *handler, u_int32_t segment, const u_int32_t *epochs) {
+  /* Transposes the fragments of the epochs of a segment into its slices,
+   * then removes their fragment records. Called by the compactor thread,
+   * which gets records in private buffers only, as db_get() ones are shared.
+   * Delta frames are decoded against the fragment of the previous epoch,
+   * segments start with keyframes */
+    tsdb_compactor *compactor = &handler->compactor;
+    tsdb_manifest manifest;
+    char key[32];
+    void *value;
+    u_int8_t *columns, *fragment_data, *previous, *swap, *compressed, present;
+    u_int32_t num_fragments[SEGMENT_EPOCHS], max_fragments = 0;
+    u_int32_t i, j, fragment, slice, key_len, value_len, compressed_len, len;
+    u_int32_t *valid, fragment_valid[FRAGMENT_VALID_WORDS(MAX_FRAGMENT_LEN)];
+    u_int64_t valid_size = (u_int64_t)handler->fragment_len / SEGMENT_SERIES * TSDB_SLICE_WORDS * sizeof(u_int32_t);
+    fragment_frame frame;
+    u_int32_t values_len = handler->values_len;
+    u_int32_t fragment_size = values_len * handler->fragment_len;
+    u_int32_t slice_len = SEGMENT_SERIES * SEGMENT_EPOCHS * values_len;
+    int rc = 0;
+
+    for (j = 0; j < SEGMENT_EPOCHS; j++) {
+        flusher_wait_epoch(handler, epochs[j]);
+        num_fragments[j] = 0;
+        if (manifest_get(handler, epochs[j], &manifest) == 0) {
+            num_fragments[j] = manifest.num_fragments;
+            manifest_free(&manifest);
+        }
+        if (num_fragments[j] > max_fragments) {
+            max_fragments = num_fragments[j];
+        }
+    }
+
+    columns = (u_int8_t*) malloc((u_int64_t)handler->fragment_len * SEGMENT_EPOCHS * values_len);
+    fragment_data = (u_int8_t*) malloc(fragment_size);
+    previous = (u_int8_t*) malloc(fragment_size);
+    compressed = (u_int8_t*) malloc(tsdb_slice_bound(handler->values_per_entry));
+    valid = (u_int32_t*) malloc(valid_size);
+    if (!columns || !fragment_data || !previous || !compressed || !valid) {
+        trace_error("Not enough memory to compact segment %u", segment);
+        rc = -2;
+        goto cleanup;
+    }
+
+    for (fragment = 0; fragment < max_fragments; fragment++) {
+        memset(columns, handler->unknown_value, (u_int64_t)handler->fragment_len * SEGMENT_EPOCHS * values_len);
+        // fragments without a record hold missing indexes only
+        memset(valid, 0, valid_size);
+        present = 0;
+
+        for (j = 0; j < SEGMENT_EPOCHS; j++) {
+            if (fragment >= num_fragments[j] ||
+                (rc = fragment_get(handler, epochs[j], fragment, &value, &value_len)) == -1) {
+                // the base of a delta frame in the next epoch
+                memset(previous, handler->unknown_value, fragment_size);
+                rc = 0;
+                continue;
+            }
+            if (rc == -2) {
+                goto cleanup;
+            }
+            len = fragment_size;
+            if (fragment_payload(handler, value, value_len, &frame) ||
+                (frame.kind == FRAGMENT_DELTA && (j == 0 || frame.base_epoch != epochs[j - 1])) ||
+                fragment_decode(&frame, fragment_data, &len, compactor->state_decompress, fragment_valid) ||
+                len != fragment_size) {
+                trace_error("Fragment %u of epoch %u is malformed", fragment, epochs[j]);
+                free(value);
+                rc = -2;
+                goto cleanup;
+            }
+            free(value);
+            if (frame.kind == FRAGMENT_DELTA) {
+                delta_apply(fragment_data, previous, fragment_size, 1);
+            }
+            swap = previous, previous = fragment_data, fragment_data = swap;
+
+            for (i = 0; i < handler->fragment_len; i++) {
+                memcpy(&columns[((u_int64_t)i * SEGMENT_EPOCHS + j) * values_len],
+                       &previous[i * values_len], values_len);
+                if (get_bit(fragment_valid, i)) {
+                    set_bit(valid, i * SEGMENT_EPOCHS + j);
+                }
+            }
+            present = 1;
+        }
+
+        if (!present) {
+            continue;
+        }
+        for (slice = 0; slice < handler->fragment_len / SEGMENT_SERIES; slice++) {
+            compressed_len = tsdb_slice_encode(handler->segment_codec, handler->values_per_entry,
+                                               &columns[(u_int64_t)slice * slice_len],
+                                               &valid[(u_int64_t)slice * TSDB_SLICE_WORDS], compressed,
+                                               handler->compactor.state_compress);
+            key_len = tsdb_segment_key(fragment, slice, segment, key);
+            db_put(handler, key, key_len, compressed, compressed_len);
+        }
+    }
+
+    // readers fall back to the segment once the fragment records are gone
+    pthread_mutex_lock(&compactor->lock);
+    compactor->cold_segments = segment + 1;
+    db_put(handler, "cold_segments", strlen("cold_segments"),
+           &compactor->cold_segments, sizeof(compactor->cold_segments));
+    for (j = 0; j < SEGMENT_EPOCHS; j++) {
+        for (fragment = 0; fragment < num_fragments[j]; fragment++) {
+            fragment_del(handler, epochs[j], fragment);
+        }
+    }
+    pthread_mutex_unlock(&compactor->lock);
+
+    trace_info("Compacted epochs %u to %u into cold segment %u",
+               epochs[0], epochs[SEGMENT_EPOCHS - 1], segment);
+
+cleanup:
+    free(columns);
+    free(fragment_data);
+    free(previous);
+    free(compressed);
+    free(valid);
+
+    return rc;
+}
+
+static void *compactor_main(void *data) {
+    tsdb_handler *handler = (tsdb_handler *)data;
+    tsdb_compactor *compactor = &handler->compactor;
+    u_int32_t epochs[SEGMENT_EPOCHS], segment;
+    int rc;
+
+    pthread_mutex_lock(&compactor->lock);
+    while (!compactor->shutdown) {
+        if (compactor->num_queued == 0) {
+            pthread_cond_wait(&compactor->cond, &compactor->lock);
+            continue;
+        }
+
+        // the segment stays queued while being compacted, the queue may be reallocated meanwhile
+        memcpy(epochs, compactor->queue, sizeof(epochs));
+        segment = compactor->cold_segments;
+        pthread_mutex_unlock(&compactor->lock);
+
+        rc = compact_segment(handler, segment, epochs);
+
+        pthread_mutex_lock(&compactor->lock);
+        if (rc) {
+            trace_error("Failed to compact segment %u, it is queued again with the next epoch", segment);
+            compactor->num_queued = 0;
+            compactor->next_segment = compactor->cold_segments;
+        } else {
+            compactor->num_queued--;
+            memmove(compactor->queue, &compactor->queue[SEGMENT_EPOCHS],
+                    compactor->num_queued * SEGMENT_EPOCHS * sizeof(u_int32_t));
+        }
+        pthread_cond_broadcast(&compactor->cond);
+    }
+    pthread_mutex_unlock(&compactor->lock);
+
+    return NULL;
+}
+
+int tsdb_set_compaction(tsdb_handler *handler, u_int32_t age) {
+    tsdb_compactor *compactor = &handler->compactor;
+
+    if (age && (handler->read_only || handler->format_version < 2)) {
+        trace_error("Compaction requires a writable DB of format 2");
+        return -1;
+    }
+
+    if (compactor->running) {
+        pthread_mutex_lock(&compactor->lock);
+        compactor->shutdown = 1;
+        pthread_cond_broadcast(&compactor->cond);
+        pthread_mutex_unlock(&compactor->lock);
+
+        pthread_join(compactor->thread, NULL); //the segment being compacted is finished first
+        free(compactor->state_compress);
+        free(compactor->state_decompress);
+        compactor->state_compress = NULL;
+        compactor->state_decompress = NULL;
+        compactor->running = compactor->shutdown = 0;
+        compactor->num_queued = 0;
+        compactor->next_segment = compactor->cold_segments;
+        pthread_cond_broadcast(&compactor->cond);
+    }
+
+    compactor->age = age;
+    if (age == 0) {
+        return 0;
+    }
+
+    compactor->state_compress = (qlz_state_compress *) calloc(1, sizeof(qlz_state_compress));
+    compactor->state_decompress = (qlz_state_decompress *) calloc(1, sizeof(qlz_state_decompress));
+    if (compactor->state_compress == NULL || compactor->state_decompress == NULL ||
+        pthread_create(&compactor->thread, NULL, compactor_main, handler)) {
+        trace_error("Unable to start the compactor thread");
+        free(compactor->state_compress);
+        free(compactor->state_decompress);
+        compactor->state_compress = NULL;
+        compactor->state_decompress = NULL;
+        compactor->age = 0;
+        return -1;
+    }
+    compactor->running = 1;
+
+    compactor_schedule(handler);
+
+    return 0;
+}
+
+void tsdb_compaction_wait(tsdb_handler *handler) {
+    tsdb_compactor *compactor = &handler->compactor;
+
+    pthread_mutex_lock(&compactor->lock);
+    while (compactor->running && compactor->num_queued) {
+        pthread_cond_wait(&compactor->cond, &compactor->lock);
+    }
+    pthread_mutex_unlock(&compactor->lock);
+}
+
+int tsdb_set_delta_frames(tsdb_handler *handler, u_int32_t keyframe_interval) {
+    tsdb_delta *delta = &handler->delta;
+
+    if (keyframe_interval && (handler->read_only || handler->format_version < 3)) {
+        trace_error("Delta frames require a writable DB of format 3");
+        return -1;
+    }
+
+    delta->keyframe_interval = keyframe_interval;
+    if (keyframe_interval == 0) {
+        free(delta->reference);
+        delta->reference = NULL;
+    }
+
+    return 0;
+}
+
+void tsdb_set_codec_budget(tsdb_handler *handler, u_int32_t usec) {
+    handler->codec_budget = usec;
+}
+
+int tsdb_set_fragment_len(tsdb_handler *handler, u_int32_t fragment_len) {
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    if (fragment_len == 0 || fragment_len > MAX_FRAGMENT_LEN || fragment_len % SEGMENT_SERIES ||
+        (u_int64_t)fragment_len * handler->values_len > MAX_FRAGMENT_BYTES) {
+        trace_error("Fragments of %u indexes are not supported", fragment_len);
+        return -1;
+    }
+
+    // the fragments of all epochs have the same length
+    if (handler->number_of_epochs || handler->chunk.data) {
+        trace_error("Fragments of a DB holding epochs cannot be resized");
+        return -1;
+    }
+
+    handler->fragment_len = fragment_len;
+    db_put(handler, "fragment_len",
+           strlen("fragment_len"),
+           &handler->fragment_len,
+           sizeof(handler->fragment_len));
+
+    return 0;
+}
+
+int tsdb_get_codec_stats(tsdb_handler *handler, tsdb_codec_stats *stats) {
+    DBC *cursor;
+    DBT key_data, data;
+    fragment_frame frame;
+    tsdb_shared_count count;
+    u_int32_t epoch, fragment;
+    u_int8_t first = 0;
+    int rv;
+
+    if (handler->format_version < 2) {
+        trace_error("Codec statistics require a DB of format 2");
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(tsdb_codec_stats));
+    pthread_mutex_lock(&handler->flusher.lock);
+    stats->unprobed = handler->codec_stats.unprobed;
+    stats->skipped = handler->codec_stats.skipped;
+    pthread_mutex_unlock(&handler->flusher.lock);
+
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    if (handler->db->cursor(handler->db, NULL, &cursor, 0) != 0) {
+        pthread_mutex_unlock(&handler->flusher.db_lock);
+        trace_error("Unable to scan the fragments");
+        return -1;
+    }
+
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+    key_data.data = &first;
+    key_data.size = 1;
+
+    rv = cursor->get(cursor, &key_data, &data, DB_SET_RANGE);
+    while (rv == 0 && parse_fragment_key(&key_data, &epoch, &fragment) == 0) {
+        if (fragment_payload(handler, data.data, data.size, &frame) == 0) {
+            stats->fragments[frame.codec]++;
+            stats->bytes[frame.codec] += data.size;
+            stats->delta_frames += (frame.kind == FRAGMENT_DELTA);
+            stats->shared += (frame.kind == FRAGMENT_SHARED);
+        }
+        rv = cursor->get(cursor, &key_data, &data, DB_NEXT);
+    }
+
+    // the reference counts of shared payloads are adjacent too
+    if (handler->format_version >= 4 && (rv == 0 || rv == DB_NOTFOUND)) {
+        memset(&key_data, 0, sizeof(key_data));
+        memset(&data, 0, sizeof(data));
+        first = SHARED_COUNT;
+        key_data.data = &first;
+        key_data.size = 1;
+
+        rv = cursor->get(cursor, &key_data, &data, DB_SET_RANGE);
+        while (rv == 0 && key_data.size == SHARED_KEY_LEN && ((u_int8_t *)key_data.data)[0] == SHARED_COUNT) {
+            if (tsdb_shared_parse_count(data.data, data.size, &count) == 0) {
+                stats->payloads++;
+                stats->payload_bytes += count.len;
+                stats->deduplicated_bytes += (u_int64_t)(count.refs - 1) * count.len;
+            }
+            rv = cursor->get(cursor, &key_data, &data, DB_NEXT);
+        }
+    }
+
+    cursor->close(cursor);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
+
+    return (rv == 0 || rv == DB_NOTFOUND ? 0 : -1);
+}
+
+int tsdb_get_key_index(tsdb_handler *handler, char *key, u_int32_t *index) {
+/*get index by key*/
+    void *ptr;
+    u_int32_t len;
+    char str[32] = { 0 };
+
+    snprintf(str, sizeof(str), "key-%s", key);
+
+    // the truncated key is the one mapped, see set_key_index()
+    if (tsdb_keymap_get(&handler->keymap, &str[strlen("key-")], index) == 0) {
+        return 0;
+    }
+
+    if (db_get(handler, str, strlen(str), &ptr, &len) == 0) {
+        *index = *(u_int32_t*)ptr;
+        tsdb_keymap_put(&handler->keymap, &str[strlen("key-")], *index);
+        return 0;
+    }
+    return -1;
+}
+
+static void set_key_index(tsdb_handler *handler, char *key, u_int32_t index) {
+    char str[32];
+
+    snprintf(str, sizeof(str), "key-%s", key); // strlen(key) <= 31 - 4 = 27
+
+    db_put(handler, str, strlen(str), &index, sizeof(index));
+    if (tsdb_keymap_put(&handler->keymap, &str[strlen("key-")], index)) {
+        trace_warning("Not enough memory to keep key %s, it will be looked up in the DB", key);
+    }
+
+    trace_info("[NEW_SET] Mapping %s -> %u", key, index);
+}
+
+int tsdb_goto_epoch(tsdb_handler *handler,
+                    u_int32_t epoch,
+                    u_int8_t fail_if_missing,
+                    u_int8_t growable) {
+  //if epoch exists, it loads it with all fragments
+  //otherwise, if permitted, a new empty epoch is created
+    int rc;
+    void *value;
+    u_int32_t value_len, fragment = 0, key_len;
+    u_int8_t *cached, has_manifest = 0;
+    tsdb_manifest manifest;
+    char str[32];
+
+    if (handler == NULL) {
+        trace_error("DB handler is NULL pointer");
+        return -1;
+    }
+
+    normalize_epoch(handler, &epoch);
+    if (handler->chunk.epoch == epoch) {
+        //by returning we effectively prevent extra disk writes (code
+        //does not reach the window_leave() line)
+        return 0;
+    }
+
+    window_leave(handler);
+    point_drop(handler);
+    if (window_enter(handler, epoch)) {
+        handler->chunk.growable = growable;
+        trace_info("Epoch %u entered from the reorder window", epoch);
+        return 0;
+    }
+    flusher_wait_epoch(handler, epoch); //its fragments may still be on the way to the DB
+
+    //normalize_epoch(handler, &epoch);
+    key_len = fragment_key(handler, epoch, fragment, str);
+
+    has_manifest = (manifest_get(handler, epoch, &manifest) == 0);
+    cached = (has_manifest ? NULL : cache_peek(handler, epoch, fragment));
+
+    if (has_manifest || cached) {
+        rc = 0;
+    } else if (handler->lazy_load) {
+        // no need to fetch the fragment, it will be loaded on demand
+        rc = db_key_exists(handler, str, key_len) ? 0 : -1;
+    } else {
+        rc = db_get(handler, str, key_len, &value, &value_len);
+    }
+
+    if (rc == -1 && fail_if_missing) {
+        return -1;
+    }
+
+    if (rc == -1 ) {
+        handler->chunk.new_epoch_flag = 1;
+        if (handler->number_of_epochs && handler->most_recent_epoch >= epoch) {
+            // a past epoch is inserted into the index when flushed, see record_new_epoch()
+            rc = tsdb_epoch_search(handler, epoch, &fragment);
+            if (rc == 0 && epoch_compacted(handler, fragment)) {
+                trace_warning("Epoch %u is older than the compacted epochs and cannot be created", epoch);
+                return -1;
+            }
+            // listed without any fragment
+            handler->chunk.new_epoch_flag = (rc != 1);
+            fragment = 0;
+            rc = -1;
+        }
+    }
+
+    handler->chunk.epoch = epoch;
+    handler->chunk.growable = growable;
+    //handler->chunk.data = NULL is set after flushing
+
+    if (rc == 0 && handler->lazy_load) {
+        u_int32_t fragment_size = handler->values_len * handler->fragment_len;
+
+        if (has_manifest) {
+            fragment = manifest.num_fragments;
+            manifest_free(&manifest);
+        } else {
+            // Fragments exist consecutively (see below), so probing is enough to size the chunk
+            do {
+                fragment++;
+                key_len = fragment_key(handler, epoch, fragment, str);
+            } while (db_key_exists(handler, str, key_len));
+        }
+
+        /* Memory is only reserved here, pages of fragments
+         * which are never accessed are never touched */
+        handler->chunk.data = (u_int8_t*) malloc((u_int64_t)fragment * fragment_size);
+        handler->chunk.valid = (u_int32_t*) calloc(fragment, FRAGMENT_VALID_BYTES(handler));
+        if (handler->chunk.data == NULL || handler->chunk.valid == NULL ||
+            chunk_reserve(&handler->chunk, fragment)) {
+            trace_error("Not enough memory (%llu bytes)", (unsigned long long)fragment * fragment_size);
+            free(handler->chunk.data);
+            free(handler->chunk.valid);
+            handler->chunk.data = NULL;
+            handler->chunk.valid = NULL;
+            return -2;
+        }
+        handler->chunk.data_len = (u_int64_t)fragment * fragment_size;
+        handler->chunk.lazy = 1;
+
+        trace_info("Epoch %u entered lazily (%u fragments)", epoch, fragment);
+    } else if (rc == 0 && has_manifest) {
+        trace_info("Loading epoch %u (%u fragments)", epoch, manifest.num_fragments);
+
+        rc = load_epoch(handler, epoch, &manifest);
+        manifest_free(&manifest);
+        if (rc) {
+            return rc;
+        }
+    } else if (rc == 0) {
+        //Epochs flushed before manifests were introduced are loaded fragment by fragment.
+        //ATTENTION! All fragments must exist consecutively, i.e., we cant have only fragments 3, 7 and 90
+        //Fragments existing in the DB for every epoch must be [0,1,...,k]
+        //Otherwise we cannot guarantee that if k+1 th fragment does not exists - there are no more fragments for
+        //this epoch. This leads to a constraint on the way we write and save data in the DB - even if we have previously written
+        //only indices, e.g., 7000 and 45000, which corresponds to fragments 0 and 4, eventually the fragments 0,1,2,3,4 must be written
+        //for that epoch, even though the fragments 1,2,3 will be empty (have only zeros)
+
+        u_int32_t new_decompr_chunk_len, fragment_size = handler->values_len * handler->fragment_len;
+        u_int64_t offset = 0;
+        u_int32_t valid[FRAGMENT_VALID_WORDS(MAX_FRAGMENT_LEN)];
+        u_int8_t *cur_data = NULL, *new_data = NULL;
+
+        trace_info("Loading epoch %u", epoch);
+
+        // records without a tag have no validity bitmap
+        memset(valid, 0xFF, sizeof(valid));
+        while (1) {
+            cur_data = new_data;
+            new_decompr_chunk_len = cached ? fragment_size : qlz_size_decompressed(value);
+            new_data = (u_int8_t*) realloc(cur_data, handler->chunk.data_len + new_decompr_chunk_len);
+            if (new_data == NULL) {
+                trace_error("Not enough memory (%llu bytes)",
+                            (unsigned long long)handler->chunk.data_len + new_decompr_chunk_len);
+                free(cur_data);
+                return -2;
+            }
+            if (cached) {
+                memcpy(&new_data[offset], cached, fragment_size);
+            } else {
+                new_decompr_chunk_len = qlz_decompress(value, &new_data[offset], &handler->state_decompress);
+                if (new_decompr_chunk_len == fragment_size) {
+                    cache_put_fragment(handler, epoch, fragment, &new_data[offset], valid);
+                }
+            }
+            handler->chunk.data_len += new_decompr_chunk_len;
+            fragment++;
+            offset = handler->chunk.data_len;
+
+            cached = cache_peek(handler, epoch, fragment);
+            if (cached) {
+                continue;
+            }
+            key_len = fragment_key(handler, epoch, fragment, str);
+            if (db_get(handler, str, key_len, &value, &value_len) == -1) {
+                break; // No more fragments
+            }
+        }
+
+        if (new_data == NULL) {
+            trace_error("Smth went wrong and epoch data was not read out into memory");
+            return -2;
+        }
+
+        handler->chunk.valid = (u_int32_t*) malloc(fragment * FRAGMENT_VALID_BYTES(handler));
+        if (handler->chunk.valid == NULL || chunk_reserve(&handler->chunk, fragment)) {
+            trace_error("Not enough memory (%u bytes)", fragment * FRAGMENT_VALID_BYTES(handler));
+            free(new_data);
+            free(handler->chunk.valid);
+            handler->chunk.valid = NULL;
+            handler->chunk.data_len = 0;
+            return -2;
+        }
+        memset(handler->chunk.valid, 0xFF, fragment * FRAGMENT_VALID_BYTES(handler));
         handler->chunk.data = new_data;
     }
 
-    return 0;
-}
+    return 0;
+}
+
+int tsdb_epoch_exists(tsdb_handler *handler,
+                    u_int32_t epoch) {
+
+  if (!handler->alive) {
+      return -1;
+  }
+
+  u_int32_t position;
+
+  normalize_epoch(handler, &epoch);
+
+  pthread_mutex_lock(&handler->flusher.lock);
+  if (flusher_has_epoch(&handler->flusher, epoch)) {
+      pthread_mutex_unlock(&handler->flusher.lock);
+      return 1;
+  }
+  pthread_mutex_unlock(&handler->flusher.lock);
+
+  return (tsdb_epoch_search(handler, epoch, &position) == 1);
+}
+
+static void report_new_keys(tsdb_handler *handler, char **keys, u_int32_t num_keys) {
+    tsdb_new_keys new_keys;
+    u_int32_t i;
+
+    if (handler->reportNewMetricsCB.cb != NULL && handler->reportNewMetricsCB.external_data != NULL) {
+        new_keys.keys = keys;
+        new_keys.num_keys = num_keys;
+        if (handler->reportNewMetricsCB.cb(&new_keys, handler->reportNewMetricsCB.external_data)) {
+            trace_warning("CallBack call failed, consolidated TSDBs will have keys missing. Data loss in those DBs possible.");
+        }
+        return;
+    }
+
+    if (handler->reportNewMetricCB.cb != NULL && handler->reportNewMetricCB.external_data != NULL) {
+        for (i = 0; i < num_keys; i++) {
+            if (handler->reportNewMetricCB.cb(keys[i], handler->reportNewMetricCB.external_data)) {
+                trace_warning("CallBack call failed, consolidated TSDBs will have keys missing. Data loss in those DBs possible.");
+            }
+        }
+    }
+}
+
+static int ensure_key_index(tsdb_handler *handler, char *key,
+                            u_int32_t *index, u_int8_t for_write) {
+    if (tsdb_get_key_index(handler, key, index) == 0) {
+        trace_info("Key %s mapped to index %u", key, *index);
+        return 0;
+    }
+
+    if (!for_write) {
+        trace_info("Unable to find key %s", key);
+        return -1;
+    }
+
+    *index = handler->lowest_free_index++;
+    set_key_index(handler, key, *index);
+
+    /* CallBack time! We report a new key discovery */
+    report_new_keys(handler, &key, 1);
+    /******/
+
+    db_put(handler,
+           "lowest_free_index", strlen("lowest_free_index"),
+           &handler->lowest_free_index,
+           sizeof(handler->lowest_free_index));
+
+    return 0;
+}
+
+typedef struct {
+    char str[32]; //"key-" followed by the key, truncated as in set_key_index()
+    u_int32_t pos; //of the key in the batch
+} key_ref;
+
+static int cmp_key_refs(const void *a, const void *b) {
+  /* Byte-wise, i.e. the order of the B-tree; duplicates by position */
+    const key_ref *x = (const key_ref *)a, *y = (const key_ref *)b;
+    int rv = strcmp(x->str, y->str);
+
+    if (rv) {
+        return rv;
+    }
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static int cmp_key_ref_positions(const void *a, const void *b) {
+    const key_ref *x = *(key_ref * const *)a, *y = *(key_ref * const *)b;
+
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+int tsdb_resolve_keys(tsdb_handler *handler, char **keys, u_int32_t num_keys,
+                      u_int32_t *indexes, u_int8_t create) {
+    key_ref *refs, **new_refs = NULL;
+    char **new_keys = NULL;
+    u_int32_t i, j, num_refs = 0, num_new = 0;
+    DBC *cursor;
+    DBT key_data, data;
+    int rc = 0;
+
+    if (!handler->alive) {
+        return -2;
+    }
+
+    if (create && handler->read_only) {
+        trace_warning("Unable to create keys (read-only mode)");
+        create = 0;
+    }
+
+    refs = (key_ref *) malloc(num_keys * sizeof(key_ref) + 1);
+    if (refs == NULL) {
+        trace_error("Not enough memory (%u bytes)", num_keys * sizeof(key_ref));
+        return -2;
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        snprintf(refs[num_refs].str, sizeof(refs[num_refs].str), "key-%s", keys[i]);
+        if (tsdb_keymap_get(&handler->keymap, &refs[num_refs].str[strlen("key-")], &indexes[i]) == 0) {
+            continue;
+        }
+        indexes[i] = TSDB_NO_INDEX;
+        refs[num_refs++].pos = i;
+    }
+
+    if (num_refs == 0) {
+        free(refs);
+        return 0;
+    }
+
+    /* Sorted keys are looked up with a single cursor, which thus moves
+     * through the B-tree in one direction. Each distinct key is looked
+     * up once, by the first of its duplicates (the lowest position) */
+    qsort(refs, num_refs, sizeof(key_ref), cmp_key_refs);
+
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    if (handler->db->cursor(handler->db, NULL, &cursor, 0) != 0) {
+        pthread_mutex_unlock(&handler->flusher.db_lock);
+        trace_error("Unable to open a cursor to look the keys up");
+        free(refs);
+        return -2;
+    }
+    for (i = 0; i < num_refs; i++) {
+        if (i && strcmp(refs[i].str, refs[i - 1].str) == 0) {
+            continue;
+        }
+
+        memset(&key_data, 0, sizeof(key_data));
+        memset(&data, 0, sizeof(data));
+        key_data.data = refs[i].str;
+        key_data.size = strlen(refs[i].str);
+
+        if (cursor->get(cursor, &key_data, &data, DB_SET) == 0) {
+            indexes[refs[i].pos] = *(u_int32_t*)data.data;
+            tsdb_keymap_put(&handler->keymap, &refs[i].str[strlen("key-")], indexes[refs[i].pos]);
+        }
+    }
+    cursor->close(cursor);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
+
+    for (i = 0; i < num_refs; i++) {
+        if (indexes[refs[i].pos] == TSDB_NO_INDEX &&
+            (i == 0 || strcmp(refs[i].str, refs[i - 1].str) != 0)) {
+            num_new++;
+        }
+    }
+
+    if (num_new && create) {
+        new_refs = (key_ref **) malloc(num_new * sizeof(key_ref *));
+        new_keys = (char **) malloc(num_new * sizeof(char *));
+        if (new_refs == NULL || new_keys == NULL) {
+            trace_error("Not enough memory (%u bytes)", num_new * sizeof(key_ref *));
+            free(new_refs);
+            free(new_keys);
+            free(refs);
+            return -2;
+        }
+
+        for (i = 0, j = 0; i < num_refs; i++) {
+            if (indexes[refs[i].pos] == TSDB_NO_INDEX &&
+                (i == 0 || strcmp(refs[i].str, refs[i - 1].str) != 0)) {
+                new_refs[j++] = &refs[i];
+            }
+        }
+
+        // new indexes follow the order of the batch, not the one of the keys
+        qsort(new_refs, num_new, sizeof(key_ref *), cmp_key_ref_positions);
+
+        for (j = 0; j < num_new; j++) {
+            indexes[new_refs[j]->pos] = handler->lowest_free_index + j;
+            new_keys[j] = keys[new_refs[j]->pos];
+            db_put(handler, new_refs[j]->str, strlen(new_refs[j]->str),
+                   &indexes[new_refs[j]->pos], sizeof(u_int32_t));
+            tsdb_keymap_put(&handler->keymap, &new_refs[j]->str[strlen("key-")],
+                            indexes[new_refs[j]->pos]);
+        }
+
+        handler->lowest_free_index += num_new;
+        db_put(handler,
+               "lowest_free_index", strlen("lowest_free_index"),
+               &handler->lowest_free_index,
+               sizeof(handler->lowest_free_index));
+
+        trace_info("[NEW_SET] Mapped %u keys to [%u, %u]", num_new,
+                   handler->lowest_free_index - num_new, handler->lowest_free_index - 1);
+
+        report_new_keys(handler, new_keys, num_new);
+        free(new_refs);
+        free(new_keys);
+    } else if (num_new) {
+        rc = -1;
+    }
+
+    // duplicates share the index of the first one
+    for (i = 1; i < num_refs; i++) {
+        if (strcmp(refs[i].str, refs[i - 1].str) == 0) {
+            indexes[refs[i].pos] = indexes[refs[i - 1].pos];
+        }
+    }
+
+    free(refs);
+
+    return rc;
+}
+
+static u_int32_t fragments_for(tsdb_handler *handler, u_int32_t num_indexes) {
+    return ((u_int64_t)num_indexes + handler->fragment_len - 1) / handler->fragment_len;
+}
+
+static int chunk_capacity(tsdb_handler *handler, u_int32_t num_fragments) {
+  /* Makes room for num_fragments fragments in the data and the validity
+   * bitmaps of the chunk, without extending it.
+   * Returns 0 on success, -2 if there is not enough memory */
+    tsdb_chunk *chunk = &handler->chunk;
+    u_int64_t capacity = (u_int64_t)num_fragments * handler->fragment_len * handler->values_len;
+    u_int8_t *data;
+    u_int32_t *valid;
+
+    if (capacity <= chunk->capacity || capacity <= chunk->data_len) {
+        return 0;
+    }
+
+    data = (u_int8_t*) realloc(chunk->data, capacity);
+    if (data == NULL) {
+        trace_error("Not enough memory (%llu bytes)", (unsigned long long)capacity);
+        return -2;
+    }
+    chunk->data = data;
+    valid = (u_int32_t*) realloc(chunk->valid, (size_t)num_fragments * FRAGMENT_VALID_BYTES(handler));
+    if (valid == NULL) {
+        trace_error("Not enough memory (%llu bytes)",
+                    (unsigned long long)num_fragments * FRAGMENT_VALID_BYTES(handler));
+        return -2;
+    }
+    chunk->valid = valid;
+    chunk->capacity = capacity;
+
+    return 0;
+}
+
+static int chunk_grow(tsdb_handler *handler, u_int32_t num_fragments) {
+  /* Extends the chunk up to num_fragments fragments of unknown values, none
+   * of their indexes set. If there is no room for them, it is made for
+   * twice as many fragments as before, so that filling an epoch copies it
+   * a few times only (glibc remaps large blocks rather than copying them).
+   * Returns 0 on success, -2 if there is not enough memory */
+    tsdb_chunk *chunk = &handler->chunk;
+    u_int32_t fragment_size = handler->fragment_len * handler->values_len;
+    u_int32_t i, old = chunk->data_len / fragment_size;
+    u_int64_t room = (chunk->capacity > chunk->data_len ? chunk->capacity : chunk->data_len) / fragment_size;
+
+    if (num_fragments <= old) {
+        return 0;
+    }
+
+    if (num_fragments > room) {
+        room = (2 * room > num_fragments ? 2 * room : num_fragments);
+        if (room > fragments_for(handler, TSDB_NO_INDEX)) {
+            room = fragments_for(handler, TSDB_NO_INDEX);
+        }
+        if (chunk_capacity(handler, room)) {
+            return -2;
+        }
+    }
+    if (chunk_reserve(chunk, num_fragments)) {
+        return -2;
+    }
+
+    memset(&chunk->data[chunk->data_len], handler->unknown_value,
+           (u_int64_t)(num_fragments - old) * fragment_size);
+    memset(&chunk->valid[(u_int64_t)old * FRAGMENT_VALID_WORDS(handler->fragment_len)], 0,
+           (size_t)(num_fragments - old) * FRAGMENT_VALID_BYTES(handler));
+    // the fragments appended are not in the DB, nothing to load for them
+    for (i = old; i < num_fragments; i++) {
+        set_bit(chunk->fragment_loaded, i);
+    }
+    chunk->data_len = (u_int64_t)num_fragments * fragment_size;
+
+    return 0;
+}
+
+int tsdb_reserve(tsdb_handler *handler, u_int32_t num_series) {
+    u_int32_t reserved;
+
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    handler->reserved_series = num_series;
+
+    // the epoch being written makes room right away
+    if (handler->chunk.data && handler->chunk.growable) {
+        reserved = (handler->lowest_free_index > num_series ? handler->lowest_free_index : num_series);
+        return chunk_capacity(handler, fragments_for(handler, reserved));
+    }
+
+    return 0;
+}
+
+static int prepare_offset_by_index(tsdb_handler *handler, u_int32_t *index,
+                                   u_int64_t *offset, u_int8_t for_write) {
+  /*index - absolute value. This func loads a respective fragment of the current epoch,
+   *decompresses it and put in the chunk struct (memory gets allocated internally) */
+    u_int32_t fragment = *index / handler->fragment_len, reserved;
+    int rc;
+
+    if (!handler->chunk.data) { // empty chunk.data assumes that the whole epoch is new,
+                                // because otherwise it would be filled with data of the epoch
+                                // by tsdb_goto_epoch
+        if (!for_write) {
+            return -1;
+        }
+
+        // new epochs have room for all series known at once, see tsdb_reserve()
+        reserved = (handler->lowest_free_index > handler->reserved_series ?
+                    handler->lowest_free_index : handler->reserved_series);
+        if ((rc = chunk_capacity(handler, fragments_for(handler, reserved))) ||
+            (rc = chunk_grow(handler, fragment + 1))) {
+            return rc;
+        }
+
+        // Load the epoch handler->chunk.epoch/fragment, if it exists
+        rc = fetch_fragment(handler, handler->chunk.epoch, fragment,
+                            &handler->chunk.data[(u_int64_t)fragment * handler->fragment_len * handler->values_len],
+                            &handler->chunk.valid[(u_int64_t)fragment * FRAGMENT_VALID_WORDS(handler->fragment_len)]);
+        if (rc == -2) {
+            return -2;
+        }
+    } else {
+        if (*index >= (handler->chunk.data_len / handler->values_len)) {
+            if (!for_write || !handler->chunk.growable) {
+                return -1;
+            }
+
+            if (chunk_grow(handler, fragment + 1)) {
+                trace_error("Unable to grow the epoch to %u fragments", fragment + 1);
+                return -2;
+            }
+            trace_info("Epoch grown to %llu", (unsigned long long)handler->chunk.data_len);
+        }
+
+        if (load_fragment(handler, fragment)) {
+            return -2;
+        }
+    }
+
+    //relative index within current fragment(chunk), offset is in bytes, index in elements (tsdb_value * values_per_entry)
+    *offset = (u_int64_t)handler->values_len * *index;
+
+    if (*offset >= handler->chunk.data_len) {
+        trace_error("INTERNAL ERROR [Id: %u][Offset: %llu/%llu]", *index,
+                    (unsigned long long)*offset, (unsigned long long)handler->chunk.data_len);
+    }
+
+    return 0;
+}
+
+static int prepare_offset_by_key(tsdb_handler *handler, char *key,
+                                 u_int64_t *offset, u_int8_t for_write) {
+    u_int32_t index; //absolute value, not relative to a fragment
+
+    if (!handler->chunk.epoch) {
+        return -1;
+    }
+
+    if (ensure_key_index(handler, key, &index, for_write) == -1) {
+        trace_info("Unable to find index %s", key);
+        return -1;
+    }
+
+    trace_info("%s mapped to idx %u", key, index);
+
+    return prepare_offset_by_index(handler, &index, offset, for_write);
+}
+
+static void mark_valid(tsdb_handler *handler, u_int32_t first, u_int32_t count, u_int8_t set) {
+  /* Marks the indexes [first, first + count) of the chunk set or missing */
+    tsdb_chunk *chunk = &handler->chunk;
+    u_int32_t *bits, bit, end;
+
+    while (count) {
+        bits = &chunk->valid[first / handler->fragment_len * FRAGMENT_VALID_WORDS(handler->fragment_len)];
+        bit = first % handler->fragment_len;
+        end = (count < handler->fragment_len - bit ? bit + count : handler->fragment_len);
+        first += end - bit;
+        count -= end - bit;
+
+        for (; bit < end; bit++) {
+            if (BIT_OFFSET(bit) == 0 && end - bit >= BITS_PER_WORD) {
+                bits[WORD_OFFSET(bit)] = (set ? 0xFFFFFFFF : 0);
+                bit += BITS_PER_WORD - 1;
+            } else if (set) {
+                set_bit(bits, bit);
+            } else {
+                clear_bit(bits, bit);
+            }
+        }
+    }
+}
+
+static int is_valid(const tsdb_handler *handler, u_int32_t index) {
+    return get_bit(&handler->chunk.valid[index / handler->fragment_len * FRAGMENT_VALID_WORDS(handler->fragment_len)], index % handler->fragment_len);
+}
+
+int tsdb_set_with_index(tsdb_handler *handler, char *key,
+                        tsdb_value *value, u_int32_t *index) {
+  /* Obsolete and useless. Use tsdb_set_by_index instead. */
+    tsdb_value *chunk_ptr;
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    if (!handler->chunk.epoch) {
+        trace_error("Missing epoch");
+        return -2;
+    }
+
+    rc = prepare_offset_by_key(handler, key, &offset, 1);
+    if (rc == 0) {
+        chunk_ptr = (tsdb_value*)(&handler->chunk.data[offset]);
+        memcpy(chunk_ptr, value, handler->values_len);
+
+        // Mark a fragment as changed
+        *index = offset / handler->values_len;
+        set_bit(handler->chunk.fragment_changed, *index / handler->fragment_len);
+        mark_valid(handler, *index, 1, 1);
+    }
+
+    return rc;
+}
+
+int tsdb_set_by_index(tsdb_handler *handler, tsdb_value *value, u_int32_t *index) {
+
+  tsdb_value *chunk_ptr;
+  u_int64_t offset;
+  int rc;
+
+  if (!handler->alive) {
+      return -1;
+  }
+
+  if (!handler->chunk.epoch) {
+      trace_error("Missing epoch");
+      return -2;
+  }
+
+  //rc = prepare_offset_by_key(handler, key, &offset, 1);
+  if (*index >= handler->lowest_free_index) {
+      trace_error("Index %ld was not mapped yet to a key, hence we refuse setting by it. Use tsdb_set with provided key name instead to create mapping key-index automatically.",*index);
+      return -1;
+  }
+  rc = prepare_offset_by_index(handler, index, &offset, 1);
+  if (rc == 0) {
+      chunk_ptr = (tsdb_value*)(&handler->chunk.data[offset]);
+      memcpy(chunk_ptr, value, handler->values_len);
+
+      // Mark a fragment as changed
+      *index = offset / handler->values_len;
+      set_bit(handler->chunk.fragment_changed, *index / handler->fragment_len);
+      mark_valid(handler, *index, 1, 1);
+  }
+
+  return rc;
+}
+
+static int touch_range(tsdb_handler *handler, u_int32_t first, u_int32_t count,
+                       u_int8_t for_write) {
+  /* Makes sure the fragments holding the indexes [first, first + count)
+   * of the current chunk are loaded, and marks them changed for writes */
+    u_int32_t fragment, last = (first + count - 1) / handler->fragment_len;
+
+    for (fragment = first / handler->fragment_len; fragment <= last; fragment++) {
+        if (load_fragment(handler, fragment)) {
+            return -2;
+        }
+        if (for_write) {
+            set_bit(handler->chunk.fragment_changed, fragment);
+        }
+    }
+
+    return 0;
+}
+
+static int prepare_write_range(tsdb_handler *handler, u_int32_t max_index) {
+  /* Checks that indexes up to max_index may be written and grows (or creates)
+   * the current chunk once to hold them. Fragments are not marked here, see
+   * touch_range() */
+    u_int64_t offset;
+
+    if (max_index >= handler->lowest_free_index) {
+        trace_error("Index %u was not mapped yet to a key, hence we refuse setting by it.", max_index);
+        return -1;
+    }
+    return prepare_offset_by_index(handler, &max_index, &offset, 1);
+}
+
+int tsdb_set_batch(tsdb_handler *handler, const u_int32_t *indexes,
+                   const tsdb_value *values, u_int32_t num_values) {
+    u_int32_t i, end, max_index = 0;
+    tsdb_value *row;
+    int rc;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    if (!handler->chunk.epoch) {
+        trace_error("Missing epoch");
+        return -2;
+    }
+
+    if (num_values == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < num_values; i++) {
+        if (indexes[i] > max_index) {
+            max_index = indexes[i];
+        }
+    }
+
+    // the chunk is created or grown once, for the largest index
+    if ((rc = prepare_write_range(handler, max_index))) {
+        return rc;
+    }
+
+    row = (tsdb_value *)handler->chunk.data;
+    for (i = 0; i < num_values; i = end) {
+        // a run of consecutive indexes is a single copy
+        for (end = i + 1; end < num_values && indexes[end] == indexes[end - 1] + 1; end++);
+
+        if ((rc = touch_range(handler, indexes[i], end - i, 1))) {
+            return rc;
+        }
+
+        if (handler->values_per_entry == 1 && end - i == 1) {
+            row[indexes[i]] = values[i];
+        } else {
+            memcpy(&row[(u_int64_t)indexes[i] * handler->values_per_entry],
+                   &values[(u_int64_t)i * handler->values_per_entry],
+                   (u_int64_t)(end - i) * handler->values_len);
+        }
+        mark_valid(handler, indexes[i], end - i, 1);
+    }
+
+    return 0;
+}
+
+int tsdb_row_write(tsdb_handler *handler, u_int32_t first_index,
+                   u_int32_t count, const tsdb_value *src) {
+    int rc;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    if (!handler->chunk.epoch) {
+        trace_error("Missing epoch");
+        return -2;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+    if ((u_int64_t)first_index + count > handler->lowest_free_index) {
+        trace_error("Indexes [%u, %u] were not mapped yet to keys, hence we refuse setting by them.",
+                    first_index, first_index + count - 1);
+        return -1;
+    }
+
+    if ((rc = prepare_write_range(handler, first_index + count - 1))) {
+        return rc;
+    }
+    if ((rc = touch_range(handler, first_index, count, 1))) {
+        return rc;
+    }
+
+    memcpy(&handler->chunk.data[(u_int64_t)first_index * handler->values_len], src,
+           (u_int64_t)count * handler->values_len);
+    mark_valid(handler, first_index, count, 1);
+
+    return 0;
+}
+
+typedef struct {
+    u_int32_t epoch; //normalized
+    u_int32_t index;
+    u_int32_t pos; //of the value in the backfill
+} sample_ref;
+
+static int cmp_sample_refs(const void *a, const void *b) {
+  /* By epoch, then index; duplicates by position, the last one is written last */
+    const sample_ref *x = (const sample_ref *)a, *y = (const sample_ref *)b;
+
+    if (x->epoch != y->epoch) {
+        return (x->epoch > y->epoch) - (x->epoch < y->epoch);
+    }
+    if (x->index != y->index) {
+        return (x->index > y->index) - (x->index < y->index);
+    }
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+int tsdb_backfill(tsdb_handler *handler, const u_int32_t *epochs,
+                  const u_int32_t *indexes, const tsdb_value *values,
+                  u_int32_t num_values) {
+    sample_ref *refs;
+    u_int32_t *run_indexes, i, j, end, position;
+    tsdb_value *run_values;
+    u_int8_t lazy_load;
+    int rc = 0;
+
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    if (num_values == 0) {
+        return 0;
+    }
+
+    refs = (sample_ref *)malloc((u_int64_t)num_values * sizeof(sample_ref));
+    run_indexes = (u_int32_t *)malloc((u_int64_t)num_values * sizeof(u_int32_t));
+    run_values = (tsdb_value *)malloc((u_int64_t)num_values * handler->values_len);
+    if (refs == NULL || run_indexes == NULL || run_values == NULL) {
+        trace_error("Not enough memory to backfill %u values", num_values);
+        free(refs);
+        free(run_indexes);
+        free(run_values);
+        return -2;
+    }
+
+    for (i = 0; i < num_values; i++) {
+        if (indexes[i] >= handler->lowest_free_index) {
+            trace_error("Index %u was not mapped yet to a key, hence we refuse setting by it.", indexes[i]);
+            rc = -1;
+            break;
+        }
+        refs[i].epoch = epochs[i];
+        normalize_epoch(handler, &refs[i].epoch);
+        refs[i].index = indexes[i];
+        refs[i].pos = i;
+    }
+
+    if (rc == 0) {
+        qsort(refs, num_values, sizeof(sample_ref), cmp_sample_refs);
+
+        // nothing is written if any epoch cannot be created
+        for (i = 0; i < num_values && rc == 0; i = end) {
+            for (end = i + 1; end < num_values && refs[end].epoch == refs[i].epoch; end++);
+
+            if (handler->number_of_epochs && refs[i].epoch <= handler->most_recent_epoch &&
+                refs[i].epoch != handler->chunk.epoch &&
+                tsdb_epoch_search(handler, refs[i].epoch, &position) == 0 &&
+                epoch_compacted(handler, position)) {
+                trace_error("Epoch %u is older than the compacted epochs, nothing is backfilled", refs[i].epoch);
+                rc = -1;
+            }
+        }
+    }
+    if (rc) {
+        goto cleanup;
+    }
+
+    // merged epochs are loaded fragment by fragment, those written only
+    lazy_load = handler->lazy_load;
+    handler->lazy_load = 1;
+
+    for (i = 0; i < num_values && rc == 0; i = end) {
+        for (end = i + 1; end < num_values && refs[end].epoch == refs[i].epoch; end++);
+
+        if ((rc = tsdb_goto_epoch(handler, refs[i].epoch, 0, 1))) {
+            break;
+        }
+        for (j = i; j < end; j++) {
+            run_indexes[j - i] = refs[j].index;
+            memcpy(&run_values[(u_int64_t)(j - i) * handler->values_per_entry],
+                   &values[(u_int64_t)refs[j].pos * handler->values_per_entry],
+                   handler->values_len);
+        }
+        rc = tsdb_set_batch(handler, run_indexes, run_values, end - i);
+    }
+
+    // the backfilled epochs reach the DB, none of them is left current or open
+    window_flush(handler);
+    handler->lazy_load = lazy_load;
+
+cleanup:
+    free(refs);
+    free(run_indexes);
+    free(run_values);
+
+    return rc;
+}
+
+int tsdb_unset_by_index(tsdb_handler *handler, u_int32_t *index) {
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    if (!handler->chunk.epoch) {
+        trace_error("Missing epoch");
+        return -2;
+    }
+
+    if ((rc = prepare_write_range(handler, *index))) {
+        return rc;
+    }
+    if ((rc = touch_range(handler, *index, 1, 1))) {
+        return rc;
+    }
+
+    offset = (u_int64_t)*index * handler->values_len;
+    memset(&handler->chunk.data[offset], handler->unknown_value, handler->values_len);
+    mark_valid(handler, *index, 1, 0);
+
+    return 0;
+}
+
+int tsdb_set(tsdb_handler *handler, char *key, tsdb_value *value) {
+    u_int32_t index; //relative to current chunk
+    return tsdb_set_with_index(handler, key, value, &index);
+}
+
+int tsdb_get_by_key(tsdb_handler *handler, char *key, tsdb_value **value) {
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive || !handler->chunk.data) {
+        return -1;
+    }
+
+    rc = prepare_offset_by_key(handler, key, &offset, 0);
+    if (rc == 0) {
+        *value = (tsdb_value*)(handler->chunk.data + offset);
+    }
+
+    return rc ;
+}
+
+static int point_load(tsdb_handler *handler, u_int32_t fragment, void *record, u_int32_t record_len) {
+  /* Decodes the keyframe record of a fragment of the lazily loaded epoch
+   * into the chunk and frees it. Returns 1 on success, -2 on errors */
+    u_int32_t fragment_size = handler->values_len * handler->fragment_len, len = fragment_size;
+    u_int8_t *dst = &handler->chunk.data[(u_int64_t)fragment * fragment_size];
+    fragment_frame frame;
+    int rc;
+
+    if (record == handler->point.record) {
+        handler->point.record = NULL; // freed below
+    }
+
+    rc = fragment_payload(handler, record, record_len, &frame);
+    if (rc == 0) {
+        rc = fragment_decode(&frame, dst, &len, &handler->state_decompress,
+                             &handler->chunk.valid[(u_int64_t)fragment * FRAGMENT_VALID_WORDS(handler->fragment_len)]);
+    }
+    free(record);
+    if (rc || len != fragment_size) {
+        trace_error("Fragment %u of epoch %u is malformed", fragment, handler->chunk.epoch);
+        return -2;
+    }
+    cache_put_fragment(handler, handler->chunk.epoch, fragment, dst,
+                       &handler->chunk.valid[(u_int64_t)fragment * FRAGMENT_VALID_WORDS(handler->fragment_len)]);
+    set_bit(handler->chunk.fragment_loaded, fragment);
+
+    return 1;
+}
+
+static int point_read(tsdb_handler *handler, u_int32_t index, tsdb_value **value) {
+  /* Unpacks the values of index out of its fragment record if it is a
+   * bit-packed keyframe, keeping the record and its validity bitmap for the
+   * next POINT_READS reads. Other keyframes are decoded into the chunk right
+   * away. Returns 1 if the fragment is to be read from the chunk */
+    tsdb_point *point = &handler->point;
+    u_int32_t fragment = index / handler->fragment_len, entry = index % handler->fragment_len, len, v;
+    fragment_frame frame;
+    void *record;
+    int rc;
+
+    if (handler->format_version < 3 || fragment >= handler->chunk.num_fragments ||
+        index >= handler->chunk.data_len / handler->values_len || get_bit(handler->chunk.fragment_loaded, fragment)) {
+        return 1;
+    }
+
+    if (point->record == NULL || point->epoch != handler->chunk.epoch || point->fragment != fragment) {
+        if (cache_peek(handler, handler->chunk.epoch, fragment) ||
+            (rc = fragment_get(handler, handler->chunk.epoch, fragment, &record, &len)) == -1) {
+            return 1;
+        }
+        if (rc == -2) {
+            return -2;
+        }
+        if (fragment_payload(handler, record, len, &frame) || frame.kind == FRAGMENT_DELTA) {
+            free(record);
+            return 1;
+        }
+        if (point->values == NULL) {
+            point->values = (u_int64_t*) malloc(handler->values_len);
+        }
+        if (point->valid == NULL) {
+            point->valid = (u_int32_t*) malloc(FRAGMENT_VALID_BYTES(handler));
+        }
+        if (frame.codec != TSDB_FRAGMENT_FOR || point->values == NULL || point->valid == NULL ||
+            frame_validity(&frame, point->valid)) {
+            return point_load(handler, fragment, record, len);
+        }
+        point_drop(handler);
+        point->epoch = handler->chunk.epoch;
+        point->fragment = fragment;
+        point->record = (u_int8_t *)record;
+        point->record_len = len;
+        point->reads = 0;
+    } else if (++point->reads >= POINT_READS) {
+        // cheaper as a whole from now on
+        return point_load(handler, fragment, point->record, point->record_len);
+    }
+
+    // the values of missing indexes are not in the record, those of set ones are at their rank
+    fragment_payload(handler, point->record, point->record_len, &frame);
+    if (!get_bit(point->valid, entry)) {
+        for (v = 0; v < handler->values_per_entry; v++) {
+            point->values[v] = frame.fill;
+        }
+    } else if (tsdb_for_get((u_int8_t *)frame.data, frame.len,
+                            tsdb_bits_count(point->valid, entry) * handler->values_per_entry,
+                            handler->values_per_entry, point->values)) {
+        trace_error("Fragment %u of epoch %u is malformed", fragment, handler->chunk.epoch);
+        return -2;
+    }
+    *value = (tsdb_value *)point->values;
+
+    return 0;
+}
+
+int tsdb_get_by_index(tsdb_handler *handler, u_int32_t *index,
+                      tsdb_value **value) {
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive || !handler->chunk.data) {
+        return -1;
+    }
+
+    if (handler->chunk.lazy && (rc = point_read(handler, *index, value)) != 1) {
+        return rc;
+    }
 
-int tsdb_epoch_exists(tsdb_handler *handler,
-                    u_int32_t epoch) {
+    rc = prepare_offset_by_index(handler, index, &offset, 0);
+    if (rc == 0) {
+        *value = (tsdb_value*)(handler->chunk.data + offset);
+    }
 
-  if (!handler->alive) {
-      return -1;
-  }
+    return rc ;
+}
 
-  u_int32_t fragment = 0;
-  char str[32];
+int tsdb_get_valid_by_index(tsdb_handler *handler, u_int32_t *index,
+                            tsdb_value **value) {
+    u_int32_t fragment = *index / handler->fragment_len;
+    int rc;
 
-  normalize_epoch(handler, &epoch);
+    if ((rc = tsdb_get_by_index(handler, index, value))) {
+        return rc;
+    }
 
-  snprintf(str, sizeof(str), "%u-%u", epoch, fragment);
+    // unless the fragment is loaded, the value was read out of its record
+    if (handler->chunk.lazy && fragment < handler->chunk.num_fragments &&
+        !get_bit(handler->chunk.fragment_loaded, fragment)) {
+        return (get_bit(handler->point.valid, *index % handler->fragment_len) ? 0 : TSDB_MISSING);
+    }
 
-  if (db_key_exists(handler, str, strlen(str))) {
-      return 1;
-  } else {
-      return 0;
-  }
+    return (is_valid(handler, *index) ? 0 : TSDB_MISSING);
 }
 
-static int ensure_key_index(tsdb_handler *handler, char *key,
-                            u_int32_t *index, u_int8_t for_write) {
-    if (tsdb_get_key_index(handler, key, index) == 0) {
-        trace_info("Key %s mapped to index %u", key, *index);
-        return 0;
-    }
+int tsdb_get_validity(tsdb_handler *handler, u_int32_t first_index,
+                      u_int32_t count, u_int32_t *bits) {
+    u_int64_t i, end = handler->chunk.data_len / handler->values_len;
 
-    if (!for_write) {
-        trace_info("Unable to find key %s", key);
+    if (!handler->alive || bits == NULL) {
         return -1;
     }
 
-    *index = handler->lowest_free_index++;
-    set_key_index(handler, key, *index);
+    memset(bits, 0, ((u_int64_t)count + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(u_int32_t));
+    // indexes beyond the epoch are clear
+    if (first_index >= end) {
+        return 0;
+    }
+    if ((u_int64_t)first_index + count < end) {
+        end = (u_int64_t)first_index + count;
+    }
+    if (touch_range(handler, first_index, end - first_index, 0)) {
+        return -2;
+    }
 
-    /* CallBack time! We report a new key discovery */
-    if (handler->reportNewMetricCB.cb != NULL && handler->reportNewMetricCB.external_data != NULL) {
-        if (handler->reportNewMetricCB.cb(key, handler->reportNewMetricCB.external_data)) {
-            trace_warning("CallBack call failed, consolidated TSDBs will have keys missing. Data loss in those DBs possible.");
+    for (i = first_index; i < end; i++) {
+        if (is_valid(handler, i)) {
+            set_bit(bits, i - first_index);
         }
     }
-    /******/
-
-    db_put(handler,
-           "lowest_free_index", strlen("lowest_free_index"),
-           &handler->lowest_free_index,
-           sizeof(handler->lowest_free_index));
 
     return 0;
 }
 
-static int prepare_offset_by_index(tsdb_handler *handler, u_int32_t *index,
-                                   u_int64_t *offset, u_int8_t for_write) {
-  /*index - absolute value. This func loads a respective fragment of the current epoch,
-   *decompresses it and put in the chunk struct (memory gets allocated internally) */
+typedef struct {
+    u_int32_t index;
+    u_int32_t position; //in the indexes given to tsdb_get_range()
+} range_ref;
+
+typedef struct {
+    u_int32_t *epochs;
+    u_int32_t num_epochs;
+    tsdb_value *values;
+    u_int32_t num_indexes;
+    range_ref *refs; //sorted by index
+    u_int32_t num_refs;
+    u_int32_t *fragments; //fragments holding the indexes, ascending
+    u_int32_t *first_ref; //first_ref[i]: first of refs held by fragments[i]
+    u_int32_t num_fragments;
+    u_int8_t *buffer; //a decompressed fragment
+    u_int8_t **bases; //bases[i]: the last fragments[i] decoded, base of delta frames, format 3 only
+    u_int32_t *base_epochs; //epochs of bases
+    u_int8_t *chained; //chained[i]: a delta frame of fragments[i] was read, its keyframes are decoded in full
+    u_int32_t missing_base; //epoch of the base range_read_fragment() asks for
+    u_int32_t first_slot; //epochs before it are read from cold segments
+} range_read;
+
+static int cmp_range_refs(const void *a, const void *b) {
+    const range_ref *x = (const range_ref *)a, *y = (const range_ref *)b;
+
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-    if (!handler->chunk.data) { // empty chunk.data assumes that the whole epoch is new,
-                                // because otherwise it would be filled with data of the epoch
-                                // by tsdb_goto_epoch
-        if (!for_write) {
-            return -1;
+static int range_read_fragment(tsdb_handler *handler, range_read *range,
+                               u_int32_t slot, u_int32_t target,
+                               void *record, u_int32_t record_len) {
+  /* Copies the values of the indexes held by the target fragment out of
+   * its record into the row of the epoch slot. Returns 1 if it is a delta
+   * frame of another base than range->bases[target], see range_fetch_base(),
+   * 2 if it refers to a shared payload, see range_read_shared() */
+    fragment_frame frame;
+    u_int8_t *swap;
+    u_int32_t i, offset, len = handler->values_len * handler->fragment_len, valid[FRAGMENT_VALID_WORDS(MAX_FRAGMENT_LEN)];
+    range_ref *ref;
+
+    if (fragment_payload(handler, record, record_len, &frame) == 0 &&
+        frame.kind == FRAGMENT_SHARED) {
+        return 2;
+    }
+    if (fragment_payload(handler, record, record_len, &frame) == 0 &&
+        frame.kind == FRAGMENT_DELTA) {
+        range->chained[target] = 1;
+        if (range->bases[target] == NULL || range->base_epochs[target] != frame.base_epoch) {
+            range->missing_base = frame.base_epoch;
+            return 1;
         }
+    }
 
-        char str[32];
-        void *value;
-        u_int8_t *old_data_ptr = NULL, *new_data_ptr = NULL;
-        u_int32_t fragment = *index / CHUNK_GROWTH, value_len;
-        size_t new_size;
-
-        if (fragment) {
-            old_data_ptr = (u_int8_t*) malloc(fragment * CHUNK_GROWTH * handler->values_len); //allocate memory for all prev fragments
-            if (old_data_ptr == NULL) {
-                trace_error("Not enough memory (%u bytes)", fragment * CHUNK_GROWTH * handler->values_len);
-                return -2;
+    // bit-packed keyframes are read value by value, unless delta frames need them as a whole
+    if (frame.kind == FRAGMENT_FULL && frame.codec == TSDB_FRAGMENT_FOR &&
+        range->chained && !range->chained[target] && frame_validity(&frame, valid) == 0) {
+        for (i = range->first_ref[target]; i < range->first_ref[target + 1]; i++) {
+            ref = &range->refs[i];
+            // missing indexes keep their unknown values
+            if (get_bit(valid, ref->index % handler->fragment_len)) {
+                tsdb_for_get((u_int8_t *)frame.data, frame.len,
+                             tsdb_bits_count(valid, ref->index % handler->fragment_len) * handler->values_per_entry,
+                             handler->values_per_entry,
+                             &range->values[((u_int64_t)slot * range->num_indexes + ref->position) * handler->values_per_entry]);
             }
         }
-        // Load the epoch handler->chunk.epoch/fragment
-
-
-        snprintf(str, sizeof(str), "%u-%u", handler->chunk.epoch, fragment);
-        if (db_get(handler, str, strlen(str), &value, &value_len) == -1) {
-            //requested fragment does not exist
-            new_size = (fragment+1) * CHUNK_GROWTH * handler->values_len;
-            new_data_ptr = (u_int8_t*) realloc(old_data_ptr, new_size);
-            if (new_data_ptr == NULL) {
-                trace_error("Not enough memory (%u bytes)", new_size);
-                return -2;
-            }
-            handler->chunk.data_len = new_size;
-            handler->chunk.data = new_data_ptr;
-            memset(handler->chunk.data,
-                   handler->unknown_value,
-                   handler->chunk.data_len);
-//            u_int32_t mem_len = handler->values_len * CHUNK_GROWTH;
-//            handler->chunk.data_len = mem_len;
-//            handler->chunk.data = (u_int8_t*)malloc(mem_len);
-//            if (handler->chunk.data == NULL) {
-//                trace_error("Not enough memory (%u bytes)", mem_len);
-//                return -2;
-//            }
-//            memset(handler->chunk.data,
-//                   handler->unknown_value,
-//                   handler->chunk.data_len);
-        } else {
-            size_t old_size_as_offset = fragment * CHUNK_GROWTH * handler->values_len;
-            new_size = old_size_as_offset + qlz_size_decompressed(value);
-            new_data_ptr = (u_int8_t*) realloc(old_data_ptr, new_size);
-            if (new_data_ptr == NULL) {
-                trace_error("Not enough memory (%u bytes)", new_size);
-                return -2;
-            }
-            handler->chunk.data_len = new_size;
-            handler->chunk.data = new_data_ptr;
-            memset(handler->chunk.data,
-                   handler->unknown_value,
-                   handler->chunk.data_len);
-            qlz_decompress(value, &handler->chunk.data[old_size_as_offset],
-                                       &handler->state_decompress);
-            free(value);
-
-//            handler->chunk.data_len = qlz_size_decompressed(value);
-//            handler->chunk.data = (u_int8_t*)malloc(handler->chunk.data_len);
-//            if (handler->chunk.data == NULL) {
-//                trace_error("Not enough memory (%u bytes)",
-//                            handler->chunk.data_len);
-//                return -2;
-//            }
-//            qlz_decompress(value, handler->chunk.data,
-//                           &handler->state_decompress);
-        }
-        //absolute index of a first element in the given fragment
-//        handler->chunk.base_index = fragment * CHUNK_GROWTH;
-        //relative index to that fragment
-//        *index -= handler->chunk.base_index;
-    } else {
-        get_offset:
-
-            if (*index >= (handler->chunk.data_len / handler->values_len)) {
-                if (!for_write || !handler->chunk.growable) {
-                    return -1;
-                }
-
-                u_int32_t to_add = CHUNK_GROWTH * handler->values_len;
-                u_int32_t new_len = handler->chunk.data_len + to_add;
-                u_int8_t *ptr = malloc(new_len);
-
-                if (!ptr) {
-                    trace_error("Not enough memory (%u bytes): unable to grow "
-                                "table", new_len);
-                    return -2;
-                }
-
-                memcpy(ptr, handler->chunk.data, handler->chunk.data_len);
-                free(handler->chunk.data);
-                memset(&ptr[handler->chunk.data_len],
-                       handler->unknown_value, to_add);
-                handler->chunk.data = ptr;
-                handler->chunk.data_len = new_len;
-
-                trace_warning("Epoch grown to %u", new_len);
+        return 0;
+    }
 
-                goto get_offset;
-            }
+    if (fragment_payload(handler, record, record_len, &frame) ||
+        fragment_decode(&frame, range->buffer, &len, &handler->state_decompress, NULL) ||
+        (frame.kind == FRAGMENT_DELTA && len != handler->values_len * handler->fragment_len)) {
+        trace_error("Fragment %u of epoch %u is malformed",
+                    range->fragments[target], range->epochs[slot]);
+        return -2;
+    }
+    if (frame.kind == FRAGMENT_DELTA) {
+        delta_apply(range->buffer, range->bases[target], len, 1);
     }
 
-    //relative index within current fragment(chunk), offset is in bytes, index in elements (tsdb_value * values_per_entry)
-    *offset = handler->values_len * *index;
+    for (i = range->first_ref[target]; i < range->first_ref[target + 1]; i++) {
+        ref = &range->refs[i];
+        offset = (ref->index % handler->fragment_len) * handler->values_len;
+        if (offset < len) {
+            memcpy(&range->values[((u_int64_t)slot * range->num_indexes + ref->position) * handler->values_per_entry],
+                   &range->buffer[offset], handler->values_len);
+        }
+    }
 
-    if (*offset >= handler->chunk.data_len) {
-        trace_error("INTERNAL ERROR [Id: %u][Offset: %u/%u]",
-                    *index, *offset, handler->chunk.data_len);
+    // the fragment is the base of that of the next epoch
+    if (range->bases && len == handler->values_len * handler->fragment_len) {
+        swap = range->bases[target];
+        range->bases[target] = range->buffer;
+        range->base_epochs[target] = range->epochs[slot];
+        range->buffer = (swap ? swap : (u_int8_t*) malloc(len));
+        if (range->buffer == NULL) {
+            trace_error("Not enough memory (%u bytes)", len);
+            return -2;
+        }
     }
 
     return 0;
 }
 
-static int prepare_offset_by_key(tsdb_handler *handler, char *key,
-                                 u_int64_t *offset, u_int8_t for_write) {
-    u_int32_t index; //absolute value, not relative to a fragment
+static int range_fetch_base(tsdb_handler *handler, range_read *range, u_int32_t target) {
+  /* Decodes the base range->missing_base of the target fragment, which
+   * precedes the range or whose record was skipped, into range->bases */
+    u_int32_t fragment_size = handler->values_len * handler->fragment_len;
+    int rc;
 
-    if (!handler->chunk.epoch) {
-        return -1;
+    if (range->bases[target] == NULL &&
+        (range->bases[target] = (u_int8_t*) malloc(fragment_size)) == NULL) {
+        trace_error("Not enough memory (%u bytes)", fragment_size);
+        return -2;
     }
 
-    if (ensure_key_index(handler, key, &index, for_write) == -1) {
-        trace_info("Unable to find index %s", key);
-        return -1;
+    rc = fetch_fragment(handler, range->missing_base, range->fragments[target], range->bases[target], NULL);
+    if (rc == -1) {
+        // the base was never written
+        memset(range->bases[target], handler->unknown_value, fragment_size);
+        rc = 0;
     }
+    range->base_epochs[target] = range->missing_base;
 
-    trace_info("%s mapped to idx %u", key, index);
-
-    return prepare_offset_by_index(handler, &index, offset, for_write);
+    return rc;
 }
 
-int tsdb_set_with_index(tsdb_handler *handler, char *key,
-                        tsdb_value *value, u_int32_t *index) {
-  /* Obsolete and useless. Use tsdb_set_by_index instead. */
-    tsdb_value *chunk_ptr;
-    u_int64_t offset;
-    int rc, i;
-    unsigned char just_created = 0;
+static int range_read_shared(tsdb_handler *handler, range_read *range,
+                             u_int32_t slot, u_int32_t target) {
+  /* range_read_fragment() of the shared payload the target fragment refers to */
+    void *record;
+    u_int32_t record_len;
+    int rc;
 
-    if (!handler->alive) {
-        return -1;
+    if ((rc = fragment_get(handler, range->epochs[slot], range->fragments[target], &record, &record_len)) == -1) {
+        // deleted meanwhile, along with the fragment
+        return 0;
     }
-
-    if (!handler->chunk.epoch) {
-        trace_error("Missing epoch");
+    if (rc == -2) {
         return -2;
     }
+    rc = range_read_fragment(handler, range, slot, target, record, record_len);
+    free(record);
+
+    return (rc == 2 ? -2 : rc);
+}
 
-    if (handler->chunk.data == NULL) {
-        just_created = 1;
+static int range_next(range_read *range, u_int32_t *slot, u_int32_t *target) {
+  /* Moves to the next fragment to read, returns 0 past the last one */
+    if (++(*target) == range->num_fragments) {
+        *target = 0;
+        (*slot)++;
     }
+    return *slot < range->num_epochs;
+}
 
-    rc = prepare_offset_by_key(handler, key, &offset, 1);
-    if (rc == 0) {
-        chunk_ptr = (tsdb_value*)(&handler->chunk.data[offset]);
-        memcpy(chunk_ptr, value, handler->values_len);
+static int range_scan(tsdb_handler *handler, range_read *range) {
+  /* Reads format 2 fragments with a single cursor. Records of consecutive
+   * fragments are adjacent, gaps are skipped by positioning the cursor */
+    DBC *cursor;
+    DBT key_data, data;
+    char key[32];
+    u_int32_t slot = range->first_slot, target = 0, epoch, fragment;
+    int rv, rc = 0;
+
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    if (handler->db->cursor(handler->db, NULL, &cursor, 0) != 0) {
+        pthread_mutex_unlock(&handler->flusher.db_lock);
+        trace_error("Unable to create a cursor");
+        return -2;
+    }
 
-        // Mark a fragment as changed
-        *index = offset / handler->values_len;
-        int fragment = *index / CHUNK_GROWTH;
-        if (fragment > MAX_NUM_FRAGMENTS - 1) {
-            trace_error("Internal error [%u > %u]",
-                        fragment, MAX_NUM_FRAGMENTS);
-            if (just_created) {
-                free(handler->chunk.data);
-                handler->chunk.data = NULL;
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+    key_data.data = key;
+    key_data.size = fragment_key(handler, range->epochs[slot], range->fragments[0], key);
+    rv = cursor->get(cursor, &key_data, &data, DB_SET_RANGE);
+
+    while (rv == 0 && parse_fragment_key(&key_data, &epoch, &fragment) == 0) {
+        // fragments before the record are missing in the DB
+        while (range->epochs[slot] < epoch ||
+               (range->epochs[slot] == epoch && range->fragments[target] < fragment)) {
+            if (!range_next(range, &slot, &target)) {
+                goto done;
             }
-        } else {
-            handler->chunk.fragment_changed[fragment] = 1;
-            if (just_created) {
-                for (i = 0; i < fragment; ++i) {
-                    handler->chunk.fragment_changed[i] = 1;
+        }
+
+        if (range->epochs[slot] == epoch && range->fragments[target] == fragment) {
+            rc = range_read_fragment(handler, range, slot, target, data.data, data.size);
+            if (rc == 1 || rc == 2) {
+                // the base or the shared payload is read with the DB unlocked, the cursor is positioned again
+                cursor->close(cursor);
+                pthread_mutex_unlock(&handler->flusher.db_lock);
+                if (rc == 1) {
+                    rc = range_fetch_base(handler, range, target);
+                } else if ((rc = range_read_shared(handler, range, slot, target)) == 0 &&
+                           !range_next(range, &slot, &target)) {
+                    return 0;
+                }
+                pthread_mutex_lock(&handler->flusher.db_lock);
+                if (rc == 0 && handler->db->cursor(handler->db, NULL, &cursor, 0) != 0) {
+                    trace_error("Unable to create a cursor");
+                    rc = -2;
                 }
+                if (rc) {
+                    pthread_mutex_unlock(&handler->flusher.db_lock);
+                    return rc;
+                }
+                goto seek;
+            }
+            if (rc) {
+                break;
+            }
+            if (!range_next(range, &slot, &target)) {
+                break;
+            }
+            if (range->epochs[slot] == epoch && range->fragments[target] == fragment + 1) {
+                rv = cursor->get(cursor, &key_data, &data, DB_NEXT);
+                continue;
             }
         }
 
+    seek:
+        memset(&key_data, 0, sizeof(key_data));
+        memset(&data, 0, sizeof(data));
+        key_data.data = key;
+        key_data.size = fragment_key(handler, range->epochs[slot], range->fragments[target], key);
+        rv = cursor->get(cursor, &key_data, &data, DB_SET_RANGE);
     }
 
+done:
+    cursor->close(cursor);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
+
     return rc;
 }
 
-int tsdb_set_by_index(tsdb_handler *handler, tsdb_value *value, u_int32_t *index) {
+static int range_get(tsdb_handler *handler, range_read *range) {
+  /* Reads format 1 fragments one by one, their keys are not ordered by time */
+    char key[32];
+    void *value;
+    u_int32_t slot = range->first_slot, target = 0, key_len, value_len;
+    int rc;
 
-  tsdb_value *chunk_ptr;
-  u_int64_t offset;
-  int rc, i;
-  unsigned char just_created = 0;
+    do {
+        key_len = fragment_key(handler, range->epochs[slot], range->fragments[target], key);
+        if (db_get(handler, key, key_len, &value, &value_len) == 0 &&
+            (rc = range_read_fragment(handler, range, slot, target, value, value_len))) {
+            return rc;
+        }
+    } while (range_next(range, &slot, &target));
 
-  if (!handler->alive) {
-      return -1;
-  }
+    return 0;
+}
 
-  if (!handler->chunk.epoch) {
-      trace_error("Missing epoch");
-      return -2;
-  }
+static int range_cold(tsdb_handler *handler, range_read *range, u_int32_t first) {
+  /* Reads the slots before range->first_slot, the epochs at positions
+   * first, first + 1... of the epoch index, from cold segments. Segments
+   * of a slice are adjacent records, walked with a single cursor */
+    DBC *cursor;
+    DBT key_data, data;
+    char key[32];
+    u_int8_t *buffer;
+    range_ref *ref;
+    u_int32_t i, j, k, next, slot, end, fragment, slice, segment, valid[TSDB_SLICE_WORDS];
+    u_int32_t slice_len = SEGMENT_SERIES * SEGMENT_EPOCHS * handler->values_len;
+    u_int32_t first_segment = first / SEGMENT_EPOCHS;
+    u_int32_t last_segment = (first + range->first_slot - 1) / SEGMENT_EPOCHS;
+    int rv, rc = 0;
+
+    buffer = (u_int8_t*) malloc(slice_len);
+    if (buffer == NULL) {
+        trace_error("Not enough memory (%u bytes)", slice_len);
+        return -2;
+    }
 
-  if (handler->chunk.data == NULL) {
-      just_created = 1;
-  }
+    pthread_mutex_lock(&handler->flusher.db_lock);
+    if (handler->db->cursor(handler->db, NULL, &cursor, 0) != 0) {
+        pthread_mutex_unlock(&handler->flusher.db_lock);
+        trace_error("Unable to create a cursor");
+        free(buffer);
+        return -2;
+    }
 
-  //rc = prepare_offset_by_key(handler, key, &offset, 1);
-  if (*index >= handler->lowest_free_index) {
-      trace_error("Index %ld was not mapped yet to a key, hence we refuse setting by it. Use tsdb_set with provided key name instead to create mapping key-index automatically.",*index);
-      return -1;
-  }
-  rc = prepare_offset_by_index(handler, index, &offset, 1);
-  if (rc == 0) {
-      chunk_ptr = (tsdb_value*)(&handler->chunk.data[offset]);
-      memcpy(chunk_ptr, value, handler->values_len);
+    for (i = 0; i < range->num_refs && rc == 0; i = next) {
+        // refs held by the same slice
+        for (next = i + 1; next < range->num_refs &&
+             range->refs[next].index / SEGMENT_SERIES == range->refs[i].index / SEGMENT_SERIES; next++);
+
+        memset(&key_data, 0, sizeof(key_data));
+        memset(&data, 0, sizeof(data));
+        key_data.data = key;
+        key_data.size = tsdb_segment_key(range->refs[i].index / handler->fragment_len,
+                                         (range->refs[i].index % handler->fragment_len) / SEGMENT_SERIES,
+                                         first_segment, key);
+        rv = cursor->get(cursor, &key_data, &data, DB_SET_RANGE);
+
+        while (rv == 0 && tsdb_segment_parse_key(key_data.data, key_data.size, &fragment, &slice, &segment) == 0 &&
+               fragment == range->refs[i].index / handler->fragment_len &&
+               slice == (range->refs[i].index % handler->fragment_len) / SEGMENT_SERIES &&
+               segment <= last_segment) {
+            // slots of the range within the segment
+            slot = (segment > first_segment ? segment * SEGMENT_EPOCHS - first : 0);
+            end = (segment + 1) * SEGMENT_EPOCHS - first;
+            if (end > range->first_slot) {
+                end = range->first_slot;
+            }
 
-      // Mark a fragment as changed
-      *index = offset / handler->values_len;
-      int fragment = *index / CHUNK_GROWTH;
-      if (fragment > MAX_NUM_FRAGMENTS - 1) {
-          trace_error("Internal error [%u > %u]",
-              fragment, MAX_NUM_FRAGMENTS);
-          if (just_created) {
-              free(handler->chunk.data);
-              handler->chunk.data = NULL;
-          }
-      } else {
-          handler->chunk.fragment_changed[fragment] = 1;
-          if (just_created) {
-              for (i = 0; i < fragment; ++i) {
-                  handler->chunk.fragment_changed[i] = 1;
-              }
-          }
-      }
+            if ((rc = tsdb_slice_open(handler->values_per_entry, data.data, data.size, buffer, valid,
+                                      &handler->state_decompress))) {
+                break;
+            }
+            for (j = i; j < next && rc == 0; j++) {
+                ref = &range->refs[j];
+                rc = tsdb_slice_copy(handler->values_per_entry, data.data, data.size, buffer,
+                                     ref->index % SEGMENT_SERIES, (first + slot) % SEGMENT_EPOCHS, end - slot,
+                                     (u_int8_t *)&range->values[((u_int64_t)slot * range->num_indexes +
+                                                                 ref->position) * handler->values_per_entry],
+                                     (u_int64_t)range->num_indexes * handler->values_len);
+                // missing indexes get unknown_value, like in fragment records
+                for (k = slot; k < end && rc == 0; k++) {
+                    if (!get_bit(valid, (ref->index % SEGMENT_SERIES) * SEGMENT_EPOCHS + (first + k) % SEGMENT_EPOCHS)) {
+                        memset(&range->values[((u_int64_t)k * range->num_indexes + ref->position) *
+                                              handler->values_per_entry],
+                               handler->unknown_value, handler->values_len);
+                    }
+                }
+            }
+            if (rc) {
+                trace_error("Failed to read slice %u of fragment %u in cold segment %u", slice, fragment, segment);
+                break;
+            }
 
-  }
+            rv = cursor->get(cursor, &key_data, &data, DB_NEXT);
+        }
+    }
 
-  return rc;
-}
+    cursor->close(cursor);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
+    free(buffer);
 
-int tsdb_set(tsdb_handler *handler, char *key, tsdb_value *value) {
-    u_int32_t index; //relative to current chunk
-    return tsdb_set_with_index(handler, key, value, &index);
+    return rc;
 }
 
-int tsdb_get_by_key(tsdb_handler *handler, char *key, tsdb_value **value) {
-    u_int64_t offset;
-    int rc;
+int tsdb_get_range(tsdb_handler *handler, u_int32_t epoch_from, u_int32_t epoch_to,
+                   const u_int32_t *indexes, u_int32_t num_indexes,
+                   u_int32_t **epochs, tsdb_value **values, u_int32_t *num_epochs) {
+    range_read range;
+    u_int32_t i, first, last, num_cold;
+    u_int64_t values_size;
+    int found, rc = 0;
 
-    if (!handler->alive || !handler->chunk.data) {
+    *epochs = NULL, *values = NULL, *num_epochs = 0;
+
+    if (!handler->alive || num_indexes == 0 || epoch_from > epoch_to) {
         return -1;
     }
 
-    rc = prepare_offset_by_key(handler, key, &offset, 0);
-    if (rc == 0) {
-        *value = (tsdb_value*)(handler->chunk.data + offset);
+    normalize_epoch(handler, &epoch_from);
+    normalize_epoch(handler, &epoch_to);
+
+    // epochs still in flight have to reach the DB
+    tsdb_flush_wait(handler);
+
+    if (tsdb_epoch_search(handler, epoch_from, &first) < 0 ||
+        (found = tsdb_epoch_search(handler, epoch_to, &last)) < 0) {
+        return -2;
+    }
+    last += found; //past the last epoch of the range
+    if (first == last) {
+        return 0;
     }
 
-    return rc ;
+    memset(&range, 0, sizeof(range));
+    range.num_epochs = last - first;
+    range.num_indexes = num_indexes;
+    values_size = (u_int64_t)range.num_epochs * num_indexes * handler->values_len;
+    range.epochs = (u_int32_t*) malloc(range.num_epochs * sizeof(u_int32_t));
+    range.values = (tsdb_value*) malloc(values_size);
+    range.refs = (range_ref*) malloc(num_indexes * sizeof(range_ref));
+    range.fragments = (u_int32_t*) malloc(num_indexes * sizeof(u_int32_t));
+    range.first_ref = (u_int32_t*) malloc((num_indexes + 1) * sizeof(u_int32_t));
+    range.buffer = (u_int8_t*) malloc(handler->values_len * handler->fragment_len);
+    if (handler->format_version >= 3) {
+        range.bases = (u_int8_t**) calloc(num_indexes, sizeof(u_int8_t*));
+        range.base_epochs = (u_int32_t*) malloc(num_indexes * sizeof(u_int32_t));
+        range.chained = (u_int8_t*) calloc(num_indexes, sizeof(u_int8_t));
+    }
+    if (!range.epochs || !range.values || !range.refs ||
+        !range.fragments || !range.first_ref || !range.buffer ||
+        (handler->format_version >= 3 && (!range.bases || !range.base_epochs || !range.chained))) {
+        trace_error("Not enough memory to read %u epochs", range.num_epochs);
+        rc = -2;
+        goto cleanup;
+    }
+    memset(range.values, handler->unknown_value, values_size);
+
+    for (i = 0; i < range.num_epochs; i++) {
+        if (tsdb_epoch_at(handler, first + i, &range.epochs[i])) {
+            rc = -2;
+            goto cleanup;
+        }
+    }
+
+    // indexes grouped by the fragments holding them
+    for (i = 0; i < num_indexes; i++) {
+        if (indexes[i] != TSDB_NO_INDEX) {
+            range.refs[range.num_refs].index = indexes[i];
+            range.refs[range.num_refs++].position = i;
+        }
+    }
+    qsort(range.refs, range.num_refs, sizeof(range_ref), cmp_range_refs);
+    for (i = 0; i < range.num_refs; i++) {
+        if (i == 0 || range.refs[i].index / handler->fragment_len != range.refs[i - 1].index / handler->fragment_len) {
+            range.fragments[range.num_fragments] = range.refs[i].index / handler->fragment_len;
+            range.first_ref[range.num_fragments++] = i;
+        }
+    }
+    range.first_ref[range.num_fragments] = range.num_refs;
+
+    if (range.num_fragments) {
+        // compacted epochs keep their records until the readers are done
+        pthread_mutex_lock(&handler->compactor.lock);
+        num_cold = (handler->format_version < 2 ? 0 : cold_epochs(handler));
+        if (num_cold > first) {
+            range.first_slot = (num_cold < last ? num_cold : last) - first;
+            rc = range_cold(handler, &range, first);
+        }
+        if (rc == 0 && range.first_slot < range.num_epochs) {
+            rc = (handler->format_version < 2 ? range_get(handler, &range) : range_scan(handler, &range));
+        }
+        pthread_mutex_unlock(&handler->compactor.lock);
+    }
+
+cleanup:
+    for (i = 0; range.bases && i < range.num_fragments; i++) {
+        free(range.bases[i]);
+    }
+    free(range.bases);
+    free(range.base_epochs);
+    free(range.chained);
+    free(range.refs);
+    free(range.fragments);
+    free(range.first_ref);
+    free(range.buffer);
+
+    if (rc) {
+        free(range.epochs);
+        free(range.values);
+        return rc;
+    }
+
+    *epochs = range.epochs;
+    *values = range.values;
+    *num_epochs = range.num_epochs;
+
+    return 0;
 }
 
-int tsdb_get_by_index(tsdb_handler *handler, u_int32_t *index,
-                      tsdb_value **value) {
-    u_int64_t offset;
+int tsdb_row_span(tsdb_handler *handler, u_int32_t first_index,
+                  u_int32_t count, tsdb_value **ptr) {
     int rc;
 
-    if (!handler->alive || !handler->chunk.data) {
+    if (!handler->alive || !handler->chunk.data || count == 0) {
         return -1;
     }
 
-    rc = prepare_offset_by_index(handler, index, &offset, 0);
-    if (rc == 0) {
-        *value = (tsdb_value*)(handler->chunk.data + offset);
+    if ((u_int64_t)first_index + count > handler->chunk.data_len / handler->values_len) {
+        return -1;
     }
 
-    return rc ;
+    if ((rc = touch_range(handler, first_index, count, 0))) {
+        return rc;
+    }
+
+    *ptr = (tsdb_value*)(handler->chunk.data + (u_int64_t)first_index * handler->values_len);
+
+    return 0;
 }
 
 void tsdb_flush(tsdb_handler *handler) {
@@ -846,8 +4678,11 @@ void tsdb_flush(tsdb_handler *handler) {
         return;
     }
     trace_info("Flushing database changes");
-    tsdb_flush_chunk(handler);
+    window_flush(handler);
+    tsdb_flush_wait(handler);
+    pthread_mutex_lock(&handler->flusher.db_lock);
     handler->db->sync(handler->db, 0);
+    pthread_mutex_unlock(&handler->flusher.db_lock);
 }
 
 static int load_tag_array(tsdb_handler *handler, char *name,
@@ -876,17 +4711,22 @@ static int load_tag_array(tsdb_handler *handler, char *name,
     return -1;
 }
 
-static int allocate_tag_array(tsdb_tag *tag) {
-   // u_int32_t array_len = CHUNK_GROWTH / sizeof(u_int32_t);
-    /*it will only contain indices enough for one chunk,
-     * better is CHUNK_GROWTH*MAX_NUM_FRAGMENTS / BITS_PER_WORD + 1 */
-    u_int32_t array_len = 1 + CHUNK_GROWTH*MAX_NUM_FRAGMENTS / BITS_PER_WORD;
-    u_int32_t* array = malloc(array_len);
-    if (!array) {
-        return -1;
+static int tag_reserve(tsdb_tag *tag, u_int32_t index) {
+  /* Grows the bitmap of a tag to cover index, indexes it did not cover
+   * are clear. Bitmaps stored by older versions may end mid-word */
+    u_int32_t array_len = (WORD_OFFSET(index) + 1) * sizeof(u_int32_t);
+    u_int32_t *array;
+
+    if (array_len <= tag->array_len) {
+        return 0;
     }
 
-    memset(array, 0, array_len);
+    array = (u_int32_t*) realloc(tag->array, array_len);
+    if (array == NULL) {
+        trace_error("Not enough memory (%u bytes)", array_len);
+        return -2;
+    }
+    memset((u_int8_t*)array + tag->array_len, 0, array_len - tag->array_len);
 
     tag->array = array;
     tag->array_len = array_len;
@@ -894,6 +4734,15 @@ static int allocate_tag_array(tsdb_tag *tag) {
     return 0;
 }
 
+static int allocate_tag_array(tsdb_tag *tag, u_int32_t index) {
+  /* Allocates an empty tag covering indexes up to index, it grows along
+   * with the indexes tagged */
+    tag->array = NULL;
+    tag->array_len = 0;
+
+    return tag_reserve(tag, index);
+}
+
 static void set_tag(tsdb_handler *handler, char *name, tsdb_tag *tag) {
   //tag->array must be allocated!
     char str[255];
@@ -903,13 +4752,17 @@ static void set_tag(tsdb_handler *handler, char *name, tsdb_tag *tag) {
     db_put(handler, str, strlen(str), tag->array, tag->array_len);
 }
 
-static int ensure_tag_array(tsdb_handler *handler, char *name, tsdb_tag *tag) {
-  // if tag exists in DF - load it, otherwise allocates empty one of size CHUNK_GROWTH/size of uint32
+static int ensure_tag_array(tsdb_handler *handler, char *name, tsdb_tag *tag, u_int32_t index) {
+  // if tag exists in DB - load it, otherwise allocates an empty one; either covers index
     if (load_tag_array(handler, name, tag) == 0) {
-        return 0;
+        if (tag_reserve(tag, index) == 0) {
+            return 0;
+        }
+        free(tag->array);
+        return -1;
     }
 
-    if (allocate_tag_array(tag) == 0) {
+    if (allocate_tag_array(tag, index) == 0) {
         return 0;
     }
 
@@ -926,7 +4779,7 @@ int tsdb_tag_key(tsdb_handler *handler, char *key, char *tag_name) {
     }
 
     tsdb_tag tag;
-    if (ensure_tag_array(handler, tag_name, &tag)) {
+    if (ensure_tag_array(handler, tag_name, &tag, index)) {
         return -1;
     }
 
@@ -975,7 +4828,15 @@ int tsdb_get_tag_indexes(tsdb_handler *handler, char *tag_name,
     tsdb_tag tag;
     if (load_tag_array(handler, tag_name, &tag) == 0) {
         u_int32_t max_index = max_tag_index(handler, indexes_len);
-        scan_tag_indexes(&tag, indexes, max_index, count);
+
+        *count = 0;
+        if (handler->lowest_free_index && indexes_len) {
+            if (tag_reserve(&tag, max_index)) {
+                free(tag.array);
+                return -2;
+            }
+            scan_tag_indexes(&tag, indexes, max_index, count);
+        }
         free(tag.array);
         return 0;
     }
@@ -1003,9 +4864,18 @@ int tsdb_get_consolidated_tag_indexes(tsdb_handler *handler,
     nullify_mask = nullify_mask >> (BITS_PER_WORD - extra_bits); //Logical shift for unsinged integers - padding with zeros MSB positions
 
     *count = 0;
+    if (handler->lowest_free_index == 0 || indexes_len == 0) {
+        return 0;
+    }
 
     for (i = 0; i < tag_names_len; i++) {
         if (load_tag_array(handler, tag_names[i], &current) == 0) {
+            // tags only cover the indexes up to the largest one tagged
+            if (tag_reserve(&current, max_index)) {
+                free(current.array);
+                free(consolidated.array);
+                return -2;
+            }
             if (consolidated.array) {
                 for (j = 0; j <= max_word; j++) {
                     switch (consolidator) {
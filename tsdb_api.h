@@ -24,24 +24,125 @@
 #include <sys/stat.h>
 #include <db.h> // Berkeley DB API
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "tsdb_trace.h"
+#include "tsdb_bitmap.h"
+#include "tsdb_cache.h"
+#include "tsdb_codec.h"
+#include "tsdb_keymap.h"
+#include "tsdb_pool.h"
+#include "tsdb_segment.h"
+#include "tsdb_shared.h"
 #include "quicklz.h"
+#include "quicklz3.h"
 
-#define CHUNK_GROWTH 10000
+#define CHUNK_GROWTH 10000 //indexes per fragment of DBs created without tsdb_set_fragment_len()
 #define CHUNK_LEN_PADDING 400
-#define MAX_NUM_FRAGMENTS 16384
+#define MAX_FRAGMENT_LEN 100000 //most indexes per fragment, see tsdb_set_fragment_len()
+#define MAX_FRAGMENT_BYTES (1 << 30) //largest decompressed fragment, QuickLZ sizes are 32-bit
+#define MAX_NUM_WORKERS 8
+#define MAX_FLUSH_DEPTH 8
+#define MAX_REORDER_EPOCHS 64 //largest reorder window, see tsdb_set_reorder_window()
+#define EPOCH_PAGE_LEN 1024 //epochs per page of the epoch index
+#define TSDB_FORMAT_VERSION 4 //format of new DBs, see fragment_payload() in tsdb_api.c
+#define FRAGMENT_KEY_LEN 9
+#define FRAGMENT_HEADER_LEN 5 //tag and base epoch of a delta frame, see fragment_payload()
+#define SHARED_REF_LEN 9 //tag and hash of a reference to a shared payload, see fragment_payload()
+#define POINT_READS 32 //values unpacked from a bit-packed fragment before decoding it
+#define CODEC_BUDGET 20000 //usec per flush picking codecs, see tsdb_set_codec_budget()
+#define FRAGMENT_VALID_WORDS(fragment_len) (((fragment_len) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define TSDB_MISSING 1 //the index was not set in the epoch, see tsdb_get_valid_by_index()
+#define SHARED_MIN_LEN 64 //keyframe records shorter than this are never shared
 
 typedef struct {
     u_int8_t *data; //byte-wise data representation
+    u_int32_t *valid; //FRAGMENT_VALID_WORDS() words per fragment, bit i tells if index i was set
     u_int8_t new_epoch_flag;
-    u_int32_t data_len;
+    u_int64_t data_len; //epochs may exceed 4 GiB, fragments may not, see MAX_FRAGMENT_BYTES
+    u_int64_t capacity; //bytes data and valid have room for, data_len if lower, see tsdb_reserve()
     u_int32_t epoch;
     u_int8_t growable;
-    u_int8_t fragment_changed[MAX_NUM_FRAGMENTS];
+    u_int8_t lazy; //fragments are decompressed on first access, see fragment_loaded
+    u_int32_t *fragment_changed; //bitset, one bit per fragment of data
+    u_int32_t *fragment_loaded; //bitset, one bit per fragment of data
+    u_int32_t num_fragments; //bits allocated in fragment_changed and fragment_loaded
     u_int32_t base_index;
+    u_int8_t *base; //previous epoch the changed fragments are delta frames of, NULL for keyframes
+    u_int64_t base_len;
+    u_int32_t base_epoch;
 } tsdb_chunk;
 
+typedef struct {
+    pthread_t thread;
+    u_int8_t running;
+    u_int8_t shutdown;
+    u_int8_t depth; //max number of chunks in flight, 0 for synchronous flushes
+    u_int8_t num_queued; //including the one being written
+    u_int8_t head;
+    tsdb_chunk *queue; //ring of depth chunks, queue[head] is being written
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //signalled on every change of the queue
+    pthread_mutex_t db_lock; //serializes DB access of the writer and the flusher thread
+} tsdb_flusher;
+
+typedef struct {
+    u_int8_t size; //epochs open at most, the current one included, 0 or 1 for none besides it
+    u_int8_t num_open; //chunks used
+    tsdb_chunk *chunks; //epochs with changes left over for another one, flushed oldest first
+} tsdb_window;
+
+typedef struct {
+    pthread_t thread;
+    u_int8_t running;
+    u_int8_t shutdown;
+    u_int32_t age; //seconds an epoch must be older than the most recent one to be compacted
+    u_int32_t cold_segments; //segments compacted, the epochs they cover have no fragment records
+    u_int32_t next_segment; //first segment not queued yet
+    u_int32_t num_queued; //segments queued, including the one being compacted
+    u_int32_t queue_len; //segments allocated in queue
+    u_int32_t *queue; //SEGMENT_EPOCHS epochs of each queued segment, queue[0] is cold_segments
+    qlz_state_compress *state_compress;
+    qlz_state_decompress *state_decompress;
+    pthread_mutex_t lock; //held by readers of cold segments while records are moved
+    pthread_cond_t cond; //signalled on every change of the queue
+} tsdb_compactor;
+
+typedef struct {
+    u_int32_t keyframe_interval; //epochs per keyframe, 0 for no delta frames
+    u_int8_t *reference; //data of the last new epoch flushed, the base of the next one
+    u_int64_t reference_len;
+    u_int32_t reference_epoch;
+} tsdb_delta;
+
+typedef struct {
+    u_int64_t fragments[TSDB_NUM_FRAGMENT_CODECS]; //per TSDB_FRAGMENT_ codec
+    u_int64_t bytes[TSDB_NUM_FRAGMENT_CODECS]; //of their records
+    u_int64_t delta_frames;
+    u_int64_t unprobed; //written with TSDB_FRAGMENT_QLZ once the budget was spent
+    u_int64_t skipped; //changed, but no index of them is set, thus not stored
+    u_int64_t shared; //fragment records referring to a shared payload, counted with its codec
+    u_int64_t payloads; //shared payloads, each stored once
+    u_int64_t payload_bytes; //of the shared payloads
+    u_int64_t deduplicated_bytes; //of the references to them beyond the first one, stored once only
+} tsdb_codec_stats;
+
+typedef struct {
+    u_int32_t epoch;
+    u_int32_t fragment;
+    u_int8_t *record; //bit-packed keyframe of the fragment, NULL if none
+    u_int32_t record_len;
+    u_int32_t reads; //values read out of it, it is decoded in full after POINT_READS
+    u_int64_t *values; //the entry last read out of it, values_per_entry values
+    u_int32_t *valid; //validity bitmap of the fragment, FRAGMENT_VALID_WORDS() words
+} tsdb_point;
+
+typedef struct {
+    u_int32_t **pages; //of EPOCH_PAGE_LEN epochs each, NULL until accessed
+    u_int32_t num_pages; //entries allocated in pages
+} tsdb_epoch_index;
+
 typedef struct {
     u_int32_t *array;
     u_int32_t array_len;
@@ -56,9 +157,17 @@ typedef struct {
     void *external_data;
 } cb_bundle_t;
 
+typedef struct {
+    char **keys;
+    u_int32_t num_keys;
+} tsdb_new_keys; //internal_data of reportNewMetricsCB
+
 typedef struct {
     u_int8_t alive;
     u_int8_t read_only;
+    u_int32_t format_version; //on-disk layout of the DB, 1 for DBs created before it was recorded
+    u_int8_t lazy_load; //if set, fragments are decompressed on demand, see tsdb_goto_epoch()
+    u_int8_t segment_codec; //of cold segments compacted from now on, TSDB_CODEC_SERIES by default
     u_int16_t values_per_entry; //1,2,3... number of values to store per epoch per time-series
     u_int16_t values_len; //=values_per_entry * sizeof(tsdb_value)
     tsdb_value unknown_value; //default value in a DB's entries
@@ -66,15 +175,35 @@ typedef struct {
     u_int32_t most_recent_epoch;
     u_int32_t lowest_free_index; //started with 0
     u_int32_t slot_duration;
-    u_int32_t *epoch_list;
+    u_int32_t fragment_len; //indexes per fragment, fixed when the DB is created
+    u_int32_t reserved_series; //indexes new epochs have room for at least, see tsdb_reserve()
+    tsdb_epoch_index epoch_index; //sorted epochs of the DB, pages are loaded on demand
     qlz_state_compress state_compress;
     qlz_state_decompress state_decompress;
     tsdb_chunk chunk;
+    tsdb_cache cache; //decompressed fragments of recently visited epochs, off by default
+    tsdb_keymap keymap; //key to index mappings, loaded by tsdb_open()
+    u_int16_t num_workers; //threads (de)compressing fragments of an epoch, 1 for no helper threads
+    tsdb_pool pool; //started on first use
+    qlz_state_compress *worker_compress; //one per helper thread, worker 0 uses state_compress
+    qlz_state_decompress *worker_decompress; //one per helper thread, worker 0 uses state_decompress
+    tsdb_flusher flusher; //background writer of flushed chunks, off by default
+    tsdb_window window; //epochs kept open in memory besides the current one, off by default
+    tsdb_compactor compactor; //background transposition of old epochs, off by default
+    tsdb_shared shared; //payloads of identical keyframes, see tsdb_get_codec_stats()
+    tsdb_delta delta; //delta frames of new epochs, off by default
+    u_int32_t codec_budget; //usec per flush, 0 to write all fragments with TSDB_FRAGMENT_QLZ
+    void *worker_qlz3[MAX_NUM_WORKERS]; //level 3 compression states, allocated on first use
+    tsdb_codec_stats codec_stats; //fragments written by this handler, updated under flusher.lock
+    tsdb_point point; //bit-packed fragment read value by value, see tsdb_get_by_index()
     DB *db;
     cb_bundle_t reportChunkDataCB;
     cb_bundle_t reportNewMetricCB;
+    cb_bundle_t reportNewMetricsCB; //if set, used instead of reportNewMetricCB for batches
 } tsdb_handler;
 
+#define TSDB_NO_INDEX ((u_int32_t)-1)
+
 extern int  tsdb_open(const char *tsdb_path, tsdb_handler *handler,
 		      u_int16_t *values_per_entry,
 		      u_int32_t slot_duration,
@@ -91,7 +220,8 @@ extern int tsdb_goto_epoch(tsdb_handler *handler,
 /* This function will go to the epoch.
  * If the epoch after normalization equals the current one,
  * the function does nothing and returns 0. In all other
- * cases it FLUSHES all changes into disk.
+ * cases it FLUSHES all changes into disk, see tsdb_set_async_flush()
+ * and tsdb_set_reorder_window().
  * If the epoch exists, then all its fragments will be loaded,
  * decompressed and glued together into a continuous chunk in memory.
  * If the epoch does not exist, a new empty chunk will be set
@@ -99,13 +229,96 @@ extern int tsdb_goto_epoch(tsdb_handler *handler,
  * This function can be used to check existence of epochs
  * in the TSDB, but if an epoch exists it will be loaded
  * and decompressed automatically. To avoid the overhead
- * one should use tsdb_epoch_exists(). */
+ * one should use tsdb_epoch_exists().
+ * If handler->lazy_load is set, fragments are decompressed on the first
+ * access to one of their indexes, see tsdb_get_by_index(). A new epoch
+ * older than the most recent one is inserted among the others, unless it
+ * is older than the compacted epochs (-1). */
+
+extern int tsdb_reserve(tsdb_handler *handler, u_int32_t num_series);
+/* Make new epochs room for num_series indexes, so that filling them
+ * never reallocates their chunk. Memory never written is reserved only.
+ * Returns 0 on success, -1 on a read-only DB, -2 if there is not enough
+ * memory. */
+
+extern void tsdb_set_cache_budget(tsdb_handler *handler, u_int64_t budget);
+/* Keep up to budget bytes of decompressed fragments of visited epochs.
+ * 0 (the default) disables the cache, counters are in handler->cache. */
+
+extern int tsdb_set_workers(tsdb_handler *handler, u_int16_t num_workers);
+/* Set the number of threads (de)compressing the fragments of an epoch,
+ * the calling one included, by default the number of online CPUs up to
+ * MAX_NUM_WORKERS. Returns 0 on success, -1 on a wrong argument. */
+
+extern int tsdb_set_async_flush(tsdb_handler *handler, u_int8_t depth);
+/* Hand chunks of the epochs left over to a background thread, with up
+ * to depth (at most MAX_FLUSH_DEPTH) chunks in flight. 0 (the default)
+ * turns it off. Returns 0 on success, -1 otherwise. */
+
+extern void tsdb_flush_wait(tsdb_handler *handler);
+/* Wait until all chunks handed to the background thread are written.
+ * Going to an epoch still in flight waits for it implicitly. */
+
+extern int tsdb_set_reorder_window(tsdb_handler *handler, u_int8_t num_epochs);
+/* Keep up to num_epochs (at most MAX_REORDER_EPOCHS) epochs with changes
+ * open in memory, so that interleaved samples of several epochs are
+ * written without reloading them. tsdb_flush() flushes them all, 0 or 1
+ * (the default) turns the window off.
+ * Returns 0 on success, -1 otherwise. */
+
+extern int tsdb_set_compaction(tsdb_handler *handler, u_int32_t age);
+/* Let a background thread move every SEGMENT_EPOCHS epochs older than
+ * the most recent one by more than age seconds into cold segments, read
+ * by tsdb_get_range() without their later changes, see tsdb_segment.h.
+ * 0 (the default) stops it. Only for writable DBs of format 2 or later.
+ * Returns 0 on success, -1 otherwise. */
+
+extern void tsdb_compaction_wait(tsdb_handler *handler);
+/* Wait until all segments queued for compaction are written. */
+
+extern int tsdb_set_delta_frames(tsdb_handler *handler, u_int32_t keyframe_interval);
+/* Write the changed fragments of new epochs as differences with the
+ * previous epoch, every keyframe_interval-th epoch in full. 0 (the
+ * default) writes keyframes only. Only for writable DBs of format 3 or
+ * later. Returns 0 on success, -1 otherwise. */
+
+extern void tsdb_set_codec_budget(tsdb_handler *handler, u_int32_t usec);
+/* Let every flush spend up to usec microseconds picking the shortest
+ * codec of the changed fragments, the others are written with QuickLZ.
+ * CODEC_BUDGET by default, 0 always uses QuickLZ. */
+
+extern int tsdb_set_fragment_len(tsdb_handler *handler, u_int32_t fragment_len);
+/* Set the number of indexes per fragment of a DB holding no epoch yet,
+ * a multiple of SEGMENT_SERIES up to MAX_FRAGMENT_LEN, CHUNK_GROWTH by
+ * default. It is stored with the DB.
+ * Returns 0 on success, -1 if the length is not supported or the DB
+ * already holds epochs. */
+
+extern int tsdb_get_codec_stats(tsdb_handler *handler, tsdb_codec_stats *stats);
+/* Count the fragment records of the DB and their bytes per codec, and
+ * the shared payloads of identical keyframes of format 4. Unflushed
+ * fragments and cold segments are not counted.
+ * Returns 0 on success, -1 for DBs of format 1 or on a DB error. */
 
 extern int tsdb_epoch_exists(tsdb_handler *handler,
                     u_int32_t epoch);
 /* This function checks whether the epoch exists in the DB, but neither
  * load it nor make any changes in the *handler */
 
+extern int tsdb_epoch_at(tsdb_handler *handler,
+                         u_int32_t position,
+                         u_int32_t *epoch);
+/* Get the epoch at position in the sorted list of epochs, 0 being the
+ * oldest one. Pages of the list are read on first access only.
+ * Returns 0 on success, -1 if position is out of range, -2 on errors. */
+
+extern int tsdb_epoch_search(tsdb_handler *handler,
+                             u_int32_t epoch,
+                             u_int32_t *position);
+/* Binary search of the (normalized) epoch in the list of epochs,
+ * *position is set to that of the first epoch not older than it.
+ * Returns 1 if the epoch is in the list, 0 if not, -2 on errors. */
+
 extern int tsdb_set(tsdb_handler *handler, char *key, tsdb_value *value);
 
 extern int tsdb_set_with_index(tsdb_handler *handler, char *key,
@@ -113,6 +326,39 @@ extern int tsdb_set_with_index(tsdb_handler *handler, char *key,
 
 extern int tsdb_set_by_index(tsdb_handler *handler, tsdb_value *value, u_int32_t *index);
 
+extern int tsdb_set_batch(tsdb_handler *handler,
+                          const u_int32_t *indexes,
+                          const tsdb_value *values,
+                          u_int32_t num_values);
+/* Set values_per_entry values of each of num_values mapped indexes in
+ * the current epoch. Nothing is written if any of them is out of range.
+ * Returns 0 on success, -1 on wrong arguments, -2 on errors. */
+
+extern int tsdb_row_write(tsdb_handler *handler,
+                          u_int32_t first_index,
+                          u_int32_t count,
+                          const tsdb_value *src);
+/* Copy the values of count consecutive indexes starting with
+ * first_index into the current epoch, like tsdb_set_batch().
+ * Returns 0 on success, -1 on wrong arguments, -2 on errors. */
+
+extern int tsdb_backfill(tsdb_handler *handler,
+                         const u_int32_t *epochs,
+                         const u_int32_t *indexes,
+                         const tsdb_value *values,
+                         u_int32_t num_values);
+/* Write num_values late samples, values_per_entry values of indexes[i]
+ * at epochs[i] each, in any order. Of duplicates the last one is kept.
+ * Open epochs are flushed, none is current afterwards. Nothing is
+ * written, and the current epoch is left alone, if an index is not mapped
+ * or a missing epoch is older than the compacted ones.
+ * Returns 0 on success, -1 on wrong arguments, -2 on errors. */
+
+extern int tsdb_unset_by_index(tsdb_handler *handler, u_int32_t *index);
+/* Mark index as missing in the current epoch, as if it was never set:
+ * its values are reset to unknown_value, see tsdb_get_valid_by_index().
+ * Returns 0 on success, -1 if index is not mapped, -2 on errors. */
+
 extern int tsdb_get_by_key(tsdb_handler *handler,
                            char *key,
                            tsdb_value **value);
@@ -120,10 +366,69 @@ extern int tsdb_get_by_key(tsdb_handler *handler,
 extern int tsdb_get_key_index(tsdb_handler *handler,
                               char *key,
                               u_int32_t *index);
+/* Keys are resolved from handler->keymap, which tsdb_open() fills with
+ * all mappings of the DB. A key missing there is looked up in the DB, as
+ * it may have been added by another process since. */
+
+extern int tsdb_resolve_keys(tsdb_handler *handler,
+                             char **keys,
+                             u_int32_t num_keys,
+                             u_int32_t *indexes,
+                             u_int8_t create);
+/* Map num_keys keys to their indexes with a single DB cursor. If create
+ * is set, missing keys get new indexes in the order given, reported with
+ * a single call of reportNewMetricsCB if set, else TSDB_NO_INDEX.
+ * Returns 0 if all keys are mapped, -1 if some are missing, -2 on errors. */
 
 extern int tsdb_get_by_index(tsdb_handler *handler,
                              u_int32_t *index,
                              tsdb_value **value);
+/* Point *value to the values of index in the current epoch. For fragments
+ * of lazily loaded epochs read value by value (see tsdb_goto_epoch()) it
+ * is a copy, valid until the next call.
+ * Returns 0 on success, -1 if index is not in the epoch, -2 on errors. */
+
+extern int tsdb_get_valid_by_index(tsdb_handler *handler,
+                                   u_int32_t *index,
+                                   tsdb_value **value);
+/* The same as tsdb_get_by_index(), but tells set values from missing
+ * ones, which read as unknown_value. Indexes of records of format 2 or
+ * older count as set, cold segments keep the validity of their epochs.
+ * Returns 0 if the index was set, TSDB_MISSING if not, -1 if it is not in
+ * the epoch, -2 on errors. */
+
+extern int tsdb_get_validity(tsdb_handler *handler,
+                             u_int32_t first_index,
+                             u_int32_t count,
+                             u_int32_t *bits);
+/* Set bit i of bits (words of BITS_PER_WORD) if index first_index + i
+ * was set in the current epoch, see tsdb_get_valid_by_index().
+ * Returns 0 on success, -1 on wrong arguments, -2 on errors. */
+
+extern int tsdb_row_span(tsdb_handler *handler,
+                         u_int32_t first_index,
+                         u_int32_t count,
+                         tsdb_value **ptr);
+/* Point *ptr to the values of count consecutive indexes starting with
+ * first_index in the current epoch. The span is read-only and valid
+ * until the next write or change of the epoch.
+ * Returns 0 on success, -1 if the range is not in the epoch, -2 on errors. */
+
+extern int tsdb_get_range(tsdb_handler *handler,
+                          u_int32_t epoch_from,
+                          u_int32_t epoch_to,
+                          const u_int32_t *indexes,
+                          u_int32_t num_indexes,
+                          u_int32_t **epochs,
+                          tsdb_value **values,
+                          u_int32_t *num_epochs);
+/* Read the values of num_indexes indexes in all epochs within
+ * [epoch_from, epoch_to] without changing the current epoch. *epochs is
+ * set to the *num_epochs epochs found, the values of indexes[i] in
+ * (*epochs)[j] are at (*values)[(j * num_indexes + i) * values_per_entry],
+ * unknown_value if missing. Both arrays must be freed. Unflushed changes
+ * are not seen.
+ * Returns 0 on success, -1 on wrong arguments, -2 on errors. */
 
 extern void tsdb_flush(tsdb_handler *handler);
 
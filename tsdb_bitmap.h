@@ -1,3 +1,6 @@
+#ifndef TSDB_BITMAP_H_
+#define TSDB_BITMAP_H_
+
 #include <stdlib.h>
 #include <limits.h>
 
@@ -15,3 +18,5 @@ int get_bit(u_int32_t *words, int n);
 void scan_result(u_int32_t *result,
                  u_int32_t max_index, 
                  void(*handler)(u_int32_t *index));
+
+#endif /* TSDB_BITMAP_H_ */
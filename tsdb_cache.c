@@ -0,0 +1,197 @@
+/*
+ * tsdb_cache.c
+ *
+ * LRU cache of decompressed epoch fragments, see tsdb_cache.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdb_cache.h"
+
+#define CACHE_MIN_BUCKETS 64
+
+static u_int32_t bucket_of(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment) {
+    return (epoch * 2654435761u ^ fragment * 40503u) % cache->num_buckets;
+}
+
+static u_int64_t entry_cost(u_int32_t data_len) {
+    return data_len + sizeof(tsdb_cache_entry);
+}
+
+static void lru_unlink(tsdb_cache *cache, tsdb_cache_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next; else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(tsdb_cache *cache, tsdb_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry; else cache->tail = entry;
+    cache->head = entry;
+}
+
+static tsdb_cache_entry **lookup(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment) {
+  /* Returns the address of the link pointing to the entry (or to NULL if absent) */
+    tsdb_cache_entry **link = &cache->buckets[bucket_of(cache, epoch, fragment)];
+
+    while (*link && ((*link)->epoch != epoch || (*link)->fragment != fragment)) {
+        link = &(*link)->hnext;
+    }
+    return link;
+}
+
+static void remove_entry(tsdb_cache *cache, tsdb_cache_entry **link) {
+    tsdb_cache_entry *entry = *link;
+
+    *link = entry->hnext;
+    lru_unlink(cache, entry);
+    cache->used -= entry_cost(entry->data_len);
+    cache->num_entries--;
+    free(entry->data);
+    free(entry);
+}
+
+static void evict_to(tsdb_cache *cache, u_int64_t limit) {
+    while (cache->used > limit && cache->tail) {
+        tsdb_cache_entry *victim = cache->tail;
+        remove_entry(cache, lookup(cache, victim->epoch, victim->fragment));
+        cache->evictions++;
+    }
+}
+
+static int rehash(tsdb_cache *cache, u_int32_t num_buckets) {
+    tsdb_cache_entry **buckets, *entry;
+    u_int32_t old_num = cache->num_buckets, i;
+
+    buckets = (tsdb_cache_entry **) calloc(num_buckets, sizeof(tsdb_cache_entry *));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    cache->num_buckets = num_buckets;
+    for (i = 0; i < old_num; i++) {
+        while ((entry = cache->buckets[i]) != NULL) {
+            u_int32_t b = bucket_of(cache, entry->epoch, entry->fragment);
+            cache->buckets[i] = entry->hnext;
+            entry->hnext = buckets[b];
+            buckets[b] = entry;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    return 0;
+}
+
+void tsdb_cache_set_budget(tsdb_cache *cache, u_int64_t budget) {
+    cache->budget = budget;
+    evict_to(cache, budget);
+    if (budget == 0) {
+        free(cache->buckets);
+        cache->buckets = NULL;
+        cache->num_buckets = 0;
+    }
+}
+
+u_int8_t *tsdb_cache_get(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment,
+                         u_int32_t *data_len) {
+    tsdb_cache_entry *entry;
+
+    if (cache->budget == 0 || cache->num_entries == 0) {
+        if (cache->budget) cache->misses++;
+        return NULL;
+    }
+
+    entry = *lookup(cache, epoch, fragment);
+    if (entry == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    lru_unlink(cache, entry);
+    lru_push_front(cache, entry);
+    *data_len = entry->data_len;
+    return entry->data;
+}
+
+int tsdb_cache_put(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment,
+                   const u_int8_t *data, u_int32_t data_len) {
+    return tsdb_cache_put_parts(cache, epoch, fragment, data, data_len, NULL, 0);
+}
+
+int tsdb_cache_put_parts(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment,
+                         const u_int8_t *data, u_int32_t data_len,
+                         const u_int8_t *extra, u_int32_t extra_len) {
+    tsdb_cache_entry **link, *entry;
+
+    if (cache->budget == 0 || entry_cost(data_len + extra_len) > cache->budget) {
+        return -1;
+    }
+
+    if (cache->buckets == NULL && rehash(cache, CACHE_MIN_BUCKETS)) {
+        return -1;
+    }
+
+    link = lookup(cache, epoch, fragment);
+    if (*link) {
+        remove_entry(cache, link);
+    }
+
+    evict_to(cache, cache->budget - entry_cost(data_len + extra_len));
+
+    entry = (tsdb_cache_entry *) calloc(1, sizeof(tsdb_cache_entry));
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->data = (u_int8_t *) malloc(data_len + extra_len);
+    if (entry->data == NULL) {
+        free(entry);
+        return -1;
+    }
+    memcpy(entry->data, data, data_len);
+    if (extra_len) {
+        memcpy(&entry->data[data_len], extra, extra_len);
+    }
+    entry->epoch = epoch;
+    entry->fragment = fragment;
+    entry->data_len = data_len + extra_len;
+
+    if (cache->num_entries >= 2 * cache->num_buckets) {
+        rehash(cache, 2 * cache->num_buckets); // on failure chains just get longer
+    }
+
+    link = &cache->buckets[bucket_of(cache, epoch, fragment)];
+    entry->hnext = *link;
+    *link = entry;
+    lru_push_front(cache, entry);
+    cache->used += entry_cost(data_len + extra_len);
+    cache->num_entries++;
+
+    return 0;
+}
+
+void tsdb_cache_invalidate(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment) {
+    tsdb_cache_entry **link;
+
+    if (cache->num_entries == 0) {
+        return;
+    }
+
+    link = lookup(cache, epoch, fragment);
+    if (*link) {
+        remove_entry(cache, link);
+        cache->invalidations++;
+    }
+}
+
+void tsdb_cache_destroy(tsdb_cache *cache) {
+    while (cache->tail) {
+        remove_entry(cache, lookup(cache, cache->tail->epoch, cache->tail->fragment));
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->num_buckets = 0;
+    cache->budget = 0;
+}
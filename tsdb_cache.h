@@ -0,0 +1,65 @@
+/*
+ * tsdb_cache.h
+ *
+ * LRU cache of decompressed epoch fragments keyed by (epoch, fragment).
+ * The cache keeps private copies of the fragments and accounts
+ * every byte it holds (data and bookkeeping) against a budget.
+ * A budget of 0 disables the cache, which is the default.
+ */
+
+#ifndef TSDB_CACHE_H_
+#define TSDB_CACHE_H_
+
+#include <sys/types.h>
+
+typedef struct tsdb_cache_entry {
+    u_int32_t epoch;
+    u_int32_t fragment;
+    u_int8_t *data;
+    u_int32_t data_len;
+    struct tsdb_cache_entry *prev;  // LRU list, head is the most recently used
+    struct tsdb_cache_entry *next;
+    struct tsdb_cache_entry *hnext; // hash bucket chain
+} tsdb_cache_entry;
+
+typedef struct {
+    tsdb_cache_entry **buckets;
+    u_int32_t num_buckets;
+    u_int32_t num_entries;
+    tsdb_cache_entry *head;
+    tsdb_cache_entry *tail;
+    u_int64_t budget;               // bytes, 0 means the cache is disabled
+    u_int64_t used;                 // bytes
+    u_int64_t hits;
+    u_int64_t misses;
+    u_int64_t evictions;
+    u_int64_t invalidations;
+} tsdb_cache;
+
+/* Set the memory budget in bytes, evicting least recently used
+ * entries if the cache holds more. 0 disables and empties the cache. */
+void tsdb_cache_set_budget(tsdb_cache *cache, u_int64_t budget);
+
+/* Return the cached fragment or NULL. The pointer is valid until the next
+ * call changing the cache. Hits and misses are counted. */
+u_int8_t *tsdb_cache_get(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment,
+                         u_int32_t *data_len);
+
+/* Store a copy of the fragment, replacing an older one. Fragments larger
+ * than the budget are not cached. Returns 0 if stored, -1 otherwise. */
+int tsdb_cache_put(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment,
+                   const u_int8_t *data, u_int32_t data_len);
+
+/* Same as tsdb_cache_put(), the entry being data followed by extra_len
+ * bytes of extra, e.g. the validity bitmap of the fragment */
+int tsdb_cache_put_parts(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment,
+                         const u_int8_t *data, u_int32_t data_len,
+                         const u_int8_t *extra, u_int32_t extra_len);
+
+/* Drop the fragment from the cache, if present */
+void tsdb_cache_invalidate(tsdb_cache *cache, u_int32_t epoch, u_int32_t fragment);
+
+/* Release all memory held by the cache, counters are kept */
+void tsdb_cache_destroy(tsdb_cache *cache);
+
+#endif /* TSDB_CACHE_H_ */
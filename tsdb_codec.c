@@ -0,0 +1,847 @@
+/*
+ * tsdb_codec.c
+ *
+ * Delta-of-delta and XOR series codec, see tsdb_codec.h
+ *
+ * Codes of TSDB_SERIES_DOD, for the zigzag-encoded delta of deltas z:
+ *   0                 z == 0
+ *   10    + 7 bits    z < 2^7
+ *   110   + 9 bits    z < 2^9
+ *   1110  + 12 bits   z < 2^12
+ *   11110 + 32 bits   z < 2^32
+ *   11111 + 64 bits   otherwise
+ * TSDB_SERIES_CONST has no codes.
+ * Codes of TSDB_SERIES_XOR, for the XOR x with the previous value:
+ *   0                 x == 0
+ *   10 + bits         x fits into the window of the last XOR
+ *   11 + 6 bits of leading zeros + 6 bits of length - 1 + bits
+ */
+
+#include <string.h>
+
+#include "tsdb_codec.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FOR_SIMD 1 // see pick_simd()
+#include <immintrin.h>
+#endif
+
+#define SERIES_HEADER_LEN 5
+#define MAX_CODE_BITS 78 // 11 + 6 + 6 + 64 bits of an XOR opening a new window
+
+typedef struct {
+    u_int8_t *buf;                  // NULL to count bits only
+    u_int64_t bit;
+} bit_writer;
+
+static void put_bits(bit_writer *w, u_int64_t value, u_int32_t num_bits) {
+  /* Appends the num_bits (up to 64) low bits of value, most significant first */
+    u_int32_t room, take;
+
+    while (num_bits) {
+        room = 8 - (w->bit & 7);
+        take = (num_bits < room ? num_bits : room);
+        if (w->buf) {
+            if ((w->bit & 7) == 0) {
+                w->buf[w->bit >> 3] = 0;
+            }
+            w->buf[w->bit >> 3] |= ((value >> (num_bits - take)) & ((1u << take) - 1)) << (room - take);
+        }
+        w->bit += take;
+        num_bits -= take;
+    }
+}
+
+static int get_bits(tsdb_series_decoder *dec, u_int32_t num_bits, u_int64_t *value) {
+    u_int32_t room, take;
+    u_int64_t v = 0;
+
+    if (dec->bit + num_bits > dec->end_bit) {
+        return -1;
+    }
+
+    while (num_bits) {
+        room = 8 - (dec->bit & 7);
+        take = (num_bits < room ? num_bits : room);
+        v = (v << take) | ((dec->src[dec->bit >> 3] >> (room - take)) & ((1u << take) - 1));
+        dec->bit += take;
+        num_bits -= take;
+    }
+    *value = v;
+
+    return 0;
+}
+
+static u_int32_t leading_zeros(u_int64_t x) {
+    return __builtin_clzll(x);
+}
+
+static u_int32_t trailing_zeros(u_int64_t x) {
+    return __builtin_ctzll(x);
+}
+
+static void encode_dod(bit_writer *w, const u_int64_t *src, u_int32_t stride, u_int32_t num_values) {
+    u_int64_t prev = src[0], delta, prev_delta = 0, zigzag;
+    int64_t dod;
+    u_int32_t i;
+
+    put_bits(w, prev, 64);
+    for (i = 1; i < num_values; i++) {
+        delta = src[(u_int64_t)i * stride] - prev;
+        dod = (int64_t)(delta - prev_delta);
+        zigzag = ((u_int64_t)dod << 1) ^ (u_int64_t)(dod >> 63);
+
+        if (zigzag == 0) {
+            put_bits(w, 0, 1);
+        } else if (zigzag < (1ULL << 7)) {
+            put_bits(w, 2, 2), put_bits(w, zigzag, 7);
+        } else if (zigzag < (1ULL << 9)) {
+            put_bits(w, 6, 3), put_bits(w, zigzag, 9);
+        } else if (zigzag < (1ULL << 12)) {
+            put_bits(w, 14, 4), put_bits(w, zigzag, 12);
+        } else if (zigzag < (1ULL << 32)) {
+            put_bits(w, 30, 5), put_bits(w, zigzag, 32);
+        } else {
+            put_bits(w, 31, 5), put_bits(w, zigzag, 64);
+        }
+
+        prev = src[(u_int64_t)i * stride];
+        prev_delta = delta;
+    }
+}
+
+static void encode_xor(bit_writer *w, const u_int64_t *src, u_int32_t stride, u_int32_t num_values) {
+    u_int64_t prev = src[0], x;
+    u_int32_t i, leading, trailing, window_leading = 0, window_length = 0;
+
+    put_bits(w, prev, 64);
+    for (i = 1; i < num_values; i++) {
+        x = src[(u_int64_t)i * stride] ^ prev;
+        prev = src[(u_int64_t)i * stride];
+
+        if (x == 0) {
+            put_bits(w, 0, 1);
+            continue;
+        }
+
+        leading = leading_zeros(x);
+        trailing = trailing_zeros(x);
+        if (window_length && leading >= window_leading &&
+            trailing >= 64 - window_leading - window_length) {
+            put_bits(w, 2, 2);
+            put_bits(w, x >> (64 - window_leading - window_length), window_length);
+        } else {
+            window_leading = leading;
+            window_length = 64 - leading - trailing;
+            put_bits(w, 3, 2);
+            put_bits(w, window_leading, 6);
+            put_bits(w, window_length - 1, 6);
+            put_bits(w, x >> trailing, window_length);
+        }
+    }
+}
+
+u_int32_t tsdb_series_bound(u_int32_t num_values) {
+    return SERIES_HEADER_LEN + 8 + (u_int32_t)(((u_int64_t)num_values * MAX_CODE_BITS + 7) / 8);
+}
+
+u_int32_t tsdb_series_encode(const u_int64_t *src, u_int32_t stride,
+                             u_int32_t num_values, u_int8_t *dst) {
+    bit_writer w;
+    u_int64_t dod_bits;
+    u_int32_t i;
+
+    dst[1] = num_values, dst[2] = num_values >> 8, dst[3] = num_values >> 16, dst[4] = num_values >> 24;
+    if (num_values == 0) {
+        dst[0] = TSDB_SERIES_DOD;
+        return SERIES_HEADER_LEN;
+    }
+
+    for (i = 1; i < num_values && src[(u_int64_t)i * stride] == src[0]; i++);
+    if (i == num_values) {
+        dst[0] = TSDB_SERIES_CONST;
+        memset(&w, 0, sizeof(w));
+        w.buf = &dst[SERIES_HEADER_LEN];
+        put_bits(&w, src[0], 64);
+        return SERIES_HEADER_LEN + 8;
+    }
+
+    // counters are usually shorter as deltas of deltas, it is checked by counting bits only
+    memset(&w, 0, sizeof(w));
+    encode_dod(&w, src, stride, num_values);
+    dod_bits = w.bit;
+    encode_xor(&w, src, stride, num_values);
+    w.buf = &dst[SERIES_HEADER_LEN];
+
+    if (dod_bits <= w.bit - dod_bits) {
+        dst[0] = TSDB_SERIES_DOD;
+        w.bit = 0;
+        encode_dod(&w, src, stride, num_values);
+    } else {
+        dst[0] = TSDB_SERIES_XOR;
+        w.bit = 0;
+        encode_xor(&w, src, stride, num_values);
+    }
+
+    return SERIES_HEADER_LEN + (u_int32_t)((w.bit + 7) / 8);
+}
+
+int tsdb_series_start(tsdb_series_decoder *dec, const u_int8_t *src, u_int32_t len) {
+    memset(dec, 0, sizeof(tsdb_series_decoder));
+
+    if (len < SERIES_HEADER_LEN || src[0] < TSDB_SERIES_DOD || src[0] > TSDB_SERIES_CONST) {
+        return -1;
+    }
+
+    dec->mode = src[0];
+    dec->remaining = src[1] | ((u_int32_t)src[2] << 8) | ((u_int32_t)src[3] << 16) | ((u_int32_t)src[4] << 24);
+    dec->src = &src[SERIES_HEADER_LEN];
+    dec->end_bit = (u_int64_t)(len - SERIES_HEADER_LEN) * 8;
+
+    return 0;
+}
+
+static int next_dod(tsdb_series_decoder *dec) {
+    static const u_int8_t widths[] = { 0, 7, 9, 12, 32, 64 };
+    u_int64_t bit, zigzag = 0;
+    u_int32_t ones = 0;
+
+    // the number of leading ones selects the width
+    while (ones < 5) {
+        if (get_bits(dec, 1, &bit)) {
+            return -1;
+        }
+        if (bit == 0) {
+            break;
+        }
+        ones++;
+    }
+    if (ones && get_bits(dec, widths[ones], &zigzag)) {
+        return -1;
+    }
+
+    dec->delta += (zigzag >> 1) ^ (0 - (zigzag & 1));
+    dec->value += dec->delta;
+
+    return 0;
+}
+
+static int next_xor(tsdb_series_decoder *dec) {
+    u_int64_t bit, x, leading, length;
+
+    if (get_bits(dec, 1, &bit)) {
+        return -1;
+    }
+    if (bit == 0) {
+        return 0;
+    }
+
+    if (get_bits(dec, 1, &bit)) {
+        return -1;
+    }
+    if (bit) {
+        if (get_bits(dec, 6, &leading) || get_bits(dec, 6, &length) ||
+            leading + length + 1 > 64) {
+            return -1;
+        }
+        dec->leading = leading;
+        dec->length = length + 1;
+    } else if (dec->length == 0) {
+        return -1; // no window yet
+    }
+
+    if (get_bits(dec, dec->length, &x)) {
+        return -1;
+    }
+    dec->value ^= x << (64 - dec->leading - dec->length);
+
+    return 0;
+}
+
+int tsdb_series_next(tsdb_series_decoder *dec, u_int64_t *value) {
+    if (dec->remaining == 0) {
+        return -1;
+    }
+
+    if (!dec->started) {
+        if (get_bits(dec, 64, &dec->value)) {
+            return -1;
+        }
+        dec->started = 1;
+    } else if ((dec->mode == TSDB_SERIES_DOD && next_dod(dec)) ||
+               (dec->mode == TSDB_SERIES_XOR && next_xor(dec))) {
+        return -1;
+    }
+
+    dec->remaining--;
+    *value = dec->value;
+
+    return 0;
+}
+
+int tsdb_series_skip(tsdb_series_decoder *dec, u_int32_t count) {
+    u_int64_t value;
+
+    while (count--) {
+        if (tsdb_series_next(dec, &value)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static const char *fragment_codec_names[TSDB_NUM_FRAGMENT_CODECS] = {
+    "qlz", "raw", "rle", "for", "qlz3", "for+qlz"
+};
+
+const char *tsdb_fragment_codec_name(u_int8_t codec) {
+    return (codec < TSDB_NUM_FRAGMENT_CODECS ? fragment_codec_names[codec] : "unknown");
+}
+
+static void put_le(u_int8_t *dst, u_int64_t value, u_int32_t num_bytes) {
+    u_int32_t i;
+
+    for (i = 0; i < num_bytes; i++) {
+        dst[i] = value >> (8 * i);
+    }
+}
+
+static u_int64_t get_le(const u_int8_t *src, u_int32_t num_bytes) {
+    u_int64_t value = 0;
+    u_int32_t i;
+
+    for (i = 0; i < num_bytes; i++) {
+        value |= (u_int64_t)src[i] << (8 * i);
+    }
+    return value;
+}
+
+#define RUN_LEN 12 // count and value
+
+u_int32_t tsdb_rle_size(const u_int64_t *src, u_int32_t num_values, u_int32_t limit) {
+    u_int64_t len = 0;
+    u_int32_t i;
+
+    for (i = 0; i < num_values; i++) {
+        if (i == 0 || src[i] != src[i - 1]) {
+            len += RUN_LEN;
+            if (len > limit) {
+                return limit + 1;
+            }
+        }
+    }
+
+    return (u_int32_t)len;
+}
+
+u_int32_t tsdb_rle_encode(const u_int64_t *src, u_int32_t num_values, u_int8_t *dst) {
+    u_int32_t i, run, len = 0;
+
+    for (i = 0; i < num_values; i += run) {
+        for (run = 1; i + run < num_values && src[i + run] == src[i]; run++);
+        put_le(&dst[len], run, 4);
+        put_le(&dst[len + 4], src[i], 8);
+        len += RUN_LEN;
+    }
+
+    return len;
+}
+
+int tsdb_rle_decode(const u_int8_t *src, u_int32_t len, u_int64_t *dst, u_int32_t max_values) {
+    u_int64_t value;
+    u_int32_t pos, run, num_values = 0;
+
+    if (len % RUN_LEN) {
+        return -1;
+    }
+
+    for (pos = 0; pos < len; pos += RUN_LEN) {
+        run = get_le(&src[pos], 4);
+        value = get_le(&src[pos + 4], 8);
+        if (run == 0 || run > max_values - num_values) {
+            return -1;
+        }
+        while (run--) {
+            dst[num_values++] = value;
+        }
+    }
+
+    return num_values;
+}
+
+#define FOR_HEADER_LEN 4       // number of values
+#define FOR_BLOCK_HEADER_LEN 9 // minimum and bit width
+#define FOR_MAX_LOAD_WIDTH 56 // widest values unpacked with a single 64-bit load
+
+/* Frame of reference blocks are scanned for their minimum and maximum,
+ * and fragments for values other than the unknown one, with SSE4.2 or AVX2
+ * if the CPU has them, picked on first use. The values
+ * of a block are back to back in a little-endian bit stream, so value j
+ * starts at bit j * width of its stream and is unpacked on its own with a
+ * 64-bit load, unless it is wider than FOR_MAX_LOAD_WIDTH bits or too
+ * close to the end of the stream. */
+
+typedef void (*for_minmax_func)(const u_int64_t *src, u_int32_t count, u_int64_t *min, u_int64_t *max);
+
+static u_int64_t load_le64(const u_int8_t *src) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    u_int64_t value;
+
+    memcpy(&value, src, sizeof(value));
+    return value;
+#else
+    return get_le(src, 8);
+#endif
+}
+
+static u_int64_t for_value(const u_int8_t *stream, u_int32_t stream_len, u_int32_t width, u_int64_t j) {
+  /* Reads value j of width bits out of a block stream of stream_len bytes */
+    u_int64_t bit = j * width, value = 0;
+    u_int32_t part, take, shift, i;
+    u_int8_t bytes[8];
+
+    // at most 32 bits at once, as for encoding
+    for (part = 0; part < width; part += 32, bit += 32) {
+        take = (width - part > 32 ? 32 : width - part);
+        shift = bit & 7;
+        if ((bit >> 3) + 8 <= stream_len) {
+            value |= ((load_le64(&stream[bit >> 3]) >> shift) & ((1ULL << take) - 1)) << part;
+        } else {
+            memset(bytes, 0, sizeof(bytes));
+            for (i = 0; i < 8 && (bit >> 3) + i < stream_len; i++) {
+                bytes[i] = stream[(bit >> 3) + i];
+            }
+            value |= ((get_le(bytes, 8) >> shift) & ((1ULL << take) - 1)) << part;
+        }
+    }
+
+    return value;
+}
+
+static u_int32_t for_safe_count(u_int64_t stream_len, u_int32_t width, u_int32_t first, u_int32_t count) {
+  /* Number of values from first on, up to count, readable with a single
+   * 64-bit load within the stream */
+    u_int64_t last;
+
+    if (width == 0 || width > FOR_MAX_LOAD_WIDTH || stream_len < 8) {
+        return 0;
+    }
+    // values starting at or before byte stream_len - 8
+    last = ((stream_len - 8) * 8) / width;
+    if (last < first) {
+        return 0;
+    }
+
+    return (last - first + 1 < count ? last - first + 1 : count);
+}
+
+static void for_minmax_scalar(const u_int64_t *src, u_int32_t count, u_int64_t *min, u_int64_t *max) {
+    u_int32_t i;
+
+    *min = *max = src[0];
+    for (i = 1; i < count; i++) {
+        if (src[i] < *min) {
+            *min = src[i];
+        }
+        if (src[i] > *max) {
+            *max = src[i];
+        }
+    }
+}
+
+static u_int32_t for_unpack(const u_int8_t *stream, u_int32_t stream_len, u_int32_t width,
+                                   u_int64_t min, u_int32_t first, u_int32_t count, u_int64_t *dst) {
+  /* Writes values first to first + count - 1 of a block into dst, returns count */
+    // blocks may be 64 bits wide, a shift by 64 is undefined
+    u_int64_t mask = (width < 64 ? (1ULL << width) - 1 : ~0ULL), bit = (u_int64_t)first * width;
+    u_int32_t j = 0, safe = for_safe_count(stream_len, width, first, count);
+
+    for (; j < safe; j++, bit += width) {
+        dst[j] = min + ((load_le64(&stream[bit >> 3]) >> (bit & 7)) & mask);
+    }
+    for (; j < count; j++) {
+        dst[j] = min + for_value(stream, stream_len, width, first + j);
+    }
+
+    return count;
+}
+
+#ifdef FOR_SIMD
+/* Unsigned 64-bit comparisons are signed ones with the sign bits flipped */
+
+__attribute__((target("sse4.2")))
+static void for_minmax_sse42(const u_int64_t *src, u_int32_t count, u_int64_t *min, u_int64_t *max) {
+    const __m128i sign = _mm_set1_epi64x((long long)0x8000000000000000ULL);
+    __m128i lo, hi, v, gt;
+    u_int64_t lanes[2];
+    u_int32_t i;
+
+    if (count < 4) {
+        for_minmax_scalar(src, count, min, max);
+        return;
+    }
+
+    lo = hi = _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), sign);
+    for (i = 2; i + 2 <= count; i += 2) {
+        v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[i]), sign);
+        gt = _mm_cmpgt_epi64(lo, v);
+        lo = _mm_blendv_epi8(lo, v, gt);
+        gt = _mm_cmpgt_epi64(v, hi);
+        hi = _mm_blendv_epi8(hi, v, gt);
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(lo, sign));
+    *min = (lanes[0] < lanes[1] ? lanes[0] : lanes[1]);
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(hi, sign));
+    *max = (lanes[0] > lanes[1] ? lanes[0] : lanes[1]);
+    for (; i < count; i++) {
+        *min = (src[i] < *min ? src[i] : *min);
+        *max = (src[i] > *max ? src[i] : *max);
+    }
+}
+
+__attribute__((target("avx2")))
+static void for_minmax_avx2(const u_int64_t *src, u_int32_t count, u_int64_t *min, u_int64_t *max) {
+    const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    __m256i lo, hi, v, gt;
+    u_int64_t lanes[4];
+    u_int32_t i, k;
+
+    if (count < 8) {
+        for_minmax_scalar(src, count, min, max);
+        return;
+    }
+
+    lo = hi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)src), sign);
+    for (i = 4; i + 4 <= count; i += 4) {
+        v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[i]), sign);
+        gt = _mm256_cmpgt_epi64(lo, v);
+        lo = _mm256_blendv_epi8(lo, v, gt);
+        gt = _mm256_cmpgt_epi64(v, hi);
+        hi = _mm256_blendv_epi8(hi, v, gt);
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_xor_si256(lo, sign));
+    for (*min = lanes[0], k = 1; k < 4; k++) {
+        *min = (lanes[k] < *min ? lanes[k] : *min);
+    }
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_xor_si256(hi, sign));
+    for (*max = lanes[0], k = 1; k < 4; k++) {
+        *max = (lanes[k] > *max ? lanes[k] : *max);
+    }
+    for (; i < count; i++) {
+        *min = (src[i] < *min ? src[i] : *min);
+        *max = (src[i] > *max ? src[i] : *max);
+    }
+}
+#endif
+
+typedef int (*all_equal_func)(const u_int64_t *src, u_int32_t num_values, u_int64_t value);
+
+static int all_equal_scalar(const u_int64_t *src, u_int32_t num_values, u_int64_t value) {
+    u_int64_t diff = 0;
+    u_int32_t i;
+
+    for (i = 0; i < num_values; i++) {
+        diff |= src[i] ^ value;
+    }
+
+    return (diff == 0);
+}
+
+#ifdef FOR_SIMD
+/* Differences are gathered over ALL_EQUAL_STRIDE values before testing them */
+#define ALL_EQUAL_STRIDE 64
+
+__attribute__((target("sse4.2")))
+static int all_equal_sse42(const u_int64_t *src, u_int32_t num_values, u_int64_t value) {
+    const __m128i pattern = _mm_set1_epi64x((long long)value);
+    __m128i diff;
+    u_int32_t i = 0, j;
+
+    for (; i + ALL_EQUAL_STRIDE <= num_values; i += ALL_EQUAL_STRIDE) {
+        diff = _mm_setzero_si128();
+        for (j = 0; j < ALL_EQUAL_STRIDE; j += 2) {
+            diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[i + j]), pattern));
+        }
+        if (!_mm_testz_si128(diff, diff)) {
+            return 0;
+        }
+    }
+
+    return all_equal_scalar(&src[i], num_values - i, value);
+}
+
+__attribute__((target("avx2")))
+static int all_equal_avx2(const u_int64_t *src, u_int32_t num_values, u_int64_t value) {
+    const __m256i pattern = _mm256_set1_epi64x((long long)value);
+    __m256i diff;
+    u_int32_t i = 0, j;
+
+    for (; i + ALL_EQUAL_STRIDE <= num_values; i += ALL_EQUAL_STRIDE) {
+        diff = _mm256_setzero_si256();
+        for (j = 0; j < ALL_EQUAL_STRIDE; j += 4) {
+            diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[i + j]), pattern));
+        }
+        if (!_mm256_testz_si256(diff, diff)) {
+            return 0;
+        }
+    }
+
+    return all_equal_scalar(&src[i], num_values - i, value);
+}
+#endif
+
+static for_minmax_func for_minmax;
+static all_equal_func all_equal;
+
+static void pick_simd(void) {
+  /* Races are harmless, all threads pick the same functions */
+    for_minmax_func minmax = for_minmax_scalar;
+    all_equal_func equal = all_equal_scalar;
+
+#ifdef FOR_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        minmax = for_minmax_avx2;
+        equal = all_equal_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        minmax = for_minmax_sse42;
+        equal = all_equal_sse42;
+    }
+#endif
+
+    all_equal = equal;
+    for_minmax = minmax;
+}
+
+int tsdb_all_equal(const u_int64_t *src, u_int32_t num_values, u_int64_t value) {
+    if (all_equal == NULL) {
+        pick_simd();
+    }
+
+    return all_equal(src, num_values, value);
+}
+
+static u_int32_t for_block_width(const u_int64_t *src, u_int32_t count, u_int64_t *min) {
+    u_int64_t max;
+
+    if (for_minmax == NULL) {
+        pick_simd();
+    }
+    for_minmax(src, count, min, &max);
+
+    return (max == *min ? 0 : 64 - leading_zeros(max - *min));
+}
+
+u_int32_t tsdb_for_size(const u_int64_t *src, u_int32_t num_values) {
+    u_int64_t min, len = FOR_HEADER_LEN;
+    u_int32_t i, count, width;
+
+    for (i = 0; i < num_values; i += count) {
+        count = (num_values - i < TSDB_FOR_BLOCK ? num_values - i : TSDB_FOR_BLOCK);
+        width = for_block_width(&src[i], count, &min);
+        len += FOR_BLOCK_HEADER_LEN + ((u_int64_t)count * width + 7) / 8;
+    }
+
+    return (u_int32_t)len;
+}
+
+u_int32_t tsdb_for_encode(const u_int64_t *src, u_int32_t num_values, u_int8_t *dst) {
+    u_int64_t min, acc, delta;
+    u_int32_t i, j, count, width, bits, len = FOR_HEADER_LEN;
+
+    put_le(dst, num_values, 4);
+    for (i = 0; i < num_values; i += count) {
+        count = (num_values - i < TSDB_FOR_BLOCK ? num_values - i : TSDB_FOR_BLOCK);
+        width = for_block_width(&src[i], count, &min);
+        put_le(&dst[len], min, 8);
+        dst[len + 8] = width;
+        len += FOR_BLOCK_HEADER_LEN;
+
+        // little-endian bit stream, values are split into halves to keep the accumulator within 64 bits
+        acc = 0, bits = 0;
+        for (j = 0; j < count && width; j++) {
+            delta = src[i + j] - min;
+            acc |= (width > 32 ? delta & 0xFFFFFFFFULL : delta) << bits;
+            bits += (width > 32 ? 32 : width);
+            if (width > 32) {
+                for (; bits >= 8; bits -= 8, acc >>= 8) {
+                    dst[len++] = acc;
+                }
+                acc |= (delta >> 32) << bits;
+                bits += width - 32;
+            }
+            for (; bits >= 8; bits -= 8, acc >>= 8) {
+                dst[len++] = acc;
+            }
+        }
+        if (bits) {
+            dst[len++] = acc;
+        }
+    }
+
+    return len;
+}
+
+static int for_walk(const u_int8_t *src, u_int32_t len, u_int32_t first, u_int32_t count,
+                    u_int64_t *dst, u_int32_t max_values) {
+  /* Unpacks values first to first + count - 1, count being capped at the
+   * number of values, skipping the blocks before them by their headers.
+   * Returns the number of values in src, -1 if it is malformed or has more
+   * than max_values values */
+    u_int64_t min, stream_len;
+    u_int32_t i, j, block_count, width, pos = FOR_HEADER_LEN, num_values;
+
+    if (len < FOR_HEADER_LEN) {
+        return -1;
+    }
+    num_values = get_le(src, 4);
+    if (num_values > max_values) {
+        return -1;
+    }
+
+    for (i = 0; i < num_values; i += block_count) {
+        block_count = (num_values - i < TSDB_FOR_BLOCK ? num_values - i : TSDB_FOR_BLOCK);
+        if (pos + FOR_BLOCK_HEADER_LEN > len) {
+            return -1;
+        }
+        min = get_le(&src[pos], 8);
+        width = src[pos + 8];
+        pos += FOR_BLOCK_HEADER_LEN;
+        stream_len = ((u_int64_t)block_count * width + 7) / 8;
+        if (width > 64 || pos + stream_len > len) {
+            return -1;
+        }
+
+        if (count && first < i + block_count) {
+            j = (first > i ? first - i : 0);
+            j = (block_count - j < count ? block_count - j : count);
+            for_unpack(&src[pos], stream_len, width, min, (first > i ? first - i : 0), j, dst);
+            dst += j;
+            first += j;
+            count -= j;
+        }
+        pos += stream_len;
+    }
+
+    return (pos == len ? (int)num_values : -1);
+}
+
+int tsdb_for_decode(const u_int8_t *src, u_int32_t len, u_int64_t *dst, u_int32_t max_values) {
+    return for_walk(src, len, 0, max_values, dst, max_values);
+}
+
+int tsdb_for_get(const u_int8_t *src, u_int32_t len, u_int32_t first, u_int32_t count, u_int64_t *dst) {
+    int num_values = for_walk(src, len, first, count, dst, 0xFFFFFFFF);
+
+    if (num_values < 0 || (u_int64_t)first + count > (u_int32_t)num_values) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Validity bitmaps are either stored as they are or as the lengths of the
+ * alternating runs of set and clear bits, starting with set ones, each a
+ * little-endian base 128 varint. Indexes are mostly set or missing in long
+ * stretches, a handful of runs then stand for thousands of bits. */
+
+#define BITS_RAW 0
+#define BITS_RUNS 1
+
+static u_int32_t bit_run(const u_int32_t *bits, u_int32_t first, u_int32_t num_bits, u_int32_t set) {
+  /* Length of the run of bits equal to set starting at first */
+    u_int32_t i = first, word;
+
+    while (i < num_bits) {
+        word = (set ? ~bits[i / 32] : bits[i / 32]) >> (i % 32);
+        if (word) {
+            i += trailing_zeros(word);
+            break;
+        }
+        i += 32 - i % 32;
+    }
+
+    return (i < num_bits ? i : num_bits) - first;
+}
+
+u_int32_t tsdb_bits_encode(const u_int32_t *bits, u_int32_t num_bits, u_int8_t *dst) {
+    u_int32_t i, run, len = 1, raw_len = (num_bits + 7) / 8, set = 1;
+
+    dst[0] = BITS_RUNS;
+    for (i = 0; i < num_bits && len <= raw_len; set = !set) {
+        run = bit_run(bits, i, num_bits, set);
+        i += run;
+        for (; run >= 0x80; run >>= 7) {
+            dst[len++] = 0x80 | (run & 0x7F);
+        }
+        dst[len++] = run;
+    }
+    if (len <= raw_len) {
+        return len;
+    }
+
+    dst[0] = BITS_RAW;
+    for (i = 0; i < raw_len; i++) {
+        dst[1 + i] = bits[i / 4] >> (8 * (i % 4));
+    }
+
+    return 1 + raw_len;
+}
+
+int tsdb_bits_decode(const u_int8_t *src, u_int32_t len, u_int32_t *bits, u_int32_t num_bits) {
+    u_int32_t i, pos, run, shift, end = 0, set = 1;
+
+    memset(bits, 0, (num_bits + 31) / 32 * sizeof(u_int32_t));
+    if (len == 0) {
+        return -1;
+    }
+
+    if (src[0] == BITS_RAW) {
+        if (len != 1 + (num_bits + 7) / 8) {
+            return -1;
+        }
+        for (i = 0; i < num_bits; i++) {
+            bits[i / 32] |= (u_int32_t)((src[1 + i / 8] >> (i % 8)) & 1) << (i % 32);
+        }
+        return 0;
+    }
+    if (src[0] != BITS_RUNS) {
+        return -1;
+    }
+
+    for (pos = 1; pos < len; set = !set) {
+        for (run = 0, shift = 0; ; shift += 7) {
+            if (pos == len || shift > 28) {
+                return -1;
+            }
+            run |= (u_int32_t)(src[pos] & 0x7F) << shift;
+            if ((src[pos++] & 0x80) == 0) {
+                break;
+            }
+        }
+        if (run > num_bits - end) {
+            return -1;
+        }
+        for (i = end, end += run; set && i < end; i++) {
+            bits[i / 32] |= 1U << (i % 32);
+        }
+    }
+
+    return (end == num_bits ? 0 : -1);
+}
+
+u_int32_t tsdb_bits_count(const u_int32_t *bits, u_int32_t num_bits) {
+    u_int32_t i, count = 0;
+
+    for (i = 0; i < num_bits / 32; i++) {
+        count += __builtin_popcount(bits[i]);
+    }
+    if (num_bits % 32) {
+        count += __builtin_popcount(bits[i] & ((1U << (num_bits % 32)) - 1));
+    }
+
+    return count;
+}
@@ -0,0 +1,129 @@
+/*
+ * tsdb_codec.h
+ *
+ * Time-series codec for values stored per series over time, in the spirit
+ * of Gorilla: integer counters are stored as deltas of deltas, anything
+ * else as the XOR with the previous value, whichever is shorter, and
+ * constant series (unknown values mostly) as their first value only. The
+ * output is bit-packed and decoded value by value.
+ *
+ * A series is a mode byte, the number of values (4 bytes, little-endian),
+ * the first value in 64 bits and one variable-length code per further
+ * value. Series start on byte boundaries, so a block of several series
+ * can be entered at any of them given their offsets.
+ *
+ * Fragments of an epoch are encoded with one of the TSDB_FRAGMENT_ codecs,
+ * picked per fragment when it is flushed. Those which need no QuickLZ are
+ * here: runs of equal values are a 4-byte count and the value each, frame
+ * of reference bit-packing is the number of values (4 bytes) followed by
+ * blocks of TSDB_FOR_BLOCK values, each being their minimum in 64 bits,
+ * the bit width of their differences with it and the packed differences,
+ * so that a single value is found by skipping the blocks before it. Blocks
+ * are scanned with SSE4.2 or AVX2 where available. All fields
+ * are little-endian.
+ *
+ * Validity bitmaps of fragments, telling the indexes set from missing
+ * ones, are stored raw or as the lengths of their runs of set and clear
+ * bits, whichever is shorter.
+ */
+
+#ifndef TSDB_CODEC_H_
+#define TSDB_CODEC_H_
+
+#include <sys/types.h>
+
+#define TSDB_CODEC_QLZ 0    // QuickLZ over the whole record
+#define TSDB_CODEC_SERIES 1 // one tsdb_series_encode() series per value over time
+
+#define TSDB_FRAGMENT_QLZ 0 // QuickLZ level 1, the codec of all fragments before codecs were picked
+#define TSDB_FRAGMENT_RAW 1 // the values as they are
+#define TSDB_FRAGMENT_RLE 2 // runs of equal values, constant fragments are a single run
+#define TSDB_FRAGMENT_FOR 3 // frame of reference bit-packing
+#define TSDB_FRAGMENT_QLZ3 4 // QuickLZ level 3, see quicklz3.h
+#define TSDB_FRAGMENT_FOR_QLZ 5 // frame of reference bit-packing compressed with QuickLZ level 1
+#define TSDB_NUM_FRAGMENT_CODECS 6
+
+#define TSDB_FOR_BLOCK 128  // values per frame of reference
+#define TSDB_BITS_BOUND(num_bits) (6 + ((num_bits) + 7) / 8) // longest tsdb_bits_encode() output
+
+#define TSDB_SERIES_DOD 1   // modes of a series
+#define TSDB_SERIES_XOR 2
+#define TSDB_SERIES_CONST 3 // all values equal to the first one, no codes follow
+
+typedef struct {
+    const u_int8_t *src;
+    u_int64_t bit;                  // next bit to read
+    u_int64_t end_bit;
+    u_int8_t mode;
+    u_int32_t remaining;            // values left to decode
+    u_int8_t started;               // set once the first value was returned
+    u_int64_t value;                // last value decoded
+    u_int64_t delta;                // last delta, TSDB_SERIES_DOD
+    u_int8_t leading;               // bit window of the last XOR, TSDB_SERIES_XOR
+    u_int8_t length;
+} tsdb_series_decoder;
+
+/* Upper bound of the encoded length of num_values values */
+u_int32_t tsdb_series_bound(u_int32_t num_values);
+
+/* Encode num_values values, stride values apart in src, into dst.
+ * Returns the encoded length in bytes */
+u_int32_t tsdb_series_encode(const u_int64_t *src, u_int32_t stride,
+                             u_int32_t num_values, u_int8_t *dst);
+
+/* Start decoding the series of len bytes at src.
+ * Returns 0 on success, -1 if it is malformed */
+int tsdb_series_start(tsdb_series_decoder *dec, const u_int8_t *src, u_int32_t len);
+
+/* Decode the next value. Returns 0 on success, -1 past the last value
+ * or if the series is truncated */
+int tsdb_series_next(tsdb_series_decoder *dec, u_int64_t *value);
+
+/* Skip count values. Returns 0 on success, -1 if there are fewer */
+int tsdb_series_skip(tsdb_series_decoder *dec, u_int32_t count);
+
+/* Returns 1 if all num_values values at src equal value, else 0 */
+int tsdb_all_equal(const u_int64_t *src, u_int32_t num_values, u_int64_t value);
+
+/* Name of a TSDB_FRAGMENT_ codec */
+const char *tsdb_fragment_codec_name(u_int8_t codec);
+
+/* Encoded length of num_values values as runs, or limit + 1 if it exceeds
+ * limit, which stops counting early */
+u_int32_t tsdb_rle_size(const u_int64_t *src, u_int32_t num_values, u_int32_t limit);
+
+/* Encode num_values values as runs into dst. Returns the encoded length */
+u_int32_t tsdb_rle_encode(const u_int64_t *src, u_int32_t num_values, u_int8_t *dst);
+
+/* Decode the runs of len bytes at src into dst, up to max_values values.
+ * Returns the number of values, -1 if the runs are malformed or too long */
+int tsdb_rle_decode(const u_int8_t *src, u_int32_t len, u_int64_t *dst, u_int32_t max_values);
+
+/* Encoded length of num_values values with frame of reference bit-packing */
+u_int32_t tsdb_for_size(const u_int64_t *src, u_int32_t num_values);
+
+/* Encode num_values values with frame of reference bit-packing into dst.
+ * Returns the encoded length */
+u_int32_t tsdb_for_encode(const u_int64_t *src, u_int32_t num_values, u_int8_t *dst);
+
+/* Decode the len bytes at src into dst, up to max_values values.
+ * Returns the number of values, -1 if they are malformed or too many */
+int tsdb_for_decode(const u_int8_t *src, u_int32_t len, u_int64_t *dst, u_int32_t max_values);
+
+/* Decode values first to first + count - 1 of the len bytes at src into
+ * dst, unpacking the blocks holding them only.
+ * Returns 0 on success, -1 if they are malformed or have fewer values */
+int tsdb_for_get(const u_int8_t *src, u_int32_t len, u_int32_t first, u_int32_t count, u_int64_t *dst);
+
+/* Encode the first num_bits bits of the bitmap bits into dst.
+ * Returns the encoded length */
+u_int32_t tsdb_bits_encode(const u_int32_t *bits, u_int32_t num_bits, u_int8_t *dst);
+
+/* Decode the len bytes at src into the num_bits bits of bits.
+ * Returns 0 on success, -1 if they are malformed or of another length */
+int tsdb_bits_decode(const u_int8_t *src, u_int32_t len, u_int32_t *bits, u_int32_t num_bits);
+
+/* Number of bits set among the first num_bits bits of bits */
+u_int32_t tsdb_bits_count(const u_int32_t *bits, u_int32_t num_bits);
+
+#endif /* TSDB_CODEC_H_ */
@@ -0,0 +1,104 @@
+/*
+ * tsdb_keymap.c
+ *
+ * Key to index hash table with linear probing, see tsdb_keymap.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdb_keymap.h"
+
+#define KEYMAP_MIN_SLOTS 1024
+
+static u_int32_t hash_of(const char *key) {
+    u_int32_t hash = 2166136261u; // FNV-1a
+
+    while (*key) {
+        hash = (hash ^ (u_int8_t)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+static tsdb_keymap_slot *lookup(tsdb_keymap *map, const char *key, u_int32_t hash) {
+  /* Returns the slot holding the key, or the empty slot it would go to */
+    u_int32_t mask = map->num_slots - 1, i = hash & mask;
+
+    while (map->slots[i].key &&
+           (map->slots[i].hash != hash || strcmp(map->slots[i].key, key) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &map->slots[i];
+}
+
+static int grow(tsdb_keymap *map) {
+    tsdb_keymap_slot *old_slots = map->slots, *slot;
+    u_int32_t old_num = map->num_slots, i;
+    u_int32_t num_slots = old_num ? old_num * 2 : KEYMAP_MIN_SLOTS;
+
+    map->slots = (tsdb_keymap_slot *) calloc(num_slots, sizeof(tsdb_keymap_slot));
+    if (map->slots == NULL) {
+        map->slots = old_slots;
+        return -1;
+    }
+
+    map->num_slots = num_slots;
+    for (i = 0; i < old_num; i++) {
+        if (old_slots[i].key) {
+            slot = lookup(map, old_slots[i].key, old_slots[i].hash);
+            *slot = old_slots[i];
+        }
+    }
+    free(old_slots);
+
+    return 0;
+}
+
+int tsdb_keymap_get(tsdb_keymap *map, const char *key, u_int32_t *index) {
+    tsdb_keymap_slot *slot;
+
+    if (map->num_entries == 0) {
+        return -1;
+    }
+
+    slot = lookup(map, key, hash_of(key));
+    if (slot->key == NULL) {
+        return -1;
+    }
+
+    *index = slot->index;
+    return 0;
+}
+
+int tsdb_keymap_put(tsdb_keymap *map, const char *key, u_int32_t index) {
+    tsdb_keymap_slot *slot;
+    u_int32_t hash = hash_of(key);
+
+    // keep the load factor under 3/4
+    if (4 * (u_int64_t)(map->num_entries + 1) > 3 * (u_int64_t)map->num_slots && grow(map)) {
+        return -1;
+    }
+
+    slot = lookup(map, key, hash);
+    if (slot->key == NULL) {
+        slot->key = strdup(key);
+        if (slot->key == NULL) {
+            return -1;
+        }
+        slot->hash = hash;
+        map->num_entries++;
+    }
+    slot->index = index;
+
+    return 0;
+}
+
+void tsdb_keymap_destroy(tsdb_keymap *map) {
+    u_int32_t i;
+
+    for (i = 0; i < map->num_slots; i++) {
+        free(map->slots[i].key);
+    }
+    free(map->slots);
+    memset(map, 0, sizeof(tsdb_keymap));
+}
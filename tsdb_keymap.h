@@ -0,0 +1,35 @@
+/*
+ * tsdb_keymap.h
+ *
+ * Open addressing hash table mapping metric keys to their indexes.
+ * Mappings never change once assigned, so the table only grows.
+ * Keys are copied into the table.
+ */
+
+#ifndef TSDB_KEYMAP_H_
+#define TSDB_KEYMAP_H_
+
+#include <sys/types.h>
+
+typedef struct {
+    char *key;                      // NULL for an empty slot
+    u_int32_t hash;
+    u_int32_t index;
+} tsdb_keymap_slot;
+
+typedef struct {
+    tsdb_keymap_slot *slots;
+    u_int32_t num_slots;            // power of two
+    u_int32_t num_entries;
+} tsdb_keymap;
+
+/* Look the key up. Returns 0 and sets *index if found, -1 otherwise */
+int tsdb_keymap_get(tsdb_keymap *map, const char *key, u_int32_t *index);
+
+/* Add the key or update its index. Returns 0 on success, -1 if out of memory */
+int tsdb_keymap_put(tsdb_keymap *map, const char *key, u_int32_t index);
+
+/* Release all memory held by the table */
+void tsdb_keymap_destroy(tsdb_keymap *map);
+
+#endif /* TSDB_KEYMAP_H_ */
@@ -0,0 +1,140 @@
+/*
+ * tsdb_pool.c
+ *
+ * Worker threads for batches of independent jobs, see tsdb_pool.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdb_pool.h"
+
+typedef struct {
+    tsdb_pool *pool;
+    u_int32_t worker;
+} worker_arg;
+
+static void run_jobs_locked(tsdb_pool *pool, u_int32_t worker) {
+  /* Takes jobs of the current batch until none is left.
+   * Called and returns with pool->lock held */
+    while (pool->next_job < pool->num_jobs) {
+        tsdb_job_func func = pool->func;
+        void *job = &pool->jobs[pool->next_job++ * pool->job_size];
+
+        pthread_mutex_unlock(&pool->lock);
+        func(job, worker);
+        pthread_mutex_lock(&pool->lock);
+
+        if (++pool->done_jobs == pool->num_jobs) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+}
+
+static void *worker_main(void *data) {
+    worker_arg arg = *(worker_arg *)data;
+    tsdb_pool *pool = arg.pool;
+
+    free(data);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown) {
+        if (pool->next_job < pool->num_jobs) {
+            run_jobs_locked(pool, arg.worker);
+        } else {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int tsdb_pool_init(tsdb_pool *pool, u_int32_t num_workers) {
+    u_int32_t i;
+
+    memset(pool, 0, sizeof(tsdb_pool));
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+
+    pool->threads = (pthread_t *) calloc(num_workers, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->num_workers = 1;
+    for (i = 1; i < num_workers; i++) {
+        worker_arg *arg = (worker_arg *) malloc(sizeof(worker_arg));
+
+        if (arg == NULL) {
+            tsdb_pool_destroy(pool);
+            return -1;
+        }
+        arg->pool = pool;
+        arg->worker = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, arg)) {
+            free(arg);
+            tsdb_pool_destroy(pool);
+            return -1;
+        }
+        pool->num_workers++;
+    }
+
+    return 0;
+}
+
+void tsdb_pool_run(tsdb_pool *pool, tsdb_job_func func,
+                   void *jobs, size_t job_size, u_int32_t num_jobs) {
+    if (num_jobs == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->run_lock);
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->jobs = (u_int8_t *) jobs;
+    pool->job_size = job_size;
+    pool->num_jobs = num_jobs;
+    pool->next_job = 0;
+    pool->done_jobs = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+
+    run_jobs_locked(pool, 0);
+    while (pool->done_jobs < pool->num_jobs) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+
+    pool->num_jobs = pool->next_job = pool->done_jobs = 0;
+    pool->jobs = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+void tsdb_pool_destroy(tsdb_pool *pool) {
+    u_int32_t i;
+
+    if (pool->threads == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    memset(pool, 0, sizeof(tsdb_pool));
+}
@@ -0,0 +1,48 @@
+/*
+ * tsdb_pool.h
+ *
+ * Minimal pool of worker threads running batches of independent jobs.
+ * The thread submitting a batch takes part in it as worker 0 and
+ * returns once every job of the batch is done, so the helper threads
+ * (workers 1..num_workers-1) are the only extra concurrency.
+ * A worker id is passed to every job, which lets callers keep
+ * per-worker scratch state (e.g. QuickLZ states) without locking.
+ * Batches submitted from different threads run one after another.
+ */
+
+#ifndef TSDB_POOL_H_
+#define TSDB_POOL_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+typedef void (*tsdb_job_func)(void *job, u_int32_t worker);
+
+typedef struct {
+    pthread_t *threads;
+    u_int32_t num_workers;          // including the submitting thread
+    pthread_mutex_t run_lock;       // held by the thread submitting the current batch
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;       // signalled when a batch is submitted
+    pthread_cond_t done_cond;       // signalled when the last job of a batch is done
+    tsdb_job_func func;
+    u_int8_t *jobs;
+    size_t job_size;
+    u_int32_t num_jobs;
+    u_int32_t next_job;
+    u_int32_t done_jobs;
+    u_int8_t shutdown;
+} tsdb_pool;
+
+/* Start num_workers - 1 helper threads. Returns 0 on success, -1 otherwise */
+int tsdb_pool_init(tsdb_pool *pool, u_int32_t num_workers);
+
+/* Run func on each of the num_jobs jobs laid out job_size bytes apart
+ * starting at jobs, and wait until all of them are done */
+void tsdb_pool_run(tsdb_pool *pool, tsdb_job_func func,
+                   void *jobs, size_t job_size, u_int32_t num_jobs);
+
+/* Stop and join the helper threads */
+void tsdb_pool_destroy(tsdb_pool *pool);
+
+#endif /* TSDB_POOL_H_ */
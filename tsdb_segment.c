@@ -0,0 +1,180 @@
+/*
+ * tsdb_segment.c
+ *
+ * Records of cold segments, see tsdb_segment.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdb_segment.h"
+#include "tsdb_codec.h"
+#include "tsdb_trace.h"
+
+#define QLZ_PADDING 400 //QuickLZ output exceeds its input by less than this
+
+static u_int32_t slice_len(u_int16_t values_per_entry) {
+    return SEGMENT_SERIES * SEGMENT_EPOCHS * values_per_entry * sizeof(u_int64_t);
+}
+
+static u_int32_t header_len(const u_int8_t *record, u_int32_t record_len) {
+  /* Length of the codec and validity bitmap of a record, 0 if they are malformed */
+    u_int32_t len;
+
+    if (record_len < 1) {
+        return 0;
+    }
+    if (!(record[0] & TSDB_SLICE_VALID)) {
+        return 1;
+    }
+    if (record_len < 3) {
+        return 0;
+    }
+    len = 3 + (record[1] | ((u_int32_t)record[2] << 8));
+
+    return (len <= record_len ? len : 0);
+}
+
+u_int32_t tsdb_segment_key(u_int32_t fragment, u_int32_t slice,
+                           u_int32_t segment, char *key) {
+    u_int8_t *ptr = (u_int8_t *)key;
+
+    ptr[0] = 1;
+    ptr[1] = fragment >> 24, ptr[2] = fragment >> 16, ptr[3] = fragment >> 8, ptr[4] = fragment;
+    ptr[5] = slice >> 8, ptr[6] = slice;
+    ptr[7] = segment >> 24, ptr[8] = segment >> 16, ptr[9] = segment >> 8, ptr[10] = segment;
+
+    return SEGMENT_KEY_LEN;
+}
+
+int tsdb_segment_parse_key(const void *key, u_int32_t key_len, u_int32_t *fragment,
+                           u_int32_t *slice, u_int32_t *segment) {
+    const u_int8_t *ptr = (const u_int8_t *)key;
+
+    if (key_len != SEGMENT_KEY_LEN || ptr[0] != 1) {
+        return -1;
+    }
+
+    *fragment = ((u_int32_t)ptr[1] << 24) | ((u_int32_t)ptr[2] << 16) | ((u_int32_t)ptr[3] << 8) | ptr[4];
+    *slice = ((u_int32_t)ptr[5] << 8) | ptr[6];
+    *segment = ((u_int32_t)ptr[7] << 24) | ((u_int32_t)ptr[8] << 16) | ((u_int32_t)ptr[9] << 8) | ptr[10];
+
+    return 0;
+}
+
+u_int32_t tsdb_slice_bound(u_int16_t values_per_entry) {
+    u_int32_t num_series = SEGMENT_SERIES * values_per_entry;
+    u_int32_t max_header_len = 3 + TSDB_BITS_BOUND(TSDB_SLICE_BITS);
+    u_int32_t qlz_len = max_header_len + slice_len(values_per_entry) + QLZ_PADDING;
+    u_int32_t series_len = max_header_len + (num_series + 1) * sizeof(u_int32_t) +
+                           num_series * tsdb_series_bound(SEGMENT_EPOCHS);
+
+    return (qlz_len > series_len ? qlz_len : series_len);
+}
+
+u_int32_t tsdb_slice_encode(u_int8_t codec, u_int16_t values_per_entry,
+                            const u_int8_t *columns, const u_int32_t *valid,
+                            u_int8_t *dst, qlz_state_compress *state) {
+    const u_int64_t *values = (const u_int64_t *)columns;
+    u_int32_t i, series, len, head_len = 1, num_series = SEGMENT_SERIES * values_per_entry;
+    u_int8_t flags = 0;
+
+    for (i = 0; i < TSDB_SLICE_WORDS && valid[i] == 0xFFFFFFFF; i++);
+    if (i < TSDB_SLICE_WORDS) {
+        len = tsdb_bits_encode(valid, TSDB_SLICE_BITS, &dst[3]);
+        dst[1] = len & 0xFF;
+        dst[2] = len >> 8;
+        head_len += 2 + len;
+        flags = TSDB_SLICE_VALID;
+    }
+
+    if (codec != TSDB_CODEC_SERIES) {
+        dst[0] = TSDB_CODEC_QLZ | flags;
+        return head_len + qlz_compress(columns, (char *)&dst[head_len],
+                                       slice_len(values_per_entry), state);
+    }
+
+    // the series of an index are its values_per_entry values over the epochs, interleaved in columns
+    dst[0] = TSDB_CODEC_SERIES | flags;
+    len = head_len + (num_series + 1) * sizeof(u_int32_t);
+    for (series = 0; series < num_series; series++) {
+        memcpy(&dst[head_len + series * sizeof(u_int32_t)], &len, sizeof(len));
+        len += tsdb_series_encode(&values[(u_int64_t)(series / values_per_entry) * SEGMENT_EPOCHS *
+                                          values_per_entry + series % values_per_entry],
+                                  values_per_entry, SEGMENT_EPOCHS, &dst[len]);
+    }
+    memcpy(&dst[head_len + num_series * sizeof(u_int32_t)], &len, sizeof(len));
+
+    return len;
+}
+
+int tsdb_slice_open(u_int16_t values_per_entry, const u_int8_t *record,
+                    u_int32_t record_len, u_int8_t *buffer, u_int32_t *valid,
+                    qlz_state_decompress *state) {
+    u_int32_t num_series = SEGMENT_SERIES * values_per_entry, end;
+    u_int32_t head_len = header_len(record, record_len);
+    u_int8_t codec = (record_len ? record[0] & ~TSDB_SLICE_VALID : 0);
+
+    if (head_len == 1) {
+        memset(valid, 0xFF, TSDB_SLICE_WORDS * sizeof(u_int32_t));
+    } else if (head_len && tsdb_bits_decode(&record[3], head_len - 3, valid, TSDB_SLICE_BITS)) {
+        head_len = 0;
+    }
+
+    if (head_len && record_len > head_len && codec == TSDB_CODEC_QLZ &&
+        qlz_size_decompressed((const char *)&record[head_len]) == slice_len(values_per_entry)) {
+        qlz_decompress((const char *)&record[head_len], buffer, state);
+        return 0;
+    }
+
+    if (head_len && record_len >= head_len + (num_series + 1) * sizeof(u_int32_t) &&
+        codec == TSDB_CODEC_SERIES) {
+        memcpy(&end, &record[head_len + num_series * sizeof(u_int32_t)], sizeof(end));
+        if (end == record_len) {
+            return 0;
+        }
+    }
+
+    trace_error("Malformed cold segment record (codec %u, %u bytes)", codec, record_len);
+    return -2;
+}
+
+int tsdb_slice_copy(u_int16_t values_per_entry, const u_int8_t *record,
+                    u_int32_t record_len, const u_int8_t *buffer,
+                    u_int32_t local, u_int32_t first, u_int32_t count,
+                    u_int8_t *dst, u_int64_t dst_stride) {
+    tsdb_series_decoder decoder;
+    u_int64_t value;
+    u_int32_t i, v, series, start, end, head_len = header_len(record, record_len);
+    u_int32_t values_len = values_per_entry * sizeof(u_int64_t);
+
+    if ((record[0] & ~TSDB_SLICE_VALID) == TSDB_CODEC_QLZ) {
+        for (i = 0; i < count; i++) {
+            memcpy(&dst[i * dst_stride],
+                   &buffer[((u_int64_t)local * SEGMENT_EPOCHS + first + i) * values_len],
+                   values_len);
+        }
+        return 0;
+    }
+
+    for (v = 0; v < values_per_entry; v++) {
+        series = local * values_per_entry + v;
+        memcpy(&start, &record[head_len + series * sizeof(u_int32_t)], sizeof(start));
+        memcpy(&end, &record[head_len + (series + 1) * sizeof(u_int32_t)], sizeof(end));
+        if (start > end || end > record_len ||
+            tsdb_series_start(&decoder, &record[start], end - start) ||
+            tsdb_series_skip(&decoder, first)) {
+            trace_error("Malformed series %u in a cold segment record", series);
+            return -2;
+        }
+        for (i = 0; i < count; i++) {
+            if (tsdb_series_next(&decoder, &value)) {
+                trace_error("Series %u in a cold segment record is truncated", series);
+                return -2;
+            }
+            memcpy(&dst[i * dst_stride + v * sizeof(value)], &value, sizeof(value));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * tsdb_segment.h
+ *
+ * Records of cold segments. Once the SEGMENT_EPOCHS epochs of a segment
+ * are compacted, every fragment of them is transposed into fragment_len /
+ * SEGMENT_SERIES records, one per slice of SEGMENT_SERIES indexes,
+ * holding the values of each index in all epochs of the segment in a row.
+ *
+ * A record starts with its codec. Unless all indexes of the slice were
+ * set in all epochs, TSDB_SLICE_VALID is added to it and it is followed by
+ * the length (2 bytes) of the validity bitmap of the slice, bit
+ * i * SEGMENT_EPOCHS + j for the i-th index in the j-th epoch, encoded
+ * with tsdb_bits_encode() and the bitmap. Then TSDB_CODEC_QLZ is followed
+ * by the compressed slice, TSDB_CODEC_SERIES by the offsets of the
+ * SEGMENT_SERIES * values_per_entry series of the slice within the record
+ * (and that of its end), then the series, so that the values of an index
+ * are decoded without touching the others.
+ *
+ * Keys are a byte 1 followed by the big-endian fragment, slice and
+ * segment, so that the history of a slice is a run of adjacent records.
+ */
+
+#ifndef TSDB_SEGMENT_H_
+#define TSDB_SEGMENT_H_
+
+#include <sys/types.h>
+
+#include "quicklz.h"
+
+#define SEGMENT_EPOCHS 256 //epochs per cold segment, see tsdb_set_compaction()
+#define SEGMENT_SERIES 100 //indexes per cold segment, divides the indexes per fragment
+#define SEGMENT_KEY_LEN 11
+
+#define TSDB_SLICE_VALID 0x80
+#define TSDB_SLICE_BITS (SEGMENT_SERIES * SEGMENT_EPOCHS) // validity bits of a slice
+#define TSDB_SLICE_WORDS ((TSDB_SLICE_BITS + 31) / 32)
+
+/* Write the key of a slice of a fragment in a segment, returns its length */
+u_int32_t tsdb_segment_key(u_int32_t fragment, u_int32_t slice,
+                           u_int32_t segment, char *key);
+
+/* Inverse of tsdb_segment_key(), returns -1 for keys of other records */
+int tsdb_segment_parse_key(const void *key, u_int32_t key_len, u_int32_t *fragment,
+                           u_int32_t *slice, u_int32_t *segment);
+
+/* Longest record of a slice of values_per_entry values per index */
+u_int32_t tsdb_slice_bound(u_int16_t values_per_entry);
+
+/* Encode a slice, the values of each index in all epochs of the segment
+ * in a row, and its validity bitmap (TSDB_SLICE_WORDS words) into dst with
+ * codec. Returns the length of the record */
+u_int32_t tsdb_slice_encode(u_int8_t codec, u_int16_t values_per_entry,
+                            const u_int8_t *columns, const u_int32_t *valid,
+                            u_int8_t *dst, qlz_state_compress *state);
+
+/* Check a record, decompressing a TSDB_CODEC_QLZ one into buffer (a slice
+ * long) and its validity bitmap into valid (TSDB_SLICE_WORDS words).
+ * Returns 0 on success, -2 if it is malformed */
+int tsdb_slice_open(u_int16_t values_per_entry, const u_int8_t *record,
+                    u_int32_t record_len, u_int8_t *buffer, u_int32_t *valid,
+                    qlz_state_decompress *state);
+
+/* Copy the values of the local-th index of a record opened by
+ * tsdb_slice_open() in count epochs of the segment, starting with the
+ * first-th one, to dst, dst_stride bytes apart. Returns 0 on success, -2
+ * if it is malformed */
+int tsdb_slice_copy(u_int16_t values_per_entry, const u_int8_t *record,
+                    u_int32_t record_len, const u_int8_t *buffer,
+                    u_int32_t local, u_int32_t first, u_int32_t count,
+                    u_int8_t *dst, u_int64_t dst_stride);
+
+#endif /* TSDB_SEGMENT_H_ */
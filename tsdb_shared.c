@@ -0,0 +1,84 @@
+/*
+ * tsdb_shared.c
+ *
+ * Records of shared payloads, see tsdb_shared.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdb_shared.h"
+
+u_int64_t tsdb_shared_hash(const u_int8_t *data, u_int32_t len) {
+  /* FNV-1a over 64-bit words, folded after each of them */
+    u_int64_t hash = 14695981039346656037ULL, word;
+    u_int32_t i;
+
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, &data[i], sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+u_int32_t tsdb_shared_key(u_int8_t type, u_int64_t hash, char *key) {
+    u_int8_t *ptr = (u_int8_t *)key;
+    u_int32_t i;
+
+    ptr[0] = type;
+    for (i = 0; i < sizeof(hash); i++) {
+        ptr[1 + i] = hash >> (56 - 8 * i);
+    }
+
+    return SHARED_KEY_LEN;
+}
+
+int tsdb_shared_parse_count(const void *value, u_int32_t value_len,
+                            tsdb_shared_count *count) {
+    memset(count, 0, sizeof(tsdb_shared_count));
+    if (value_len != sizeof(tsdb_shared_count)) {
+        return -1;
+    }
+    memcpy(count, value, sizeof(tsdb_shared_count));
+
+    return 0;
+}
+
+int tsdb_shared_remember(tsdb_shared *shared, u_int32_t epoch, u_int32_t fragment,
+                         u_int64_t hash, u_int32_t len) {
+    tsdb_shared_candidate *candidates;
+    u_int32_t num_fragments;
+
+    if (fragment >= shared->num_fragments) {
+        num_fragments = (shared->num_fragments ? shared->num_fragments : 16);
+        while (num_fragments <= fragment) {
+            num_fragments *= 2;
+        }
+        candidates = (tsdb_shared_candidate*) realloc(shared->candidates,
+                                                      num_fragments * sizeof(tsdb_shared_candidate));
+        if (candidates == NULL) {
+            return -2;
+        }
+        memset(&candidates[shared->num_fragments], 0,
+               (num_fragments - shared->num_fragments) * sizeof(tsdb_shared_candidate));
+        shared->candidates = candidates;
+        shared->num_fragments = num_fragments;
+    }
+
+    shared->candidates[fragment].epoch = epoch;
+    shared->candidates[fragment].hash = hash;
+    shared->candidates[fragment].len = len;
+
+    return 0;
+}
+
+void tsdb_shared_destroy(tsdb_shared *shared) {
+    free(shared->candidates);
+    shared->candidates = NULL;
+    shared->num_fragments = 0;
+}
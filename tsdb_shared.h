@@ -0,0 +1,61 @@
+/*
+ * tsdb_shared.h
+ *
+ * Records of shared payloads. From format 4 on, a keyframe record stored
+ * again with the same content becomes a shared payload under a byte
+ * SHARED_PAYLOAD followed by the big-endian 64-bit hash of the record,
+ * and the fragment records refer to it. A byte SHARED_COUNT followed by
+ * the hash keys its tsdb_shared_count. Keyframes stored in place are
+ * remembered per fragment, so that the next one with the same content is
+ * told without reading it back.
+ */
+
+#ifndef TSDB_SHARED_H_
+#define TSDB_SHARED_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#define SHARED_KEY_LEN 9
+#define SHARED_PAYLOAD 2
+#define SHARED_COUNT 3
+
+typedef struct {
+    u_int32_t refs;
+    u_int32_t len;                  // of the payload
+} tsdb_shared_count;
+
+typedef struct {
+    u_int32_t epoch;
+    u_int64_t hash;
+    u_int32_t len;                  // 0 if none
+} tsdb_shared_candidate;            // last keyframe of a fragment stored in place
+
+typedef struct {
+    pthread_mutex_t lock;           // serializes the records of shared payloads and their reference counts
+    tsdb_shared_candidate *candidates; // per fragment, shared once the same record follows
+    u_int32_t num_fragments;        // entries allocated in candidates
+} tsdb_shared;
+
+/* Hash of a record. Collisions are possible, records with the same hash
+ * are to be compared */
+u_int64_t tsdb_shared_hash(const u_int8_t *data, u_int32_t len);
+
+/* Write the key of the SHARED_PAYLOAD or SHARED_COUNT record of a hash,
+ * returns its length */
+u_int32_t tsdb_shared_key(u_int8_t type, u_int64_t hash, char *key);
+
+/* Read a SHARED_COUNT record. Returns 0 on success, -1 (and a count of 0
+ * references) if it is malformed */
+int tsdb_shared_parse_count(const void *value, u_int32_t value_len,
+                            tsdb_shared_count *count);
+
+/* Remember the keyframe of a fragment stored in place. Returns 0 on
+ * success, -2 if there is not enough memory */
+int tsdb_shared_remember(tsdb_shared *shared, u_int32_t epoch, u_int32_t fragment,
+                         u_int64_t hash, u_int32_t len);
+
+/* Release the remembered keyframes, the lock is left alone */
+void tsdb_shared_destroy(tsdb_shared *shared);
+
+#endif /* TSDB_SHARED_H_ */
@@ -15,9 +15,8 @@
  * 3. Support of values_per_entry > 1 by local functions. Some of them support it already. This however will require implementation of arithmetic for long types (more than int64_t).
  * 4. Syslogging / custom logging to file of all tracing info instead of stdout.
  * 5. Global writing process lock - only one TSDB writing process can be started. Implementation: either through some tsdbw.lock file or using the app specific field DB_ENV->app_private field, where DB_ENV is the Berkeley DB environment handle.
- * 6. There should be clear distinction between 0 value and unknown value in TSDB, maybe internally and transparently for the user.
- *    It will make consolidation function more accurate and granular on the consolidated values, query function will be able to
- *    detect not only missing epochs but also the missing values in existing epochs.
+ * 6. Query function should report not only missing epochs but also the values missing in existing epochs, see tsdb_get_valid_by_index().
+ *    Consolidation tells them from 0 values already, data_tuple_t cannot express them yet.
  * */
 
 #include "tsdb_wrapper_api.h"
@@ -35,6 +34,41 @@
 #include "seatest.h"
 #endif
 
+static time_t tsdbw_now(tsdbw_handle *h) {
+  /* Current time as seen by the handle, see tsdbw_set_clock() */
+  return h->clock != NULL ? h->clock(h->clock_data) : time(NULL);
+}
+
+static int add_new_metrics(pointers_collection_t *cb_pointers, char **keys, u_int32_t num_keys) {
+
+  /* Make a deep copy of every key for every accumulation buffer to make it persistent
+   * and add them to the lists of metrics with one reallocation of the latter per row */
+  char **intermediate_array;
+
+  u_int32_t i, j;
+  size_t numElems, mtr_size;
+  for (i = 0; i < cb_pointers->num_of_rows; ++i) {
+      numElems = cb_pointers->rows[i]->new_metrics.num_of_entries;
+
+      /* Add the new keys (metrics) to every row */
+      intermediate_array = (char**) realloc(cb_pointers->rows[i]->new_metrics.list,
+          (numElems + num_keys) * sizeof(char*) );
+      if (intermediate_array == NULL) return -1;
+      cb_pointers->rows[i]->new_metrics.list = intermediate_array;
+
+      for (j = 0; j < num_keys; ++j) {
+          mtr_size = strlen(keys[j]) + 1; // +1 to incorporate /0 character
+          intermediate_array[numElems + j] = (char *) malloc( mtr_size );
+          if (intermediate_array[numElems + j] == NULL) return -1;
+          memcpy(intermediate_array[numElems + j], keys[j], mtr_size);
+          cb_pointers->rows[i]->new_metrics.num_of_entries++;
+      }
+      intermediate_array = NULL;
+  }
+
+  return 0;
+}
+
 static int _reportNewMetricCB(void *int_data, void *ext_data) {
 
   /* typeof int_data == char* */
@@ -43,44 +77,31 @@ static int _reportNewMetricCB(void *int_data, void *ext_data) {
   if (int_data == NULL || ext_data == NULL) {
       return -1;
   }
-  /* Make a deep copy of the key for every accumulation buffer to make it persistent */
-  pointers_collection_t *cb_pointers = (pointers_collection_t*) ext_data;
-  size_t mtr_size = strlen((char *)int_data) + 1; // +1 to incorporate /0 character
-  char *key_m = (char *) malloc( mtr_size ); if (key_m == NULL ) return -1;
-  char *key_c = (char *) malloc( mtr_size ); if (key_c == NULL ) return -1;
 
-  memcpy(key_m, (char *)int_data, mtr_size);
-  memcpy(key_c, (char *)int_data, mtr_size);
+  char *key = (char *) int_data;
+  return add_new_metrics((pointers_collection_t*) ext_data, &key, 1);
+}
 
-  /* Add the key to the list of metrics with reallocation of the latter */
-  char **intermediate_array;
+static int _reportNewMetricsCB(void *int_data, void *ext_data) {
 
-  u_int32_t i;
-  size_t numElems;
-  for (i = 0; i < cb_pointers->num_of_rows; ++i) {
-      numElems = cb_pointers->rows[i]->new_metrics.num_of_entries;
+  /* typeof int_data == tsdb_new_keys* */
+  /* typeof ext_data == pointers_collection_t* */
 
-      /* Add a new key (metric) to every row */
-      intermediate_array = (char**) realloc(cb_pointers->rows[i]->new_metrics.list,
-          (numElems + 1) * sizeof(char*) );
-      if (intermediate_array == NULL) {free(key_m); free(key_c); return -1;}
-      intermediate_array[numElems] = (i == TSDBW_MODERATE - 1) ? key_m : key_c;
-      cb_pointers->rows[i]->new_metrics.list = intermediate_array;
-      cb_pointers->rows[i]->new_metrics.num_of_entries++;
-      intermediate_array = NULL;
+  if (int_data == NULL || ext_data == NULL) {
+      return -1;
   }
 
-  return 0;
+  tsdb_new_keys *new_keys = (tsdb_new_keys *) int_data;
+  return add_new_metrics((pointers_collection_t*) ext_data, new_keys->keys, new_keys->num_keys);
 }
 
-int consolidate_incrementally(tsdb_value *new_data, tsdb_row_t *row) {
+int consolidate_incrementally(tsdb_value *new_data, const u_int32_t *valid, tsdb_row_t *row) {
   /* Arithmetic average
    *
-   * IMPORTANT: due to the current TSDB API implementation state,
-   * one cannot distinguish absent values from 0 values, they are the same.
-   * Thus in general consolidation algorithm cannot tell which values
-   * to be consolidated are missing and which are simply zeros, and
-   * it's important as we would like to omit the missing values.
+   * Values missing in the fine TSDB, i.e. not written in an epoch of it,
+   * are told from real zeros by the validity bitmap of the epoch (see
+   * tsdb_get_validity()) and omitted, each element of row averages the
+   * values set for it only. row->samples counts them.
    * Example:
    *   Values within one consolidation epoch
    *   10 20 0 0 0 20 20
@@ -88,11 +109,9 @@ int consolidate_incrementally(tsdb_value *new_data, tsdb_row_t *row) {
    *         | | |
    *     missing |
    *             real zero was reported
-   *    Resulted consolidate value with current implementation:
-   *    10 + 20 + 0 + 0 + 0 + 20 + 20 / 7 = truncate(10) = 10
-   *    Ideally should be:
-   *    10 + 20 + 0 + 0 + 0 + 20 + 20 / 5 = truncate(14) = 14
-   */
+   *   10 + 20 + 0 + 0 + 0 + 20 + 20 / 5 = truncate(14) = 14
+   * Elements without any value set keep their initial value and are
+   * written as missing into the consolidated TSDB. */
   /* The algorithm currently does not support values,
    * which span several contiguous tsdb_values elements.
    * Hence it works correctly only values_per_entry = 1
@@ -100,7 +119,8 @@ int consolidate_incrementally(tsdb_value *new_data, tsdb_row_t *row) {
    * for larger values, however one would need to introduce
    * arithmetic for large integers not covered by any type. */
 
-  /* MUST BE: lenof(new_data) == lenof(row->data) == row->size */
+  /* MUST BE: lenof(new_data) == lenof(row->data) == lenof(row->samples) == row->size,
+   * valid holds row->size bits, all of them are set if it is NULL */
   /* Thus function implements incremental average algorithm.
    * Let S_n = (a_1 + a_2 + ... + a_n) / n be a partial sum for
    * a sequence a_1, a_2, a_3, ..., a_n, ... The sum is an average
@@ -108,8 +128,10 @@ int consolidate_incrementally(tsdb_value *new_data, tsdb_row_t *row) {
    * represents an average as well. Proof is evident. */
   /* Here S_n is every element of row, whereas a_(n+1) is an element
    * of the new_data array. */
-  size_t i;
-  u_int32_t n = row->cr_elapsed;
+  size_t i, w;
+  u_int32_t n, word;
+
+  if (row->size != 0 && row->samples == NULL) return -1;
 
 #ifdef _TSDBW_DEBUG_
   printf("BEF CONS:\n");
@@ -119,9 +141,21 @@ int consolidate_incrementally(tsdb_value *new_data, tsdb_row_t *row) {
   printf("\n");
 #endif
 
-  for (i=0; i < row->size; ++i) {
-      row->data[i] = (tsdb_value)((long double)((int64_t) row->data[i]) * (long double)n / (long double)(n + 1)
-                     + (long double)((int64_t)new_data[i]) / (long double)(n+1));
+  /* Words of the bitmap without bits set, sparse metrics mostly,
+   * are skipped as a whole */
+  for (w = 0; w * BITS_PER_WORD < row->size; ++w) {
+      word = valid != NULL ? valid[w] : ~0U;
+      if (row->size - w * BITS_PER_WORD < BITS_PER_WORD) {
+          word &= (1U << (row->size - w * BITS_PER_WORD)) - 1;
+      }
+      while (word != 0) {
+          i = w * BITS_PER_WORD + __builtin_ctz(word);
+          word &= word - 1;
+          n = row->samples[i];
+          row->data[i] = (tsdb_value)((long double)((int64_t) row->data[i]) * (long double)n / (long double)(n + 1)
+                         + (long double)((int64_t)new_data[i]) / (long double)(n+1));
+          row->samples[i]++;
+      }
   }
 
 #ifdef _TSDBW_DEBUG_
@@ -155,6 +189,7 @@ static int _reportChunkDataCB(void *int_data, void *ext_data) {
 
   tsdb_value *r_data = (tsdb_value *) ((tsdb_handler *) int_data)->chunk.data; // reported data array
   tsdb_value *r_data_prepared = NULL;
+  u_int32_t *r_valid; // bitmap of the values set in the reported data
   size_t tsdb_val_len = ((tsdb_handler *) int_data)->values_len; //size in bytes (i.e. chars)
   size_t r_data_size = ((tsdb_handler *) int_data)->chunk.data_len / tsdb_val_len;
   size_t unified_size = r_data_size;
@@ -175,6 +210,15 @@ static int _reportChunkDataCB(void *int_data, void *ext_data) {
 
       /* fill it with the data passed to the callBack as r_data*/
       memcpy(r_data_prepared, r_data, r_data_size * tsdb_val_len);
+      r_data = r_data_prepared;
+  }
+
+  /* Values set in the epoch, the ones beyond it are missing */
+  r_valid = (u_int32_t *) malloc((unified_size / BITS_PER_WORD + 1) * sizeof(u_int32_t));
+  if (r_valid == NULL || tsdb_get_validity((tsdb_handler *) int_data, 0, unified_size, r_valid)) {
+      free(r_valid);
+      free(r_data_prepared);
+      return -1;
   }
 
   for (i = 0; i < rows_bundle->num_of_rows; ++i ) {
@@ -182,32 +226,39 @@ static int _reportChunkDataCB(void *int_data, void *ext_data) {
           /* Reallocate the row */
           tsdb_value *row_data_prepared = (tsdb_value *) realloc(rows_bundle->rows[i]->data, unified_size * tsdb_val_len);
           if (row_data_prepared == NULL) {
+              free(r_valid);
+              free(r_data_prepared);
+              return -1;
+          }
+          rows_bundle->rows[i]->data = row_data_prepared;
+          u_int32_t *row_samples_prepared = (u_int32_t *) realloc(rows_bundle->rows[i]->samples, unified_size * sizeof(u_int32_t));
+          if (row_samples_prepared == NULL) {
+              free(r_valid);
               free(r_data_prepared);
               return -1;
           }
+          rows_bundle->rows[i]->samples = row_samples_prepared;
 
           /* Fill the grown undefined portion of data with default value */
           memset(&row_data_prepared[rows_bundle->rows[i]->size],
                  ((tsdb_handler *) int_data)->unknown_value,
                  (unified_size - rows_bundle->rows[i]->size) * tsdb_val_len);
-          rows_bundle->rows[i]->data = row_data_prepared;
+          memset(&row_samples_prepared[rows_bundle->rows[i]->size], 0,
+                 (unified_size - rows_bundle->rows[i]->size) * sizeof(u_int32_t));
           rows_bundle->rows[i]->size = unified_size;
       }
 
       /* Now data in chunk and data in accumulation arrays are prepared
        * and all the arrays are aligned in size. Now one can safely
        * perform consolidation */
-      if (r_data_prepared == NULL) { //reported data chunk was not reallocated, as it is the largest one
-          if (consolidate_incrementally(r_data, rows_bundle->rows[i])) return -1;
-      } else {
-          if (consolidate_incrementally(r_data_prepared, rows_bundle->rows[i])) {
-              free(r_data_prepared);
-              return -1;
-          }
+      if (consolidate_incrementally(r_data, r_valid, rows_bundle->rows[i])) {
+          free(r_valid);
+          free(r_data_prepared);
+          return -1;
       }
-      free(r_data_prepared);
-      r_data_prepared = NULL;
   }
+  free(r_valid);
+  free(r_data_prepared);
 
   *(rows_bundle->last_accum_update) = (time_t) ((tsdb_handler *) int_data)->chunk.epoch;
 
@@ -366,41 +417,36 @@ static int open_DBs(tsdbw_handle *handle, u_int16_t *finest_timestep,
 static int init_structures_and_callbacks(tsdbw_handle *h) {
 
   int i;
-  u_int32_t cur_time = (u_int32_t) time(NULL);
-  u_int32_t cur_time_norm;
 
   /* Assigning initial values */
   for (i = 0; i < TSDBW_DB_NUM; ++i){
       h->db_hs[i]->unknown_value = TSDBW_UNKNOWN_VALUE;
+      /* Queries read a handful of metrics per epoch, hence
+       * only fragments holding them are worth decompressing */
+      if (h->mode == TSDBW_MODE_READ) h->db_hs[i]->lazy_load = 1;
   }
+  /* The fine TSDB changes its epoch with every poll cycle, its
+   * chunks are compressed and stored by a background thread */
+  if (h->mode != TSDBW_MODE_READ) tsdb_set_async_flush(h->db_hs[TSDBW_FINE], 2);
 
   h->mod_accum.data = NULL;
   h->mod_accum.size = 0;
+  h->mod_accum.samples = NULL;
   h->mod_accum.cr_elapsed = 0;
   h->mod_accum.new_metrics.list = NULL;
   h->mod_accum.new_metrics.num_of_entries = 0;
-  if (h->db_hs[TSDBW_MODERATE]->most_recent_epoch == 0) {
-      cur_time_norm = cur_time;
-      normalize_epoch(h->db_hs[TSDBW_MODERATE], &cur_time_norm);
-      h->mod_accum.last_flush_time =  (time_t) cur_time_norm;
-  } else {
-      h->mod_accum.last_flush_time =  (time_t) h->db_hs[TSDBW_MODERATE]->most_recent_epoch;
-  }
+  /* For an empty DB it is set by the first write, see tsdbw_write_at() */
+  h->mod_accum.last_flush_time =  (time_t) h->db_hs[TSDBW_MODERATE]->most_recent_epoch;
 
   h->coarse_accum.data = NULL;
   h->coarse_accum.size = 0;
+  h->coarse_accum.samples = NULL;
   h->coarse_accum.cr_elapsed = 0;
   h->coarse_accum.new_metrics.list = NULL;
   h->coarse_accum.new_metrics.num_of_entries = 0;
-  if (h->db_hs[TSDBW_COARSE]->most_recent_epoch == 0) {
-      cur_time_norm = cur_time;
-      normalize_epoch(h->db_hs[TSDBW_COARSE], &cur_time_norm);
-      h->coarse_accum.last_flush_time =  (time_t) cur_time_norm;
-  } else {
-      h->coarse_accum.last_flush_time =  (time_t) h->db_hs[TSDBW_COARSE]->most_recent_epoch;
-  }
+  h->coarse_accum.last_flush_time =  (time_t) h->db_hs[TSDBW_COARSE]->most_recent_epoch;
 
-  h->last_accum_update = (time_t) cur_time;
+  h->last_accum_update = tsdbw_now(h);
 
   h->cb_communication.last_accum_update = &h->last_accum_update;
   h->cb_communication.num_of_rows = TSDBW_DB_NUM - 1; // assuming every but fine DB has its own accumulation buffer for incremental consolidation
@@ -413,8 +459,10 @@ static int init_structures_and_callbacks(tsdbw_handle *h) {
    * For other TSDBs these have NULL values
    * and will be ignored within the original TSDB API */
   h->db_hs[0]->reportNewMetricCB.external_data = & h->cb_communication;
+  h->db_hs[0]->reportNewMetricsCB.external_data = & h->cb_communication;
   h->db_hs[0]->reportChunkDataCB.external_data = & h->cb_communication;
   h->db_hs[0]->reportNewMetricCB.cb = _reportNewMetricCB;
+  h->db_hs[0]->reportNewMetricsCB.cb = _reportNewMetricsCB;
   h->db_hs[0]->reportChunkDataCB.cb = _reportChunkDataCB;
 
   return 0;
@@ -433,6 +481,34 @@ static int consolidation_start(tsdbw_handle *h) {
   return 0;
 }
 
+void tsdbw_set_clock(tsdbw_handle *h, tsdbw_clock_t clock, void *clock_data) {
+
+  h->clock = clock;
+  h->clock_data = clock_data;
+
+  /* Nothing was consolidated yet, the time of the last update
+   * set by tsdbw_init() has to come from the new clock as well */
+  if (h->mod_accum.size == 0 && h->coarse_accum.size == 0) {
+      h->last_accum_update = tsdbw_now(h);
+  }
+}
+
+int tsdbw_set_compaction(tsdbw_handle *h, u_int32_t age) {
+
+  u_int8_t i;
+
+  if (h->mode == TSDBW_MODE_READ) {
+      trace_error("Compaction is unavailable in the read mode");
+      return -1;
+  }
+
+  for (i = 0; i < TSDBW_DB_NUM; ++i) {
+      if (tsdb_set_compaction(h->db_hs[i], age)) return -1;
+  }
+
+  return 0;
+}
+
 int tsdbw_init(tsdbw_handle *h, u_int16_t *finest_timestep,
                const char **db_files,
                char io_flag) {
@@ -457,7 +533,7 @@ int tsdbw_init(tsdbw_handle *h, u_int16_t *finest_timestep,
   return 0;
 }
 
-static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf, time_t last_update_time ) {
+static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf, time_t last_update_time, time_t now ) {
   //TODO: add flag for strict writing error handling
   if (last_update_time == 0) return -1;
 
@@ -468,7 +544,7 @@ static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf,
   u_int32_t epoch_to_write = last_update_time;
   normalize_epoch(tsdb_h, &epoch_to_write);
 
-  u_int32_t epoch_current = (u_int32_t) time(NULL);
+  u_int32_t epoch_current = (u_int32_t) now;
   normalize_epoch(tsdb_h, &epoch_current);
 
   if (epoch_to_write + tsdb_h->slot_duration < epoch_current && epoch_to_write != 0) { //they are equal if no epochs were missed
@@ -515,10 +591,15 @@ static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf,
    * new metrics are appended always at the very end one by one */
 
   size_t data_entries_num = tsdb_h->lowest_free_index > accum_buf->size ? accum_buf->size : tsdb_h->lowest_free_index;
+  if (tsdb_row_write(tsdb_h, 0, data_entries_num, accum_buf->data)) {
+      trace_error("Failed to write values in consolidated TSDB. New metrics were not being added and the DB consistency is intact.");
+  }
+
+  /* Metrics without any value in the fine TSDB during the consolidation
+   * epoch are missing in the consolidated one too, rather than zero */
   for (i = 0; i < data_entries_num; ++i) {
-      if (tsdb_set_by_index(tsdb_h, &accum_buf->data[i * nvpe], &i)) {
-          trace_error("Failed to write a value in consolidated TSDB. New metrics were not being added and the DB consistency is intact.");
-          break;
+      if (accum_buf->samples[i] == 0 && tsdb_unset_by_index(tsdb_h, &i)) {
+          trace_error("Failed to mark a value missing in consolidated TSDB.");
       }
   }
 
@@ -552,6 +633,7 @@ static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf,
           /* Attempt of recovery: all values get nullified in the accum buffer,
            * its size is preserved, unwritten metrics are preserved. So that they can
            * be written upon next flushing */
+          memset(accum_buf->samples, 0, accum_buf->size * sizeof(u_int32_t));
           memset(accum_buf->data, 0, accum_buf->size * tsdb_h->values_len); // we deliberately nullify it and not setting it to an undefined value, because arithmetic operations in the consolidation function are undefined in general for an undefined value
 
           /* by setting "accum_buf->cr_elapsed = 0;" at the end of the function
@@ -574,6 +656,10 @@ static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf,
           trace_info("Recovery of unwritten metrics succeeded");
           break;
       }
+      j = start_idx + i;
+      if ((j >= accum_buf->size || accum_buf->samples[j] == 0) && tsdb_unset_by_index(tsdb_h, &j)) {
+          trace_error("Failed to mark a value missing in consolidated TSDB.");
+      }
   }
 
 
@@ -581,6 +667,8 @@ static int tsdbw_consolidated_flush(tsdb_handler *tsdb_h, tsdb_row_t *accum_buf,
   if (!err_flag) {
       free(accum_buf->data); // allocated within data callback
       accum_buf->data = NULL; // MUST BE NULL, so that realloc in a callback can allocate memory anew as malloc
+      free(accum_buf->samples);
+      accum_buf->samples = NULL;
       accum_buf->size = 0;
       for (j = 0; j < accum_buf->new_metrics.num_of_entries; ++j) { //accum_buf->new_metrics.num_of_entries is intact only if no errors happened
           free(accum_buf->new_metrics.list[j]);
@@ -609,7 +697,8 @@ void tsdbw_close(tsdbw_handle *handle) {
   for (i = 1; i < TSDBW_DB_NUM; ++i) { // the finest DB will be flushed automatically when closed
       (i == TSDBW_MODERATE) ? sprintf(report_str,"moderate") : sprintf(report_str,"coarse");
       trace_info("Flushing %s TSDB\n",report_str);
-      if (tsdbw_consolidated_flush(handle->db_hs[i], handle->cb_communication.rows[i-1], handle->last_accum_update)) {
+      if (tsdbw_consolidated_flush(handle->db_hs[i], handle->cb_communication.rows[i-1], handle->last_accum_update,
+                                   handle->last_write_time != 0 ? handle->last_write_time : tsdbw_now(handle))) {
           trace_error("Could not flush %u th consolidated DB", i);
       }
   }
@@ -628,11 +717,15 @@ void tsdbw_close(tsdbw_handle *handle) {
       handle->mod_accum.size = 0;
       handle->mod_accum.data = NULL;
   }
+  free(handle->mod_accum.samples);
+  handle->mod_accum.samples = NULL;
   if (handle->coarse_accum.data != NULL) {
       free(handle->coarse_accum.data);
       handle->coarse_accum.size = 0;
       handle->coarse_accum.data = NULL;
   }
+  free(handle->coarse_accum.samples);
+  handle->coarse_accum.samples = NULL;
   if (handle->mod_accum.new_metrics.list != NULL) {
       for (i = 0; i < handle->mod_accum.new_metrics.num_of_entries; ++i) {
           free(handle->mod_accum.new_metrics.list[i]);
@@ -708,14 +801,20 @@ static int check_args_write(tsdbw_handle *db_set_h, char **metrics, const int64_
 
 static int fine_tsdb_update(tsdbw_handle *db_set_h,
     /* This function does not support currently values_per_entry > 1*/
+    u_int32_t cur_time,
     char **metrics,
     const int64_t *values,
     u_int32_t num_elem) {
 
   int rv;
   tsdb_value *buf = (tsdb_value *) calloc(num_elem, db_set_h->db_hs[0]->values_len);
-  if (buf == NULL) {
+  u_int32_t *indexes = (u_int32_t *) calloc(num_elem, sizeof(u_int32_t));
+  char **keys = (char **) calloc(num_elem, sizeof(char *));
+  if (buf == NULL || indexes == NULL || keys == NULL) {
       trace_error("Failed to allocate memory");
+      free(buf);
+      free(indexes);
+      free(keys);
       return -1;
   }
 
@@ -724,7 +823,10 @@ static int fine_tsdb_update(tsdbw_handle *db_set_h,
   /* This hack works only with GCC. The function is unpacked for other compilers. */
   rv = lambda(int,
           (tsdb_value *buf,
+          u_int32_t *indexes,
+          char **keys,
           tsdbw_handle *db_set_h,
+          u_int32_t cur_time,
           char **metrics,
           const int64_t *values,
           u_int32_t num_elem),
@@ -732,59 +834,60 @@ static int fine_tsdb_update(tsdbw_handle *db_set_h,
               int i;
               int fail_if_missing = 0;
               int is_growable = 1;
-              u_int32_t cur_time = (u_int32_t) time(NULL);
+              u_int32_t num_keys = 0;
 
-              /* Converting values into the proper type for TSDB */
+              /* Converting values into the proper type for TSDB, skipping empty metrics */
               for (i = 0; i < num_elem; ++i) {
-                  buf[i] = (tsdb_value) values[i];
+                  if (strlen(metrics[i]) == 0) continue;
+                  keys[num_keys] = metrics[i];
+                  buf[num_keys++] = (tsdb_value) values[i];
               }
+              if (num_keys == 0) return 0;
 
-              for (i = 0; i < num_elem; ++i) {
-
-                  if (strlen(metrics[i]) == 0) continue; //skip empty metric
-
-                  if (tsdb_goto_epoch(db_set_h->db_hs[0], cur_time, fail_if_missing, is_growable)) {
-                      trace_error("Failed to advance to a new epoch");
-                      return -1;
-                  }
-                  if (tsdb_set(db_set_h->db_hs[0], metrics[i], &buf[i])) {
-                      trace_warning("Failed to set value in a TSDB. ");
-                      /* An entry in TSDB with an unset value will preserve its initially
-                       * set one by default (which can be adjusted on per TSDB basis)  */
-                  }
+              if (tsdb_goto_epoch(db_set_h->db_hs[0], cur_time, fail_if_missing, is_growable)) {
+                  trace_error("Failed to advance to a new epoch");
+                  return -1;
+              }
+              /* All metrics are mapped and written at once */
+              if (tsdb_resolve_keys(db_set_h->db_hs[0], keys, num_keys, indexes, 1) ||
+                  tsdb_set_batch(db_set_h->db_hs[0], indexes, buf, num_keys)) {
+                  trace_warning("Failed to set values in a TSDB. ");
+                  /* An entry in TSDB with an unset value will preserve its initially
+                   * set one by default (which can be adjusted on per TSDB basis)  */
               }
               return 0;
-          })(buf, db_set_h, metrics, values, num_elem );
+          })(buf, indexes, keys, db_set_h, cur_time, metrics, values, num_elem );
 #else
   int i;
   int fail_if_missing = 0;
   int is_growable = 1;
-  u_int32_t cur_time = (u_int32_t) time(NULL);
+  u_int32_t num_keys = 0;
 
-  /* Converting values into the proper type for TSDB */
+  /* Converting values into the proper type for TSDB, skipping empty metrics */
   for (i = 0; i < num_elem; ++i) {
-      buf[i] = (tsdb_value) values[i];
+      if (strlen(metrics[i]) == 0) continue;
+      keys[num_keys] = metrics[i];
+      buf[num_keys++] = (tsdb_value) values[i];
   }
 
-  for (i = 0; i < num_elem; ++i) {
-
-      if (strlen(metrics[i]) == 0) continue; //skip empty metric
-
+  rv = 0;
+  if (num_keys != 0) {
       if (tsdb_goto_epoch(db_set_h->db_hs[0], cur_time, fail_if_missing, is_growable)) {
           trace_error("Failed to advance to a new epoch");
-          free(buf);
-          return -1;
-      }
-      if (tsdb_set(db_set_h->db_hs[0], metrics[i], &buf[i])) {
-          trace_warning("Failed to set value in a TSDB. ");
+          rv = -1;
+      } else if (tsdb_resolve_keys(db_set_h->db_hs[0], keys, num_keys, indexes, 1) ||
+                 tsdb_set_batch(db_set_h->db_hs[0], indexes, buf, num_keys)) {
+          /* All metrics are mapped and written at once */
+          trace_warning("Failed to set values in a TSDB. ");
           /* An entry in TSDB with an unset value will preserve its initially
            * set one by default (which can be adjusted on per TSDB basis)  */
       }
   }
-  rv = 0;
 #endif
 
   free(buf);
+  free(indexes);
+  free(keys);
   return rv;
 }
 
@@ -795,6 +898,20 @@ int tsdbw_write(tsdbw_handle *db_set_h,
                 const int64_t *values,
                 u_int32_t num_elem) {
 
+  if (db_set_h == NULL) {
+      trace_error("DBs handle not allocated");
+      return -1;
+  }
+
+  return tsdbw_write_at(db_set_h, tsdbw_now(db_set_h), metrics, values, num_elem);
+}
+
+int tsdbw_write_at(tsdbw_handle *db_set_h,
+                   time_t cur_time,
+                   char **metrics,
+                   const int64_t *values,
+                   u_int32_t num_elem) {
+
   int i, rv;
   char report_str[20];
   if (db_set_h->mode == TSDBW_MODE_READ) return -1;
@@ -804,15 +921,21 @@ int tsdbw_write(tsdbw_handle *db_set_h,
   else if (rv != 0) return -1;
 
   /* Updating the fine TSDB with values for metrics*/
-  if (fine_tsdb_update(db_set_h, metrics, values, num_elem) != 0) return -1;
+  if (fine_tsdb_update(db_set_h, (u_int32_t) cur_time, metrics, values, num_elem) != 0) return -1;
+  db_set_h->last_write_time = cur_time;
 
   /* Flushing arrays of consolidated data, if we step over an epoch */
-  time_t cur_time = time(NULL);
   time_t time_diff, time_step;
 
   for (i = 1; i < TSDBW_DB_NUM; ++i) { // omitting the finest TSDB (i == 0)
 
-     // if (db_set_h->cb_communication.rows[i-1]->last_flush_time == 0) continue; //skip if the given TSDB is empty (newly created)
+      if (db_set_h->cb_communication.rows[i-1]->last_flush_time == 0) {
+          /* The given TSDB is empty (newly created), its first epoch starts now */
+          u_int32_t cur_time_norm = (u_int32_t) cur_time;
+          normalize_epoch(db_set_h->db_hs[i], &cur_time_norm);
+          db_set_h->cb_communication.rows[i-1]->last_flush_time = (time_t) cur_time_norm;
+          continue;
+      }
 
       time_diff = cur_time - db_set_h->cb_communication.rows[i-1]->last_flush_time;
       time_step = (time_t)db_set_h->db_hs[i]->slot_duration;
@@ -829,7 +952,7 @@ int tsdbw_write(tsdbw_handle *db_set_h,
 
           trace_info("Flushing %s TSDB\n",report_str);
 
-          if (tsdbw_consolidated_flush(db_set_h->db_hs[i], db_set_h->cb_communication.rows[i-1], db_set_h->last_accum_update  )) {
+          if (tsdbw_consolidated_flush(db_set_h->db_hs[i], db_set_h->cb_communication.rows[i-1], db_set_h->last_accum_update, cur_time)) {
               return -1;
           }
       }
@@ -868,20 +991,32 @@ static int get_list_of_epochs(tsdb_handler *db_h, u_int32_t epoch_from, u_int32_
 
   } else {
       /* All other cases */
-      u_int32_t i, j;
+      u_int32_t i, j, pos, db_epoch = 0;
       *epoch_num = (epoch_to - epoch_from) / db_h->slot_duration + 1;
       if ((epochs_list = (u_int32_t *) calloc(*epoch_num, sizeof(u_int32_t))) == NULL) return -1;
       if ((isEpochEmpty = (u_int8_t *) calloc(*epoch_num, sizeof(u_int8_t))) == NULL) {free(epochs_list); return -1;}
       if (epochs_list == NULL || isEpochEmpty == NULL) return -1;
+
+      /* The epochs of the DB within the range start at the position of its lower bound */
+      if (tsdb_epoch_search(db_h, epoch_from, &pos) < 0 ||
+          (pos < db_h->number_of_epochs && tsdb_epoch_at(db_h, pos, &db_epoch))) {
+          free(epochs_list);
+          free(isEpochEmpty);
+          return -1;
+      }
       for (i = 0, j = 0; i < *epoch_num; ++i) {
           epochs_list[i] = epoch_from + i * db_h->slot_duration;
-          if (epochs_list[i] < db_h->epoch_list[0] ||
-              epochs_list[i] > db_h->most_recent_epoch ||
-              epochs_list[i] < db_h->epoch_list[j]) {
+          if (pos >= db_h->number_of_epochs ||
+              epochs_list[i] < db_epoch) {
               isEpochEmpty[i] = 1;
           } else {
               isEpochEmpty[i] = 0;
               j++;
+              if (++pos < db_h->number_of_epochs && tsdb_epoch_at(db_h, pos, &db_epoch)) {
+                  free(epochs_list);
+                  free(isEpochEmpty);
+                  return -1;
+              }
           }
       }
 #ifdef _TSDBW_DEBUG_
@@ -897,7 +1032,7 @@ static int get_list_of_epochs(tsdb_handler *db_h, u_int32_t epoch_from, u_int32_
   return 0;
 }
 
-static int check_args_query(tsdb_handler *tsdb_h, time_t *epoch_from,
+static int check_args_query(tsdb_handler *tsdb_h, time_t now, time_t *epoch_from,
     time_t *epoch_to,  char **metrics, u_int32_t metrics_num, data_tuple_t ***tuples ) {
 
   int i;
@@ -917,9 +1052,9 @@ static int check_args_query(tsdb_handler *tsdb_h, time_t *epoch_from,
       return -1;
   }
 
-  if (*epoch_to > (u_int32_t) time(NULL)) {
+  if (*epoch_to > now) {
       trace_info("Epoch range exceeds the current time. The upper bound was set to the current time.");
-      *epoch_to = (u_int32_t) time(NULL);
+      *epoch_to = now;
   }
 
   if (metrics == NULL) {
@@ -984,7 +1119,7 @@ int tsdbw_query(tsdbw_handle *db_set_h, q_request_t *req, q_reply_t *rep) {
     return -1;
   }
 
-  if (check_args_query(tsdb_h, &epoch_from, &epoch_to, metrics, metrics_num, &rep->tuples )) return -1;
+  if (check_args_query(tsdb_h, tsdbw_now(db_set_h), &epoch_from, &epoch_to, metrics, metrics_num, &rep->tuples )) return -1;
 
   u_int32_t *epochs_list = NULL, epoch_num = 0;
   u_int8_t *isEpochEmpty = NULL;
@@ -998,38 +1133,42 @@ int tsdbw_query(tsdbw_handle *db_set_h, q_request_t *req, q_reply_t *rep) {
   }
   /* Filling the query result array - for every metric, every epoch in the requested range */
   data_tuple_t **query_res = rep->tuples;
-  tsdb_value *val = NULL;
-  u_int8_t fail_if_epoch_missing = 1, allowed_to_grow_epochs = 0;
-  u_int32_t metr_idx, epch_idx;
-  char epoch_descr[20];
+  tsdb_value *found_values = NULL;
+  u_int32_t *indexes, *found_epochs = NULL, found_num = 0;
+  u_int32_t metr_idx, epch_idx, found_idx;
+
+  /* Metrics are resolved at once, the missing ones get TSDB_NO_INDEX, hence unknown values */
+  if ((indexes = (u_int32_t *) malloc(metrics_num * sizeof(u_int32_t))) == NULL ||
+      tsdb_resolve_keys(tsdb_h, metrics, metrics_num, indexes, 0) == -2 ||
+      tsdb_get_range(tsdb_h, epochs_list[0], epochs_list[epoch_num - 1], indexes, metrics_num,
+                     &found_epochs, &found_values, &found_num)) {
+      trace_error("Failed to read the epoch range");
+      free(indexes);
+      free_darray(metrics_num, (void **) rep->tuples);
+      rep->tuples = NULL;
+      free(epochs_list);
+      free(isEpochEmpty);
+      return -1;
+  }
+
+  for (metr_idx = 0; metr_idx < metrics_num; ++metr_idx) {
+      if (indexes[metr_idx] == TSDB_NO_INDEX) trace_info("No metric %s found", metrics[metr_idx]);
+  }
+
+  for (epch_idx = 0, found_idx = 0; epch_idx < epoch_num; ++epch_idx){
+      /* Epochs found in the DB come in the same order */
+      while (found_idx < found_num && found_epochs[found_idx] < epochs_list[epch_idx]) found_idx++;
+      if (found_idx == found_num || found_epochs[found_idx] != epochs_list[epch_idx]) isEpochEmpty[epch_idx] = 1;
 
-  for (epch_idx = 0; epch_idx < epoch_num; ++epch_idx){
       for (metr_idx = 0; metr_idx < metrics_num; ++metr_idx) {
 
           query_res[metr_idx][epch_idx].epoch = (time_t) epochs_list[epch_idx];
 
           if (isEpochEmpty[epch_idx] == 0) {
-              /* If Epoch is not empty and exists: */
-              if (tsdb_goto_epoch(tsdb_h, epochs_list[epch_idx], fail_if_epoch_missing, allowed_to_grow_epochs)) {
-                  /* If we have failed to load this epoch, we treat it as empty one for all metrics: */
-                  trace_error("Epoch was not found, though it must exist. Treating it like empty one.");
-                  isEpochEmpty[epch_idx] = 1;
-                  query_res[metr_idx][epch_idx].value = tsdb_h->unknown_value;
-                  continue;
-              }
-
-              /* The epoch exists and we have loaded it */
-
-              if (tsdb_get_by_key(tsdb_h, metrics[metr_idx], &val )) {
-                  /* The value for the given metric and epoch does not exist, or the key is missing */
-                  time2str(&epochs_list[epch_idx], epoch_descr, 20);
-                  trace_info("No value or metric found. Epoch %s, metric %s", epoch_descr, metrics[metr_idx]);
-                  query_res[metr_idx][epch_idx].value = tsdb_h->unknown_value;
-              } else {
-                  /* The value for the given metric and epoch does exist, but it
-                   * might be either a SNMP provided value or default unknown one */
-                  query_res[metr_idx][epch_idx].value = *((int64_t*) val);
-              }
+              /* The value for the given metric and epoch does exist, but it
+               * might be either a SNMP provided value or default unknown one */
+              query_res[metr_idx][epch_idx].value =
+                  (int64_t) found_values[(found_idx * metrics_num + metr_idx) * tsdb_h->values_per_entry];
           } else {
               /* If Epoch does not exist: */
               query_res[metr_idx][epch_idx].value = tsdb_h->unknown_value;
@@ -1037,6 +1176,9 @@ int tsdbw_query(tsdbw_handle *db_set_h, q_request_t *req, q_reply_t *rep) {
       }
   }
 
+  free(indexes);
+  free(found_epochs);
+  free(found_values);
   rep->epochs_num_res = epoch_num;
   free(epochs_list);
   free(isEpochEmpty);
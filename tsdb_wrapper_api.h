@@ -54,6 +54,7 @@ typedef struct {
 typedef struct {
   tsdb_value *data;
   size_t size; // of data
+  u_int32_t *samples;           // samples[i]: number of values consolidated into data[i], those set in the fine TSDB
   u_int32_t cr_elapsed;         // consolidation rounds elapsed on data (implicitly the number of the fine tsdb flushes)
   metrics_t new_metrics;        // emptied during each write cycle in a respective consolidated DB
   time_t last_flush_time;       // last sync'ed epoch in the related consolidated TSDB as well
@@ -65,6 +66,8 @@ typedef  struct {
   time_t *last_accum_update;    // pointer to tsdbw_handle.last_accum_update
 } pointers_collection_t;
 
+typedef time_t (*tsdbw_clock_t)(void *clock_data);
+
 typedef struct {
   char mode;
   tsdb_handler **db_hs;         // number of DBs is defined by TSDBW_DB_NUM
@@ -72,6 +75,9 @@ typedef struct {
   tsdb_row_t coarse_accum;
   time_t last_accum_update;     // using this time we can find out which epoch the consolidated data should be attributed to. Every fine TSDB sync -> data callback -> consolidation buffers updated incrementally -> this timer updated
   pointers_collection_t cb_communication;
+  tsdbw_clock_t clock;          // source of the current time, time(NULL) if NULL. Set by tsdbw_set_clock()
+  void *clock_data;             // passed to clock
+  time_t last_write_time;       // time of the last tsdbw_write/tsdbw_write_at call, 0 if none
 } tsdbw_handle;
 
 typedef struct {
@@ -97,6 +103,21 @@ int tsdbw_write(tsdbw_handle *db_set_h,      // handle of all DBs, must be preal
                 const int64_t *values,       // array of values for the metrics, length num_elem
                 u_int32_t num_elem);         // number of metrics and respective values to write into TSDB
 
+int tsdbw_write_at(tsdbw_handle *db_set_h,   // handle of all DBs, must be preallocated
+                   time_t epoch,             // time the values belong to, instead of the current time.
+                                             // It drives epochs of all DBs and consolidation, thus must not decrease
+                   char **metrics,           // array of strings, which are names of metrics, length num_elem
+                   const int64_t *values,    // array of values for the metrics, length num_elem
+                   u_int32_t num_elem);      // number of metrics and respective values to write into TSDB
+
+void tsdbw_set_clock(tsdbw_handle *db_set_h, // handle of all DBs, initialized by tsdbw_init()
+                     tsdbw_clock_t clock,    // returns the current time for tsdbw_write() and tsdbw_query(), NULL for time(NULL)
+                     void *clock_data);      // passed to every clock call
+
+int tsdbw_set_compaction(tsdbw_handle *db_set_h, // handle of all DBs, initialized by tsdbw_init()
+                         u_int32_t age);          // seconds after which epochs of every DB are moved into
+                                                  // series-major cold segments, 0 to stop. See tsdb_set_compaction()
+
 int tsdbw_init(tsdbw_handle *db_set_h,    // handle of all DBs, must be preallocated
                u_int16_t *finest_timestep,// num of seconds between entries in the finest TSDB.
                                           // time step for moderate TSDB: 5 * finest_timestep
@@ -108,7 +129,7 @@ int tsdbw_init(tsdbw_handle *db_set_h,    // handle of all DBs, must be prealloc
 
 void tsdbw_close(tsdbw_handle *handle);
 
-int consolidate_incrementally(tsdb_value *new_data, tsdb_row_t *row);
+int consolidate_incrementally(tsdb_value *new_data, const u_int32_t *valid, tsdb_row_t *row);
 
 
 #endif /* TSDB_WRAPPER_API_H_ */
@@ -26,6 +26,10 @@ typedef struct {
     u_int8_t populate;
     u_int8_t query;
     u_int8_t debug_lvl;
+    u_int16_t num_workers;
+    u_int8_t flush_depth;
+    u_int32_t fragment_len;
+    double scale_gib;
     u_int32_t seed;
 } set_container;
 
@@ -36,6 +40,8 @@ typedef struct {
 #define STRING_MAX_LEN 20
 #define TIME_STEP 60 //seconds
 #define NUM_EPOCHS 60 //in time steps
+#define KEY_BATCH 50000
+#define SCALE_STRIDE 8 //scale_DB() writes every SCALE_STRIDE-th batch of rows
 #define RANDOM_FILL 0
 #define CONTIGUOUS_FILL 1
 #define FNAME ".TSDB_test_conf.bin"
@@ -47,11 +53,15 @@ static char *program_invocation_short_name;
 #endif
 
 static void help(int code) {
-    printf("test-queryTime (-c DB_file_name | -q DB_file_name | -h ) [-s seed] \n");
+    printf("test-queryTime (-c DB_file_name | -q DB_file_name | -h ) [-s seed] [-w num_workers] [-a depth] [-f fragment_len] [-g GiB] \n");
     printf("-c creates a new DB file given by DB_file_name for subsequent test with the key -q\n");
     printf("-q performs query tests on the given DB DB_file_name and print profiling time they took\n");
     printf("-s to set a seed for a random generator. 1 by default. If it was set during the creation of DBs with the option -c, then the same seed value must be provided while performing profiling tests with the option -q\n");
     printf("-d to set a debug level in the range 0-99, where 99 is the most verbose and 0 for quiet mode. 0 by default.\n");
+    printf("-w to set the number of threads compressing fragments while populating the DB with -c. The number of online CPUs by default.\n");
+    printf("-a to flush epochs in the background while populating the DB with -c, with up to depth epochs in flight. 0 (synchronous flushes) by default.\n");
+    printf("-f to set the number of indexes per fragment of the DB created with -c, a multiple of %u. %u by default.\n", SEGMENT_SERIES, CHUNK_GROWTH);
+    printf("-g to also write and read back a single epoch of GiB gibibytes with -c, 512 values per entry of about 262144 keys per GiB, every %u-th batch of them written. None by default.\n", SCALE_STRIDE);
     printf("-h shows this brief help\n\n");
     printf("Usage: test-queryTime -c myDB.tsdb -s 50\n");
     printf("Then: test-queryTime -q myDB.tsdb -s 50\n");
@@ -60,7 +70,7 @@ static void help(int code) {
 
 static void process_args(int argc, char *argv[], set_container *settings) {
 
-  if (argc < 2 || argc > 7){
+  if (argc < 2 || argc > 15){
       help(1);
   }
 
@@ -69,12 +79,16 @@ static void process_args(int argc, char *argv[], set_container *settings) {
   settings->query = 0;
   settings->seed = 1;
   settings->debug_lvl = 0;
+  settings->num_workers = 0;
+  settings->flush_depth = 0;
+  settings->fragment_len = 0;
+  settings->scale_gib = 0;
 
 #if !defined __GNUC__
 program_invocation_short_name = argv[0];
 #endif
 
-  while ((c = getopt(argc, argv, "hc:q:s:d:")) != -1) {
+  while ((c = getopt(argc, argv, "hc:q:s:d:w:a:f:g:")) != -1) {
       switch (c) {
       case 'h':
         help(0);
@@ -98,15 +112,35 @@ program_invocation_short_name = argv[0];
             help(1);
         }
         break;
+      case 'w':
+        settings->num_workers = atoi(optarg);
+        break;
+      case 'a':
+        settings->flush_depth = atoi(optarg);
+        break;
+      case 'f':
+        settings->fragment_len = atoi(optarg);
+        break;
+      case 'g':
+        settings->scale_gib = atof(optarg);
+        break;
       default:
         help(1);
       }
   }
 }
 
+u_int32_t epoch_at(tsdb_handler* handler, u_int32_t position) {
+  u_int32_t epoch = 0;
+  assert_int_equal(0, tsdb_epoch_at(handler, position, &epoch));
+  return epoch;
+}
+
 void print_tsdb_info(tsdb_handler* handler) {
   char str[30];
-  u_int32_t i;
+  u_int32_t i, epoch;
+  u_int64_t bytes = 0;
+  tsdb_codec_stats stats;
   time2str(&handler->most_recent_epoch, str, 30);
   fprintf(stdout,"========== TSDB INFO ==========\n");
   fprintf(stdout,"num of columns: %d\n",handler->lowest_free_index);
@@ -114,10 +148,19 @@ void print_tsdb_info(tsdb_handler* handler) {
   fprintf(stdout,"most recent epoch: %s\n",str);
   fprintf(stdout,"time step between rows: %d s\n",handler->slot_duration);
   fprintf(stdout,"size of one value in TSDB: %d bytes\n",handler->values_len);
+  fprintf(stdout,"indexes per fragment: %u\n",handler->fragment_len);
+  if (tsdb_get_codec_stats(handler, &stats) == 0) {
+      for (i = 0; i < TSDB_NUM_FRAGMENT_CODECS; i++) {
+          bytes += stats.bytes[i];
+      }
+      fprintf(stdout,"bytes of fragment records and shared payloads: %llu\n",
+              (unsigned long long)(bytes + stats.payload_bytes));
+  }
   fprintf(stdout,"=========== EPOCHS ============\n");
   for(i = 0; i< handler->number_of_epochs; ++i) {
-      time2str(&(handler->epoch_list[i]), str, 30);
-      fprintf(stdout,"%5d: %s (%d)\n", i+1, str, handler->epoch_list[i]);
+      epoch = epoch_at(handler, i);
+      time2str(&epoch, str, 30);
+      fprintf(stdout,"%5d: %s (%d)\n", i+1, str, epoch);
   }
   fprintf(stdout,"===============================\n");
 }
@@ -221,6 +264,64 @@ ssize_t read_conf_file(void **buf) {
   return actual_size;
 }
 
+tsdb_value open_test_db(set_container* settings, const char* suffix, tsdb_handler* handler,
+                        u_int16_t* values_per_entry, tsdb_value unknown,
+                        char* file_name, u_int32_t* cur_time) {
+  /* Creates the DB <DB file>-<suffix> afresh, its name is written into
+   * file_name (256 bytes) and the current epoch into cur_time. Returns a
+   * value made of unknown_value bytes, that of unset indexes */
+    tsdb_value fill;
+
+    snprintf(file_name, 256, "%s-%s", settings->DB_file_name, suffix);
+    ensure_old_dbFile_is_gone(file_name);
+
+    if(tsdb_open(file_name,handler,values_per_entry,TIME_STEP,0)) {
+        fprintf (stderr, "%s: Couldn't create file %s; %s\n",
+                 program_invocation_short_name, file_name, strerror (errno));
+        exit(-1);
+    }
+    handler->unknown_value = unknown;
+    memset(&fill, handler->unknown_value, sizeof(fill));
+    *cur_time = time(NULL);
+    normalize_epoch(handler,cur_time);
+
+    return fill;
+}
+
+void reopen_test_db(const char* file_name, tsdb_handler* handler,
+                    u_int16_t* values_per_entry, tsdb_value unknown) {
+  /* Closes the DB and opens it again as a reader */
+    tsdb_close(handler);
+    if(tsdb_open(file_name,handler,values_per_entry,0,1)) {
+        fprintf (stderr, "%s: Couldn't open file %s; %s\n",
+                 program_invocation_short_name, file_name, strerror (errno));
+        exit(-1);
+    }
+    handler->unknown_value = unknown;
+}
+
+char** make_keys(const char* prefix, u_int32_t first, u_int32_t num_keys) {
+  /* Keys "<prefix>-<first>" to "<prefix>-<first + num_keys - 1>" */
+    char **keys = (char**) malloc(num_keys * sizeof(char*));
+    u_int32_t i;
+
+    for (i = 0; i < num_keys; i++) {
+        keys[i] = (char*) malloc(STRING_MAX_LEN);
+        sprintf(keys[i], "%s-%u", prefix, first + i);
+    }
+
+    return keys;
+}
+
+void free_keys(char** keys, u_int32_t num_keys) {
+    u_int32_t i;
+
+    for (i = 0; i < num_keys; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
 void populate_DB(set_container* settings, u_int32_t* index, int mode){
     tsdb_handler db_handler;
     char metric[32], timeStr[30];
@@ -231,8 +332,9 @@ void populate_DB(set_container* settings, u_int32_t* index, int mode){
     u_int32_t cur_time = time(NULL), first_time = 0, checkTime;
     u_int32_t num_Epochs = NUM_EPOCHS; // number of Epochs in the TSDB (effectively rows, not taking into account splitting in chunks)
     u_int32_t num_Metrics = METRICS_NUM, missed_epochs = 0, j;
-    u_int32_t *epoch_to_miss;
-    tsdb_value i, transient_value;
+    u_int32_t *epoch_to_miss, *batch_indexes, lowest_free_index;
+    char **batch_keys;
+    tsdb_value i, transient_value, *batch_values, *value;
     struct timeval time_start, time_end;
     struct timeval diff;
     float result = 0;
@@ -263,13 +365,26 @@ void populate_DB(set_container* settings, u_int32_t* index, int mode){
     }
 
     db_handler.unknown_value = 999;
+    if (settings->fragment_len) {
+        rv = tsdb_set_fragment_len(&db_handler, settings->fragment_len);
+        assert_int_equal(0,rv);
+    }
+    if (settings->num_workers) {
+        rv = tsdb_set_workers(&db_handler, settings->num_workers);
+        assert_int_equal(0,rv);
+    }
+    if (settings->flush_depth) {
+        rv = tsdb_set_async_flush(&db_handler, settings->flush_depth);
+        assert_int_equal(0,rv);
+    }
 
     normalize_epoch(&db_handler,&cur_time);
     first_time += cur_time + TIME_STEP * (NUM_EPOCHS - 1);
     time2str(&first_time, timeStr, 30);
     fprintf(stdout,"Most recent epoch will be (check it!): %s (UTC)\n", timeStr);
 
-    fprintf(stdout,"Start populating DB. Number of columns: %u, number of rows: %u\n", num_Metrics, num_Epochs);
+    fprintf(stdout,"Start populating DB. Number of columns: %u, number of rows: %u, compressing with %u worker(s)\n",
+            num_Metrics, num_Epochs, db_handler.num_workers);
 
     if (mode == RANDOM_FILL) {
         fprintf(stdout,"Using random column indices to write, every write call is affected by uniform time noise\n");
@@ -314,16 +429,109 @@ void populate_DB(set_container* settings, u_int32_t* index, int mode){
     }
     fprintf(stdout,"\n");
 
-    /* Checking erroneous intention handling (going into non-existent past)*/
-    fprintf(stdout,"Testing wrong epoch numbers addressing...");
+    /* Going into non-existent past creates the epoch, it stays missing unless written */
+    fprintf(stdout,"Testing past epoch numbers addressing...");
     for (j = 1; j < NUM_EPOCHS - 1; ++j) {
         if (!epoch_to_miss[j]) continue;
         time_noise = rand()%(TIME_STEP - 1);
         rv = tsdb_goto_epoch(&db_handler,cur_time + j*slot_duration + time_noise, 0, 1);
-        assert_int_equal(rv, -1);
+        assert_int_equal(rv, 0);
+        assert_int_equal(1, db_handler.chunk.new_epoch_flag);
     }
     fprintf(stdout," Done.\n");
 
+    /* Every epoch written so far must be in the DB once the flushes are over */
+    tsdb_flush_wait(&db_handler);
+    for (j = 0; j < NUM_EPOCHS; ++j) {
+        assert_int_equal(!epoch_to_miss[j], tsdb_epoch_exists(&db_handler, cur_time + j*slot_duration));
+    }
+    /* and positions in the epoch index skip the missing ones */
+    assert_int_equal(NUM_EPOCHS - missed_epochs, db_handler.number_of_epochs);
+    for (j = 0, checkTime = 0; j < NUM_EPOCHS; ++j) {
+        rv = tsdb_epoch_search(&db_handler, cur_time + j*slot_duration, &lowest_free_index);
+        assert_int_equal(!epoch_to_miss[j], rv);
+        assert_int_equal(checkTime, lowest_free_index);
+        if (!epoch_to_miss[j]) checkTime++;
+    }
+    rv = tsdb_epoch_search(&db_handler, cur_time + NUM_EPOCHS*slot_duration, &lowest_free_index);
+    assert_int_equal(0, rv);
+    assert_int_equal(db_handler.number_of_epochs, lowest_free_index);
+
+    /* Rewriting the last epoch with a single batch of the same values */
+    rv = tsdb_goto_epoch(&db_handler, cur_time + (NUM_EPOCHS - 1)*slot_duration, 1, 0);
+    assert_int_equal(0, rv);
+    batch_indexes = (u_int32_t*) malloc((METRICS_NUM + 1) * sizeof(u_int32_t));
+    batch_values = (tsdb_value*) malloc(METRICS_NUM * sizeof(tsdb_value));
+    for (j = 0; j < METRICS_NUM; ++j) {
+        batch_indexes[j] = index[j];
+        batch_values[j] = index[j];
+    }
+    batch_indexes[METRICS_NUM] = db_handler.lowest_free_index;
+    rv = tsdb_set_batch(&db_handler, batch_indexes, batch_values, METRICS_NUM + 1);
+    assert_int_equal(-1, rv);
+
+    gettimeofday(&time_start, NULL);
+    rv = tsdb_set_batch(&db_handler, batch_indexes, batch_values, METRICS_NUM);
+    gettimeofday(&time_end, NULL);
+    assert_int_equal(0, rv);
+    for (j = 0; j < METRICS_NUM; ++j) {
+        rv = tsdb_get_by_index(&db_handler, &j, &value);
+        assert_int_equal(0, rv);
+        assert_ulong_equal(j, *value);
+    }
+    free(batch_indexes);
+
+    timeval_subtract(&diff, &time_start, &time_end);
+    fprintf(stdout,"Wrote a row in one batch for %.6f s\n", timeval2float(&diff));
+
+    /* and once more as a contiguous range */
+    for (j = 0; j < METRICS_NUM; ++j) {
+        batch_values[j] = j;
+    }
+    rv = tsdb_row_write(&db_handler, 1, METRICS_NUM + KEY_BATCH, batch_values);
+    assert_int_equal(-1, rv);
+    gettimeofday(&time_start, NULL);
+    rv = tsdb_row_write(&db_handler, 0, METRICS_NUM, batch_values);
+    gettimeofday(&time_end, NULL);
+    assert_int_equal(0, rv);
+    rv = tsdb_row_span(&db_handler, 0, METRICS_NUM, &value);
+    assert_int_equal(0, rv);
+    assert_int_equal(0, memcmp(batch_values, value, METRICS_NUM * sizeof(tsdb_value)));
+    free(batch_values);
+
+    timeval_subtract(&diff, &time_start, &time_end);
+    fprintf(stdout,"Wrote a row as a range for %.6f s\n", timeval2float(&diff));
+
+    /* Resolving a batch of keys, every other one is new */
+    batch_keys = (char**) malloc(KEY_BATCH * sizeof(char*));
+    batch_indexes = (u_int32_t*) malloc(KEY_BATCH * sizeof(u_int32_t));
+    for (j = 0; j < KEY_BATCH; ++j) {
+        batch_keys[j] = (char*) malloc(STRING_MAX_LEN);
+        if (j % 2) {
+            sprintf(batch_keys[j], "metric-%u", j + 1);
+        } else {
+            sprintf(batch_keys[j], "device-%u", j);
+        }
+    }
+    lowest_free_index = db_handler.lowest_free_index;
+    rv = tsdb_resolve_keys(&db_handler, batch_keys, KEY_BATCH, batch_indexes, 0);
+    assert_int_equal(-1, rv);
+    assert_int_equal(lowest_free_index, db_handler.lowest_free_index);
+
+    gettimeofday(&time_start, NULL);
+    rv = tsdb_resolve_keys(&db_handler, batch_keys, KEY_BATCH, batch_indexes, 1);
+    gettimeofday(&time_end, NULL);
+    assert_int_equal(0, rv);
+    for (j = 0; j < KEY_BATCH; ++j) {
+        assert_int_equal((j % 2) ? j : lowest_free_index + j / 2, batch_indexes[j]);
+        free(batch_keys[j]);
+    }
+    assert_int_equal(lowest_free_index + KEY_BATCH / 2, db_handler.lowest_free_index);
+    free(batch_keys);
+    free(batch_indexes);
+
+    timeval_subtract(&diff, &time_start, &time_end);
+    fprintf(stdout,"Resolved %u keys, %u of them new, for %.6f s\n", KEY_BATCH, KEY_BATCH / 2, timeval2float(&diff));
 
     tsdb_flush(&db_handler);
     print_tsdb_info(&db_handler);
@@ -349,8 +557,9 @@ void query_and_profile_DB(set_container* settings, u_int32_t* index){
 	u_int32_t j, i, *epoch_to_miss = NULL;
 	ssize_t len;
 	u_int16_t values_per_entry;
-	float one_value_read=0, row_read=0;
-	tsdb_value **interim_data, *returnedValue;
+	float one_value_read=0, row_read=0, span_read=0;
+	tsdb_value **interim_data, *returnedValue, *span, *range_values, unknown;
+	u_int32_t range_indexes[5], *range_epochs, range_num;
 	struct timeval time_start, time_end, time_start_long;
 	struct timeval diff;
 
@@ -382,15 +591,31 @@ void query_and_profile_DB(set_container* settings, u_int32_t* index){
 	}
 	/* 2. List of epochs is correct, all epochs exist and are available */
 	for(j=0; j < db_handler.number_of_epochs; j++) {
-		rv = tsdb_goto_epoch(&db_handler, db_handler.epoch_list[j], 1, 0);
+		rv = tsdb_goto_epoch(&db_handler, epoch_at(&db_handler, j), 1, 0);
 		assert_int_equal(0,rv);
 	}
 
+	/* 3. All keys are known right after opening and resolve to their indices */
+	assert_int_equal(db_handler.lowest_free_index, db_handler.keymap.num_entries);
+	gettimeofday(&time_start_long, NULL);
+	for(i=0; i < METRICS_NUM; i++) {
+		char metric[STRING_MAX_LEN];
+		u_int32_t key_index;
+
+		sprintf(metric,"metric-%u",i+1);
+		rv = tsdb_get_key_index(&db_handler, metric, &key_index);
+		assert_int_equal(0,rv);
+		assert_int_equal(i,key_index);
+	}
+	gettimeofday(&time_end, NULL);
+	timeval_subtract(&diff, &time_start_long, &time_end);
+	fprintf(stdout,"We have resolved all %u keys to indices. It took: %lu.%06lu s\n",METRICS_NUM,diff.tv_sec,diff.tv_usec);
+
 	/* Test performance of reading 1 column (with index METRICS_NUM/2) in the TSDB */
 	gettimeofday(&time_start_long, NULL);
 
 	for(j=0; j < db_handler.number_of_epochs; j++) {
-		rv = tsdb_goto_epoch(&db_handler, db_handler.epoch_list[j], 1, 0);
+		rv = tsdb_goto_epoch(&db_handler, epoch_at(&db_handler, j), 1, 0);
 		assert_int_equal(0,rv);
 
 		/* Let's check if the retrieved value is the one we have stored originally in the TSDB */
@@ -408,6 +633,133 @@ void query_and_profile_DB(set_container* settings, u_int32_t* index){
 	timeval_subtract(&diff, &time_start_long, &time_end);
 	fprintf(stdout,"We have read successfully 1 column in the TSDB. It took: %lu.%06lu s\n",diff.tv_sec,diff.tv_usec);
 
+	/* The same column with fragments decompressed by the calling thread only */
+	if(tsdb_open(settings->DB_file_name,&db_handler,&values_per_entry,0,1)) {
+		fprintf (stderr, "%s: Couldn't open file %s; %s\n",
+				program_invocation_short_name, settings->DB_file_name, strerror (errno));
+		exit(-1);
+	}
+	u_int16_t num_workers = db_handler.num_workers;
+	rv = tsdb_set_workers(&db_handler, 1);
+	assert_int_equal(0,rv);
+
+	gettimeofday(&time_start_long, NULL);
+	for(j=0; j < db_handler.number_of_epochs; j++) {
+		rv = tsdb_goto_epoch(&db_handler, epoch_at(&db_handler, j), 1, 0);
+		assert_int_equal(0,rv);
+
+		rv=tsdb_get_by_index(&db_handler,&index[METRICS_NUM/2],&returnedValue);
+		assert_int_equal(0,rv);
+		assert_int_equal(index[METRICS_NUM/2],*returnedValue);
+	}
+	gettimeofday(&time_end, NULL);
+	tsdb_close(&db_handler);
+
+	timeval_subtract(&diff, &time_start_long, &time_end);
+	fprintf(stdout,"We have read successfully 1 column in the TSDB with 1 worker instead of %u. It took: %lu.%06lu s\n",num_workers,diff.tv_sec,diff.tv_usec);
+
+	/* The same column once more, but only the fragment holding it gets decompressed */
+	if(tsdb_open(settings->DB_file_name,&db_handler,&values_per_entry,0,1)) {
+		fprintf (stderr, "%s: Couldn't open file %s; %s\n",
+				program_invocation_short_name, settings->DB_file_name, strerror (errno));
+		exit(-1);
+	}
+	db_handler.lazy_load = 1;
+
+	gettimeofday(&time_start_long, NULL);
+	for(j=0; j < db_handler.number_of_epochs; j++) {
+		rv = tsdb_goto_epoch(&db_handler, epoch_at(&db_handler, j), 1, 0);
+		assert_int_equal(0,rv);
+
+		rv=tsdb_get_by_index(&db_handler,&index[METRICS_NUM/2],&returnedValue);
+		assert_int_equal(0,rv);
+		assert_int_equal(index[METRICS_NUM/2],*returnedValue);
+	}
+	gettimeofday(&time_end, NULL);
+	tsdb_close(&db_handler);
+
+	timeval_subtract(&diff, &time_start_long, &time_end);
+	fprintf(stdout,"We have read successfully 1 column in the TSDB loading epochs lazily. It took: %lu.%06lu s\n",diff.tv_sec,diff.tv_usec);
+
+	/* Same lazy read twice with the fragment cache on, the second pass must not decompress anything */
+	if(tsdb_open(settings->DB_file_name,&db_handler,&values_per_entry,0,1)) {
+		fprintf (stderr, "%s: Couldn't open file %s; %s\n",
+				program_invocation_short_name, settings->DB_file_name, strerror (errno));
+		exit(-1);
+	}
+	db_handler.lazy_load = 1;
+	tsdb_set_cache_budget(&db_handler, 64 * 1024 * 1024);
+
+	for(i=0; i < 2; i++) {
+		u_int64_t hits_before = db_handler.cache.hits;
+
+		gettimeofday(&time_start_long, NULL);
+		for(j=0; j < db_handler.number_of_epochs; j++) {
+			rv = tsdb_goto_epoch(&db_handler, epoch_at(&db_handler, j), 1, 0);
+			assert_int_equal(0,rv);
+
+			rv=tsdb_get_by_index(&db_handler,&index[METRICS_NUM/2],&returnedValue);
+			assert_int_equal(0,rv);
+			assert_int_equal(index[METRICS_NUM/2],*returnedValue);
+		}
+		gettimeofday(&time_end, NULL);
+		if (i == 1) {
+			assert_true(db_handler.cache.hits - hits_before >= db_handler.number_of_epochs);
+		}
+
+		timeval_subtract(&diff, &time_start_long, &time_end);
+		fprintf(stdout,"We have read successfully 1 column in the TSDB with the fragment cache (pass %u). It took: %lu.%06lu s\n",i+1,diff.tv_sec,diff.tv_usec);
+	}
+	fprintf(stdout,"Fragment cache: %llu hits, %llu misses, %llu evictions\n",
+			(unsigned long long)db_handler.cache.hits, (unsigned long long)db_handler.cache.misses,
+			(unsigned long long)db_handler.cache.evictions);
+	tsdb_close(&db_handler);
+
+	/* Test reading a few columns over a range of epochs at once */
+	if(tsdb_open(settings->DB_file_name,&db_handler,&values_per_entry,0,1)) {
+		fprintf (stderr, "%s: Couldn't open file %s; %s\n",
+				program_invocation_short_name, settings->DB_file_name, strerror (errno));
+		exit(-1);
+	}
+	range_indexes[0] = index[METRICS_NUM/2];
+	range_indexes[1] = 0;
+	range_indexes[2] = TSDB_NO_INDEX;
+	range_indexes[3] = METRICS_NUM - 1;
+	range_indexes[4] = METRICS_NUM; // mapped to a key, but never written
+	memset(&unknown, db_handler.unknown_value, sizeof(unknown));
+
+	gettimeofday(&time_start, NULL);
+	rv = tsdb_get_range(&db_handler, epoch_at(&db_handler, 0), db_handler.most_recent_epoch,
+			range_indexes, 5, &range_epochs, &range_values, &range_num);
+	gettimeofday(&time_end, NULL);
+	assert_int_equal(0,rv);
+	assert_int_equal(db_handler.number_of_epochs, range_num);
+	for(j=0; j < range_num; j++) {
+		assert_int_equal(epoch_at(&db_handler, j), range_epochs[j]);
+		for(i=0; i < 5; i++) {
+			if (range_indexes[i] < METRICS_NUM) {
+				assert_ulong_equal(range_indexes[i], range_values[j*5 + i]);
+			} else {
+				assert_ulong_equal(unknown, range_values[j*5 + i]);
+			}
+		}
+	}
+	free(range_epochs);
+	free(range_values);
+	timeval_subtract(&diff, &time_start, &time_end);
+	fprintf(stdout,"We have read successfully 4 columns in the TSDB as a range. It took: %lu.%06lu s\n",diff.tv_sec,diff.tv_usec);
+
+	/* a range within the history, bounds not normalized */
+	rv = tsdb_get_range(&db_handler, epoch_at(&db_handler, 1) + 1, db_handler.most_recent_epoch - 1,
+			range_indexes, 5, &range_epochs, &range_values, &range_num);
+	assert_int_equal(0,rv);
+	assert_int_equal(db_handler.number_of_epochs - 2, range_num);
+	assert_int_equal(epoch_at(&db_handler, 1), range_epochs[0]);
+	assert_ulong_equal(range_indexes[0], range_values[(range_num - 1)*5]);
+	free(range_epochs);
+	free(range_values);
+	tsdb_close(&db_handler);
+
 	/* Test performance of reading all columns in the TSDB */
 	/* Testing separately contiguous and random access reading within a row
 	 * does not make much sense as the whole row gets loaded into memory,
@@ -447,7 +799,7 @@ void query_and_profile_DB(set_container* settings, u_int32_t* index){
 
 	gettimeofday(&time_start_long, NULL);
 	for(j=0; j < db_handler.number_of_epochs; j++) {
-		rv = tsdb_goto_epoch(&db_handler, db_handler.epoch_list[j], 1, 0);
+		rv = tsdb_goto_epoch(&db_handler, epoch_at(&db_handler, j), 1, 0);
 		assert_int_equal(0,rv);
 
 		/* Profiling time to read a one random value within a row */
@@ -471,6 +823,19 @@ void query_and_profile_DB(set_container* settings, u_int32_t* index){
 		gettimeofday(&time_end, NULL);
 		timeval_subtract(&diff,&time_start,&time_end);
 		row_read += timeval2float(&diff);
+
+		/* Profiling time to read a whole row at once */
+		gettimeofday(&time_start, NULL);
+		rv=tsdb_row_span(&db_handler, 0, METRICS_NUM, &span);
+		assert_int_equal(0,rv);
+		for(i=0;i < METRICS_NUM; ++i){
+			assert_int_equal(i, span[i]);
+		}
+		gettimeofday(&time_end, NULL);
+		timeval_subtract(&diff,&time_start,&time_end);
+		span_read += timeval2float(&diff);
+		rv=tsdb_row_span(&db_handler, 1, METRICS_NUM, &span);
+		assert_int_equal(-1,rv);
 		//fprintf(stdout,"Time to read %lu random values from the same epoch: %lu.%06lu s\n", METRICS_NUM, diff.tv_sec,diff.tv_usec); fflush(stdout);
 	}
 
@@ -492,6 +857,1153 @@ void query_and_profile_DB(set_container* settings, u_int32_t* index){
 	fprintf(stdout,"We have read successfully all %u columns in the TSDB. It took: %lu.%06lu s\n",METRICS_NUM,diff.tv_sec,diff.tv_usec);
 	fprintf(stdout,"Avg time to read one random element in a row: %.6f\n", one_value_read / NUM_EPOCHS);
 	fprintf(stdout,"Avg time to read a row: %.6f\n", row_read / NUM_EPOCHS);
+	fprintf(stdout,"Avg time to read a row as a span: %.6f\n", span_read / NUM_EPOCHS);
+}
+
+tsdb_value cold_value(u_int32_t epoch_num, u_int32_t index) {
+    /* counters in the first fragment, gauges jumping around in the second one */
+    if (index < CHUNK_GROWTH) {
+        return (tsdb_value)epoch_num * 100000 + index;
+    }
+    return ((tsdb_value)(epoch_num * 2654435761u) ^ index) * 0x9E3779B97F4A7C15ULL;
+}
+
+void compaction_DB(set_container* settings, u_int8_t codec) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_epochs = 2 * SEGMENT_EPOCHS + 10, num_keys = 2 * CHUNK_GROWTH;
+    u_int32_t cur_time, i, j, pass, range_num, *key_indexes, *range_epochs;
+    u_int32_t batch_indexes[100], range_indexes[5] = { 3, CHUNK_GROWTH + 49, TSDB_NO_INDEX, 7000, 49 };
+    tsdb_value batch_values[100], *range_values, *value, unknown;
+    int rv;
+
+    unknown = open_test_db(settings, "cold", &db_handler, &values_per_entry, 999,
+                           file_name, &cur_time);
+
+    db_handler.segment_codec = codec;
+    rv = tsdb_set_compaction(&db_handler, 5 * TIME_STEP);
+    assert_int_equal(0,rv);
+
+    keys = make_keys("cold", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+
+    /* two fragments, 50 indexes written in each of them */
+    fprintf(stdout,"Writing %u epochs to be compacted with codec %u...", num_epochs, codec);
+    for (j = 0; j < num_epochs; j++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (j == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        for (i = 0; i < 100; i++) {
+            batch_indexes[i] = (i < 50 ? i : CHUNK_GROWTH + i - 50);
+            batch_values[i] = cold_value(j, batch_indexes[i]);
+        }
+        rv = tsdb_set_batch(&db_handler, batch_indexes, batch_values, 100);
+        assert_int_equal(0,rv);
+    }
+    tsdb_flush(&db_handler);
+    tsdb_compaction_wait(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    /* the last segment is not old enough */
+    assert_int_equal(2, db_handler.compactor.cold_segments);
+
+    for (pass = 0; pass < 2; pass++) {
+        /* a range starting within the first cold segment and ending in the head */
+        rv = tsdb_get_range(&db_handler, epoch_at(&db_handler, 200), db_handler.most_recent_epoch,
+                            range_indexes, 5, &range_epochs, &range_values, &range_num);
+        assert_int_equal(0,rv);
+        assert_int_equal(num_epochs - 200, range_num);
+        for (j = 0; j < range_num; j++) {
+            assert_int_equal(cur_time + (200 + j)*TIME_STEP, range_epochs[j]);
+            for (i = 0; i < 5; i++) {
+                if (range_indexes[i] == TSDB_NO_INDEX || range_indexes[i] == 7000) {
+                    assert_ulong_equal(unknown, range_values[j*5 + i]);
+                } else {
+                    assert_ulong_equal(cold_value(200 + j, range_indexes[i]), range_values[j*5 + i]);
+                }
+            }
+        }
+        free(range_epochs);
+        free(range_values);
+
+        /* cold epochs are still loaded as a whole and lazily */
+        for (j = 100; j < 400; j += 150) {
+            rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            rv = tsdb_get_by_index(&db_handler, &range_indexes[1], &value);
+            assert_int_equal(0,rv);
+            assert_ulong_equal(cold_value(j, range_indexes[1]), *value);
+            rv = tsdb_get_by_index(&db_handler, &range_indexes[0], &value);
+            assert_int_equal(0,rv);
+            assert_ulong_equal(cold_value(j, range_indexes[0]), *value);
+            rv = tsdb_get_by_index(&db_handler, &range_indexes[3], &value);
+            assert_int_equal(0,rv);
+            assert_ulong_equal(unknown, *value);
+            db_handler.lazy_load = !db_handler.lazy_load;
+        }
+
+        /* once more by a reader */
+        reopen_test_db(file_name, &db_handler, &values_per_entry, 999);
+        assert_int_equal(-1, tsdb_set_compaction(&db_handler, TIME_STEP));
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Cold segments are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+tsdb_value delta_value(u_int32_t epoch_num, u_int32_t index, tsdb_value unknown) {
+    // the first 50 indexes of two fragments, the second one in even epochs only
+    if (index % CHUNK_GROWTH >= 50 || (index >= CHUNK_GROWTH && epoch_num % 2)) {
+        return unknown;
+    }
+    return cold_value(epoch_num, index);
+}
+
+void delta_frames_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_epochs = SEGMENT_EPOCHS + 20, num_keys = 2 * CHUNK_GROWTH, rewritten = SEGMENT_EPOCHS + 5;
+    u_int32_t cur_time, i, j, pass, range_num, *key_indexes, *range_epochs, before;
+    u_int32_t batch_indexes[100], range_indexes[3] = { 3, CHUNK_GROWTH + 49, 7000 };
+    tsdb_value batch_values[100], *range_values, *value, unknown, expected;
+    int rv;
+
+    unknown = open_test_db(settings, "delta", &db_handler, &values_per_entry, 999,
+                           file_name, &cur_time);
+
+    assert_int_equal(0, tsdb_set_delta_frames(&db_handler, 8));
+    assert_int_equal(0, tsdb_set_async_flush(&db_handler, 2));
+    assert_int_equal(0, tsdb_set_compaction(&db_handler, 5 * TIME_STEP));
+
+    keys = make_keys("delta", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+
+    fprintf(stdout,"Writing %u epochs as delta frames...", num_epochs);
+    for (j = 0; j < num_epochs; j++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (j == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        for (i = 0; i < 100; i++) {
+            batch_indexes[i] = (i < 50 ? i : CHUNK_GROWTH + i - 50);
+            batch_values[i] = cold_value(j, batch_indexes[i]);
+        }
+        rv = tsdb_set_batch(&db_handler, batch_indexes, batch_values, (j % 2 ? 50 : 100));
+        assert_int_equal(0,rv);
+    }
+    tsdb_flush(&db_handler);
+    tsdb_compaction_wait(&db_handler);
+    assert_int_equal(1, db_handler.compactor.cold_segments);
+
+    /* no epoch is inserted before compacted ones */
+    assert_int_equal(-1, tsdb_goto_epoch(&db_handler, cur_time - TIME_STEP, 0, 1));
+    before = cur_time - TIME_STEP, batch_indexes[0] = 3, batch_values[0] = 1;
+    assert_int_equal(-1, tsdb_backfill(&db_handler, &before, batch_indexes, batch_values, 1));
+
+    /* the next epoch is a delta frame of the one rewritten */
+    rv = tsdb_goto_epoch(&db_handler, cur_time + rewritten*TIME_STEP, 1, 0);
+    assert_int_equal(0,rv);
+    batch_values[0] = 12345;
+    rv = tsdb_set_batch(&db_handler, range_indexes, batch_values, 1);
+    assert_int_equal(0,rv);
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    for (pass = 0; pass < 2; pass++) {
+        for (j = 0; j < num_epochs; j++) {
+            rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = 0; i < 3; i++) {
+                rv = tsdb_get_by_index(&db_handler, &range_indexes[i], &value);
+                if (range_indexes[i] >= CHUNK_GROWTH && j % 2) {
+                    assert_int_equal(-1,rv); // odd epochs hold a single fragment
+                    continue;
+                }
+                assert_int_equal(0,rv);
+                expected = (j == rewritten && i == 0 ? 12345 : delta_value(j, range_indexes[i], unknown));
+                assert_ulong_equal(expected, *value);
+            }
+            db_handler.lazy_load = !db_handler.lazy_load;
+        }
+
+        /* starting within a chain, in the cold segment */
+        rv = tsdb_get_range(&db_handler, epoch_at(&db_handler, SEGMENT_EPOCHS - 3), db_handler.most_recent_epoch,
+                            range_indexes, 3, &range_epochs, &range_values, &range_num);
+        assert_int_equal(0,rv);
+        assert_int_equal(23, range_num);
+        for (j = 0; j < range_num; j++) {
+            for (i = 0; i < 3; i++) {
+                expected = (SEGMENT_EPOCHS - 3 + j == rewritten && i == 0 ? 12345 :
+                            delta_value(SEGMENT_EPOCHS - 3 + j, range_indexes[i], unknown));
+                assert_ulong_equal(expected, range_values[j*3 + i]);
+            }
+        }
+        free(range_epochs);
+        free(range_values);
+
+        /* once more by a reader */
+        reopen_test_db(file_name, &db_handler, &values_per_entry, 999);
+        assert_int_equal(-1, tsdb_set_delta_frames(&db_handler, 8));
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Delta frames are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+tsdb_value codec_value(u_int32_t epoch_num, u_int32_t index) {
+    // a constant fragment, small and large pseudo-random values, a repeated pattern
+    u_int64_t z = ((u_int64_t)epoch_num * 4 * CHUNK_GROWTH + index + 1) * 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 31)) * 0xBF58476D1CE4E5B9ULL;
+    z ^= z >> 29;
+    switch (index / CHUNK_GROWTH) {
+    case 0:
+        return 7;
+    case 1:
+        return z & 1023;
+    case 2:
+        return z;
+    default:
+        return (index % 97) * 1000003 + epoch_num;
+    }
+}
+
+void fragment_codecs_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_epochs = 4, num_keys = 4 * CHUNK_GROWTH;
+    u_int32_t cur_time, i, j, pass, *key_indexes, *range_epochs, range_num, codec;
+    u_int32_t range_indexes[4] = { 5, CHUNK_GROWTH + 77, 2 * CHUNK_GROWTH + 9999, 3 * CHUNK_GROWTH };
+    tsdb_value *row, *value, *range_values;
+    u_int64_t num_fragments;
+    tsdb_codec_stats stats;
+    int rv;
+
+    open_test_db(settings, "codecs", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+
+    keys = make_keys("codec", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+
+    fprintf(stdout,"Writing %u epochs of fragments for different codecs...", num_epochs);
+    row = (tsdb_value*) malloc(num_keys * sizeof(tsdb_value));
+    for (j = 0; j < num_epochs; j++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (j == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        for (i = 0; i < num_keys; i++) {
+            row[i] = codec_value(j, i);
+        }
+        /* the last epoch without picking codecs */
+        if (j == num_epochs - 1) {
+            tsdb_set_codec_budget(&db_handler, 0);
+        }
+        rv = tsdb_row_write(&db_handler, 0, num_keys, row);
+        assert_int_equal(0,rv);
+    }
+    free(row);
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    for (pass = 0; pass < 2; pass++) {
+        assert_int_equal(0, tsdb_get_codec_stats(&db_handler, &stats));
+        assert_true(stats.fragments[TSDB_FRAGMENT_RLE] >= num_epochs - 1);
+        assert_true(stats.fragments[TSDB_FRAGMENT_FOR] >= num_epochs - 1);
+        assert_true(stats.fragments[TSDB_FRAGMENT_RAW] >= num_epochs - 1);
+        assert_true(stats.fragments[TSDB_FRAGMENT_QLZ] >= 4);
+        for (codec = 0, num_fragments = 0; codec < TSDB_NUM_FRAGMENT_CODECS; codec++) {
+            num_fragments += stats.fragments[codec];
+        }
+        assert_int_equal(4 * num_epochs, num_fragments);
+
+        /* bit-packed fragments are read value by value when loading lazily */
+        for (j = 0; j < num_epochs; j++) {
+            db_handler.lazy_load = j % 2;
+            rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = j; i < num_keys; i += 37) {
+                rv = tsdb_get_by_index(&db_handler, &i, &value);
+                assert_int_equal(0,rv);
+                assert_ulong_equal(codec_value(j, i), *value);
+            }
+        }
+
+        rv = tsdb_get_range(&db_handler, cur_time, cur_time + (num_epochs - 1)*TIME_STEP,
+                            range_indexes, 4, &range_epochs, &range_values, &range_num);
+        assert_int_equal(0,rv);
+        assert_int_equal(num_epochs, range_num);
+        for (j = 0; j < range_num; j++) {
+            for (i = 0; i < 4; i++) {
+                assert_ulong_equal(codec_value(j, range_indexes[i]), range_values[j*4 + i]);
+            }
+        }
+        free(range_epochs);
+        free(range_values);
+
+        /* once more by a reader */
+        reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Fragments of all codecs are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+void sparse_fragments_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_keys = 8 * CHUNK_GROWTH, cur_time, i, j, pass, *key_indexes;
+    u_int32_t indexes[3] = { 7 * CHUNK_GROWTH + 5, 3, 4 * CHUNK_GROWTH }, *range_epochs, range_num;
+    tsdb_value *value, *range_values, unknown, written = 4242, batch_values[2];
+    tsdb_codec_stats stats;
+    int rv;
+
+    unknown = open_test_db(settings, "sparse", &db_handler, &values_per_entry, 0x55,
+                           file_name, &cur_time);
+
+    keys = make_keys("sparse", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+
+    /* a single high index, then a batch also writing a low fragment, whose index is unset again */
+    fprintf(stdout,"Writing sparse epochs...");
+    rv = tsdb_goto_epoch(&db_handler, cur_time, 0, 1);
+    assert_int_equal(0,rv);
+    rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+    assert_int_equal(0,rv);
+    rv = tsdb_set_by_index(&db_handler, &written, &indexes[0]);
+    assert_int_equal(0,rv);
+    rv = tsdb_goto_epoch(&db_handler, cur_time + TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    batch_values[0] = written;
+    batch_values[1] = unknown;
+    rv = tsdb_set_batch(&db_handler, indexes, batch_values, 2);
+    assert_int_equal(0,rv);
+    rv = tsdb_unset_by_index(&db_handler, &indexes[1]);
+    assert_int_equal(0,rv);
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    for (pass = 0; pass < 2; pass++) {
+        assert_int_equal(0, tsdb_get_codec_stats(&db_handler, &stats));
+        assert_int_equal(2, stats.fragments[TSDB_FRAGMENT_QLZ] + stats.fragments[TSDB_FRAGMENT_RAW] +
+                         stats.fragments[TSDB_FRAGMENT_RLE] + stats.fragments[TSDB_FRAGMENT_FOR] +
+                         stats.fragments[TSDB_FRAGMENT_QLZ3] + stats.fragments[TSDB_FRAGMENT_FOR_QLZ]);
+        assert_int_equal(pass ? 0 : 1, stats.skipped);
+
+        for (j = 0; j < 2; j++) {
+            db_handler.lazy_load = pass;
+            rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = 0; i < 3; i++) {
+                rv = tsdb_get_by_index(&db_handler, &indexes[i], &value);
+                assert_int_equal(0,rv);
+                assert_ulong_equal(i == 0 ? written : unknown, *value);
+            }
+        }
+
+        rv = tsdb_get_range(&db_handler, cur_time, cur_time + TIME_STEP,
+                            indexes, 3, &range_epochs, &range_values, &range_num);
+        assert_int_equal(0,rv);
+        assert_int_equal(2, range_num);
+        for (j = 0; j < range_num * 3; j++) {
+            assert_ulong_equal(j % 3 == 0 ? written : unknown, range_values[j]);
+        }
+        free(range_epochs);
+        free(range_values);
+
+        /* once more by a reader */
+        reopen_test_db(file_name, &db_handler, &values_per_entry, 0x55);
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Sparse epochs are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+void validity_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_keys = 2 * CHUNK_GROWTH + 2, cur_time, i, j, e, pass, *key_indexes;
+    u_int32_t indexes[6] = { 5, 7, 9, 150, CHUNK_GROWTH + 17, 2 * CHUNK_GROWTH + 1 };
+    u_int32_t bits[256 / BITS_PER_WORD], set, *range_epochs, range_num;
+    tsdb_value *value, *row, *range_values, zero = 0, expected;
+    int rv, missing;
+
+    open_test_db(settings, "validity", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+    assert_int_equal(0, tsdb_set_delta_frames(&db_handler, 8));
+
+    keys = make_keys("validity", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+    row = (tsdb_value*) malloc(CHUNK_GROWTH * sizeof(tsdb_value));
+
+    /* index 5 is set to zero, the unknown value, 7 in even epochs only, 9 when
+     * the first epoch is written again, 100 to 199 and the second fragment in
+     * all of them; the third fragment is set and unset, thus never stored */
+    fprintf(stdout,"Writing epochs with missing indexes...");
+    for (e = 0; e < 3; e++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (e == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        assert_int_equal(0, tsdb_set_by_index(&db_handler, &zero, &indexes[0]));
+        if (e % 2 == 0) {
+            expected = 42 + e;
+            assert_int_equal(0, tsdb_set_by_index(&db_handler, &expected, &indexes[1]));
+        }
+        for (i = 0; i < 100; i++) {
+            row[i] = 100 + i + e;
+        }
+        assert_int_equal(0, tsdb_row_write(&db_handler, 100, 100, row));
+        for (i = 0; i < CHUNK_GROWTH; i++) {
+            row[i] = (i * 7919 + e) % 1000;
+        }
+        assert_int_equal(0, tsdb_row_write(&db_handler, CHUNK_GROWTH, CHUNK_GROWTH, row));
+        assert_int_equal(0, tsdb_set_by_index(&db_handler, &zero, &indexes[5]));
+        assert_int_equal(0, tsdb_unset_by_index(&db_handler, &indexes[5]));
+        tsdb_flush(&db_handler);
+    }
+    rv = tsdb_goto_epoch(&db_handler, cur_time, 0, 1);
+    assert_int_equal(0,rv);
+    expected = 9;
+    assert_int_equal(0, tsdb_set_by_index(&db_handler, &expected, &indexes[2]));
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    for (pass = 0; pass < 4; pass++) {
+        db_handler.lazy_load = pass % 2;
+        for (e = 0; e < 3; e++) {
+            rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = 0; i < 6; i++) {
+                missing = (i == 1 && e % 2) || (i == 2 && e) || i == 5;
+                expected = i == 1 ? 42 + e : i == 2 ? 9 : i == 3 ? 100 + 50 + e :
+                    i == 4 ? (17 * 7919 + e) % 1000 : 0;
+                rv = tsdb_get_valid_by_index(&db_handler, &indexes[i], &value);
+                assert_int_equal(missing ? TSDB_MISSING : 0, rv);
+                assert_ulong_equal(missing ? 0 : expected, *value);
+            }
+
+            rv = tsdb_get_validity(&db_handler, 0, 256, bits);
+            assert_int_equal(0,rv);
+            for (j = 0; j < 256; j++) {
+                set = j == 5 || (j == 7 && e % 2 == 0) || (j == 9 && e == 0) || (j >= 100 && j < 200);
+                assert_int_equal(set, (bits[j / BITS_PER_WORD] >> (j % BITS_PER_WORD)) & 1);
+            }
+
+            /* beyond the epoch, and across its end */
+            memset(bits, 0xFF, sizeof(bits));
+            rv = tsdb_get_validity(&db_handler, 100000, 64, bits);
+            assert_int_equal(0,rv);
+            rv = tsdb_get_validity(&db_handler, 0xFFFFFFF0, 64, &bits[64 / BITS_PER_WORD]);
+            assert_int_equal(0,rv);
+            for (j = 0; j < 128; j++) {
+                assert_int_equal(0, (bits[j / BITS_PER_WORD] >> (j % BITS_PER_WORD)) & 1);
+            }
+            rv = tsdb_get_validity(&db_handler, 2 * CHUNK_GROWTH - 32, 64, bits);
+            assert_int_equal(0,rv);
+            for (j = 0; j < 64; j++) {
+                assert_int_equal(j < 32, (bits[j / BITS_PER_WORD] >> (j % BITS_PER_WORD)) & 1);
+            }
+        }
+
+        rv = tsdb_get_range(&db_handler, cur_time, cur_time + 2*TIME_STEP,
+                            indexes, 6, &range_epochs, &range_values, &range_num);
+        assert_int_equal(0,rv);
+        assert_int_equal(3, range_num);
+        for (e = 0; e < 3; e++) {
+            assert_ulong_equal(e % 2 ? 0 : 42 + e, range_values[e*6 + 1]);
+            assert_ulong_equal(e ? 0 : 9, range_values[e*6 + 2]);
+            assert_ulong_equal(100 + 50 + e, range_values[e*6 + 3]);
+            assert_ulong_equal(0, range_values[e*6 + 5]);
+        }
+        free(range_epochs);
+        free(range_values);
+
+        /* once more by a reader */
+        if (pass == 1) {
+            reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+        }
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Missing indexes are told from set ones.\n");
+
+    /* cold segments keep the validity bitmaps of the compacted epochs */
+    fprintf(stdout,"Compacting epochs with missing indexes...");
+    assert_int_equal(0, tsdb_open(file_name, &db_handler, &values_per_entry, TIME_STEP, 0));
+    db_handler.unknown_value = 0;
+    assert_int_equal(0, tsdb_set_compaction(&db_handler, 5 * TIME_STEP));
+    for (e = 3; e < SEGMENT_EPOCHS + 6; e++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        expected = 100 + 50 + e;
+        assert_int_equal(0, tsdb_set_by_index(&db_handler, &expected, &indexes[3]));
+    }
+    tsdb_flush(&db_handler);
+    tsdb_compaction_wait(&db_handler);
+    assert_int_equal(1, db_handler.compactor.cold_segments);
+    fprintf(stdout," Done.\n");
+
+    for (pass = 0; pass < 2; pass++) {
+        db_handler.lazy_load = pass;
+        for (e = 0; e < 3; e++) {
+            rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = 0; i < 4; i++) {
+                missing = (i == 1 && e % 2) || (i == 2 && e);
+                expected = i == 1 ? 42 + e : i == 2 ? 9 : i == 3 ? 100 + 50 + e : 0;
+                rv = tsdb_get_valid_by_index(&db_handler, &indexes[i], &value);
+                assert_int_equal(missing ? TSDB_MISSING : 0, rv);
+                assert_ulong_equal(missing ? 0 : expected, *value);
+            }
+            rv = tsdb_get_validity(&db_handler, 0, 256, bits);
+            assert_int_equal(0,rv);
+            for (j = 0; j < 256; j++) {
+                set = j == 5 || (j == 7 && e % 2 == 0) || (j == 9 && e == 0) || (j >= 100 && j < 200);
+                assert_int_equal(set, (bits[j / BITS_PER_WORD] >> (j % BITS_PER_WORD)) & 1);
+            }
+        }
+    }
+
+    /* read from the cold segment, missing indexes get the unknown value of the reader */
+    db_handler.unknown_value = 1;
+    memset(&expected, 1, sizeof(expected));
+    rv = tsdb_get_range(&db_handler, cur_time, cur_time + 2*TIME_STEP,
+                        indexes, 4, &range_epochs, &range_values, &range_num);
+    assert_int_equal(0,rv);
+    assert_int_equal(3, range_num);
+    for (e = 0; e < 3; e++) {
+        assert_ulong_equal(0, range_values[e*4]);
+        assert_ulong_equal(e % 2 ? expected : 42 + e, range_values[e*4 + 1]);
+        assert_ulong_equal(e ? expected : 9, range_values[e*4 + 2]);
+        assert_ulong_equal(100 + 50 + e, range_values[e*4 + 3]);
+    }
+    free(range_epochs);
+    free(range_values);
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Missing indexes of compacted epochs are told from set ones.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    free(row);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+void dedup_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_keys = 2 * CHUNK_GROWTH, cur_time, i, e, pass, *key_indexes;
+    u_int32_t indexes[2] = { 17, CHUNK_GROWTH + 17 }, *range_epochs, range_num;
+    tsdb_value *value, *row, *range_values, changed = 4242;
+    tsdb_codec_stats stats;
+    u_int64_t payload_bytes;
+    DBC *cursor;
+    DBT key_data, data;
+    u_int8_t first = 2;
+    int rv;
+
+    open_test_db(settings, "dedup", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+
+    keys = make_keys("dedup", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+    row = (tsdb_value*) malloc(num_keys * sizeof(tsdb_value));
+
+    /* the first fragment is the same in all epochs, the second one changes */
+    fprintf(stdout,"Writing epochs with identical fragments...");
+    for (e = 0; e < 4; e++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (e == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        for (i = 0; i < num_keys; i++) {
+            row[i] = (i * 7919) % 100003 + (i < CHUNK_GROWTH ? 0 : e);
+        }
+        assert_int_equal(0, tsdb_row_write(&db_handler, 0, num_keys, row));
+    }
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    assert_int_equal(0, tsdb_get_codec_stats(&db_handler, &stats));
+    /* the second one is shared from the second epoch on, the first one then refers to it */
+    assert_int_equal(4, stats.shared);
+    assert_int_equal(1, stats.payloads);
+    assert_true(stats.payload_bytes > 0);
+    assert_ulong_equal(3 * stats.payload_bytes, stats.deduplicated_bytes);
+    payload_bytes = stats.payload_bytes;
+
+    /* a rewritten fragment is stored in place, the others keep referring to the payload */
+    rv = tsdb_goto_epoch(&db_handler, cur_time + TIME_STEP, 1, 0);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, tsdb_set_by_index(&db_handler, &changed, &indexes[0]));
+    tsdb_flush(&db_handler);
+    assert_int_equal(0, tsdb_get_codec_stats(&db_handler, &stats));
+    assert_int_equal(3, stats.shared);
+    assert_int_equal(1, stats.payloads);
+    assert_ulong_equal(payload_bytes, stats.payload_bytes);
+    assert_ulong_equal(2 * payload_bytes, stats.deduplicated_bytes);
+
+    for (pass = 0; pass < 4; pass++) {
+        db_handler.lazy_load = pass % 2;
+        for (e = 0; e < 4; e++) {
+            rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = 0; i < 2; i++) {
+                rv = tsdb_get_by_index(&db_handler, &indexes[i], &value);
+                assert_int_equal(0,rv);
+                assert_ulong_equal(i == 0 && e == 1 ? changed : (indexes[i] * 7919) % 100003 + (i ? e : 0),
+                                   *value);
+            }
+        }
+
+        rv = tsdb_get_range(&db_handler, cur_time, cur_time + 3*TIME_STEP,
+                            indexes, 2, &range_epochs, &range_values, &range_num);
+        assert_int_equal(0,rv);
+        assert_int_equal(4, range_num);
+        for (e = 0; e < 4; e++) {
+            assert_ulong_equal(e == 1 ? changed : (indexes[0] * 7919) % 100003, range_values[e*2]);
+            assert_ulong_equal((indexes[1] * 7919) % 100003 + e, range_values[e*2 + 1]);
+        }
+        free(range_epochs);
+        free(range_values);
+
+        /* once more by a reader */
+        if (pass == 1) {
+            reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+        }
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Identical fragments are stored once.\n");
+
+    /* a reference to a payload which is gone is an error, not a missing fragment */
+    assert_int_equal(0, tsdb_open(file_name, &db_handler, &values_per_entry, TIME_STEP, 0));
+    assert_int_equal(0, db_handler.db->cursor(db_handler.db, NULL, &cursor, 0));
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+    key_data.data = &first;
+    key_data.size = 1;
+    assert_int_equal(0, cursor->get(cursor, &key_data, &data, DB_SET_RANGE));
+    assert_int_equal(2, ((u_int8_t *)key_data.data)[0]);
+    assert_int_equal(0, cursor->del(cursor, 0));
+    cursor->close(cursor);
+    assert_int_equal(-2, tsdb_goto_epoch(&db_handler, cur_time, 1, 0));
+    rv = tsdb_get_range(&db_handler, cur_time, cur_time + 3*TIME_STEP,
+                        indexes, 2, &range_epochs, &range_values, &range_num);
+    assert_int_equal(-2,rv);
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Missing shared payloads are reported.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    free(row);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+void fragment_len_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_keys = 1000, fragment_len = 3 * SEGMENT_SERIES, cur_time;
+    u_int32_t i, e, pass, *key_indexes;
+    tsdb_value *value, written;
+    int rv;
+
+    open_test_db(settings, "fraglen", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+    assert_int_equal(CHUNK_GROWTH, db_handler.fragment_len);
+    assert_int_equal(-1, tsdb_set_fragment_len(&db_handler, 0));
+    assert_int_equal(-1, tsdb_set_fragment_len(&db_handler, SEGMENT_SERIES + 1));
+    assert_int_equal(-1, tsdb_set_fragment_len(&db_handler, MAX_FRAGMENT_LEN + SEGMENT_SERIES));
+    assert_int_equal(0, tsdb_set_fragment_len(&db_handler, fragment_len));
+
+    keys = make_keys("fraglen", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+
+    /* every fifth index is missing, a different one in every epoch */
+    fprintf(stdout,"Writing epochs with fragments of %u indexes...", fragment_len);
+    for (e = 0; e < 3; e++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (e == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        for (i = 0; i < num_keys; i++) {
+            if ((i + e) % 5) {
+                written = i * 10 + e;
+                assert_int_equal(0, tsdb_set_by_index(&db_handler, &written, &key_indexes[i]));
+            }
+        }
+        assert_int_equal((num_keys + fragment_len - 1) / fragment_len, db_handler.chunk.num_fragments);
+        // the fragments of the DB are sized once
+        assert_int_equal(-1, tsdb_set_fragment_len(&db_handler, CHUNK_GROWTH));
+    }
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    for (pass = 0; pass < 4; pass++) {
+        db_handler.lazy_load = pass % 2;
+        for (e = 0; e < 3; e++) {
+            rv = tsdb_goto_epoch(&db_handler, cur_time + e*TIME_STEP, 1, 0);
+            assert_int_equal(0,rv);
+            for (i = 0; i < num_keys; i += 7) {
+                rv = tsdb_get_valid_by_index(&db_handler, &key_indexes[i], &value);
+                if ((i + e) % 5) {
+                    assert_int_equal(0,rv);
+                    assert_ulong_equal(i * 10 + e, *value);
+                } else {
+                    assert_int_equal(TSDB_MISSING,rv);
+                }
+            }
+        }
+
+        /* once more by a reader, which gets the length from the DB */
+        if (pass == 1) {
+            reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+            assert_int_equal(fragment_len, db_handler.fragment_len);
+        }
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Fragments of the length set are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+void reserve_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 2;
+    u_int32_t num_keys = 8 * CHUNK_GROWTH, cur_time, fragment_size, i, *key_indexes;
+    u_int8_t *data;
+    tsdb_value written[2], *value;
+    int rv;
+
+    open_test_db(settings, "reserve", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+    fragment_size = db_handler.fragment_len * db_handler.values_len;
+
+    keys = make_keys("reserve", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+
+    /* the first key comes alone, the chunk grows along with the others */
+    fprintf(stdout,"Writing epochs growing and reserved...");
+    rv = tsdb_goto_epoch(&db_handler, cur_time, 0, 1);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, tsdb_resolve_keys(&db_handler, keys, 1, key_indexes, 1));
+    written[0] = 0, written[1] = 1;
+    assert_int_equal(0, tsdb_set_by_index(&db_handler, written, &key_indexes[0]));
+    assert_true(db_handler.chunk.capacity == fragment_size);
+    assert_int_equal(0, tsdb_resolve_keys(&db_handler, &keys[1], num_keys - 1, &key_indexes[1], 1));
+    for (i = 1; i < num_keys; i++) {
+        written[0] = i * 2, written[1] = i * 2 + 1;
+        assert_int_equal(0, tsdb_set_by_index(&db_handler, written, &key_indexes[i]));
+        // room for twice as many fragments at a time
+        if (i % db_handler.fragment_len == 0) {
+            assert_true(db_handler.chunk.data_len == (u_int64_t)(i / db_handler.fragment_len + 1) * fragment_size);
+            assert_true(db_handler.chunk.capacity >= db_handler.chunk.data_len);
+            assert_true(db_handler.chunk.capacity < 2 * db_handler.chunk.data_len);
+        }
+    }
+
+    /* a new epoch has room for all series known, or those reserved */
+    rv = tsdb_goto_epoch(&db_handler, cur_time + TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    written[0] = 42, written[1] = 43;
+    assert_int_equal(0, tsdb_set_by_index(&db_handler, written, &key_indexes[0]));
+    assert_true(db_handler.chunk.data_len == fragment_size);
+    assert_true(db_handler.chunk.capacity == (u_int64_t)num_keys * db_handler.values_len);
+    assert_int_equal(0, tsdb_reserve(&db_handler, 2 * num_keys));
+    assert_true(db_handler.chunk.capacity == (u_int64_t)2 * num_keys * db_handler.values_len);
+    data = db_handler.chunk.data;
+    assert_int_equal(0, tsdb_set_by_index(&db_handler, written, &key_indexes[num_keys - 1]));
+    assert_true(db_handler.chunk.data == data);
+    assert_true(db_handler.chunk.data_len == (u_int64_t)num_keys * db_handler.values_len);
+
+    rv = tsdb_goto_epoch(&db_handler, cur_time + 2*TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, tsdb_set_by_index(&db_handler, written, &key_indexes[0]));
+    assert_true(db_handler.chunk.capacity == (u_int64_t)2 * num_keys * db_handler.values_len);
+    tsdb_flush(&db_handler);
+    fprintf(stdout," Done.\n");
+
+    rv = tsdb_goto_epoch(&db_handler, cur_time, 1, 0);
+    assert_int_equal(0,rv);
+    for (i = 0; i < num_keys; i += 7) {
+        assert_int_equal(0, tsdb_get_valid_by_index(&db_handler, &key_indexes[i], &value));
+        assert_ulong_equal(i * 2, value[0]);
+        assert_ulong_equal(i * 2 + 1, value[1]);
+    }
+    rv = tsdb_goto_epoch(&db_handler, cur_time + TIME_STEP, 1, 0);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, tsdb_get_valid_by_index(&db_handler, &key_indexes[num_keys - 1], &value));
+    assert_ulong_equal(42, value[0]);
+    assert_int_equal(TSDB_MISSING, tsdb_get_valid_by_index(&db_handler, &key_indexes[num_keys / 2], &value));
+    rv = tsdb_goto_epoch(&db_handler, cur_time + 2*TIME_STEP, 1, 0);
+    assert_int_equal(0,rv);
+    assert_int_equal(-1, tsdb_get_valid_by_index(&db_handler, &key_indexes[num_keys - 1], &value));
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Grown and reserved epochs are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+#define BACKFILL_EPOCHS (2 * SEGMENT_EPOCHS + 20)
+
+void backfill_check(tsdb_handler* handler, u_int32_t cur_time, u_int32_t *probes,
+                    tsdb_value expected[][3], u_int8_t written[][3]) {
+    u_int32_t i, j, position = 0;
+    tsdb_value *value;
+
+    for (j = 0; j < BACKFILL_EPOCHS; j++) {
+        if (!written[j][0] && !written[j][1] && !written[j][2]) {
+            continue;
+        }
+        // listed in order, wherever they were written
+        assert_int_equal(cur_time + j*TIME_STEP, epoch_at(handler, position));
+        position++;
+        assert_int_equal(0, tsdb_goto_epoch(handler, cur_time + j*TIME_STEP, 1, 0));
+        for (i = 0; i < 3; i++) {
+            if (written[j][i]) {
+                assert_int_equal(0, tsdb_get_valid_by_index(handler, &probes[i], &value));
+                assert_ulong_equal(expected[j][i], *value);
+            }
+        }
+    }
+    assert_int_equal(position, handler->number_of_epochs);
+}
+
+void backfill_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_keys = 2 * CHUNK_GROWTH, cur_time, i, j, *key_indexes;
+    u_int32_t probes[3] = { 3, 4, CHUNK_GROWTH + 2 }, batch_indexes[100];
+    u_int32_t late_epochs[6], late_indexes[6];
+    tsdb_value batch_values[100], late_values[6], expected[BACKFILL_EPOCHS][3];
+    u_int8_t written[BACKFILL_EPOCHS][3];
+    int rv;
+
+    open_test_db(settings, "backfill", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+    assert_int_equal(0, tsdb_set_delta_frames(&db_handler, 8));
+
+    keys = make_keys("backfill", 0, num_keys);
+    key_indexes = (u_int32_t*) malloc(num_keys * sizeof(u_int32_t));
+    memset(written, 0, sizeof(written));
+
+    /* every other epoch, the others come late */
+    fprintf(stdout,"Writing epochs and backfilling the missing ones...");
+    for (j = 0; j < BACKFILL_EPOCHS; j += 2) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 0, 1);
+        assert_int_equal(0,rv);
+        if (j == 0) {
+            rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+            assert_int_equal(0,rv);
+        }
+        for (i = 0; i < 100; i++) {
+            batch_indexes[i] = (i < 50 ? i : CHUNK_GROWTH + i - 50);
+            batch_values[i] = cold_value(j, batch_indexes[i]);
+        }
+        rv = tsdb_set_batch(&db_handler, batch_indexes, batch_values, 100);
+        assert_int_equal(0,rv);
+        for (i = 0; i < 3; i++) {
+            expected[j][i] = cold_value(j, probes[i]);
+            written[j][i] = 1;
+        }
+    }
+    tsdb_flush(&db_handler);
+
+    /* a missing epoch in the past, the one after it was a delta frame */
+    rv = tsdb_goto_epoch(&db_handler, cur_time + 5*TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    assert_int_equal(1, db_handler.chunk.new_epoch_flag);
+    batch_values[0] = 555;
+    rv = tsdb_set_batch(&db_handler, &probes[0], batch_values, 1);
+    assert_int_equal(0,rv);
+    tsdb_flush(&db_handler);
+    expected[5][0] = 555;
+    written[5][0] = 1;
+    assert_int_equal(BACKFILL_EPOCHS / 2 + 1, db_handler.number_of_epochs);
+    assert_int_equal(cur_time + (BACKFILL_EPOCHS - 2)*TIME_STEP, db_handler.most_recent_epoch);
+
+    /* merged into an existing epoch lazily, its second fragment untouched */
+    db_handler.lazy_load = 1;
+    rv = tsdb_goto_epoch(&db_handler, cur_time + 10*TIME_STEP, 1, 0);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, db_handler.chunk.new_epoch_flag);
+    batch_values[0] = 1010;
+    rv = tsdb_set_batch(&db_handler, &probes[1], batch_values, 1);
+    assert_int_equal(0,rv);
+    tsdb_flush(&db_handler);
+    db_handler.lazy_load = 0;
+    expected[10][1] = 1010;
+
+    /* shuffled, duplicated, into missing and existing epochs */
+    late_epochs[0] = cur_time + 7*TIME_STEP, late_indexes[0] = probes[2], late_values[0] = 70;
+    late_epochs[1] = cur_time + 1*TIME_STEP, late_indexes[1] = probes[1], late_values[1] = 11;
+    late_epochs[2] = cur_time + 7*TIME_STEP, late_indexes[2] = probes[0], late_values[2] = 71;
+    late_epochs[3] = cur_time + 12*TIME_STEP, late_indexes[3] = probes[0], late_values[3] = 120;
+    late_epochs[4] = cur_time + 7*TIME_STEP, late_indexes[4] = probes[2], late_values[4] = 72;
+    late_epochs[5] = cur_time + 1*TIME_STEP + 1, late_indexes[5] = probes[1], late_values[5] = 12;
+    rv = tsdb_backfill(&db_handler, late_epochs, late_indexes, late_values, 6);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, db_handler.chunk.epoch);
+    expected[7][2] = 72, written[7][2] = 1;
+    expected[7][0] = 71, written[7][0] = 1;
+    expected[1][1] = 12, written[1][1] = 1;
+    expected[12][0] = 120;
+    assert_int_equal(BACKFILL_EPOCHS / 2 + 3, db_handler.number_of_epochs);
+
+    /* a rejected backfill leaves the current epoch alone */
+    rv = tsdb_goto_epoch(&db_handler, cur_time + 7*TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    late_indexes[0] = num_keys;
+    assert_int_equal(-1, tsdb_backfill(&db_handler, late_epochs, late_indexes, late_values, 1));
+    assert_int_equal(cur_time + 7*TIME_STEP, db_handler.chunk.epoch);
+    assert_int_equal(BACKFILL_EPOCHS / 2 + 3, db_handler.number_of_epochs);
+
+    /* delta frames after the inserted epochs are compacted, nothing is inserted among them */
+    assert_int_equal(0, tsdb_set_compaction(&db_handler, 5 * TIME_STEP));
+    rv = tsdb_goto_epoch(&db_handler, cur_time + (BACKFILL_EPOCHS - 1)*TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    batch_values[0] = 999;
+    rv = tsdb_set_batch(&db_handler, &probes[0], batch_values, 1);
+    assert_int_equal(0,rv);
+    tsdb_flush(&db_handler);
+    tsdb_compaction_wait(&db_handler);
+    assert_int_equal(1, db_handler.compactor.cold_segments);
+    expected[BACKFILL_EPOCHS - 1][0] = 999;
+    written[BACKFILL_EPOCHS - 1][0] = 1;
+    late_epochs[0] = cur_time + 3*TIME_STEP, late_indexes[0] = probes[0];
+    assert_int_equal(-1, tsdb_backfill(&db_handler, late_epochs, late_indexes, late_values, 1));
+    assert_int_equal(-1, tsdb_goto_epoch(&db_handler, cur_time + 3*TIME_STEP, 0, 1));
+    fprintf(stdout," Done.\n");
+
+    backfill_check(&db_handler, cur_time, probes, expected, written);
+
+    /* once more by a reader */
+    reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+    backfill_check(&db_handler, cur_time, probes, expected, written);
+    assert_int_equal(-1, tsdb_backfill(&db_handler, late_epochs, late_indexes, late_values, 1));
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Backfilled epochs are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    free(key_indexes);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+#define REORDER_ROUNDS 20
+
+void reorder_write(tsdb_handler* handler, u_int32_t epoch_num, u_int32_t cur_time,
+                   u_int32_t *key_indexes, u_int32_t first, u_int32_t count) {
+    tsdb_value values[50];
+    u_int32_t i;
+
+    assert_int_equal(0, tsdb_goto_epoch(handler, cur_time + epoch_num*TIME_STEP, 0, 1));
+    for (i = 0; i < count; i++) {
+        values[i] = (tsdb_value)epoch_num * 1000 + first + i;
+    }
+    assert_int_equal(0, tsdb_row_write(handler, key_indexes[first], count, values));
+}
+
+void reorder_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 1;
+    u_int32_t num_keys = 100, cur_time, i, j, r, key_indexes[100];
+    tsdb_value *value;
+    int rv;
+
+    open_test_db(settings, "reorder", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+    assert_int_equal(-1, tsdb_set_reorder_window(&db_handler, MAX_REORDER_EPOCHS + 1));
+    assert_int_equal(0, tsdb_set_reorder_window(&db_handler, 3));
+
+    keys = make_keys("reorder", 0, num_keys);
+    rv = tsdb_goto_epoch(&db_handler, cur_time, 0, 1);
+    assert_int_equal(0,rv);
+    rv = tsdb_resolve_keys(&db_handler, keys, num_keys, key_indexes, 1);
+    assert_int_equal(0,rv);
+
+    /* every epoch is answered in three parts, the last two of them late */
+    fprintf(stdout,"Writing epochs answered late...");
+    for (r = 0; r < REORDER_ROUNDS + 2; r++) {
+        if (r < REORDER_ROUNDS) {
+            reorder_write(&db_handler, r, cur_time, key_indexes, 0, 50);
+            // the epochs before the window were flushed, once
+            assert_int_equal(r < 3 ? 0 : r - 2, db_handler.number_of_epochs);
+        }
+        if (r >= 1 && r <= REORDER_ROUNDS) {
+            reorder_write(&db_handler, r - 1, cur_time, key_indexes, 50, 25);
+        }
+        if (r >= 2) {
+            reorder_write(&db_handler, r - 2, cur_time, key_indexes, 75, 25);
+        }
+        assert_true(db_handler.window.num_open < 3);
+    }
+
+    /* an open epoch entered again takes the growable flag of the call */
+    assert_int_equal(cur_time + (REORDER_ROUNDS - 1)*TIME_STEP, db_handler.chunk.epoch);
+    rv = tsdb_goto_epoch(&db_handler, cur_time + (REORDER_ROUNDS - 2)*TIME_STEP, 0, 0);
+    assert_int_equal(0,rv);
+    assert_int_equal(0, db_handler.chunk.growable);
+    rv = tsdb_goto_epoch(&db_handler, cur_time + (REORDER_ROUNDS - 1)*TIME_STEP, 0, 1);
+    assert_int_equal(0,rv);
+    assert_int_equal(1, db_handler.chunk.growable);
+    tsdb_flush(&db_handler);
+    assert_int_equal(0, db_handler.window.num_open);
+    assert_int_equal(REORDER_ROUNDS, db_handler.number_of_epochs);
+
+    /* shrinking the window flushes the epochs left open */
+    reorder_write(&db_handler, REORDER_ROUNDS, cur_time, key_indexes, 0, 50);
+    reorder_write(&db_handler, REORDER_ROUNDS + 1, cur_time, key_indexes, 0, 50);
+    assert_int_equal(1, db_handler.window.num_open);
+    assert_int_equal(0, tsdb_set_reorder_window(&db_handler, 0));
+    assert_int_equal(0, db_handler.window.num_open);
+    assert_int_equal(REORDER_ROUNDS + 1, db_handler.number_of_epochs);
+    fprintf(stdout," Done.\n");
+
+    /* once more by a reader, the current epoch was flushed on closing */
+    reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+    assert_int_equal(-1, tsdb_set_reorder_window(&db_handler, 3));
+    assert_int_equal(REORDER_ROUNDS + 2, db_handler.number_of_epochs);
+    for (j = 0; j < REORDER_ROUNDS + 2; j++) {
+        rv = tsdb_goto_epoch(&db_handler, cur_time + j*TIME_STEP, 1, 0);
+        assert_int_equal(0,rv);
+        for (i = 0; i < num_keys; i++) {
+            rv = tsdb_get_valid_by_index(&db_handler, &key_indexes[i], &value);
+            if (j >= REORDER_ROUNDS && i >= 50) {
+                assert_int_equal(TSDB_MISSING, rv);
+                continue;
+            }
+            assert_int_equal(0,rv);
+            assert_ulong_equal((tsdb_value)j * 1000 + i, *value);
+        }
+    }
+    tsdb_close(&db_handler);
+    fprintf(stdout,"Epochs written through the reorder window are read back correctly.\n");
+
+    free_keys(keys, num_keys);
+    ensure_old_dbFile_is_gone(file_name);
+}
+
+void scale_DB(set_container* settings) {
+    tsdb_handler db_handler;
+    char file_name[256], **keys;
+    u_int16_t values_per_entry = 512; // wide entries get beyond 4 GiB with about a million keys
+    u_int32_t cur_time, num_keys, first, count, batch, i, j, pass, *key_indexes;
+    u_int64_t epoch_len;
+    tsdb_value *row, *span, expected;
+    struct timeval time_start, time_end, diff;
+    int rv, missing;
+
+    open_test_db(settings, "scale", &db_handler, &values_per_entry, 0,
+                 file_name, &cur_time);
+    epoch_len = settings->scale_gib * (1ULL << 30);
+    assert_true(epoch_len / db_handler.values_len < TSDB_NO_INDEX);
+    num_keys = epoch_len / db_handler.values_len;
+    /* rows are written and read in batches of KEY_BATCH values */
+    batch = KEY_BATCH / values_per_entry;
+
+    key_indexes = (u_int32_t*) malloc(KEY_BATCH * sizeof(u_int32_t));
+    row = (tsdb_value*) malloc(batch * db_handler.values_len);
+
+    fprintf(stdout,"Mapping %u keys...", num_keys);
+    for (first = 0; first < num_keys; first += count) {
+        count = (num_keys - first < KEY_BATCH ? num_keys - first : KEY_BATCH);
+        keys = make_keys("scale", first, count);
+        rv = tsdb_resolve_keys(&db_handler, keys, count, key_indexes, 1);
+        free_keys(keys, count);
+        assert_int_equal(0,rv);
+        assert_int_equal(first, key_indexes[0]);
+        assert_int_equal(first + count - 1, key_indexes[count - 1]);
+    }
+    fprintf(stdout," Done.\n");
+
+    /* the last rows come first, so that the chunk is sized at once; the
+     * batches in between are left missing, the DB holds a fraction of the
+     * epoch only, but its offsets still go beyond 4 GiB */
+    gettimeofday(&time_start, NULL);
+    rv = tsdb_goto_epoch(&db_handler, cur_time, 0, 1);
+    assert_int_equal(0,rv);
+    for (first = num_keys; first > 0; first -= count) {
+        count = (first < batch ? first : batch);
+        if ((num_keys - first) / batch % SCALE_STRIDE) {
+            continue;
+        }
+        for (i = 0; i < count * values_per_entry; i++) {
+            row[i] = (u_int64_t)(first - count) * values_per_entry + i;
+        }
+        rv = tsdb_row_write(&db_handler, first - count, count, row);
+        assert_int_equal(0,rv);
+    }
+    assert_true(db_handler.chunk.data_len >= epoch_len);
+    tsdb_flush(&db_handler);
+    gettimeofday(&time_end, NULL);
+    timeval_subtract(&diff, &time_start, &time_end);
+    fprintf(stdout,"Epoch of %llu bytes written in %.3f s\n",
+            (unsigned long long)epoch_len, timeval2float(&diff));
+
+    reopen_test_db(file_name, &db_handler, &values_per_entry, 0);
+    for (pass = 0; pass < 2; pass++) {
+        db_handler.lazy_load = pass;
+        gettimeofday(&time_start, NULL);
+        rv = tsdb_goto_epoch(&db_handler, cur_time, 1, 0);
+        assert_int_equal(0,rv);
+        for (first = num_keys; first > 0; first -= count) {
+            count = (first < batch ? first : batch);
+            missing = (num_keys - first) / batch % SCALE_STRIDE != 0;
+            rv = tsdb_row_span(&db_handler, first - count, count, &span);
+            assert_int_equal(0,rv);
+            for (j = 0; j < count * values_per_entry; j++) {
+                expected = missing ? 0 : (u_int64_t)(first - count) * values_per_entry + j;
+                if (span[j] != expected) {
+                    assert_ulong_equal(expected, span[j]);
+                }
+            }
+        }
+        gettimeofday(&time_end, NULL);
+        timeval_subtract(&diff, &time_start, &time_end);
+        fprintf(stdout,"Epoch read back %s in %.3f s\n", (pass ? "lazily" : "at once"), timeval2float(&diff));
+    }
+    tsdb_close(&db_handler);
+
+    free(key_indexes);
+    free(row);
+    ensure_old_dbFile_is_gone(file_name);
 }
 
 int main(int argc, char *argv[]) {
@@ -515,6 +2027,31 @@ int main(int argc, char *argv[]) {
       populate_DB(&settings,index,CONTIGUOUS_FILL);
       fprintf(stdout,"*** TEST 2 ***\n");
       populate_DB(&settings,index,RANDOM_FILL);
+      fprintf(stdout,"*** TEST 3 ***\n");
+      compaction_DB(&settings, TSDB_CODEC_QLZ);
+      compaction_DB(&settings, TSDB_CODEC_SERIES);
+      fprintf(stdout,"*** TEST 4 ***\n");
+      delta_frames_DB(&settings);
+      fprintf(stdout,"*** TEST 5 ***\n");
+      fragment_codecs_DB(&settings);
+      fprintf(stdout,"*** TEST 6 ***\n");
+      sparse_fragments_DB(&settings);
+      fprintf(stdout,"*** TEST 7 ***\n");
+      validity_DB(&settings);
+      fprintf(stdout,"*** TEST 8 ***\n");
+      dedup_DB(&settings);
+      fprintf(stdout,"*** TEST 9 ***\n");
+      fragment_len_DB(&settings);
+      fprintf(stdout,"*** TEST 10 ***\n");
+      reserve_DB(&settings);
+      fprintf(stdout,"*** TEST 11 ***\n");
+      backfill_DB(&settings);
+      fprintf(stdout,"*** TEST 12 ***\n");
+      reorder_DB(&settings);
+      if (settings.scale_gib > 0) {
+          fprintf(stdout,"*** TEST 13 ***\n");
+          scale_DB(&settings);
+      }
   } else if (settings.query) {
       query_and_profile_DB(&settings,index);
   }
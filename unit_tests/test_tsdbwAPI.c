@@ -28,6 +28,12 @@
 #define TSDB_DG_METRIC_NUM 6
 #define TSDB_DG_EPOCHS_NUM 20
 #define TSDB_DG_FINE_TS 2
+#define TSDB_RP_METRIC_NUM 2      // replay test, see test_replay()
+#define TSDB_RP_EPOCHS_NUM 40
+#define TSDB_RP_FINE_TS 60
+#define TSDB_RP_BASE 1000000200   // aligned to epochs of all DBs
+#define TSDB_RP_GAP_FROM 13       // fine epochs [13, 19) are not written
+#define TSDB_RP_GAP_TO 19
 #define MAX_PATH_LEN 50
 #define COMMENT_CHAR '#' //for pattern CSV file
 #define LF_CHAR '\n'	 //for pattern CSV file
@@ -401,6 +407,12 @@ u_int32_t emulate_outage(u_int32_t slp_time, u_int32_t ts, u_int32_t *ep_cnt) {
   return time_left;
 }
 
+u_int32_t epoch_at(tsdb_handler *h, u_int32_t position) {
+  u_int32_t epoch = 0;
+  assert_true(tsdb_epoch_at(h, position, &epoch) == 0);
+  return epoch;
+}
+
 int open_dbs(tsdbw_handle *db_bundle, const char **db_paths, char mode) {
   u_int16_t timestep = TSDB_DG_FINE_TS;
   if (!tsdbw_init(db_bundle, &timestep, db_paths, mode)) {
@@ -415,8 +427,8 @@ int open_dbs(tsdbw_handle *db_bundle, const char **db_paths, char mode) {
 int prepare_args_q_test1(tsdbw_handle *db_bundle, q_request_t *req, u_int32_t mnum) {
 
   req->granularity_flag = TSDBW_FINE;
-  req->epoch_from = db_bundle->db_hs[TSDBW_FINE]->epoch_list[0] - db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
-  req->epoch_to = db_bundle->db_hs[TSDBW_FINE]->epoch_list[db_bundle->db_hs[TSDBW_FINE]->number_of_epochs - 1] + db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
+  req->epoch_from = epoch_at(db_bundle->db_hs[TSDBW_FINE], 0) - db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
+  req->epoch_to = db_bundle->db_hs[TSDBW_FINE]->most_recent_epoch + db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
   req->metrics_num = mnum;
 
   char **metrics;
@@ -429,8 +441,8 @@ int prepare_args_q_test1(tsdbw_handle *db_bundle, q_request_t *req, u_int32_t mn
 int prepare_args_q_test2(tsdbw_handle *db_bundle, q_request_t *req, u_int32_t mnum) {
 
   req->granularity_flag = TSDBW_MODERATE;
-  req->epoch_from = db_bundle->db_hs[TSDBW_FINE]->epoch_list[0] - db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
-  req->epoch_to = db_bundle->db_hs[TSDBW_FINE]->epoch_list[db_bundle->db_hs[TSDBW_FINE]->number_of_epochs - 1] + db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
+  req->epoch_from = epoch_at(db_bundle->db_hs[TSDBW_FINE], 0) - db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
+  req->epoch_to = db_bundle->db_hs[TSDBW_FINE]->most_recent_epoch + db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
   req->metrics_num = mnum;
 
   char **metrics;
@@ -443,8 +455,8 @@ int prepare_args_q_test2(tsdbw_handle *db_bundle, q_request_t *req, u_int32_t mn
 int prepare_args_q_test3(tsdbw_handle *db_bundle, q_request_t *req, u_int32_t mnum) {
 
   req->granularity_flag = TSDBW_COARSE;
-  req->epoch_from = db_bundle->db_hs[TSDBW_FINE]->epoch_list[0] - db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
-  req->epoch_to = db_bundle->db_hs[TSDBW_FINE]->epoch_list[db_bundle->db_hs[TSDBW_FINE]->number_of_epochs - 1] + db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
+  req->epoch_from = epoch_at(db_bundle->db_hs[TSDBW_FINE], 0) - db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
+  req->epoch_to = db_bundle->db_hs[TSDBW_FINE]->most_recent_epoch + db_bundle->db_hs[TSDBW_FINE]->slot_duration * 1.5;
   req->metrics_num = mnum;
 
   char **metrics;
@@ -497,11 +509,17 @@ DArray * consolidate(DArray *base, float cint, void *fillval){
   memset(&accum, 0, sizeof(accum));
   accum.data = calloc(base->rown, sizeof(tsdb_value));
   if (accum.data == NULL) return NULL;
+  accum.samples = calloc(base->rown, sizeof(u_int32_t));
+  if (accum.samples == NULL) {
+      free(accum.data);
+      return NULL;
+  }
   accum.size = base->rown;
 
   DArray *carr = new_darray(base->rown, 0, sizeof(int64_t), fillval);
   if (carr == NULL) {
       free(accum.data);
+      free(accum.samples);
       return NULL;
   }
 
@@ -510,7 +528,7 @@ DArray * consolidate(DArray *base, float cint, void *fillval){
       col = (tsdb_value *)base->get_col(base, ci); assert_true(col != NULL);
 
       if (!isarreq(col, &cval, sizeof(tsdb_value), accum.size)) {
-          consolidate_incrementally(col, &accum);
+          consolidate_incrementally(col, NULL, &accum);
       }
 
       if ((ci + 1 >= (float) (cint * mult)) || // if a new epoch has come
@@ -520,10 +538,12 @@ DArray * consolidate(DArray *base, float cint, void *fillval){
           accum.cr_elapsed = 0;
 
           memset(accum.data, 0, base->rown * sizeof(tsdb_value));
+          memset(accum.samples, 0, base->rown * sizeof(u_int32_t));
       }
   }
 
   free(accum.data);
+  free(accum.samples);
 
   assert_true(mult - 1 == carr->coln);
   return carr;
@@ -546,7 +566,7 @@ int verify_reply_test1(set_args *args, tsdb_handler *h, q_reply_t *rep,q_request
   read_fpattern(args, &pattern);
 
   u_int32_t ep_afront_num, ep_trail_num, ep_sleep_ftsdb = *sleep_time/ TSDB_DG_FINE_TS;
-  ep_afront_num = ep_num(h, req->epoch_from, h->epoch_list[0]); // == 2
+  ep_afront_num = ep_num(h, req->epoch_from, epoch_at(h, 0)); // == 2
   ep_trail_num = ep_num(h, h->most_recent_epoch, req->epoch_to); // == 1
   assert_true(ep_afront_num >= 0 && ep_trail_num >= 0);
 
@@ -558,7 +578,7 @@ int verify_reply_test1(set_args *args, tsdb_handler *h, q_reply_t *rep,q_request
 
   /** Creating anticipated epochs **/
   /* First anticipated epoch */
-  anepochs[0] =  h->epoch_list[0] - ep_afront_num * h->slot_duration;
+  anepochs[0] =  epoch_at(h, 0) - ep_afront_num * h->slot_duration;
 
   /* Rest of them */
   for(i = 1; i < num_epochs; ++i) {
@@ -604,7 +624,7 @@ int verify_reply_test2(set_args *args, tsdb_handler *h, q_reply_t *rep, q_reques
 
   printf("Test: correctness of moderate TSDB data...\n");
   u_int32_t ep_afront_num, ep_trail_num, ep_sleep_ftsdb = *sleep_time/ TSDB_DG_FINE_TS;
-  ep_afront_num = ep_num(h, req->epoch_from, h->epoch_list[0]); // == 1
+  ep_afront_num = ep_num(h, req->epoch_from, epoch_at(h, 0)); // == 1
   ep_trail_num = ep_num(h, h->most_recent_epoch, req->epoch_to); // == 0
   assert_true(ep_afront_num >= 0 && ep_trail_num >= 0);
 
@@ -636,7 +656,7 @@ int verify_reply_test2(set_args *args, tsdb_handler *h, q_reply_t *rep, q_reques
   assert_true(anepochs != NULL);
 
   /* First anticipated epoch */
-  anepochs[0] =  h->epoch_list[0] - ep_afront_num * h->slot_duration;
+  anepochs[0] =  epoch_at(h, 0) - ep_afront_num * h->slot_duration;
 
   /* Rest of them */
   for(i = 1; i < num_epochs; ++i) {
@@ -676,7 +696,7 @@ int verify_reply_test3(set_args *args, tsdb_handler *h, q_reply_t *rep, q_reques
 
   printf("Test: correctness of coarse TSDB data...\n");
   u_int32_t ep_afront_num , ep_trail_num , ep_sleep_ftsdb = *sleep_time/ TSDB_DG_FINE_TS;
-  ep_afront_num = ep_num(h, req->epoch_from, h->epoch_list[0]); // == 1
+  ep_afront_num = ep_num(h, req->epoch_from, epoch_at(h, 0)); // == 1
   ep_trail_num = ep_num(h, h->most_recent_epoch, req->epoch_to); // == 1
   assert_true(ep_afront_num >= 0 && ep_trail_num >= 0);
 
@@ -707,7 +727,7 @@ int verify_reply_test3(set_args *args, tsdb_handler *h, q_reply_t *rep, q_reques
   u_int32_t *anepochs = (u_int32_t *) malloc(num_epochs * sizeof *anepochs); //anticipated epochs
   assert_true(anepochs != NULL);
   /* First anticipated epoch */
-  anepochs[0] =  h->epoch_list[0] - ep_afront_num * h->slot_duration;
+  anepochs[0] =  epoch_at(h, 0) - ep_afront_num * h->slot_duration;
 
   /* Rest of them */
   for(i = 1; i < num_epochs; ++i) {
@@ -774,11 +794,13 @@ u_int8_t dbs_exist(const char **db_paths) {
 
 void print_epochs(tsdb_handler *h){
   char timestr[32];
+  u_int32_t epoch;
   size_t i;
   printf("List of epochs (CTSDB):\n");
 
   for (i = 0; i < h->number_of_epochs; ++i) {
-      time2str(&h->epoch_list[i], timestr, 32);
+      epoch = epoch_at(h, i);
+      time2str(&epoch, timestr, 32);
       printf("%s\n", timestr);
   }
 }
@@ -880,6 +902,116 @@ void test_read(set_args *args, tsdbw_handle *db_bundle, const char **db_paths) {
   tsdbw_close(db_bundle);
 }
 
+static time_t replay_clock(void *data) {
+  /* Fake clock of the replay test, the time is set by the test itself */
+  return *(time_t *) data;
+}
+
+int64_t replay_value(u_int32_t metric, u_int32_t epoch_idx) {
+  /* Value of the metric written in the fine epoch, 0 - not written at all.
+   * Multiples of 6 keep averages of up to 3 samples exact */
+  if (epoch_idx >= TSDB_RP_GAP_FROM && epoch_idx < TSDB_RP_GAP_TO) return 0; // outage
+  if (metric == 1 && epoch_idx % 2) return 0; // second metric comes every other epoch
+  return 6 * (epoch_idx + 1) * (metric + 1);
+}
+
+void verify_replay(tsdbw_handle *db_bundle, char **metrics, u_int8_t granularity, time_t now) {
+  /* Every consolidated epoch holds the average of the fine epochs falling into it */
+  tsdb_handler *h = db_bundle->db_hs[granularity];
+  q_request_t req;
+  q_reply_t rep;
+  u_int32_t i, j, m, epoch, samples, epochs_num = 0;
+  int64_t sum, anval;
+  int rv;
+
+  memset(&req, 0, sizeof(req));
+  memset(&rep, 0, sizeof(rep));
+  req.granularity_flag = granularity;
+  req.epoch_from = TSDB_RP_BASE;
+  req.epoch_to = now; // anything later is cut by the fake clock
+  req.metrics = metrics;
+  req.metrics_num = TSDB_RP_METRIC_NUM;
+  rv = tsdbw_query(db_bundle, &req, &rep); assert_true(rv == 0);
+  assert_true(rep.epochs_num_res == ep_num(h, TSDB_RP_BASE, now) + 1);
+
+  for (j = 0; j < rep.epochs_num_res; ++j) {
+      epoch = TSDB_RP_BASE + j * h->slot_duration;
+      for (m = 0, samples = 0; m < TSDB_RP_METRIC_NUM; ++m) {
+          for (i = 0, sum = 0, anval = 0; i < TSDB_RP_EPOCHS_NUM; ++i) {
+              if (TSDB_RP_BASE + i * TSDB_RP_FINE_TS < epoch ||
+                  TSDB_RP_BASE + i * TSDB_RP_FINE_TS >= epoch + h->slot_duration ||
+                  replay_value(m, i) == 0) continue;
+              sum += replay_value(m, i);
+              anval++;
+          }
+          samples += anval;
+          anval = anval ? sum / anval : h->unknown_value;
+          if (rep.tuples[m][j].value != anval) {
+              printf("Metric value wrong. Met %u, epoch %u, val: available %ld, anticipated %ld\n", m + 1, epoch, rep.tuples[m][j].value, anval);
+          }
+          assert_true(rep.tuples[m][j].value == anval);
+          assert_true(rep.tuples[m][j].epoch == epoch);
+      }
+      /* Epochs of the outage are not created at all */
+      if (samples == 0) continue;
+      assert_true(epoch_at(h, epochs_num) == epoch);
+      epochs_num++;
+  }
+  assert_true(h->number_of_epochs == epochs_num);
+
+  free_darray(TSDB_RP_METRIC_NUM, (void **) rep.tuples);
+}
+
+void test_replay(void) {
+  /* Replays the fine epochs with a fake clock instead of waiting for them,
+   * an outage in the middle spans several moderate and coarse epochs */
+  const char *db_paths[TSDBW_DB_NUM] = {"./DBs/f_replay.tsdb", "./DBs/m_replay.tsdb", "./DBs/c_replay.tsdb"};
+  tsdbw_handle db_bundle;
+  u_int16_t timestep = TSDB_RP_FINE_TS;
+  char *metrics[TSDB_RP_METRIC_NUM] = {"r-1", "r-2"}, *written[TSDB_RP_METRIC_NUM];
+  int64_t values[TSDB_RP_METRIC_NUM];
+  time_t fake_now, started = time(NULL);
+  u_int32_t i, m, num;
+  int rv;
+
+  printf("Test: replay of epochs with a fake clock...\n");
+  for (i = 0; i < TSDBW_DB_NUM; ++i) unlink(db_paths[i]);
+  rv = tsdbw_init(&db_bundle, &timestep, db_paths, 'w'); assert_true(rv == 0);
+  fake_now = TSDB_RP_BASE;
+  tsdbw_set_clock(&db_bundle, replay_clock, &fake_now);
+
+  for (i = 0; i < TSDB_RP_EPOCHS_NUM; ++i) {
+      for (m = 0, num = 0; m < TSDB_RP_METRIC_NUM; ++m) {
+          if ((values[num] = replay_value(m, i)) == 0) continue;
+          written[num++] = metrics[m];
+      }
+      if (num == 0) continue;
+      if (i < TSDB_RP_EPOCHS_NUM / 2) {
+          /* Explicit epochs first, the clock is left behind */
+          rv = tsdbw_write_at(&db_bundle, TSDB_RP_BASE + i * TSDB_RP_FINE_TS, written, values, num);
+      } else {
+          /* Then the fake clock drives the epochs */
+          fake_now = TSDB_RP_BASE + i * TSDB_RP_FINE_TS;
+          rv = tsdbw_write(&db_bundle, written, values, num);
+      }
+      assert_true(rv == 0);
+  }
+  fake_now = TSDB_RP_BASE + TSDB_RP_EPOCHS_NUM * TSDB_RP_FINE_TS;
+  tsdbw_close(&db_bundle);
+
+  rv = tsdbw_init(&db_bundle, &timestep, db_paths, 'r'); assert_true(rv == 0);
+  tsdbw_set_clock(&db_bundle, replay_clock, &fake_now);
+  assert_true(db_bundle.db_hs[TSDBW_FINE]->number_of_epochs == TSDB_RP_EPOCHS_NUM - (TSDB_RP_GAP_TO - TSDB_RP_GAP_FROM));
+  verify_replay(&db_bundle, metrics, TSDBW_FINE, fake_now);
+  verify_replay(&db_bundle, metrics, TSDBW_MODERATE, fake_now);
+  verify_replay(&db_bundle, metrics, TSDBW_COARSE, fake_now);
+  tsdbw_close(&db_bundle);
+
+  /* Replaying took no wall-clock time of the epochs it covers */
+  assert_true(time(NULL) - started < TSDB_RP_FINE_TS);
+  printf("Done\n");
+}
+
 int main(int argc, char *argv[]) {
 
   set_args args;
@@ -893,7 +1025,10 @@ int main(int argc, char *argv[]) {
   db_paths[2] = "./DBs/c_db.tsdb";
 
   if (! dbs_exist(db_paths) && args.ronly == 1) return 2;
-  if (args.ronly == 0) test_write(&args, & db_bundle, db_paths);
+  if (args.ronly == 0) {
+      test_replay();
+      test_write(&args, & db_bundle, db_paths);
+  }
 
   test_read(&args, & db_bundle, db_paths);
 